@@ -0,0 +1,1423 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "dbll.h"
+#include "poolalloc.h"
+
+/*
+   microbenchmarks for dbll and the pool allocator
+
+   usage: pa_bench [max_nodes] [pool_ops]
+
+   Results are printed to stdout as CSV with the columns
+
+     impl,op,n,ops,ns_per_op,failed,util
+
+   impl is the implementation being measured (dbll, array, mpool in each
+   mode, malloc),
+   n is the list length or the number of live pool blocks, ops is the
+   number of timed operations and failed counts operations that returned
+   NULL.
+
+   The threads_* rows share one allocator between n threads; ns_per_op
+   is wall time divided by the operations of all threads, so it falls as
+   the allocator scales. The counters_* rows have n threads each
+   increment a counter of its own, allocated one after the other from
+   one pool with and without MPOOL_CACHELINE; without it the counters
+   share cache lines, and every increment contends with the other
+   threads (false sharing). The free_all_* rows free n blocks in random
+   order one mpool_free at a time (each), with one mpool_free_batch
+   (batch) and with mpool_free into a MPOOL_DEFERRED pool followed by
+   mpool_flush (deferred). The file_reopen rows time mpool_open of a
+   file-backed pool of n MiB that was closed with mpool_destroy. The
+   trim row times mpool_trim giving back a free block of n MiB, and the
+   calloc_* rows mpool_calloc of that block while its pages are resident
+   (they are cleared) and after the trim (they are known to be zero).
+   The frag_fill_4096 rows fill a heap with small blocks, free a random
+   half and allocate 4096-byte blocks until one fails; n is the number
+   of small blocks, and util shows how much of the heap plain pools can
+   use that way and how much compacting handles (mpool_handles) can.
+   The typed_churn rows replace random objects of one 48-byte struct
+   through the inline functions of MPOOL_DEFINE_TYPED (mpool_typed),
+   mpool_alloc, a slab cache and malloc.
+   The mpool_tags_profile_<rate> rows run the pool workload with the
+   heap profiler sampling every <rate> bytes on average, next to the
+   same pool without it (mpool_tags_noprofile).
+
+   util is only given for the fill_* rows of the pools: the fraction of
+   the pool holding requested bytes when an allocation first fails, so
+   1 - util is what fragmentation (internal and external) cost. For the
+   realloc_* rows it is the fraction of resizes that did not move the
+   block instead.
+*/
+
+#define MIN_OPS 1000000       /* repeat small runs until at least this many ops are timed */
+#define ARRAY_MIDDLE_MAX 10000 /* array inserts/removes in the middle are O(n), skip beyond this */
+
+static double now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char *impl, const char *op, size_t n, size_t ops, double ns, size_t failed)
+{
+  printf("%s,%s,%zu,%zu,%.2f,%zu,\n", impl, op, n, ops, ops ? ns / ops : 0.0, failed);
+  fflush(stdout);
+}
+
+static void report_util(const char *impl, const char *op, size_t n, size_t ops, double ns, size_t failed, double util)
+{
+  printf("%s,%s,%zu,%zu,%.2f,%zu,%.3f\n", impl, op, n, ops, ops ? ns / ops : 0.0, failed, util);
+  fflush(stdout);
+}
+
+/* xorshift64, so that every run sees the same workload */
+static uint64_t rng_state = 88172645463325252ULL;
+
+static uint64_t rng(void)
+{
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+/* ---- dbll ---- */
+
+static int dummy;
+
+static struct dbll *build_list(size_t n)
+{
+  struct dbll *ll = dbll_create();
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    dbll_append(ll, &dummy);
+  }
+  return ll;
+}
+
+static int count_node(struct dbll *ll, struct llnode *n, void *ctx)
+{
+  (*(size_t *) ctx)++;
+  return 1;
+}
+
+/* each run_* function performs n operations and returns the time spent on them */
+
+static double run_dbll_append(size_t n)
+{
+  struct dbll *ll = dbll_create();
+  size_t i;
+
+  double t = now_ns();
+  for (i = 0; i < n; i++) {
+    dbll_append(ll, &dummy);
+  }
+  t = now_ns() - t;
+
+  dbll_free(ll);
+  return t;
+}
+
+static double run_dbll_prepend(size_t n)
+{
+  struct dbll *ll = dbll_create();
+  size_t i;
+
+  double t = now_ns();
+  for (i = 0; i < n; i++) {
+    dbll_preppend(ll, &dummy);
+  }
+  t = now_ns() - t;
+
+  dbll_free(ll);
+  return t;
+}
+
+static double run_dbll_insert_after(size_t n)
+{
+  struct dbll *ll = build_list(1);
+  size_t i;
+
+  double t = now_ns();
+  for (i = 0; i < n; i++) {
+    dbll_insert_after(ll, ll->first, &dummy);
+  }
+  t = now_ns() - t;
+
+  dbll_free(ll);
+  return t;
+}
+
+static double run_dbll_insert_before(size_t n)
+{
+  struct dbll *ll = build_list(1);
+  size_t i;
+
+  double t = now_ns();
+  for (i = 0; i < n; i++) {
+    dbll_insert_before(ll, ll->last, &dummy);
+  }
+  t = now_ns() - t;
+
+  dbll_free(ll);
+  return t;
+}
+
+static double run_dbll_remove_head(size_t n)
+{
+  struct dbll *ll = build_list(n);
+  size_t i;
+
+  double t = now_ns();
+  for (i = 0; i < n; i++) {
+    dbll_remove(ll, ll->first);
+  }
+  t = now_ns() - t;
+
+  dbll_free(ll);
+  return t;
+}
+
+static double run_dbll_remove_middle(size_t n)
+{
+  struct dbll *ll = build_list(n);
+  struct llnode *mid = ll->first;
+  size_t i;
+
+  for (i = 0; i < n / 2; i++) {
+    mid = mid->next;
+  }
+
+  double t = now_ns();
+  for (i = 0; i < n; i++) {
+    struct llnode *next = (i % 2) ? mid->next : mid->prev;
+
+    if (next == NULL) {
+      next = (mid->next != NULL) ? mid->next : mid->prev;
+    }
+    dbll_remove(ll, mid);
+    mid = next;
+  }
+  t = now_ns() - t;
+
+  dbll_free(ll);
+  return t;
+}
+
+static double run_dbll_remove_tail(size_t n)
+{
+  struct dbll *ll = build_list(n);
+  size_t i;
+
+  double t = now_ns();
+  for (i = 0; i < n; i++) {
+    dbll_remove(ll, ll->last);
+  }
+  t = now_ns() - t;
+
+  dbll_free(ll);
+  return t;
+}
+
+static double run_dbll_iterate(size_t n)
+{
+  struct dbll *ll = build_list(n);
+  size_t count = 0;
+
+  double t = now_ns();
+  dbll_iterate(ll, NULL, NULL, &count, count_node);
+  t = now_ns() - t;
+
+  dbll_free(ll);
+  return t;
+}
+
+static double run_dbll_iterate_reverse(size_t n)
+{
+  struct dbll *ll = build_list(n);
+  size_t count = 0;
+
+  double t = now_ns();
+  dbll_iterate_reverse(ll, NULL, NULL, &count, count_node);
+  t = now_ns() - t;
+
+  dbll_free(ll);
+  return t;
+}
+
+static double run_dbll_free(size_t n)
+{
+  struct dbll *ll = build_list(n);
+
+  double t = now_ns();
+  dbll_free(ll);
+  return now_ns() - t;
+}
+
+/* ---- array baseline: a growable ring buffer of pointers (a deque) ---- */
+
+struct deque {
+  void **buf;
+  size_t cap;   /* always a power of two */
+  size_t head;  /* index of the first element */
+  size_t len;
+};
+
+static void dq_init(struct deque *d)
+{
+  d->cap = 16;
+  d->buf = malloc(d->cap * sizeof(void *));
+  d->head = d->len = 0;
+}
+
+static void **dq_at(struct deque *d, size_t i)
+{
+  return &d->buf[(d->head + i) & (d->cap - 1)];
+}
+
+static void dq_grow(struct deque *d)
+{
+  void **buf = malloc(2 * d->cap * sizeof(void *));
+  size_t i;
+
+  for (i = 0; i < d->len; i++) {
+    buf[i] = *dq_at(d, i);
+  }
+  free(d->buf);
+  d->buf = buf;
+  d->cap *= 2;
+  d->head = 0;
+}
+
+static void dq_push_back(struct deque *d, void *x)
+{
+  if (d->len == d->cap) dq_grow(d);
+  *dq_at(d, d->len++) = x;
+}
+
+static void dq_push_front(struct deque *d, void *x)
+{
+  if (d->len == d->cap) dq_grow(d);
+  d->head = (d->head - 1) & (d->cap - 1);
+  d->len++;
+  d->buf[d->head] = x;
+}
+
+/* insert x so that it becomes element i, shifting the elements after it */
+static void dq_insert(struct deque *d, size_t i, void *x)
+{
+  size_t j;
+
+  if (d->len == d->cap) dq_grow(d);
+  for (j = d->len; j > i; j--) {
+    *dq_at(d, j) = *dq_at(d, j - 1);
+  }
+  *dq_at(d, i) = x;
+  d->len++;
+}
+
+/* remove element i, shifting the elements after it */
+static void dq_erase(struct deque *d, size_t i)
+{
+  size_t j;
+
+  for (j = i; j + 1 < d->len; j++) {
+    *dq_at(d, j) = *dq_at(d, j + 1);
+  }
+  d->len--;
+}
+
+static void dq_build(struct deque *d, size_t n)
+{
+  size_t i;
+
+  dq_init(d);
+  for (i = 0; i < n; i++) {
+    dq_push_back(d, &dummy);
+  }
+}
+
+static int count_item(void *item, void *ctx)
+{
+  (*(size_t *) ctx)++;
+  return 1;
+}
+
+/* the iteration callback is called through a pointer, as in dbll_iterate */
+static int (*volatile item_fn)(void *, void *) = count_item;
+
+static double run_array_append(size_t n)
+{
+  struct deque d;
+  size_t i;
+
+  dq_init(&d);
+  double t = now_ns();
+  for (i = 0; i < n; i++) {
+    dq_push_back(&d, &dummy);
+  }
+  t = now_ns() - t;
+
+  free(d.buf);
+  return t;
+}
+
+static double run_array_prepend(size_t n)
+{
+  struct deque d;
+  size_t i;
+
+  dq_init(&d);
+  double t = now_ns();
+  for (i = 0; i < n; i++) {
+    dq_push_front(&d, &dummy);
+  }
+  t = now_ns() - t;
+
+  free(d.buf);
+  return t;
+}
+
+static double run_array_insert_after(size_t n)
+{
+  struct deque d;
+  size_t i;
+
+  dq_build(&d, 1);
+  double t = now_ns();
+  for (i = 0; i < n; i++) {
+    dq_insert(&d, 1, &dummy);
+  }
+  t = now_ns() - t;
+
+  free(d.buf);
+  return t;
+}
+
+static double run_array_insert_before(size_t n)
+{
+  struct deque d;
+  size_t i;
+
+  dq_build(&d, 1);
+  double t = now_ns();
+  for (i = 0; i < n; i++) {
+    dq_insert(&d, d.len - 1, &dummy);
+  }
+  t = now_ns() - t;
+
+  free(d.buf);
+  return t;
+}
+
+static double run_array_remove_head(size_t n)
+{
+  struct deque d;
+  size_t i;
+
+  dq_build(&d, n);
+  double t = now_ns();
+  for (i = 0; i < n; i++) {
+    d.head = (d.head + 1) & (d.cap - 1);
+    d.len--;
+  }
+  t = now_ns() - t;
+
+  free(d.buf);
+  return t;
+}
+
+static double run_array_remove_middle(size_t n)
+{
+  struct deque d;
+  size_t i;
+
+  dq_build(&d, n);
+  double t = now_ns();
+  for (i = 0; i < n; i++) {
+    dq_erase(&d, d.len / 2);
+  }
+  t = now_ns() - t;
+
+  free(d.buf);
+  return t;
+}
+
+static double run_array_remove_tail(size_t n)
+{
+  struct deque d;
+  size_t i;
+
+  dq_build(&d, n);
+  double t = now_ns();
+  for (i = 0; i < n; i++) {
+    d.len--;
+  }
+  t = now_ns() - t;
+
+  free(d.buf);
+  return t;
+}
+
+static double run_array_iterate(size_t n)
+{
+  struct deque d;
+  size_t i, count = 0;
+
+  dq_build(&d, n);
+  double t = now_ns();
+  for (i = 0; i < d.len; i++) {
+    item_fn(*dq_at(&d, i), &count);
+  }
+  t = now_ns() - t;
+
+  free(d.buf);
+  return t;
+}
+
+static double run_array_iterate_reverse(size_t n)
+{
+  struct deque d;
+  size_t i, count = 0;
+
+  dq_build(&d, n);
+  double t = now_ns();
+  for (i = d.len; i > 0; i--) {
+    item_fn(*dq_at(&d, i - 1), &count);
+  }
+  t = now_ns() - t;
+
+  free(d.buf);
+  return t;
+}
+
+static double run_array_free(size_t n)
+{
+  struct deque d;
+
+  dq_build(&d, n);
+  double t = now_ns();
+  free(d.buf);
+  return now_ns() - t;
+}
+
+struct list_bench {
+  const char *op;
+  double (*dbll)(size_t);
+  double (*array)(size_t);
+  int array_is_linear;  /* array version is O(n) per op */
+};
+
+static struct list_bench list_benches[] = {
+  { "append", run_dbll_append, run_array_append, 0 },
+  { "prepend", run_dbll_prepend, run_array_prepend, 0 },
+  { "insert_after", run_dbll_insert_after, run_array_insert_after, 1 },
+  { "insert_before", run_dbll_insert_before, run_array_insert_before, 1 },
+  { "remove_head", run_dbll_remove_head, run_array_remove_head, 0 },
+  { "remove_middle", run_dbll_remove_middle, run_array_remove_middle, 1 },
+  { "remove_tail", run_dbll_remove_tail, run_array_remove_tail, 0 },
+  { "iterate", run_dbll_iterate, run_array_iterate, 0 },
+  { "iterate_reverse", run_dbll_iterate_reverse, run_array_iterate_reverse, 0 },
+  { "free", run_dbll_free, run_array_free, 0 },
+};
+
+/* quadratic runs are only done once, everything else is repeated up to MIN_OPS */
+static void run_list(const char *impl, const char *op, size_t n, double (*fn)(size_t), int quadratic)
+{
+  size_t reps = (quadratic || n >= MIN_OPS) ? 1 : MIN_OPS / n;
+  size_t r;
+  double total = 0;
+
+  for (r = 0; r < reps; r++) {
+    total += fn(n);
+  }
+  report(impl, op, n, n * reps, total, 0);
+}
+
+static void bench_lists(size_t max_nodes)
+{
+  size_t n, b;
+
+  for (n = 10; n <= max_nodes; n *= 10) {
+    for (b = 0; b < sizeof(list_benches) / sizeof(list_benches[0]); b++) {
+      struct list_bench *lb = &list_benches[b];
+
+      run_list("dbll", lb->op, n, lb->dbll, 0);
+      if (!lb->array_is_linear || n <= ARRAY_MIDDLE_MAX) {
+        run_list("array", lb->op, n, lb->array, lb->array_is_linear);
+      }
+    }
+  }
+}
+
+/* ---- pool allocator ---- */
+
+/* an allocator under test, so that mpool and malloc run the same workload */
+struct allocator {
+  const char *name;
+  void *(*alloc)(void *ctx, size_t size);
+  void (*free)(void *ctx, void *addr);
+  void *ctx;
+  size_t capacity;  /* bytes available to the allocator, 0 if unbounded */
+};
+
+static void *pool_alloc(void *ctx, size_t size) { return mpool_alloc(ctx, size); }
+static void pool_free(void *ctx, void *addr) { mpool_free(ctx, addr); }
+static void *slab_alloc(void *ctx, size_t size) { return mpool_slab_alloc(ctx); }
+static void slab_free(void *ctx, void *addr) { mpool_slab_free(ctx, addr); }
+static void *fixed_alloc(void *ctx, size_t size) { return mpool_fixed_alloc(ctx); }
+static void fixed_free(void *ctx, void *addr) { mpool_fixed_free(ctx, addr); }
+static void *sys_alloc(void *ctx, size_t size) { return malloc(size); }
+static void sys_free(void *ctx, void *addr) { free(addr); }
+
+/* after a workload, keep allocating random sizes in [1, max_size] until
+   the first failure and report how much of the allocator's capacity was
+   in use; the extra blocks are freed again */
+static void bench_fill(struct allocator *a, void **slots, size_t *slot_size, size_t live, size_t max_size)
+{
+  size_t used = 0, n = 0, cap = 1024, i;
+  void **extra = malloc(cap * sizeof(void *));
+  char op[64];
+  double t;
+
+  for (i = 0; i < live; i++) {
+    used += (slots[i] != NULL) ? slot_size[i] : 0;
+  }
+
+  t = now_ns();
+  for (;;) {
+    size_t size = 1 + rng() % max_size;
+    void *addr = a->alloc(a->ctx, size);
+
+    if (addr == NULL) {
+      break;
+    }
+    if (n == cap) {
+      cap *= 2;
+      extra = realloc(extra, cap * sizeof(void *));
+    }
+    extra[n++] = addr;
+    used += size;
+  }
+  t = now_ns() - t;
+  snprintf(op, sizeof(op), "fill_1-%zu", max_size);
+  report_util(a->name, op, live, n + 1, t, 1, (double) used / a->capacity);
+
+  for (i = 0; i < n; i++) {
+    a->free(a->ctx, extra[i]);
+  }
+  free(extra);
+}
+
+/* fill `live` slots with random sizes in [1, max_size], then run `ops`
+   random replacements, then (for bounded allocators) fill up what is
+   left, then free everything */
+static void bench_alloc_workload(struct allocator *a, size_t live, size_t ops, size_t max_size)
+{
+  void **slots = calloc(live, sizeof(void *));
+  size_t *slot_size = malloc(live * sizeof(size_t));
+  size_t *sizes = malloc(ops * sizeof(size_t));
+  size_t *victims = malloc(ops * sizeof(size_t));
+  size_t i, failed;
+  char op[64];
+  double t;
+
+  //draw the workload up front so that the rng is not timed
+  for (i = 0; i < ops; i++) {
+    sizes[i] = 1 + rng() % max_size;
+    victims[i] = rng() % live;
+  }
+
+  failed = 0;
+  t = now_ns();
+  for (i = 0; i < live; i++) {
+    slots[i] = a->alloc(a->ctx, sizes[i % ops]);
+    slot_size[i] = sizes[i % ops];
+    failed += (slots[i] == NULL);
+  }
+  t = now_ns() - t;
+  snprintf(op, sizeof(op), "alloc_1-%zu", max_size);
+  report(a->name, op, live, live, t, failed);
+
+  failed = 0;
+  t = now_ns();
+  for (i = 0; i < ops; i++) {
+    size_t s = victims[i];
+
+    if (slots[s] != NULL) {
+      a->free(a->ctx, slots[s]);
+    }
+    slots[s] = a->alloc(a->ctx, sizes[i]);
+    slot_size[s] = sizes[i];
+    failed += (slots[s] == NULL);
+  }
+  t = now_ns() - t;
+  snprintf(op, sizeof(op), "churn_1-%zu", max_size);
+  report(a->name, op, live, 2 * ops, t, failed);
+
+  if (a->capacity > 0) {
+    bench_fill(a, slots, slot_size, live, max_size);
+  }
+
+  t = now_ns();
+  for (i = 0; i < live; i++) {
+    if (slots[i] != NULL) {
+      a->free(a->ctx, slots[i]);
+    }
+  }
+  t = now_ns() - t;
+  snprintf(op, sizeof(op), "free_1-%zu", max_size);
+  report(a->name, op, live, live, t, 0);
+
+  free(victims);
+  free(sizes);
+  free(slot_size);
+  free(slots);
+}
+
+/* pool modes to compare against each other and against malloc */
+static struct {
+  const char *name;
+  int flags;
+} pool_modes[] = {
+  { "mpool", MPOOL_LISTS },
+  { "mpool_tags", MPOOL_TAGS },
+  { "mpool_buddy", MPOOL_BUDDY },
+  { "mpool_tags_huge", MPOOL_TAGS | MPOOL_HUGEPAGE },
+  { "mpool_tags_grow", MPOOL_TAGS | MPOOL_GROW },
+  { "mpool_tags_stats", MPOOL_TAGS | MPOOL_STATS },
+};
+
+static void bench_pools(size_t ops)
+{
+  size_t live_counts[] = {100, 1000, 10000};
+  size_t max_sizes[] = {16, 256, 4096};
+  size_t l, m, k;
+
+  for (l = 0; l < sizeof(live_counts) / sizeof(live_counts[0]); l++) {
+    for (m = 0; m < sizeof(max_sizes) / sizeof(max_sizes[0]); m++) {
+      size_t live = live_counts[l], max_size = max_sizes[m];
+
+      for (k = 0; k < sizeof(pool_modes) / sizeof(pool_modes[0]); k++) {
+        /* room for every live block at its largest size, plus slack for fragmentation */
+        size_t size = 2 * live * (max_size + 32) + 4096;
+        int grow = pool_modes[k].flags & MPOOL_GROW;
+
+        /* growable pools start at a sixteenth of that and have no fixed capacity to fill */
+        struct memory_pool *p = mpool_create_flags(grow ? size / 16 : size, pool_modes[k].flags);
+        struct allocator pool = { pool_modes[k].name, pool_alloc, pool_free, p, grow ? 0 : p->size };
+
+        rng_state = 88172645463325252ULL;
+        bench_alloc_workload(&pool, live, ops, max_size);
+        mpool_destroy(p);
+      }
+
+      struct allocator sys = { "malloc", sys_alloc, sys_free, NULL, 0 };
+
+      rng_state = 88172645463325252ULL;
+      bench_alloc_workload(&sys, live, ops, max_size);
+    }
+  }
+}
+
+/* request-scoped work: allocate n objects, then release all of them,
+   once per object or (for the arena) with a single mpool_reset */
+static void bench_request(struct allocator *a, struct memory_pool *arena, size_t n, size_t max_size)
+{
+  void **objs = malloc(n * sizeof(void *));
+  size_t *sizes = malloc(n * sizeof(size_t));
+  size_t i, failed = 0;
+  char op[64];
+  double t;
+
+  for (i = 0; i < n; i++) {
+    sizes[i] = 1 + rng() % max_size;
+  }
+
+  t = now_ns();
+  for (i = 0; i < n; i++) {
+    objs[i] = a->alloc(a->ctx, sizes[i]);
+    failed += (objs[i] == NULL);
+  }
+  t = now_ns() - t;
+  snprintf(op, sizeof(op), "request_alloc_1-%zu", max_size);
+  report(a->name, op, n, n, t, failed);
+
+  t = now_ns();
+  if (arena != NULL) {
+    mpool_reset(arena);
+  } else {
+    for (i = 0; i < n; i++) {
+      a->free(a->ctx, objs[i]);
+    }
+  }
+  t = now_ns() - t;
+  snprintf(op, sizeof(op), "request_release_1-%zu", max_size);
+  report(a->name, op, n, n, t, 0);
+
+  free(sizes);
+  free(objs);
+}
+
+static void bench_arena(void)
+{
+  size_t counts[] = {100, 1000, 10000, 100000};
+  size_t k;
+
+  for (k = 0; k < sizeof(counts) / sizeof(counts[0]); k++) {
+    size_t n = counts[k];
+    size_t size = n * (256 + 48) + 4096;
+    struct memory_pool *p;
+
+    p = mpool_create_flags(size, MPOOL_ARENA);
+    struct allocator arena = { "mpool_arena", pool_alloc, pool_free, p, size };
+    rng_state = 88172645463325252ULL;
+    bench_request(&arena, p, n, 256);
+    mpool_destroy(p);
+
+    p = mpool_create_flags(size, MPOOL_TAGS);
+    struct allocator tags = { "mpool_tags", pool_alloc, pool_free, p, size };
+    rng_state = 88172645463325252ULL;
+    bench_request(&tags, NULL, n, 256);
+    mpool_destroy(p);
+
+    struct allocator sys = { "malloc", sys_alloc, sys_free, NULL, 0 };
+    rng_state = 88172645463325252ULL;
+    bench_request(&sys, NULL, n, 256);
+  }
+}
+
+/* ---- freeing many blocks: one at a time, as a batch, deferred ---- */
+
+enum { FREE_EACH, FREE_BATCH, FREE_DEFERRED };
+
+static void bench_free_all_run(const char *impl, int flags, int how, size_t n)
+{
+  static const char *ops[] = { "free_all_each", "free_all_batch", "free_all_deferred" };
+  struct memory_pool *p = mpool_create_flags(n * (256 + 48) + 4096, flags | (how == FREE_DEFERRED ? MPOOL_DEFERRED : 0));
+  void **objs = malloc(n * sizeof(void *));
+  size_t i, failed = 0;
+  double t;
+
+  rng_state = 88172645463325252ULL;
+  for (i = 0; i < n; i++) {
+    objs[i] = mpool_alloc(p, 1 + rng() % 256);
+    failed += (objs[i] == NULL);
+  }
+  for (i = n - 1; i > 0; i--) { //free in random order
+    size_t j = rng() % (i + 1);
+    void *x = objs[i];
+
+    objs[i] = objs[j];
+    objs[j] = x;
+  }
+
+  t = now_ns();
+  if (how == FREE_BATCH) {
+    mpool_free_batch(p, objs, n);
+  } else {
+    for (i = 0; i < n; i++) {
+      mpool_free(p, objs[i]);
+    }
+    mpool_flush(p);
+  }
+  t = now_ns() - t;
+  report(impl, ops[how], n, n, t, failed);
+
+  free(objs);
+  mpool_destroy(p);
+}
+
+static void bench_free_all(void)
+{
+  size_t counts[] = {100, 1000, 10000};
+  size_t k;
+  int how;
+
+  for (k = 0; k < sizeof(counts) / sizeof(counts[0]); k++) {
+    for (how = FREE_EACH; how <= FREE_DEFERRED; how++) {
+      bench_free_all_run("mpool", MPOOL_LISTS, how, counts[k]);
+      bench_free_all_run("mpool_tags", MPOOL_TAGS, how, counts[k]);
+    }
+  }
+}
+
+/* ---- reopening file-backed pools ---- */
+
+static void bench_file(void)
+{
+  size_t mib[] = {1, 64, 1024};
+  char path[] = "/tmp/pa_bench_pool_XXXXXX";
+  size_t k;
+  int fd;
+
+  for (k = 0; k < sizeof(mib) / sizeof(mib[0]); k++) {
+    if ((fd = mkstemp(path)) < 0) {
+      return;
+    }
+    close(fd);
+
+    /* the file is sparse, only the pages the pool writes take space */
+    struct memory_pool *p = mpool_open(path, mib[k] << 20, MPOOL_TAGS);
+
+    if (p == NULL) {
+      unlink(path);
+      return;
+    }
+    mpool_set_root(p, mpool_off(p, mpool_alloc(p, 64)));
+    mpool_destroy(p);
+
+    double t = now_ns();
+    p = mpool_open(path, 0, MPOOL_TAGS);
+    t = now_ns() - t;
+    report("mpool_file", "file_reopen", mib[k], 1, t, p == NULL || mpool_root(p) == 0);
+
+    if (p != NULL) {
+      mpool_destroy(p);
+    }
+    unlink(path);
+    strcpy(path, "/tmp/pa_bench_pool_XXXXXX");
+  }
+}
+
+/* ---- giving free memory back with mpool_trim ---- */
+
+static void bench_trim(void)
+{
+  size_t mib[] = {1, 16, 256};
+  size_t k;
+
+  for (k = 0; k < sizeof(mib) / sizeof(mib[0]); k++) {
+    size_t size = mib[k] << 20;
+    struct memory_pool *p = mpool_create_flags(size + (1 << 16), MPOOL_LISTS);
+    char *addr;
+    double t;
+
+    if (p == NULL) {
+      return;
+    }
+
+    /* calloc of a block whose pages are resident has to clear them */
+    addr = mpool_alloc(p, size);
+    if (addr != NULL) {
+      memset(addr, 1, size);
+      mpool_free(p, addr);
+    }
+    t = now_ns();
+    addr = mpool_calloc(p, 1, size);
+    t = now_ns() - t;
+    report("mpool", "calloc_resident", mib[k], 1, t, addr == NULL);
+
+    /* once they are released they are known to be zero */
+    mpool_free(p, addr);
+    t = now_ns();
+    size_t released = mpool_trim(p, 0);
+    t = now_ns() - t;
+    report("mpool", "trim", mib[k], 1, t, released < size / 2);
+
+    t = now_ns();
+    addr = mpool_calloc(p, 1, size);
+    t = now_ns() - t;
+    report("mpool", "calloc_released", mib[k], 1, t, addr == NULL);
+
+    mpool_destroy(p);
+  }
+}
+
+/* ---- fragmentation: plain pools against handles with compaction ---- */
+
+/* fill `size` bytes with blocks of 16 to 256 bytes, free a random half,
+   then allocate 4096-byte blocks until the first failure; util is the
+   fraction of the heap in use by then */
+static void bench_compact_run(const char *impl, int flags, int handles, size_t size)
+{
+  struct memory_pool *p = mpool_create_flags(handles ? size + 4096 : size, flags);
+  struct mpool_handles *h = handles ? mpool_handles_create(p, size, 0) : NULL;
+  size_t cap = size / 16, n, i, used = 0, big = 0;
+  uintptr_t *objs = malloc(cap * sizeof(uintptr_t));
+  size_t *sizes = malloc(cap * sizeof(size_t));
+  double t;
+
+  rng_state = 88172645463325252ULL;
+  for (n = 0; n < cap; n++) {
+    sizes[n] = 16 + rng() % 241;
+    objs[n] = handles ? mpool_halloc(h, sizes[n]) : (uintptr_t) mpool_alloc(p, sizes[n]);
+    if (objs[n] == 0) {
+      break;
+    }
+    used += sizes[n];
+  }
+  for (i = 0; i < n; i++) {
+    if (rng() % 2) {
+      handles ? mpool_hfree(h, (uint32_t) objs[i]) : mpool_free(p, (void *) objs[i]);
+      used -= sizes[i];
+    }
+  }
+
+  t = now_ns();
+  for (;;) {
+    uintptr_t x = handles ? mpool_halloc(h, 4096) : (uintptr_t) mpool_alloc(p, 4096);
+
+    if (x == 0) {
+      break;
+    }
+    big++;
+    used += 4096;
+  }
+  t = now_ns() - t;
+  report_util(impl, "frag_fill_4096", n, big + 1, t, 1, (double) used / size);
+
+  free(sizes);
+  free(objs);
+  if (h != NULL) {
+    mpool_handles_destroy(h);
+  }
+  mpool_destroy(p);
+}
+
+static void bench_compact(void)
+{
+  size_t kib[] = {64, 1024, 16384};
+  size_t k;
+
+  for (k = 0; k < sizeof(kib) / sizeof(kib[0]); k++) {
+    bench_compact_run("mpool", MPOOL_LISTS, 0, kib[k] << 10);
+    bench_compact_run("mpool_tags", MPOOL_TAGS, 0, kib[k] << 10);
+    bench_compact_run("mpool_handles", MPOOL_TAGS, 1, kib[k] << 10);
+  }
+}
+
+/* ---- one type: MPOOL_DEFINE_TYPED against the generic paths ---- */
+
+typedef struct bnode {
+  struct bnode *next;
+  uint64_t key;
+  char payload[32];
+} bnode_t;
+
+MPOOL_DEFINE_TYPED(bnode_t)
+
+enum { TYPED_INLINE, TYPED_GENERIC, TYPED_SLAB, TYPED_MALLOC };
+
+/* `ops` random replacements among `live` objects; every object is
+   written, so a block handed out twice would show in the key check */
+#define TYPED_CHURN(alloc, release) \
+  for (i = 0; i < ops; i++) { \
+    bnode_t *x = slots[victims[i]]; \
+    if (x != NULL) { \
+      failed += (x->key != victims[i]); \
+      release; \
+    } \
+    x = alloc; \
+    if (x != NULL) { \
+      x->key = victims[i]; \
+    } \
+    failed += (x == NULL); \
+    slots[victims[i]] = x; \
+  }
+
+static void bench_typed_run(const char *impl, int how, int flags, size_t live, size_t ops)
+{
+  struct memory_pool *p = mpool_create_flags(2 * live * (sizeof(bnode_t) + 32) + (1 << 16), flags);
+  struct mpool_slab_cache *c = (how == TYPED_SLAB) ? mpool_slab_create(p, sizeof(bnode_t), 0) : NULL;
+  struct mpool_bnode_t tp;
+  bnode_t **slots = calloc(live, sizeof(bnode_t *));
+  size_t *victims = malloc(ops * sizeof(size_t));
+  size_t i, failed = 0;
+  char op[64];
+  double t;
+
+  mpool_bnode_t_init(&tp, p);
+  rng_state = 88172645463325252ULL;
+  for (i = 0; i < ops; i++) {
+    victims[i] = rng() % live;
+  }
+
+  t = now_ns();
+  switch (how) {
+  case TYPED_INLINE:
+    TYPED_CHURN(mpool_bnode_t_alloc(&tp), mpool_bnode_t_free(&tp, x));
+    break;
+  case TYPED_GENERIC:
+    TYPED_CHURN(mpool_alloc(p, sizeof(bnode_t)), mpool_free(p, x));
+    break;
+  case TYPED_SLAB:
+    TYPED_CHURN(mpool_slab_alloc(c), mpool_slab_free(c, x));
+    break;
+  default:
+    TYPED_CHURN(malloc(sizeof(bnode_t)), free(x));
+    break;
+  }
+  t = now_ns() - t;
+  snprintf(op, sizeof(op), "typed_churn_%zu", sizeof(bnode_t));
+  report(impl, op, live, 2 * ops, t, failed);
+
+  for (i = 0; i < live; i++) {
+    if (how == TYPED_MALLOC) {
+      free(slots[i]);
+    } else if (how == TYPED_SLAB && slots[i] != NULL) {
+      mpool_slab_free(c, slots[i]);
+    } else if (how == TYPED_GENERIC && slots[i] != NULL) {
+      mpool_free(p, slots[i]);
+    }
+  }
+  mpool_bnode_t_destroy(&tp);
+  if (c != NULL) {
+    mpool_slab_destroy(c);
+  }
+  free(victims);
+  free(slots);
+  mpool_destroy(p);
+}
+
+static void bench_typed(size_t ops)
+{
+  size_t live_counts[] = {100, 1000, 10000};
+  size_t l;
+
+  for (l = 0; l < sizeof(live_counts) / sizeof(live_counts[0]); l++) {
+    bench_typed_run("mpool_typed", TYPED_INLINE, MPOOL_TAGS, live_counts[l], ops);
+    bench_typed_run("mpool", TYPED_GENERIC, MPOOL_LISTS, live_counts[l], ops);
+    bench_typed_run("mpool_tags", TYPED_GENERIC, MPOOL_TAGS, live_counts[l], ops);
+    bench_typed_run("slab_mpool_tags", TYPED_SLAB, MPOOL_TAGS, live_counts[l], ops);
+    bench_typed_run("malloc", TYPED_MALLOC, MPOOL_TAGS, live_counts[l], ops);
+  }
+}
+
+/* ---- cost of the sampling heap profiler ---- */
+
+static void bench_profile(size_t ops)
+{
+  size_t rates[] = {0, 512 * 1024, 4096};
+  size_t live = 1000, k;
+
+  for (k = 0; k < sizeof(rates) / sizeof(rates[0]); k++) {
+    size_t size = 2 * live * (256 + 32) + 4096;
+    struct memory_pool *p = mpool_create_flags(size, MPOOL_TAGS);
+    char name[64];
+
+    snprintf(name, sizeof(name), rates[k] ? "mpool_tags_profile_%zu" : "mpool_tags_noprofile", rates[k]);
+    struct allocator pool = { name, pool_alloc, pool_free, p, p->size };
+
+    mpool_set_profile(p, rates[k]);
+    rng_state = 88172645463325252ULL;
+    bench_alloc_workload(&pool, live, ops, 256);
+    mpool_destroy(p);
+  }
+}
+
+/* append-heavy buffers: `live` buffers grow by 1 to max_step bytes at
+   a time, and one that passes max_size is freed and started again */
+static void bench_realloc_workload(const char *name, void *(*resize)(void *ctx, void *addr, size_t size),
+                                   void (*release)(void *ctx, void *addr), void *ctx,
+                                   size_t live, size_t ops, size_t max_step, size_t max_size)
+{
+  void **bufs = calloc(live, sizeof(void *));
+  size_t *lens = calloc(live, sizeof(size_t));
+  size_t i, failed = 0, in_place = 0;
+  char op[64];
+  double t;
+
+  t = now_ns();
+  for (i = 0; i < ops; i++) {
+    size_t s = rng() % live;
+    size_t len = lens[s] + 1 + rng() % max_step;
+    void *addr;
+
+    if (len > max_size) {
+      release(ctx, bufs[s]);
+      bufs[s] = NULL;
+      len = 1 + rng() % max_step;
+    }
+    if ((addr = resize(ctx, bufs[s], len)) == NULL) {
+      failed++;
+      continue;
+    }
+    in_place += (addr == bufs[s]);
+    bufs[s] = addr;
+    lens[s] = len;
+  }
+  t = now_ns() - t;
+  snprintf(op, sizeof(op), "realloc_append_%zu-%zu", max_step, max_size);
+  report_util(name, op, live, ops, t, failed, (double) in_place / ops);
+
+  for (i = 0; i < live; i++) {
+    release(ctx, bufs[i]);
+  }
+  free(lens);
+  free(bufs);
+}
+
+static void *pool_realloc(void *ctx, void *addr, size_t size) { return mpool_realloc(ctx, addr, size); }
+static void *sys_realloc(void *ctx, void *addr, size_t size) { return realloc(addr, size); }
+
+static void bench_realloc(size_t ops)
+{
+  size_t live_counts[] = {1, 16, 256};
+  size_t l, k;
+
+  for (l = 0; l < sizeof(live_counts) / sizeof(live_counts[0]); l++) {
+    size_t live = live_counts[l];
+
+    for (k = 0; k < sizeof(pool_modes) / sizeof(pool_modes[0]); k++) {
+      struct memory_pool *p = mpool_create_flags(4 * live * 4096 + 4096, pool_modes[k].flags);
+
+      rng_state = 88172645463325252ULL;
+      bench_realloc_workload(pool_modes[k].name, pool_realloc, pool_free, p, live, ops, 64, 4096);
+      mpool_destroy(p);
+    }
+
+    rng_state = 88172645463325252ULL;
+    bench_realloc_workload("malloc", sys_realloc, sys_free, NULL, live, ops, 64, 4096);
+  }
+}
+
+/* objects of at most SLAB_OBJECT bytes: a slab cache of SLAB_OBJECT-byte
+   objects against the pool and malloc running the same workload */
+#define SLAB_OBJECT 64
+
+static void bench_slabs(size_t ops)
+{
+  size_t live_counts[] = {100, 1000, 10000};
+  size_t l, k;
+
+  for (l = 0; l < sizeof(live_counts) / sizeof(live_counts[0]); l++) {
+    size_t live = live_counts[l];
+    size_t size = 2 * live * (SLAB_OBJECT + 32) + (1 << 16);
+
+    for (k = 0; k < sizeof(pool_modes) / sizeof(pool_modes[0]); k++) {
+      char name[64];
+      struct memory_pool *p = mpool_create_flags(size, pool_modes[k].flags);
+      struct mpool_slab_cache *c = mpool_slab_create(p, SLAB_OBJECT, 0);
+
+      snprintf(name, sizeof(name), "slab_%s", pool_modes[k].name);
+      struct allocator slab = { name, slab_alloc, slab_free, c, 0 };
+
+      rng_state = 88172645463325252ULL;
+      bench_alloc_workload(&slab, live, ops, SLAB_OBJECT);
+      mpool_slab_destroy(c);
+      mpool_destroy(p);
+    }
+  }
+}
+
+/* ---- per-thread counters from a shared pool, with and without MPOOL_CACHELINE ---- */
+
+#define COUNTER_OPS 10000000
+
+struct counter_work {
+  volatile uint64_t *counter;
+  size_t ops;
+};
+
+static void *counter_loop(void *arg)
+{
+  struct counter_work *w = arg;
+  size_t i;
+
+  for (i = 0; i < w->ops; i++) {
+    (*w->counter)++;
+  }
+  return NULL;
+}
+
+static void bench_counters(void)
+{
+  int cacheline;
+  size_t nthreads, i;
+
+  for (nthreads = 1; nthreads <= 16; nthreads *= 2) {
+    for (cacheline = 0; cacheline < 2; cacheline++) {
+      struct memory_pool *p = mpool_create_flags(1 << 16, MPOOL_TAGS | MPOOL_THREADS | (cacheline ? MPOOL_CACHELINE : 0));
+      pthread_t tid[16];
+      struct counter_work work[16];
+
+      /* allocated back to back by one thread, as a program would set them up */
+      for (i = 0; i < nthreads; i++) {
+        work[i].counter = mpool_alloc(p, sizeof(uint64_t));
+        *work[i].counter = 0;
+        work[i].ops = COUNTER_OPS / nthreads;
+      }
+
+      double t = now_ns();
+      for (i = 0; i < nthreads; i++) {
+        pthread_create(&tid[i], NULL, counter_loop, &work[i]);
+      }
+      for (i = 0; i < nthreads; i++) {
+        pthread_join(tid[i], NULL);
+      }
+      t = now_ns() - t;
+
+      report(cacheline ? "mpool_tags_cacheline" : "mpool_tags", "counters_increment", nthreads,
+             nthreads * (COUNTER_OPS / nthreads), t, 0);
+      for (i = 0; i < nthreads; i++) {
+        mpool_free(p, (void *) work[i].counter);
+      }
+      mpool_destroy(p);
+    }
+  }
+}
+
+/* ---- shared pool, 1 to 64 threads ---- */
+
+#define THREAD_SLOTS 64
+#define THREAD_MAX_SIZE 256
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* a plain pool behind one global mutex, the baseline for MPOOL_THREADS */
+static void *locked_alloc(void *ctx, size_t size)
+{
+  pthread_mutex_lock(&pool_lock);
+  void *addr = mpool_alloc(ctx, size);
+  pthread_mutex_unlock(&pool_lock);
+  return addr;
+}
+
+static void locked_free(void *ctx, void *addr)
+{
+  pthread_mutex_lock(&pool_lock);
+  mpool_free(ctx, addr);
+  pthread_mutex_unlock(&pool_lock);
+}
+
+struct thread_work {
+  struct allocator *a;
+  size_t ops;
+  uint64_t seed;
+  size_t failed;
+};
+
+/* random replacements in THREAD_SLOTS slots of the thread's own */
+static void *thread_churn(void *arg)
+{
+  struct thread_work *w = arg;
+  void *slots[THREAD_SLOTS] = { NULL };
+  uint64_t x = w->seed;
+  size_t i;
+
+  for (i = 0; i < w->ops; i++) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+
+    size_t s = x % THREAD_SLOTS;
+    if (slots[s] != NULL) {
+      w->a->free(w->a->ctx, slots[s]);
+    }
+    slots[s] = w->a->alloc(w->a->ctx, 1 + (x >> 32) % THREAD_MAX_SIZE);
+    w->failed += (slots[s] == NULL);
+  }
+
+  for (i = 0; i < THREAD_SLOTS; i++) {
+    if (slots[i] != NULL) {
+      w->a->free(w->a->ctx, slots[i]);
+    }
+  }
+  return NULL;
+}
+
+/* run `ops` replacements in each of `nthreads` threads; report the wall
+   time per operation over all threads */
+static void bench_threads_workload(struct allocator *a, size_t nthreads, size_t ops)
+{
+  pthread_t tid[64];
+  struct thread_work work[64];
+  size_t i, failed = 0;
+  char op[64];
+
+  double t = now_ns();
+  for (i = 0; i < nthreads; i++) {
+    work[i].a = a;
+    work[i].ops = ops;
+    work[i].seed = 88172645463325252ULL + i;
+    work[i].failed = 0;
+    pthread_create(&tid[i], NULL, thread_churn, &work[i]);
+  }
+  for (i = 0; i < nthreads; i++) {
+    pthread_join(tid[i], NULL);
+    failed += work[i].failed;
+  }
+  t = now_ns() - t;
+
+  snprintf(op, sizeof(op), "threads_churn_1-%d", THREAD_MAX_SIZE);
+  report(a->name, op, nthreads, 2 * ops * nthreads, t, failed);
+}
+
+static void bench_threads(size_t ops)
+{
+  size_t nthreads;
+
+  for (nthreads = 1; nthreads <= 64; nthreads *= 2) {
+    /* room for every thread's blocks plus what its magazines hold on to */
+    size_t size = nthreads * (1 << 20);
+    size_t per_thread = ops / nthreads > 1000 ? ops / nthreads : 1000;
+    struct memory_pool *p;
+
+    p = mpool_create_flags(size, MPOOL_TAGS);
+    struct allocator locked = { "mpool_tags_mutex", locked_alloc, locked_free, p, size };
+    bench_threads_workload(&locked, nthreads, per_thread);
+    mpool_destroy(p);
+
+    p = mpool_create_flags(size, MPOOL_TAGS | MPOOL_THREADS);
+    struct allocator tags = { "mpool_tags_threads", pool_alloc, pool_free, p, size };
+    bench_threads_workload(&tags, nthreads, per_thread);
+    mpool_destroy(p);
+
+    p = mpool_create_flags(size, MPOOL_BUDDY | MPOOL_THREADS);
+    struct allocator buddy = { "mpool_buddy_threads", pool_alloc, pool_free, p, size };
+    bench_threads_workload(&buddy, nthreads, per_thread);
+    mpool_destroy(p);
+
+    /* every size fits a THREAD_MAX_SIZE block; no lock and no magazines */
+    p = mpool_create_flags(size, MPOOL_TAGS);
+    struct mpool_fixed *f = mpool_fixed_create(p, THREAD_MAX_SIZE, nthreads * THREAD_SLOTS);
+    struct allocator fixed = { "mpool_fixed_lockfree", fixed_alloc, fixed_free, f, size };
+    bench_threads_workload(&fixed, nthreads, per_thread);
+    mpool_fixed_destroy(f);
+    mpool_destroy(p);
+
+    struct allocator sys = { "malloc", sys_alloc, sys_free, NULL, 0 };
+    bench_threads_workload(&sys, nthreads, per_thread);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  size_t max_nodes = 10000000;
+  size_t pool_ops = 100000;
+
+  if (argc > 1) {
+    max_nodes = strtoul(argv[1], NULL, 10);
+  }
+  if (argc > 2) {
+    pool_ops = strtoul(argv[2], NULL, 10);
+  }
+
+  printf("impl,op,n,ops,ns_per_op,failed,util\n");
+  bench_lists(max_nodes);
+  bench_pools(pool_ops);
+  bench_slabs(pool_ops);
+  bench_arena();
+  bench_free_all();
+  bench_file();
+  bench_trim();
+  bench_compact();
+  bench_typed(pool_ops);
+  bench_profile(pool_ops);
+  bench_realloc(pool_ops);
+  bench_threads(pool_ops);
+  bench_counters();
+  return 0;
+}
@@ -0,0 +1,314 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pa_map.h"
+#include "pa_trace.h"
+
+/* writing and reading allocation traces, and recording them from any allocator */
+
+#define TRACE_BUFFER (1 << 20)
+
+struct trace_writer {
+  FILE *f;
+  uint64_t last;              /* time of the previous event */
+  size_t len;                 /* bytes used in buf */
+  unsigned char buf[TRACE_BUFFER];
+};
+
+struct trace_slot {
+  uintptr_t addr;             /* the key, 0 for an empty slot */
+  size_t size;
+  uint32_t id;
+};
+
+static uint64_t clock_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* ---- writing ---- */
+
+static void put_varint(struct trace_writer *w, uint64_t v)
+{
+  while (v >= 0x80) {
+    w->buf[w->len++] = (unsigned char) (v | 0x80);
+    v >>= 7;
+  }
+  w->buf[w->len++] = (unsigned char) v;
+}
+
+static int flush(struct trace_writer *w)
+{
+  int ok = fwrite(w->buf, 1, w->len, w->f) == w->len;
+
+  w->len = 0;
+  return ok;
+}
+
+/* returns NULL if the file could not be created */
+struct trace_writer *trace_writer_open(const char *path)
+{
+  struct trace_writer *w = (struct trace_writer*)malloc(sizeof(struct trace_writer));
+
+  if (w == NULL) { //check mem allocation
+    return NULL;
+  }
+  if ((w->f = fopen(path, "wb")) == NULL) {
+    free(w);
+    return NULL;
+  }
+
+  fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), w->f);
+  w->last = clock_ns();
+  w->len = 0;
+  return w;
+}
+
+void trace_write(struct trace_writer *w, int op, uint32_t id, size_t size)
+{
+  uint64_t now = clock_ns();
+
+  //an event takes at most 1 + 5 + 10 + 10 bytes
+  if (w->len > TRACE_BUFFER - 32) {
+    flush(w);
+  }
+
+  w->buf[w->len++] = (unsigned char) op;
+  put_varint(w, id);
+  if (op != TRACE_FREE) {
+    put_varint(w, size);
+  }
+  put_varint(w, now - w->last);
+  w->last = now;
+}
+
+/* returns 0 if the trace could not be written completely */
+int trace_writer_close(struct trace_writer *w)
+{
+  int ok = flush(w);
+
+  ok = (fclose(w->f) == 0) && ok;
+  free(w);
+  return ok;
+}
+
+/* ---- reading ---- */
+
+/* decode a varint at *pos, 0 if it runs past end */
+static int get_varint(const unsigned char **pos, const unsigned char *end, uint64_t *v)
+{
+  const unsigned char *p = *pos;
+  int shift = 0;
+
+  *v = 0;
+  while (p < end && shift < 64) {
+    *v |= (uint64_t) (*p & 0x7f) << shift;
+    if (!(*p++ & 0x80)) {
+      *pos = p;
+      return 1;
+    }
+    shift += 7;
+  }
+  return 0;
+}
+
+/* read a whole trace into memory */
+/* returns its events (free them with free), NULL if the file cannot be
+   read or is not a trace; *nids is one more than the largest id */
+struct trace_event *trace_read(const char *path, size_t *nevents, uint32_t *nids)
+{
+  FILE *f = fopen(path, "rb");
+  unsigned char *data;
+  long len;
+
+  if (f == NULL) {
+    return NULL;
+  }
+  if (fseek(f, 0, SEEK_END) != 0 || (len = ftell(f)) < (long) strlen(TRACE_MAGIC) || fseek(f, 0, SEEK_SET) != 0) {
+    fclose(f);
+    return NULL;
+  }
+  if ((data = malloc(len)) == NULL || fread(data, 1, len, f) != (size_t) len ||
+      memcmp(data, TRACE_MAGIC, strlen(TRACE_MAGIC)) != 0) {
+    free(data);
+    fclose(f);
+    return NULL;
+  }
+  fclose(f);
+
+  /* every event takes at least three bytes */
+  struct trace_event *events = malloc((len / 3 + 1) * sizeof(struct trace_event));
+  const unsigned char *pos = data + strlen(TRACE_MAGIC), *end = data + len;
+  uint64_t id, size = 0, delta, time = 0;
+  size_t n = 0;
+
+  *nids = 0;
+  while (events != NULL && pos < end) {
+    int op = *pos++;
+
+    if ((op != TRACE_ALLOC && op != TRACE_FREE && op != TRACE_REALLOC) || !get_varint(&pos, end, &id) ||
+        (op != TRACE_FREE && !get_varint(&pos, end, &size)) || !get_varint(&pos, end, &delta) || id >= UINT32_MAX) {
+      free(events); //corrupt or truncated
+      events = NULL;
+      break;
+    }
+
+    time += delta;
+    events[n].op = op;
+    events[n].id = (uint32_t) id;
+    events[n].size = (op != TRACE_FREE) ? size : 0;
+    events[n].time = time;
+    n++;
+    if (id >= *nids) {
+      *nids = (uint32_t) id + 1;
+    }
+  }
+
+  free(data);
+  *nevents = n;
+  return events;
+}
+
+/* ---- recording ---- */
+
+/* record that the block at addr has id; returns 0 if memory could not be allocated */
+static int map_add(struct trace_recorder *r, void *addr, size_t size, uint32_t id)
+{
+  struct trace_slot *e = pa_map_add(&r->map, (uintptr_t) addr);
+
+  if (e == NULL) {
+    return 0;
+  }
+  e->size = size;
+  e->id = id;
+  return 1;
+}
+
+static uint32_t id_new(struct trace_recorder *r)
+{
+  return (r->nfree_ids > 0) ? r->free_ids[--r->nfree_ids] : r->next_id++;
+}
+
+static void id_release(struct trace_recorder *r, uint32_t id)
+{
+  if (r->nfree_ids == r->free_ids_cap) {
+    size_t cap = r->free_ids_cap ? 2 * r->free_ids_cap : 1024;
+    uint32_t *ids = realloc(r->free_ids, cap * sizeof(uint32_t));
+
+    if (ids == NULL) { //the id is simply not reused
+      return;
+    }
+    r->free_ids = ids;
+    r->free_ids_cap = cap;
+  }
+  r->free_ids[r->nfree_ids++] = id;
+}
+
+/* start recording the calls made through r to the allocator given by
+   alloc_fn, free_fn, realloc_fn (which may be NULL) and ctx into the
+   trace at path */
+/* returns 0 if the trace could not be created */
+int trace_recorder_open(struct trace_recorder *r, const char *path,
+                        void *(*alloc_fn)(void *ctx, size_t size),
+                        void (*free_fn)(void *ctx, void *addr),
+                        void *(*realloc_fn)(void *ctx, void *addr, size_t size),
+                        void *ctx)
+{
+  memset(r, 0, sizeof(*r));
+  r->alloc = alloc_fn;
+  r->free = free_fn;
+  r->realloc = realloc_fn;
+  r->ctx = ctx;
+  pa_map_init(&r->map, sizeof(struct trace_slot));
+  r->w = trace_writer_open(path);
+  return r->w != NULL;
+}
+
+/* finish the trace; blocks still allocated are left to the allocator */
+/* returns 0 if the trace could not be written completely, or lost track
+   of some blocks (see trace_recorder.lost) */
+int trace_recorder_close(struct trace_recorder *r)
+{
+  int ok = trace_writer_close(r->w) && r->lost == 0;
+
+  pa_map_free(&r->map);
+  free(r->free_ids);
+  memset(r, 0, sizeof(*r));
+  return ok;
+}
+
+void *trace_recorder_alloc(void *rec, size_t size)
+{
+  struct trace_recorder *r = rec;
+  void *addr = r->alloc(r->ctx, size);
+
+  if (addr != NULL) {
+    uint32_t id = id_new(r);
+
+    if (map_add(r, addr, size, id)) {
+      trace_write(r->w, TRACE_ALLOC, id, size);
+    } else { //the block cannot be told apart from one allocated before recording started
+      id_release(r, id);
+      r->lost++;
+    }
+  }
+  return addr;
+}
+
+void trace_recorder_free(void *rec, void *addr)
+{
+  struct trace_recorder *r = rec;
+  struct trace_slot *e = pa_map_find(&r->map, (uintptr_t) addr);
+
+  if (e != NULL) {
+    trace_write(r->w, TRACE_FREE, e->id, 0);
+    id_release(r, e->id);
+    pa_map_remove(&r->map, e);
+  }
+  r->free(r->ctx, addr);
+}
+
+/* allocators without realloc get one made of alloc, copy and free */
+void *trace_recorder_realloc(void *rec, void *addr, size_t size)
+{
+  struct trace_recorder *r = rec;
+  struct trace_slot *e = pa_map_find(&r->map, (uintptr_t) addr);
+  void *moved;
+
+  if (addr == NULL) {
+    return trace_recorder_alloc(rec, size);
+  }
+  if (size == 0) {
+    trace_recorder_free(rec, addr);
+    return NULL;
+  }
+
+  if (r->realloc != NULL) {
+    moved = r->realloc(r->ctx, addr, size);
+  } else if (e != NULL && (moved = r->alloc(r->ctx, size)) != NULL) {
+    memcpy(moved, addr, (e->size < size) ? e->size : size);
+    r->free(r->ctx, addr);
+  } else {
+    moved = NULL; //the old size of a block that was not recorded is unknown
+  }
+
+  if (moved != NULL && e != NULL) {
+    uint32_t id = e->id;
+
+    trace_write(r->w, TRACE_REALLOC, id, size);
+    e->size = size;
+    if (moved != addr) {
+      pa_map_remove(&r->map, e);
+      if (!map_add(r, moved, size, id)) { //its free will be missing from the trace
+        r->lost++;
+      }
+    }
+  }
+  return moved;
+}
@@ -0,0 +1,68 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "pa_map.h"
+
+/*
+   allocation traces (pa_trace.c)
+
+   A trace file starts with TRACE_MAGIC and is followed by one record per
+   event:
+
+     op     1 byte, TRACE_ALLOC, TRACE_FREE or TRACE_REALLOC
+     id     varint, the block the event is about
+     size   varint, new size of the block (not for TRACE_FREE)
+     delta  varint, nanoseconds since the previous event
+
+   Varints are little-endian base 128, 7 bits per byte, so a typical
+   event takes 4 to 6 bytes. Ids are small integers that are reused once
+   their block is freed, so a replayer can keep blocks in an array
+   indexed by id.
+*/
+
+#define TRACE_MAGIC "PATRACE1"
+
+enum { TRACE_ALLOC = 1, TRACE_FREE = 2, TRACE_REALLOC = 3 };
+
+struct trace_event {
+  uint8_t op;
+  uint32_t id;
+  size_t size;
+  uint64_t time;              /* nanoseconds since the first event */
+};
+
+struct trace_writer;
+
+struct trace_writer *trace_writer_open(const char *path);
+void trace_write(struct trace_writer *w, int op, uint32_t id, size_t size);
+int trace_writer_close(struct trace_writer *w);
+
+struct trace_event *trace_read(const char *path, size_t *nevents, uint32_t *nids);
+
+/* wraps an allocator and records every call made through it */
+/* trace_recorder_alloc/free/realloc take the recorder as their context,
+   so the recorder can stand in wherever the allocator itself was used */
+struct trace_recorder {
+  void *(*alloc)(void *ctx, size_t size);
+  void (*free)(void *ctx, void *addr);
+  void *(*realloc)(void *ctx, void *addr, size_t size);
+  void *ctx;
+  struct trace_writer *w;
+  struct pa_map map;          /* address -> struct trace_slot */
+  uint32_t *free_ids;         /* ids of freed blocks, reused first */
+  size_t nfree_ids;
+  size_t free_ids_cap;
+  uint32_t next_id;           /* smallest id never used */
+  size_t lost;                /* blocks whose events are missing because the map could not grow */
+};
+
+int trace_recorder_open(struct trace_recorder *r, const char *path,
+                        void *(*alloc_fn)(void *ctx, size_t size),
+                        void (*free_fn)(void *ctx, void *addr),
+                        void *(*realloc_fn)(void *ctx, void *addr, size_t size),
+                        void *ctx);
+int trace_recorder_close(struct trace_recorder *r);
+void *trace_recorder_alloc(void *rec, size_t size);
+void trace_recorder_free(void *rec, void *addr);
+void *trace_recorder_realloc(void *rec, void *addr, size_t size);
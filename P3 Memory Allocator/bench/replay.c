@@ -0,0 +1,335 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <malloc.h>
+
+#include "poolalloc.h"
+#include "pa_trace.h"
+
+/*
+   replay allocation traces against the pool allocator and malloc
+
+   usage: pa_replay trace [impl ...]
+          pa_replay -g events trace
+
+   The first form replays the trace once with each impl (by default
+   mpool_tags, mpool_buddy and malloc; mpool, the MPOOL_LISTS mode, is
+   slow on large traces and has to be asked for). Pools are MPOOL_GROW
+   pools that start at POOL_START bytes. The trace is decoded into memory
+   before the clock starts, and replayed as fast as possible (the
+   recorded times are not waited for).
+
+   Results are printed to stdout as two CSV tables:
+
+     impl,events,ns_per_event,mevents_per_s,failed,peak_live,max_sampled_footprint
+
+   and, sampled SAMPLES times during each replay,
+
+     impl,event,live,footprint,util
+
+   where live is the bytes the trace has allocated at that point,
+   footprint the bytes the allocator holds (all chunks of a pool;
+   mallinfo2's arena and mmapped bytes for malloc, less what they were
+   when the replay started) and util = live / footprint, so 1 - util is
+   what fragmentation and unused pool space cost over time. peak_live is
+   exact, but the footprint is only read at the samples (mallinfo2 is too
+   slow to call on every event), so max_sampled_footprint is the largest
+   of those and may miss a peak between two of them.
+
+   The second form writes a synthetic trace of about `events` events by
+   running a workload on malloc through a trace_recorder.
+*/
+
+#define POOL_START ((size_t) 1 << 20)
+#define SAMPLES 20
+
+static double now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* xorshift64, so that every generated trace is the same */
+static uint64_t rng_state = 88172645463325252ULL;
+
+static uint64_t rng(void)
+{
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+/* ---- allocators ---- */
+
+struct replay_impl {
+  const char *name;
+  int flags;                  /* mpool_create_flags flags, -1 for malloc */
+};
+
+static struct replay_impl impls[] = {
+  { "mpool", MPOOL_LISTS | MPOOL_GROW },
+  { "mpool_tags", MPOOL_TAGS | MPOOL_GROW },
+  { "mpool_buddy", MPOOL_BUDDY | MPOOL_GROW },
+  { "malloc", -1 },
+};
+
+#define NIMPLS (sizeof(impls) / sizeof(impls[0]))
+
+static size_t footprint(struct memory_pool *p)
+{
+  if (p != NULL) {
+    return p->grow_total;
+  }
+
+  struct mallinfo2 mi = mallinfo2();
+  return mi.arena + mi.hblkhd;
+}
+
+/* ---- replay ---- */
+
+struct replay_result {
+  size_t events;
+  double ns;                  /* time spent replaying, without sampling */
+  size_t failed;
+  size_t peak_live;
+  size_t max_sampled_footprint;
+  int nsamples;
+  size_t samples[SAMPLES][3]; /* event, live, footprint */
+};
+
+static void *impl_alloc(struct memory_pool *p, size_t size)
+{
+  return (p != NULL) ? mpool_alloc(p, size) : malloc(size);
+}
+
+static void impl_free(struct memory_pool *p, void *addr)
+{
+  if (p != NULL) {
+    mpool_free(p, addr);
+  } else {
+    free(addr);
+  }
+}
+
+static void *impl_realloc(struct memory_pool *p, void *addr, size_t size)
+{
+  return (p != NULL) ? mpool_realloc(p, addr, size) : realloc(addr, size);
+}
+
+/* returns 0 if the pool or the replayer's own arrays could not be created */
+static int replay(struct replay_impl *impl, struct trace_event *events, size_t n, uint32_t nids, struct replay_result *res)
+{
+  void **blocks = calloc(nids, sizeof(void *));
+  size_t *sizes = calloc(nids, sizeof(size_t));
+  struct memory_pool *p = NULL;
+  size_t live = 0, base = 0, i, next_sample;
+  double start;
+
+  if (blocks == NULL || sizes == NULL || (impl->flags >= 0 && (p = mpool_create_flags(POOL_START, impl->flags)) == NULL)) {
+    free(sizes);
+    free(blocks);
+    return 0;
+  }
+
+  //malloc already holds the trace and the replayer's own arrays
+  if (p == NULL) {
+    base = footprint(NULL);
+  }
+
+  memset(res, 0, sizeof(*res));
+  res->events = n;
+  next_sample = n / SAMPLES;
+  start = now_ns();
+  for (i = 0; i < n; i++) {
+    struct trace_event *e = &events[i];
+    void *addr;
+
+    switch (e->op) {
+    case TRACE_ALLOC:
+      if ((addr = impl_alloc(p, e->size)) == NULL) { //the id holds nothing until its next alloc
+        blocks[e->id] = NULL;
+        sizes[e->id] = 0;
+        res->failed++;
+        break;
+      }
+      blocks[e->id] = addr;
+      sizes[e->id] = e->size;
+      live += e->size;
+      break;
+    case TRACE_FREE:
+      if (blocks[e->id] != NULL) {
+        impl_free(p, blocks[e->id]);
+        blocks[e->id] = NULL;
+        live -= sizes[e->id];
+      }
+      break;
+    case TRACE_REALLOC:
+      if ((addr = impl_realloc(p, blocks[e->id], e->size)) == NULL) {
+        if (blocks[e->id] == NULL) { //a realloc from NULL that failed is a failed alloc
+          sizes[e->id] = 0;
+        }
+        res->failed++;
+        break;
+      }
+      blocks[e->id] = addr;
+      live += e->size - sizes[e->id];
+      sizes[e->id] = e->size;
+      break;
+    }
+    res->peak_live = (live > res->peak_live) ? live : res->peak_live;
+
+    /* sampling is not timed */
+    if (i + 1 == next_sample && res->nsamples < SAMPLES) {
+      size_t *sample = res->samples[res->nsamples++];
+
+      res->ns += now_ns() - start;
+      sample[0] = i + 1;
+      sample[1] = live;
+      sample[2] = footprint(p) - base;
+      res->max_sampled_footprint = (sample[2] > res->max_sampled_footprint) ? sample[2] : res->max_sampled_footprint;
+      next_sample += n / SAMPLES;
+      start = now_ns();
+    }
+  }
+  res->ns += now_ns() - start;
+
+  for (i = 0; i < nids; i++) {
+    if (blocks[i] != NULL) {
+      impl_free(p, blocks[i]);
+    }
+  }
+  if (p != NULL) {
+    mpool_destroy(p);
+  }
+  free(sizes);
+  free(blocks);
+  return 1;
+}
+
+/* ---- synthetic traces ---- */
+
+static void *sys_alloc(void *ctx, size_t size) { return malloc(size); }
+static void sys_free(void *ctx, void *addr) { free(addr); }
+static void *sys_realloc(void *ctx, void *addr, size_t size) { return realloc(addr, size); }
+
+/* a size between 1 and 64 KiB, mostly small: a random power of two
+   (smaller ones more likely) with a random offset */
+static size_t synth_size(void)
+{
+  int k = 3 + __builtin_ctzll(rng() | (1ULL << 13));
+
+  return ((size_t) 1 << k) + rng() % ((size_t) 1 << k);
+}
+
+/* phases of building up and tearing down a working set, with some
+   blocks that live through all of them and some that keep growing */
+static int generate(const char *path, size_t events)
+{
+  struct trace_recorder r;
+  size_t cap = 1 << 16, n = 0, i;
+  void **live = malloc(cap * sizeof(void *));
+  size_t done = 0;
+
+  if (live == NULL || !trace_recorder_open(&r, path, sys_alloc, sys_free, sys_realloc, NULL)) {
+    free(live);
+    return 0;
+  }
+
+  while (done < events) {
+    size_t target = 1 + rng() % cap;
+
+    /* grow to target, then shrink to a random fraction of it */
+    while (n < target && done < events) {
+      if (rng() % 8 == 0 && n > 0) {
+        size_t s = rng() % n;
+        void *addr = trace_recorder_realloc(&r, live[s], synth_size() * 2);
+
+        live[s] = (addr != NULL) ? addr : live[s];
+      } else if ((live[n] = trace_recorder_alloc(&r, synth_size())) != NULL) {
+        n++;
+      }
+      done++;
+    }
+    target = rng() % (n + 1);
+    while (n > target && done < events) {
+      size_t s = rng() % n;
+
+      trace_recorder_free(&r, live[s]);
+      live[s] = live[--n];
+      done++;
+    }
+  }
+
+  for (i = 0; i < n; i++) {
+    trace_recorder_free(&r, live[i]);
+  }
+  free(live);
+  if (r.lost > 0) {
+    fprintf(stderr, "%zu blocks are missing from the trace\n", r.lost);
+  }
+  return trace_recorder_close(&r);
+}
+
+int main(int argc, char *argv[])
+{
+  struct replay_result results[NIMPLS];
+  int done[NIMPLS];
+  struct trace_event *events;
+  size_t n, i, k;
+  uint32_t nids;
+
+  if (argc == 4 && strcmp(argv[1], "-g") == 0) {
+    if (!generate(argv[3], strtoul(argv[2], NULL, 10))) {
+      fprintf(stderr, "could not write %s\n", argv[3]);
+      return 1;
+    }
+    return 0;
+  }
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s trace [impl ...]\n       %s -g events trace\n", argv[0], argv[0]);
+    return 1;
+  }
+
+  if ((events = trace_read(argv[1], &n, &nids)) == NULL) {
+    fprintf(stderr, "could not read %s\n", argv[1]);
+    return 1;
+  }
+
+  for (k = 0; k < NIMPLS; k++) {
+    int wanted = (argc == 2 && strcmp(impls[k].name, "mpool") != 0);
+
+    for (i = 2; i < (size_t) argc; i++) {
+      wanted = wanted || strcmp(argv[i], impls[k].name) == 0;
+    }
+    done[k] = wanted && replay(&impls[k], events, n, nids, &results[k]);
+  }
+
+  printf("impl,events,ns_per_event,mevents_per_s,failed,peak_live,max_sampled_footprint\n");
+  for (k = 0; k < NIMPLS; k++) {
+    struct replay_result *res = &results[k];
+
+    if (done[k]) {
+      printf("%s,%zu,%.2f,%.2f,%zu,%zu,%zu\n", impls[k].name, res->events, res->events ? res->ns / res->events : 0.0,
+             res->ns > 0 ? res->events / res->ns * 1e3 : 0.0, res->failed, res->peak_live, res->max_sampled_footprint);
+    }
+  }
+
+  printf("\nimpl,event,live,footprint,util\n");
+  for (k = 0; k < NIMPLS; k++) {
+    for (i = 0; done[k] && i < (size_t) results[k].nsamples; i++) {
+      size_t *sample = results[k].samples[i];
+
+      printf("%s,%zu,%zu,%zu,%.3f\n", impls[k].name, sample[0], sample[1], sample[2],
+             sample[2] ? (double) sample[1] / sample[2] : 0.0);
+    }
+  }
+
+  free(events);
+  return 0;
+}
@@ -17,12 +17,47 @@ struct llnode *newNode(void *data)
   if (new != NULL) {
     new->user_data = data;
     new->prev = new->next = NULL;
+    new->block = NULL;
     return new;
   }
 
   return NULL;
 }
 
+/* marks nodes whose memory belongs to the caller (see dbll_node_init) */
+static struct llnode_block caller_owned;
+
+/* initialize a node whose memory is owned by the caller, for example a
+   node embedded in a larger structure */
+/* such nodes are linked with dbll_link_after/dbll_link_before and are
+   never freed by dbll_remove, dbll_remove_range or dbll_free */
+void dbll_node_init(struct llnode *node, void *user_data)
+{
+  node->user_data = user_data;
+  node->prev = node->next = NULL;
+  node->block = &caller_owned;
+}
+
+/* free a node created by newNode or dbll_append_array */
+/* nodes that share a block only release it once the last of them is gone */
+static void freeNode(struct llnode *node)
+{
+  struct llnode_block *block = node->block;
+
+  if (block == NULL) {
+    free(node);
+    return;
+  }
+  if (block == &caller_owned) {
+    return;
+  }
+
+  block->live--;
+  if (block->live == 0) {
+    free(block);
+  }
+}
+
 /* create a doubly-linked list */
 /* returns an empty list or NULL if memory allocation failed */
 struct dbll *dbll_create()
@@ -50,7 +85,7 @@ void dbll_free(struct dbll *list)
   struct llnode *node = list->first;
   while (node != NULL) {
     struct llnode *next = node->next;
-    free(node);
+    freeNode(node);
     node = next;
   }
 
@@ -90,19 +125,19 @@ int dbll_iterate(struct dbll *list,
   struct llnode *it = start;
   int call;
 
-  do {
-    call = f(list, it->next, ctx);
-      if (call == 0) {
-        return 1;
-      }
-      it = it->next;
-  } while (it != stop);
-  
-  if (it == stop) {
-    return 1;
-  } else {
-    return 0;
+  while (it != NULL) {
+    call = f(list, it, ctx);
+    if (call == 0) {
+      return 1;
+    }
+    if (it == stop) {
+      return 1;
+    }
+    it = it->next;
   }
+
+  //ran off the end without seeing stop (or the list is empty)
+  return start == NULL;
 }
 
 /* similar to dbll_iterate, except that the list is traversed using
@@ -131,19 +166,19 @@ int dbll_iterate_reverse(struct dbll *list,
   struct llnode *it = start;
   int call;
 
-  do {
+  while (it != NULL) {
     call = f(list, it, ctx);
-      if (call == 0) {
-        return 1;
-      }
-      it = it->prev;
-  } while (it != stop);
-  
-  if (it == stop) {
-    return 1;
-  } else {
-    return 0;
+    if (call == 0) {
+      return 1;
+    }
+    if (it == stop) {
+      return 1;
+    }
+    it = it->prev;
   }
+
+  //ran off the front without seeing stop (or the list is empty)
+  return start == NULL;
 }
 
 
@@ -152,11 +187,7 @@ int dbll_iterate_reverse(struct dbll *list,
 /* You can assume user_data will be freed by somebody else (or has already been freed) */
 void dbll_remove(struct dbll *list, struct llnode *node)
 {
-  struct llnode *it = list->first;
-
-  while (it != node) {
-    it = it->next;
-  }
+  struct llnode *it = node;
 
   if (it == list->first) {
     list->first = it->next;
@@ -171,21 +202,72 @@ void dbll_remove(struct dbll *list, struct llnode *node)
     it->next->prev = it->prev;
   }
 
-  free(it);
+  freeNode(it);
   return;
 }
 
 /* Removes last 'llnode' from 'list' */
 void dbll_pop(struct dbll *list) {
   if (list->last != NULL) {
-    list->last = list->last->prev;
-    free(list->last->next);
-    list->last->next = NULL;
-    return;
+    dbll_remove(list, list->last);
   }
   return;
 }
 
+/* Link the caller-owned node `new` into list after `node` */
+/* if node is NULL, then link it at the end of the list */
+/* returns new */
+struct llnode *dbll_link_after(struct dbll *list, struct llnode *node, struct llnode *new)
+{
+  if (node == NULL) {
+    node = list->last;
+  }
+
+  new->prev = node;
+  if (node != NULL) { //insert after node
+    new->next = node->next;
+    node->next = new;
+  } else { //empty list
+    new->next = NULL;
+    list->first = new;
+  }
+
+  if (new->next != NULL) {
+    new->next->prev = new;
+  } else { //insert last
+    list->last = new;
+  }
+
+  return new;
+}
+
+/* Link the caller-owned node `new` into list before `node` */
+/* if node is NULL, then link it at the beginning of the list */
+/* returns new */
+struct llnode *dbll_link_before(struct dbll *list, struct llnode *node, struct llnode *new)
+{
+  if (node == NULL) {
+    node = list->first;
+  }
+
+  new->next = node;
+  if (node != NULL) { //insert before node
+    new->prev = node->prev;
+    node->prev = new;
+  } else { //empty list
+    new->prev = NULL;
+    list->last = new;
+  }
+
+  if (new->prev != NULL) {
+    new->prev->next = new;
+  } else { //insert first
+    list->first = new;
+  }
+
+  return new;
+}
+
 /* Create and return a new node containing `user_data` */
 /* The new node must be inserted after `node` */
 /* if node is NULL, then insert the node at the end of the list */
@@ -194,18 +276,10 @@ struct llnode *dbll_insert_after(struct dbll *list, struct llnode *node, void *u
 {
   struct llnode *new = newNode(user_data);
   if (new == NULL) { //check mem allocation
-      return NULL;
-    }
-  
-  if (node != NULL && node != list->last) { //insert between
-    new->prev = node;
-    new->next = node->next;
-    node->next->prev = new;
-    node->next = new;
-    return new;
-  } else { //empty list, or insert last
-    return dbll_append(list, user_data);
+    return NULL;
   }
+
+  return dbll_link_after(list, node, new);
 }
 
 /* Create and return a new node containing `user_data` */
@@ -216,18 +290,10 @@ struct llnode *dbll_insert_before(struct dbll *list, struct llnode *node, void *
 {
   struct llnode *new = newNode(user_data);
   if (new == NULL) { //check mem allocation
-      return NULL;
-    }
-  
-  if (node != NULL && node != list->first) { //insert between
-    new->next = node;
-    new->prev = node->prev;
-    node->prev->next = new;
-    node->prev = new;
-    return new;
-  } else { //empty list, or insert first
-    return dbll_preppend(list, user_data);
+    return NULL;
   }
+
+  return dbll_link_before(list, node, new);
 }
 
 /* create and return an `llnode` that stores `user_data` */
@@ -236,44 +302,223 @@ struct llnode *dbll_insert_before(struct dbll *list, struct llnode *node, void *
 /* this function is a convenience function and can use the dbll_insert_after function */
 struct llnode *dbll_append(struct dbll *list, void *user_data)
 {
-  struct llnode *new = newNode(user_data);
+  return dbll_insert_after(list, NULL, user_data);
+}
 
-  if (new == NULL) { //check mem allocation
-    return NULL;
+/* create and return an `llnode` that stores `user_data` */
+/* the `llnode` is added to the front of list */
+/* return NULL if memory could not be allocated */
+/* this function is a convenience function and can use the dbll_insert_before function */
+struct llnode *dbll_preppend(struct dbll *list, void *user_data)
+{
+  return dbll_insert_before(list, NULL, user_data);
+}
+
+/* Move the run of nodes first..last (inclusive) out of `src` and into `dst` */
+/* The run is placed before `pos`; if pos is NULL it is placed at the end of dst */
+/* if first is NULL, the run starts at src->first; if last is NULL, it ends at src->last */
+/* No memory is allocated or freed and nodes keep their addresses, so this is O(1) */
+/* src and dst may be the same list as long as pos is not part of the run */
+void dbll_splice(struct dbll *dst, struct llnode *pos,
+				 struct dbll *src, struct llnode *first, struct llnode *last)
+{
+  if (first == NULL) {
+    first = src->first;
+  }
+  if (last == NULL) {
+    last = src->last;
+  }
+  if (first == NULL || last == NULL) { //nothing to move
+    return;
   }
 
-  new->prev = list->last;
-  if (list->last != NULL) {
-    list->last->next = new;
+  //unlink the run from src
+  if (first->prev != NULL) {
+    first->prev->next = last->next;
+  } else {
+    src->first = last->next;
   }
-  list->last = new;
-  if (list->first == NULL) { //empty list
-    list->first = new;
+  if (last->next != NULL) {
+    last->next->prev = first->prev;
+  } else {
+    src->last = first->prev;
   }
 
-  return new;
+  //link it into dst
+  if (pos == NULL) { //at the end
+    first->prev = dst->last;
+    last->next = NULL;
+    if (dst->last != NULL) {
+      dst->last->next = first;
+    } else {
+      dst->first = first;
+    }
+    dst->last = last;
+  } else {
+    first->prev = pos->prev;
+    last->next = pos;
+    if (pos->prev != NULL) {
+      pos->prev->next = first;
+    } else {
+      dst->first = first;
+    }
+    pos->prev = last;
+  }
 }
 
-/* create and return an `llnode` that stores `user_data` */
-/* the `llnode` is added to the front of list */
-/* return NULL if memory could not be allocated */
-/* this function is a convenience function and can use the dbll_insert_before function */
-struct llnode *dbll_preppend(struct dbll *list, void *user_data)
+/* create `n` nodes storing items[0] .. items[n-1] and add them, in order, to the end of list */
+/* all n nodes are carved out of a single allocation */
+/* return the first new node, or NULL if n is 0 or memory could not be allocated */
+struct llnode *dbll_append_array(struct dbll *list, void **items, size_t n)
 {
-  struct llnode *new = newNode(user_data);
+  if (n == 0) {
+    return NULL;
+  }
 
-  if (new == NULL) { //check mem allocation
+  struct llnode_block *block = (struct llnode_block*)malloc(sizeof(struct llnode_block) + n * sizeof(struct llnode));
+  if (block == NULL) { //check mem allocation
     return NULL;
   }
+  block->live = n;
 
-  new->next = list->first;
-  if (list->first != NULL) {
-    list->first->prev = new;
+  struct llnode *nodes = block->nodes;
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    nodes[i].user_data = items[i];
+    nodes[i].block = block;
+    nodes[i].prev = (i > 0) ? &nodes[i - 1] : NULL;
+    nodes[i].next = (i + 1 < n) ? &nodes[i + 1] : NULL;
   }
-  list->first = new;
-  if (list->last == NULL) { //empty list
-    list->last = new;
+
+  //attach the whole run with one relink
+  nodes[0].prev = list->last;
+  if (list->last != NULL) {
+    list->last->next = &nodes[0];
+  } else {
+    list->first = &nodes[0];
   }
+  list->last = &nodes[n - 1];
 
-  return new;
-}
\ No newline at end of file
+  return &nodes[0];
+}
+
+/* Remove the run of nodes first..last (inclusive) from `list` */
+/* the run is unlinked in O(1) and then the nodes are freed */
+/* if first is NULL, the run starts at list->first; if last is NULL, it ends at list->last */
+/* You can assume user_data will be freed by somebody else (or has already been freed) */
+void dbll_remove_range(struct dbll *list, struct llnode *first, struct llnode *last)
+{
+  struct dbll run = { NULL, NULL };
+
+  dbll_splice(&run, NULL, list, first, last);
+
+  struct llnode *node = run.first;
+  while (node != NULL) {
+    struct llnode *next = node->next;
+    freeNode(node);
+    node = next;
+  }
+}
+
+/* Sort `list` in place using the comparator `cmp` */
+/* cmp is called with the user_data of two nodes and ctx, and returns a
+   negative, zero or positive value like the comparator given to qsort */
+
+/* this is a bottom-up merge sort on the node links: it is stable (equal
+   nodes keep their relative order), runs in O(n log n) and allocates no memory */
+void dbll_sort(struct dbll *list, void *ctx, int (*cmp)(void *, void *, void *))
+{
+  struct llnode *head = list->first;
+  size_t insize = 1;
+
+  if (head == NULL) {
+    return;
+  }
+
+  while (1) {
+    struct llnode *p = head, *tail = NULL;
+    size_t nmerges = 0;
+
+    head = NULL;
+
+    //merge each pair of adjacent runs of length insize
+    while (p != NULL) {
+      struct llnode *q = p;
+      size_t psize = 0, qsize = insize;
+      size_t i;
+
+      nmerges++;
+      for (i = 0; i < insize && q != NULL; i++) {
+        psize++;
+        q = q->next;
+      }
+
+      while (psize > 0 || (qsize > 0 && q != NULL)) {
+        struct llnode *e;
+
+        if (psize == 0) {
+          e = q; q = q->next; qsize--;
+        } else if (qsize == 0 || q == NULL) {
+          e = p; p = p->next; psize--;
+        } else if (cmp(p->user_data, q->user_data, ctx) <= 0) { //ties go to the left run
+          e = p; p = p->next; psize--;
+        } else {
+          e = q; q = q->next; qsize--;
+        }
+
+        if (tail != NULL) {
+          tail->next = e;
+        } else {
+          head = e;
+        }
+        e->prev = tail;
+        tail = e;
+      }
+
+      p = q;
+    }
+
+    tail->next = NULL;
+
+    if (nmerges <= 1) { //a single run covers the list
+      list->first = head;
+      list->last = tail;
+      return;
+    }
+
+    insize *= 2;
+  }
+}
+
+/* Merge the sorted list `src` into the sorted list `dst` */
+/* both lists must already be ordered by `cmp` (see dbll_sort) */
+/* afterwards dst holds all nodes in order and src is empty */
+/* the merge is stable, with nodes of dst placed before equal nodes of src */
+/* runs of src are moved with dbll_splice, so this is linear and allocates no memory */
+void dbll_merge(struct dbll *dst, struct dbll *src, void *ctx, int (*cmp)(void *, void *, void *))
+{
+  struct llnode *d = dst->first;
+
+  while (src->first != NULL) {
+    struct llnode *s = src->first;
+
+    //skip dst nodes that belong before s
+    while (d != NULL && cmp(d->user_data, s->user_data, ctx) <= 0) {
+      d = d->next;
+    }
+
+    if (d == NULL) { //everything left in src goes at the end
+      dbll_splice(dst, NULL, src, NULL, NULL);
+      return;
+    }
+
+    //move the run of src nodes that belong before d
+    struct llnode *last = s;
+    while (last->next != NULL && cmp(last->next->user_data, d->user_data, ctx) < 0) {
+      last = last->next;
+    }
+
+    dbll_splice(dst, d, src, s, last);
+  }
+}
@@ -1,4 +1,7 @@
 #pragma once
+#include <stddef.h>
+
+struct llnode_block;
 
 /* structure that holds each node of a doubly-linked list */
 /* Must satisfy the following invariants at all times */
@@ -10,6 +13,15 @@ struct llnode {
   void *user_data;      /* pointer to user data */
   struct llnode *next;  /* next node in linked list, NULL if this is the last node */
   struct llnode *prev;  /* prev node in linked list, NULL if this is the first node */
+  struct llnode_block *block; /* shared allocation this node came from, NULL if malloc'd alone */
+                              /* (or a marker for nodes owned by the caller, see dbll_node_init) */
+};
+
+/* nodes created together by dbll_append_array share a single allocation */
+/* the block is released when the last of its nodes is freed */
+struct llnode_block {
+  size_t live;           /* nodes of this block that have not been freed yet */
+  struct llnode nodes[]; /* the nodes themselves */
 };
 
 /* structure for the doubly-linked list */
@@ -34,6 +46,21 @@ struct llnode *dbll_insert_before(struct dbll *list, struct llnode *node, void *
 
 void dbll_free(struct dbll *list);
 
+/* nodes owned by the caller */
+void dbll_node_init(struct llnode *node, void *user_data);
+struct llnode *dbll_link_after(struct dbll *list, struct llnode *node, struct llnode *new);
+struct llnode *dbll_link_before(struct dbll *list, struct llnode *node, struct llnode *new);
+
+/* bulk operations */
+void dbll_splice(struct dbll *dst, struct llnode *pos,
+				 struct dbll *src, struct llnode *first, struct llnode *last);
+struct llnode *dbll_append_array(struct dbll *list, void **items, size_t n);
+void dbll_remove_range(struct dbll *list, struct llnode *first, struct llnode *last);
+
+/* ordering */
+void dbll_sort(struct dbll *list, void *ctx, int (*cmp)(void *, void *, void *));
+void dbll_merge(struct dbll *dst, struct dbll *src, void *ctx, int (*cmp)(void *, void *, void *));
+
 int dbll_iterate(struct dbll *list,
 				 struct llnode *start,
 				 struct llnode *end,
@@ -0,0 +1,281 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "dbll.h"
+#include "dbll_snap.h"
+
+/* Routines to save a doubly-linked list as one contiguous snapshot and to
+   use a snapshot in place after mapping it back into memory */
+
+static uint64_t snap_align(uint64_t n)
+{
+  return (n + DBLL_SNAP_ALIGN - 1) & ~((uint64_t) DBLL_SNAP_ALIGN - 1);
+}
+
+/* write all of iov to fd, continuing after short writes */
+static int write_all(int fd, struct iovec *iov, int iovcnt)
+{
+  while (iovcnt > 0) {
+    ssize_t n = writev(fd, iov, iovcnt);
+
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+
+    //skip over what was written
+    while (iovcnt > 0 && (size_t) n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *) iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+
+  return 0;
+}
+
+/* write a snapshot of `list` to the file descriptor fd */
+
+/* for each node, payload is called with the node's user_data and ctx. It
+   must point *bytes at the serialized element and return its size. The
+   bytes only need to stay valid until payload is called again. */
+
+/* the elements are gathered into one buffer and the header, offset table
+   and payload are written with a single writev */
+
+/* return 0 on success, -1 on failure (errno is set) */
+int dbll_snap_write(struct dbll *list, int fd, void *ctx,
+					size_t (*payload)(void *user_data, const void **bytes, void *ctx))
+{
+  struct dbll_snap_header header;
+  struct llnode *node;
+  uint64_t count = 0, payload_size = 0;
+
+  //first pass: lay out the offset table
+  for (node = list->first; node != NULL; node = node->next) {
+    count++;
+  }
+
+  struct dbll_snap_entry *table = (struct dbll_snap_entry*)malloc((count ? count : 1) * sizeof(struct dbll_snap_entry));
+  if (table == NULL) { //check mem allocation
+    return -1;
+  }
+
+  uint64_t i = 0;
+  for (node = list->first; node != NULL; node = node->next, i++) {
+    const void *bytes;
+
+    table[i].offset = payload_size;
+    table[i].size = payload(node->user_data, &bytes, ctx);
+    payload_size = snap_align(payload_size + table[i].size);
+  }
+
+  //second pass: gather the payload
+  char *buf = (char*)calloc(payload_size ? payload_size : 1, 1);
+  if (buf == NULL) { //check mem allocation
+    free(table);
+    return -1;
+  }
+
+  i = 0;
+  for (node = list->first; node != NULL; node = node->next, i++) {
+    const void *bytes;
+    size_t size = payload(node->user_data, &bytes, ctx);
+
+    if (size != table[i].size) { //payload must be deterministic
+      free(buf);
+      free(table);
+      errno = EINVAL;
+      return -1;
+    }
+    memcpy(buf + table[i].offset, bytes, size);
+  }
+
+  memcpy(header.magic, DBLL_SNAP_MAGIC, sizeof(header.magic));
+  header.version = DBLL_SNAP_VERSION;
+  header.header_size = sizeof(header);
+  header.count = count;
+  header.payload_size = payload_size;
+
+  struct iovec iov[3] = {
+    { &header, sizeof(header) },
+    { table, count * sizeof(struct dbll_snap_entry) },
+    { buf, payload_size },
+  };
+
+  int ret = write_all(fd, iov, 3);
+
+  free(buf);
+  free(table);
+  return ret;
+}
+
+/* map the snapshot stored in fd into memory */
+
+/* the mapping is private and writable: elements can be modified in place
+   without changing the file, and pages are only copied when written */
+
+/* return NULL if the file is not a valid snapshot or the mapping failed */
+struct dbll_snap *dbll_snap_map(int fd)
+{
+  struct stat st;
+
+  if (fstat(fd, &st) < 0) {
+    return NULL;
+  }
+  if ((size_t) st.st_size < sizeof(struct dbll_snap_header)) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  struct dbll_snap *snap = (struct dbll_snap*)malloc(sizeof(struct dbll_snap));
+  if (snap == NULL) { //check mem allocation
+    return NULL;
+  }
+
+  snap->map_size = st.st_size;
+  snap->map = mmap(NULL, snap->map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (snap->map == MAP_FAILED) {
+    free(snap);
+    return NULL;
+  }
+
+  //check the header, the table itself is checked one entry at a time on access
+  const struct dbll_snap_header *header = snap->map;
+  uint64_t table_size = header->count * sizeof(struct dbll_snap_entry);
+
+  if (memcmp(header->magic, DBLL_SNAP_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != DBLL_SNAP_VERSION ||
+      header->header_size != sizeof(struct dbll_snap_header) ||
+      header->count > (snap->map_size - sizeof(struct dbll_snap_header)) / sizeof(struct dbll_snap_entry) ||
+      header->payload_size > snap->map_size - sizeof(struct dbll_snap_header) - table_size) {
+    munmap(snap->map, snap->map_size);
+    free(snap);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  snap->header = header;
+  snap->table = (const struct dbll_snap_entry *) (header + 1);
+  snap->payload = (char *) snap->map + sizeof(struct dbll_snap_header) + table_size;
+
+  return snap;
+}
+
+/* unmap a snapshot */
+/* lists created from it with dbll_snap_to_list must not be used afterwards */
+void dbll_snap_unmap(struct dbll_snap *snap)
+{
+  if (snap == NULL) {
+    return;
+  }
+
+  munmap(snap->map, snap->map_size);
+  free(snap);
+}
+
+/* return the number of elements in the snapshot */
+size_t dbll_snap_count(struct dbll_snap *snap)
+{
+  return snap->header->count;
+}
+
+/* return a pointer to element i inside the mapping, and store its size in *size */
+/* return NULL if i is out of range or its table entry is corrupt */
+void *dbll_snap_item(struct dbll_snap *snap, size_t i, size_t *size)
+{
+  if (i >= snap->header->count) {
+    return NULL;
+  }
+
+  const struct dbll_snap_entry *e = &snap->table[i];
+
+  if (e->offset > snap->header->payload_size || e->size > snap->header->payload_size - e->offset) {
+    return NULL;
+  }
+
+  if (size != NULL) {
+    *size = e->size;
+  }
+  return snap->payload + e->offset;
+}
+
+/* iterate over the elements of a snapshot in list order, without creating any nodes */
+
+/* at each element, call f with the snapshot, a pointer to the element,
+   its size and the value of ctx. If f returns 0, stop iteration */
+
+/* return 1 on successful iteration, 0 if a corrupt entry was found */
+int dbll_snap_iterate(struct dbll_snap *snap,
+					  void *ctx,
+					  int (*f)(struct dbll_snap *, void *, size_t, void *))
+{
+  size_t i, size;
+
+  for (i = 0; i < snap->header->count; i++) {
+    void *item = dbll_snap_item(snap, i, &size);
+
+    if (item == NULL) {
+      return 0;
+    }
+    if (f(snap, item, size, ctx) == 0) {
+      return 1;
+    }
+  }
+
+  return 1;
+}
+
+/* convert a snapshot back into a mutable doubly-linked list */
+
+/* the user_data of each node points at its element inside the mapping,
+   so no element is copied and all nodes come from one allocation. The
+   list can be changed freely, but it must be freed before the snapshot is
+   unmapped */
+
+/* return NULL if memory could not be allocated or an entry is corrupt */
+struct dbll *dbll_snap_to_list(struct dbll_snap *snap)
+{
+  struct dbll *list = dbll_create();
+  size_t n = snap->header->count;
+  size_t i;
+
+  if (list == NULL || n == 0) {
+    return list;
+  }
+
+  void **items = (void**)malloc(n * sizeof(void *));
+  if (items == NULL) { //check mem allocation
+    dbll_free(list);
+    return NULL;
+  }
+
+  for (i = 0; i < n; i++) {
+    items[i] = dbll_snap_item(snap, i, NULL);
+    if (items[i] == NULL) {
+      free(items);
+      dbll_free(list);
+      return NULL;
+    }
+  }
+
+  if (dbll_append_array(list, items, n) == NULL) {
+    dbll_free(list);
+    list = NULL;
+  }
+
+  free(items);
+  return list;
+}
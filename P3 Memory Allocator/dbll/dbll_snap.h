@@ -0,0 +1,57 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "dbll.h"
+
+/* contiguous snapshot of a doubly-linked list */
+
+/* A snapshot file is laid out as
+
+     struct dbll_snap_header
+     struct dbll_snap_entry  table[count]
+     payload bytes
+
+   Entry i describes the bytes of element i in the payload. Every element
+   starts on a DBLL_SNAP_ALIGN boundary so that it can be used in place
+   once the file is mapped. All integers are in host byte order. */
+
+#define DBLL_SNAP_MAGIC "DBLLSNAP"
+#define DBLL_SNAP_VERSION 1
+#define DBLL_SNAP_ALIGN 8
+
+struct dbll_snap_header {
+  char magic[8];          /* DBLL_SNAP_MAGIC, not NUL-terminated */
+  uint32_t version;       /* DBLL_SNAP_VERSION */
+  uint32_t header_size;   /* sizeof(struct dbll_snap_header) */
+  uint64_t count;         /* number of elements */
+  uint64_t payload_size;  /* bytes of payload following the table */
+};
+
+struct dbll_snap_entry {
+  uint64_t offset;        /* offset of the element from the start of the payload */
+  uint64_t size;          /* size of the element in bytes */
+};
+
+/* a snapshot that has been mapped into memory */
+struct dbll_snap {
+  void *map;                             /* start of the mapping */
+  size_t map_size;                       /* size of the mapping */
+  const struct dbll_snap_header *header;
+  const struct dbll_snap_entry *table;
+  char *payload;
+};
+
+int dbll_snap_write(struct dbll *list, int fd, void *ctx,
+					size_t (*payload)(void *user_data, const void **bytes, void *ctx));
+
+struct dbll_snap *dbll_snap_map(int fd);
+void dbll_snap_unmap(struct dbll_snap *snap);
+
+size_t dbll_snap_count(struct dbll_snap *snap);
+void *dbll_snap_item(struct dbll_snap *snap, size_t i, size_t *size);
+
+int dbll_snap_iterate(struct dbll_snap *snap,
+					  void *ctx,
+					  int (*f)(struct dbll_snap *, void *, size_t, void *));
+
+struct dbll *dbll_snap_to_list(struct dbll_snap *snap);
@@ -1,8 +1,11 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 #include "dbll.h"
+#include "dbll_snap.h"
 #include "test_helper.h"
 
 int test_dbll_insert_before() {
@@ -368,6 +371,88 @@ int test_dbll_rev_iteration() {
   return ret;
 }
 
+/* records the value of every node it is called on */
+struct visit_log {
+  int n;
+  int vals[10];
+};
+
+int record_visit(struct dbll *ll, struct llnode *n, void *ctx) {
+  struct visit_log *log = (struct visit_log *) ctx;
+
+  if(log->n < 10)
+	log->vals[log->n++] = *(int *) n->user_data;
+
+  return 1;
+}
+
+/* the callback sees exactly start..stop, both included, in either direction */
+static int visited(struct visit_log *log, int n, int first, int step) {
+  int i;
+
+  if(log->n != n)
+	return 0;
+  for(i = 0; i < n; i++)
+	if(log->vals[i] != first + i * step)
+	  return 0;
+  return 1;
+}
+
+int test_dbll_iterate_range() {
+  struct dbll *ll, *empty;
+  struct llnode *n[5];
+  int test_data[] = {0, 1, 2, 3, 4};
+  struct visit_log log;
+  int ret = 0, iret, i;
+
+  ll = dbll_create();
+  empty = dbll_create();
+
+  if(!(ret = th_check(ll != NULL && empty != NULL, "iter_range: dbll_create return values must be non-NULL")))
+	return 0;
+
+  for(i = 0; i < 5; i++)
+	n[i] = dbll_append(ll, &test_data[i]);
+
+  log.n = 0;
+  iret = dbll_iterate(ll, n[1], n[3], &log, record_visit);
+  ret = th_check(iret == 1 && visited(&log, 3, 1, 1), "iter_range: forward n[1]..n[3] visits 1, 2, 3 (%d nodes)", log.n) && ret;
+
+  log.n = 0;
+  iret = dbll_iterate(ll, NULL, NULL, &log, record_visit);
+  ret = th_check(iret == 1 && visited(&log, 5, 0, 1), "iter_range: forward NULL..NULL visits every node (%d nodes)", log.n) && ret;
+
+  log.n = 0;
+  iret = dbll_iterate(ll, n[2], n[2], &log, record_visit);
+  ret = th_check(iret == 1 && visited(&log, 1, 2, 1), "iter_range: forward n[2]..n[2] visits only n[2] (%d nodes)", log.n) && ret;
+
+  log.n = 0;
+  iret = dbll_iterate(ll, n[3], n[1], &log, record_visit);
+  ret = th_check(iret == 0 && visited(&log, 2, 3, 1), "iter_range: forward n[3]..n[1] runs off the end and returns 0 (%d nodes)", log.n) && ret;
+
+  log.n = 0;
+  iret = dbll_iterate_reverse(ll, n[3], n[1], &log, record_visit);
+  ret = th_check(iret == 1 && visited(&log, 3, 3, -1), "iter_range: reverse n[3]..n[1] visits 3, 2, 1 (%d nodes)", log.n) && ret;
+
+  log.n = 0;
+  iret = dbll_iterate_reverse(ll, NULL, NULL, &log, record_visit);
+  ret = th_check(iret == 1 && visited(&log, 5, 4, -1), "iter_range: reverse NULL..NULL visits every node, stop included (%d nodes)", log.n) && ret;
+
+  log.n = 0;
+  iret = dbll_iterate_reverse(ll, n[1], n[3], &log, record_visit);
+  ret = th_check(iret == 0 && visited(&log, 2, 1, -1), "iter_range: reverse n[1]..n[3] runs off the front and returns 0 (%d nodes)", log.n) && ret;
+
+  log.n = 0;
+  ret = th_check(dbll_iterate(empty, NULL, NULL, &log, record_visit) == 1
+				 && dbll_iterate_reverse(empty, NULL, NULL, &log, record_visit) == 1 && log.n == 0,
+				 "iter_range: an empty list calls nothing and returns 1") && ret;
+
+  fprintf(stderr, "=== DONE\n\n");
+  dbll_free(empty);
+  dbll_free(ll);
+  return ret;
+}
+
 int test_dbll_remove() {
   struct dbll *ll;
 
@@ -574,6 +659,464 @@ int test_dbll_create_and_free() {
   return ret;
 }
 
+/* check that the values in ll are exactly expected[0] .. expected[n-1], following next and prev links */
+int check_list_values(const char *test, struct dbll *ll, int *expected, int n) {
+  struct llnode *it, *prev = NULL;
+  int i, ret = 1;
+
+  for(i = 0, it = ll->first; ret && i < n; i++, prev = it, it = it->next) {
+	ret = th_check(it != NULL, "%s: node %d (%p) must be non-NULL", test, i, it) && ret;
+	if(ret) {
+	  ret = th_check(*((int *) it->user_data) == expected[i],
+					 "%s: node %d holds %d, expected %d", test, i, *((int *) it->user_data), expected[i]) && ret;
+	  ret = th_check(it->prev == prev,
+					 "%s: node %d prev (%p) is the previous node (%p)", test, i, it->prev, prev) && ret;
+	}
+  }
+
+  if(ret) {
+	ret = th_check(it == NULL, "%s: list ends after %d nodes (%p)", test, n, it) && ret;
+	ret = th_check(ll->last == prev, "%s: ll->last (%p) is the final node (%p)", test, ll->last, prev) && ret;
+  }
+
+  return ret;
+}
+
+int test_dbll_splice() {
+  struct dbll *a, *b;
+
+  int N = 5;
+  struct llnode *na[N], *nb[N];
+
+  int ret = 0;
+  int test_data[] = {0, 1, 2, 3, 4, 10, 11, 12, 13, 14};
+  int i;
+
+  a = dbll_create();
+  b = dbll_create();
+
+  if(!(ret = th_check(a != NULL && b != NULL, "splice: dbll_create return values (%p, %p) must be non-NULL", a, b)))
+	return 0;
+
+  for(i = 0; i < N; i++) {
+	na[i] = dbll_append(a, &test_data[i]);
+	nb[i] = dbll_append(b, &test_data[N + i]);
+	ret = th_check(na[i] != NULL && nb[i] != NULL, "splice: dbll_append return values must be non-NULL") && ret;
+  }
+
+  if(!ret) return ret;
+
+  /* move b[1..3] before a[2] */
+  dbll_splice(a, na[2], b, nb[1], nb[3]);
+
+  int after_mid_a[] = {0, 1, 11, 12, 13, 2, 3, 4};
+  int after_mid_b[] = {10, 14};
+
+  ret = check_list_values("splice: middle run into middle", a, after_mid_a, 8) && ret;
+  ret = check_list_values("splice: middle run out of source", b, after_mid_b, 2) && ret;
+
+  ret = th_check(a->first->next->next == nb[1], "splice: spliced node (%p) keeps its address (%p)",
+				 a->first->next->next, nb[1]) && ret;
+
+  /* move all of b to the end of a */
+  dbll_splice(a, NULL, b, NULL, NULL);
+
+  int after_all_a[] = {0, 1, 11, 12, 13, 2, 3, 4, 10, 14};
+
+  ret = check_list_values("splice: whole list to end", a, after_all_a, 10) && ret;
+  ret = th_check(b->first == NULL && b->last == NULL, "splice: source list is empty (%p, %p)", b->first, b->last) && ret;
+
+  /* move the head of a to the front of (empty) b, then back to the front of a */
+  dbll_splice(b, NULL, a, na[0], na[1]);
+
+  int after_head_a[] = {11, 12, 13, 2, 3, 4, 10, 14};
+  int after_head_b[] = {0, 1};
+
+  ret = check_list_values("splice: head run out of source", a, after_head_a, 8) && ret;
+  ret = check_list_values("splice: head run into empty list", b, after_head_b, 2) && ret;
+
+  dbll_splice(a, a->first, b, NULL, NULL);
+
+  ret = check_list_values("splice: run to front", a, after_all_a, 10) && ret;
+
+  /* move the tail of a to its front within the same list */
+  dbll_splice(a, a->first, a, nb[0], nb[4]);
+
+  int after_self[] = {10, 14, 0, 1, 11, 12, 13, 2, 3, 4};
+
+  ret = check_list_values("splice: tail run to front of same list", a, after_self, 10) && ret;
+
+  dbll_free(a);
+  dbll_free(b);
+  fprintf(stderr, "=== DONE\n\n");
+  return ret;
+}
+
+int test_dbll_append_array() {
+  struct dbll *ll;
+
+  int N = 5;
+  int ret = 0;
+  int test_data[] = {0, 1, 2, 3, 4, 5};
+  void *items[N];
+  int i;
+
+  for(i = 0; i < N; i++)
+	items[i] = &test_data[i + 1];
+
+  ll = dbll_create();
+
+  if(!(ret = th_check(ll != NULL, "append_array: dbll_create return value (%p) must be non-NULL", ll)))
+	return 0;
+
+  ret = th_check(dbll_append_array(ll, items, 0) == NULL, "append_array: appending 0 items returns NULL") && ret;
+  ret = th_check(ll->first == NULL && ll->last == NULL, "append_array: appending 0 items leaves list empty") && ret;
+
+  struct llnode *n0 = dbll_append(ll, &test_data[0]);
+  struct llnode *first = dbll_append_array(ll, items, N);
+
+  if(!(ret = th_check(n0 != NULL && first != NULL, "append_array: return value (%p) must be non-NULL", first) && ret))
+	return ret;
+
+  int expected[] = {0, 1, 2, 3, 4, 5};
+
+  ret = check_list_values("append_array", ll, expected, N + 1) && ret;
+  ret = th_check(n0->next == first && first->prev == n0, "append_array: first new node (%p) follows old last node (%p)", first, n0) && ret;
+  ret = th_check(first->block != NULL && first->block == ll->last->block, "append_array: new nodes share one allocation (%p)", first->block) && ret;
+
+  /* removing nodes of a shared block one at a time must only release the block at the end */
+  dbll_remove(ll, first->next);
+  dbll_remove(ll, ll->last);
+  dbll_pop(ll);
+
+  int after_remove[] = {0, 1, 3};
+
+  ret = check_list_values("append_array: remove shared nodes", ll, after_remove, 3) && ret;
+
+  dbll_free(ll);
+  fprintf(stderr, "=== DONE\n\n");
+  return ret;
+}
+
+int test_dbll_remove_range() {
+  struct dbll *ll;
+
+  int N = 8;
+  struct llnode *n[N];
+
+  int ret = 0;
+  int test_data[] = {0, 1, 2, 3, 4, 5, 6, 7};
+  int i;
+
+  ll = dbll_create();
+
+  if(!(ret = th_check(ll != NULL, "remove_range: dbll_create return value (%p) must be non-NULL", ll)))
+	return 0;
+
+  for(i = 0; i < N; i++) {
+	n[i] = dbll_append(ll, &test_data[i]);
+	ret = th_check(n[i] != NULL, "remove_range: dbll_append return value (n[%d] == %p) must be non-NULL", i, n[i]) && ret;
+  }
+
+  if(!ret) return ret;
+
+  dbll_remove_range(ll, n[2], n[4]);
+
+  int after_mid[] = {0, 1, 5, 6, 7};
+  ret = check_list_values("remove_range: middle", ll, after_mid, 5) && ret;
+
+  dbll_remove_range(ll, NULL, n[1]);
+
+  int after_head[] = {5, 6, 7};
+  ret = check_list_values("remove_range: head", ll, after_head, 3) && ret;
+
+  dbll_remove_range(ll, n[6], NULL);
+
+  int after_tail[] = {5};
+  ret = check_list_values("remove_range: tail", ll, after_tail, 1) && ret;
+
+  dbll_remove_range(ll, NULL, NULL);
+
+  ret = check_list_values("remove_range: everything", ll, NULL, 0) && ret;
+
+  dbll_free(ll);
+  fprintf(stderr, "=== DONE\n\n");
+  return ret;
+}
+
+/* comparator for dbll_sort/dbll_merge on struct sort_item, ordering by key only */
+struct sort_item {
+  int key;
+  int seq;  /* original position, used to check stability */
+};
+
+int compare_key(void *a, void *b, void *ctx) {
+  struct sort_item *x = (struct sort_item *) a;
+  struct sort_item *y = (struct sort_item *) b;
+  int *ncalls = (int *) ctx;
+
+  (*ncalls)++;
+  return (x->key > y->key) - (x->key < y->key);
+}
+
+/* check that ll is ordered by key, stable by seq, and correctly linked */
+int check_sorted(const char *test, struct dbll *ll, int n) {
+  struct llnode *it, *prev = NULL;
+  int i, ret = 1;
+
+  for(i = 0, it = ll->first; ret && it != NULL; i++, prev = it, it = it->next) {
+	ret = th_check(it->prev == prev, "%s: node %d prev (%p) is the previous node (%p)", test, i, it->prev, prev) && ret;
+
+	if(ret && prev != NULL) {
+	  struct sort_item *a = prev->user_data, *b = it->user_data;
+
+	  ret = th_check(a->key < b->key || (a->key == b->key && a->seq < b->seq),
+					 "%s: node %d (%d, %d) is ordered after node %d (%d, %d)",
+					 test, i, b->key, b->seq, i - 1, a->key, a->seq) && ret;
+	}
+  }
+
+  if(ret) {
+	ret = th_check(i == n, "%s: list has %d nodes, expected %d", test, i, n) && ret;
+	ret = th_check(ll->last == prev, "%s: ll->last (%p) is the final node (%p)", test, ll->last, prev) && ret;
+  }
+
+  return ret;
+}
+
+int test_dbll_sort() {
+  struct dbll *ll;
+
+  int N = 1000;
+  struct sort_item items[N];
+
+  int ret = 0;
+  int i, ncalls = 0;
+
+  ll = dbll_create();
+
+  if(!(ret = th_check(ll != NULL, "sort: dbll_create return value (%p) must be non-NULL", ll)))
+	return 0;
+
+  dbll_sort(ll, &ncalls, compare_key);
+  ret = th_check(ll->first == NULL && ll->last == NULL, "sort: sorting an empty list leaves it empty") && ret;
+
+  srand(252);
+  for(i = 0; i < N; i++) {
+	items[i].key = rand() % 50;  /* lots of duplicates */
+	items[i].seq = i;
+	ret = th_check(dbll_append(ll, &items[i]) != NULL, "sort: dbll_append of item %d must be non-NULL", i) && ret;
+  }
+
+  if(!ret) return ret;
+
+  dbll_sort(ll, &ncalls, compare_key);
+  ret = check_sorted("sort: random keys", ll, N) && ret;
+
+  /* n log n bound: 1000 * 10 */
+  ret = th_check(ncalls <= N * 10, "sort: used %d comparisons for %d nodes", ncalls, N) && ret;
+
+  /* sorting a sorted list must not change it */
+  dbll_sort(ll, &ncalls, compare_key);
+  ret = check_sorted("sort: already sorted", ll, N) && ret;
+
+  dbll_free(ll);
+  fprintf(stderr, "=== DONE\n\n");
+  return ret;
+}
+
+int test_dbll_merge() {
+  struct dbll *a, *b;
+
+  int N = 6;
+  struct sort_item items[2 * N];
+
+  int ret = 0;
+  int i, ncalls = 0;
+  int akeys[] = {1, 3, 3, 5, 8, 9};
+  int bkeys[] = {0, 3, 4, 5, 10, 11};
+
+  a = dbll_create();
+  b = dbll_create();
+
+  if(!(ret = th_check(a != NULL && b != NULL, "merge: dbll_create return values (%p, %p) must be non-NULL", a, b)))
+	return 0;
+
+  /* seq records the order in which equal keys must appear: all of a before b */
+  for(i = 0; i < N; i++) {
+	items[i].key = akeys[i];
+	items[i].seq = i;
+	items[N + i].key = bkeys[i];
+	items[N + i].seq = N + i;
+	ret = th_check(dbll_append(a, &items[i]) != NULL && dbll_append(b, &items[N + i]) != NULL,
+				   "merge: dbll_append of item %d must be non-NULL", i) && ret;
+  }
+
+  if(!ret) return ret;
+
+  dbll_merge(a, b, &ncalls, compare_key);
+
+  ret = check_sorted("merge", a, 2 * N) && ret;
+  ret = th_check(b->first == NULL && b->last == NULL, "merge: source list is empty (%p, %p)", b->first, b->last) && ret;
+  ret = th_check(ncalls <= 4 * N, "merge: used %d comparisons for %d nodes", ncalls, 2 * N) && ret;
+
+  /* merging an empty list is a no-op, and merging into an empty list moves everything */
+  dbll_merge(a, b, &ncalls, compare_key);
+  ret = check_sorted("merge: empty source", a, 2 * N) && ret;
+
+  dbll_merge(b, a, &ncalls, compare_key);
+  ret = check_sorted("merge: empty destination", b, 2 * N) && ret;
+  ret = th_check(a->first == NULL && a->last == NULL, "merge: source list is empty (%p, %p)", a->first, a->last) && ret;
+
+  dbll_free(a);
+  dbll_free(b);
+  fprintf(stderr, "=== DONE\n\n");
+  return ret;
+}
+
+/* payload callback for dbll_snap_write: elements are NUL-terminated strings */
+size_t string_payload(void *user_data, const void **bytes, void *ctx) {
+  *bytes = user_data;
+  return strlen((char *) user_data) + 1;
+}
+
+int count_chars(struct dbll_snap *snap, void *item, size_t size, void *ctx) {
+  size_t *nchars = (size_t *) ctx;
+
+  *nchars += strlen((char *) item);
+  return 1;
+}
+
+int test_dbll_snapshot() {
+  struct dbll *ll;
+
+  int N = 5;
+  char *test_data[] = {"zero", "one", "two", "three", ""};
+
+  int ret = 0;
+  int i;
+
+  ll = dbll_create();
+
+  if(!(ret = th_check(ll != NULL, "snapshot: dbll_create return value (%p) must be non-NULL", ll)))
+	return 0;
+
+  for(i = 0; i < N; i++)
+	ret = th_check(dbll_append(ll, test_data[i]) != NULL, "snapshot: dbll_append of item %d must be non-NULL", i) && ret;
+
+  FILE *f = tmpfile();
+
+  if(!(ret = th_check(f != NULL, "snapshot: tmpfile (%p) must be non-NULL", f) && ret))
+	return 0;
+
+  ret = th_check(dbll_snap_write(ll, fileno(f), NULL, string_payload) == 0, "snapshot: dbll_snap_write must succeed") && ret;
+
+  struct dbll_snap *snap = dbll_snap_map(fileno(f));
+
+  if(!(ret = th_check(snap != NULL, "snapshot: dbll_snap_map return value (%p) must be non-NULL", snap) && ret))
+	return 0;
+
+  ret = th_check(dbll_snap_count(snap) == N, "snapshot: count (%lu) is %d", dbll_snap_count(snap), N) && ret;
+
+  for(i = 0; ret && i < N; i++) {
+	size_t size;
+	char *item = dbll_snap_item(snap, i, &size);
+
+	ret = th_check(item != NULL && strcmp(item, test_data[i]) == 0, "snapshot: item %d (%s) is %s", i, item, test_data[i]) && ret;
+	ret = th_check(size == strlen(test_data[i]) + 1, "snapshot: item %d size (%lu) is %lu", i, size, strlen(test_data[i]) + 1) && ret;
+	ret = th_check(((size_t) item) % DBLL_SNAP_ALIGN == 0, "snapshot: item %d (%p) is aligned", i, item) && ret;
+  }
+
+  ret = th_check(dbll_snap_item(snap, N, NULL) == NULL, "snapshot: item past the end is NULL") && ret;
+
+  size_t nchars = 0;
+  ret = th_check(dbll_snap_iterate(snap, &nchars, count_chars) == 1, "snapshot: iterate should return 1 as return value") && ret;
+  ret = th_check(nchars == 15, "snapshot: iterate+count_chars must count 15 characters, counted %lu", nchars) && ret;
+
+  /* convert back into a list; nodes point into the mapping */
+  struct dbll *copy = dbll_snap_to_list(snap);
+
+  if(!(ret = th_check(copy != NULL, "snapshot: dbll_snap_to_list return value (%p) must be non-NULL", copy) && ret))
+	return 0;
+
+  struct llnode *a, *b;
+  for(i = 0, a = ll->first, b = copy->first; ret && a != NULL; i++, a = a->next, b = b->next) {
+	ret = th_check(b != NULL && strcmp(a->user_data, b->user_data) == 0, "snapshot: list node %d matches original", i) && ret;
+	ret = th_check(b->user_data == dbll_snap_item(snap, i, NULL), "snapshot: list node %d points into the mapping", i) && ret;
+  }
+  ret = th_check(b == NULL, "snapshot: list has as many nodes as the original") && ret;
+
+  /* the list is mutable and its elements are writable without changing the file */
+  ((char *) copy->first->user_data)[0] = 'Z';
+  dbll_remove(copy, copy->last);
+
+  ret = th_check(strcmp(dbll_snap_item(snap, 0, NULL), "Zero") == 0, "snapshot: elements can be modified in place") && ret;
+
+  dbll_free(copy);
+  dbll_snap_unmap(snap);
+
+  snap = dbll_snap_map(fileno(f));
+  ret = th_check(snap != NULL && strcmp(dbll_snap_item(snap, 0, NULL), "zero") == 0, "snapshot: modifications are private to the mapping") && ret;
+  dbll_snap_unmap(snap);
+
+  /* a file that is not a snapshot must be rejected */
+  FILE *bad = tmpfile();
+  fputs("definitely not a snapshot header", bad);
+  fflush(bad);
+
+  ret = th_check(dbll_snap_map(fileno(bad)) == NULL, "snapshot: mapping a non-snapshot file fails") && ret;
+
+  fclose(bad);
+  fclose(f);
+  dbll_free(ll);
+  fprintf(stderr, "=== DONE\n\n");
+  return ret;
+}
+
+int test_dbll_link() {
+  struct dbll *ll;
+
+  int N = 5;
+  struct llnode n[N];  /* caller-owned nodes, must never be freed by dbll */
+
+  int ret = 0;
+  int test_data[] = {0, 1, 2, 3, 4};
+  int i;
+
+  ll = dbll_create();
+
+  if(!(ret = th_check(ll != NULL, "link: dbll_create return value (%p) must be non-NULL", ll)))
+	return 0;
+
+  for(i = 0; i < N; i++)
+	dbll_node_init(&n[i], &test_data[i]);
+
+  ret = th_check(dbll_link_after(ll, NULL, &n[2]) == &n[2], "link: dbll_link_after returns the linked node") && ret;
+  dbll_link_before(ll, NULL, &n[0]);
+  dbll_link_after(ll, NULL, &n[4]);
+  dbll_link_after(ll, &n[0], &n[1]);
+  dbll_link_before(ll, &n[4], &n[3]);
+
+  int expected[] = {0, 1, 2, 3, 4};
+  ret = check_list_values("link", ll, expected, N) && ret;
+
+  dbll_remove(ll, &n[2]);
+  dbll_remove_range(ll, &n[3], NULL);
+
+  int after_remove[] = {0, 1};
+  ret = check_list_values("link: remove", ll, after_remove, 2) && ret;
+
+  /* removed nodes can be linked again */
+  dbll_link_after(ll, &n[0], &n[2]);
+
+  int after_relink[] = {0, 2, 1};
+  ret = check_list_values("link: relink", ll, after_relink, 3) && ret;
+
+  dbll_free(ll);
+  fprintf(stderr, "=== DONE\n\n");
+  return ret;
+}
+
 int main(void) {
   if(!test_dbll_create_and_free())
 	exit(1);
@@ -590,12 +1133,36 @@ int main(void) {
   if(!test_dbll_rev_iteration())
 	exit(1);
 
+  if(!test_dbll_iterate_range())
+	exit(1);
+
   if(!test_dbll_insert_after())
 	exit(1);
 
   if(!test_dbll_insert_before())
 	exit(1);
 
+  if(!test_dbll_link())
+	exit(1);
+
+  if(!test_dbll_splice())
+	exit(1);
+
+  if(!test_dbll_append_array())
+	exit(1);
+
+  if(!test_dbll_remove_range())
+	exit(1);
+
+  if(!test_dbll_sort())
+	exit(1);
+
+  if(!test_dbll_merge())
+	exit(1);
+
+  if(!test_dbll_snapshot())
+	exit(1);
+
   printf("ALL DONE\n");
   return 0;
 }
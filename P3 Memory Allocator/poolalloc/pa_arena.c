@@ -0,0 +1,87 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include "poolalloc.h"
+#include "poolalloc_int.h"
+
+/*
+   MPOOL_ARENA mode: bump allocation
+
+   The pool is used from the start up, and arena_top is the offset of the
+   first byte that has not been handed out. mpool_alloc aligns arena_top
+   as the block needs and moves it past the allocation; nothing
+   else is recorded about a block.
+
+   mpool_free does nothing. Memory is given back all at once, either to a
+   point recorded with mpool_mark (mpool_release_to) or entirely
+   (mpool_reset), which are both O(1).
+
+   The offset of the last allocation is kept as well, so that
+   mpool_realloc can grow or shrink it in place by moving arena_top.
+*/
+
+#define ARENA_NONE ((size_t) -1)
+
+int pa_arena_init(struct memory_pool *p)
+{
+  p->arena_top = 0;
+  p->arena_last = ARENA_NONE;
+  return 1;
+}
+
+void *pa_arena_alloc(struct memory_pool *p, size_t size, size_t align)
+{
+  uintptr_t addr = ((uintptr_t) (p->start + p->arena_top) + align - 1) & ~((uintptr_t) align - 1);
+  size_t off = addr - (uintptr_t) p->start;
+
+  if (off > p->size || size > p->size - off) {
+    return NULL;
+  }
+
+  p->arena_top = off + size;
+  p->arena_last = off;
+  return p->start + off;
+}
+
+/* resize the block at addr in place if it is the last allocation */
+/* otherwise returns 0 and sets *copy to the bytes that may belong to it
+   (up to arena_top, since block sizes are not recorded), or 0 if addr is
+   not in the allocated part of the arena */
+int pa_arena_resize(struct memory_pool *p, void *addr, size_t size, size_t *copy)
+{
+  size_t off = (char *) addr - p->start;
+
+  if ((char *) addr < p->start || off >= p->arena_top) {
+    *copy = 0;
+    return 0;
+  }
+  if (size > 0 && off == p->arena_last && size <= p->size - off) {
+    p->arena_top = off + size;
+    return 1;
+  }
+
+  *copy = p->arena_top - off;
+  return 0;
+}
+
+/* record the current top of an arena, for mpool_release_to */
+/* returns 0 for a pool that is not a MPOOL_ARENA pool */
+size_t mpool_mark(struct memory_pool *p)
+{
+  return ((p->flags & MPOOL_MODE_MASK) == MPOOL_ARENA) ? p->arena_top : 0;
+}
+
+/* free everything allocated from an arena since `mark` was taken */
+/* marks taken after `mark` are no longer valid; does nothing for other pools */
+void mpool_release_to(struct memory_pool *p, size_t mark)
+{
+  if ((p->flags & MPOOL_MODE_MASK) == MPOOL_ARENA && mark <= p->arena_top) {
+    p->arena_top = mark;
+    p->arena_last = ARENA_NONE;
+  }
+}
+
+/* free everything allocated from an arena; does nothing for other pools */
+void mpool_reset(struct memory_pool *p)
+{
+  mpool_release_to(p, 0);
+}
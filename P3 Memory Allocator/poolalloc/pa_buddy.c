@@ -0,0 +1,341 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include "poolalloc.h"
+#include "poolalloc_int.h"
+
+/*
+   MPOOL_BUDDY mode: a binary buddy system
+
+   Every block is 2^k bytes (its order is k) and starts at an offset that
+   is a multiple of its size, so the buddy of the block at offset off is
+   at off ^ 2^k. The pool is first cut into the largest such blocks that
+   fit (one per bit set in its size), and those are never merged with each
+   other.
+
+   For every order there is a list of free blocks, linked through their
+   payload, and two bitmaps indexed by off >> k:
+
+     free:  the block of order k at off is free
+     split: the block of order k at off has been split in two halves
+
+   mpool_alloc rounds the request up to a power of two, takes the smallest
+   free block that is large enough and splits it down, so both allocating
+   and freeing take O(log n) steps. mpool_free finds the order of a block
+   by following the split bits down from the top and merges it with its
+   buddy for as long as the buddy is free. mpool_realloc grows a block in
+   place by merging it with the free upper buddies of its larger orders,
+   and shrinks it by splitting it down as mpool_alloc does.
+
+   Every block is at least BUDDY_MIN bytes, so all payloads are 16-byte
+   aligned.
+*/
+
+#define BUDDY_MIN_ORDER 4
+#define BUDDY_MIN (1 << BUDDY_MIN_ORDER)
+#define BUDDY_NONE ((size_t) -1)
+#define BUDDY_ORDERS 64
+
+struct buddy_links {
+  size_t next;  /* offset of the next free block of this order, BUDDY_NONE if none */
+  size_t prev;  /* offset of the previous free block of this order, BUDDY_NONE if none */
+};
+
+struct pa_buddy {
+  size_t usable;                    /* bytes of the pool managed, a multiple of BUDDY_MIN */
+  uint64_t orders;                  /* bit k is set when heads[k] is not empty */
+  size_t heads[BUDDY_ORDERS];       /* first free block of each order */
+  size_t free_map[BUDDY_ORDERS];    /* index into bits[] of the free bitmap of each order */
+  size_t split_map[BUDDY_ORDERS];   /* index into bits[] of the split bitmap of each order */
+  uint64_t bits[];
+};
+
+static struct buddy_links *buddy_links(struct memory_pool *p, size_t off)
+{
+  return (struct buddy_links *) (p->start + off);
+}
+
+/* the bitmaps are read and written atomically (with no ordering), so
+   that pa_buddy_usable can run without the MPOOL_THREADS lock: the bits
+   it reads belong to the block and its parents, which do not change while
+   the block is allocated, but other bits in the same words may */
+
+static int bit_test(struct pa_buddy *b, size_t map, size_t i)
+{
+  return (__atomic_load_n(&b->bits[map + i / 64], __ATOMIC_RELAXED) >> (i % 64)) & 1;
+}
+
+static void bit_set(struct pa_buddy *b, size_t map, size_t i)
+{
+  __atomic_fetch_or(&b->bits[map + i / 64], 1ULL << (i % 64), __ATOMIC_RELAXED);
+}
+
+static void bit_clear(struct pa_buddy *b, size_t map, size_t i)
+{
+  __atomic_fetch_and(&b->bits[map + i / 64], ~(1ULL << (i % 64)), __ATOMIC_RELAXED);
+}
+
+/* order of the largest block that contains off, one of the blocks the pool was cut into */
+static int buddy_top(struct pa_buddy *b, size_t off)
+{
+  return 63 - __builtin_clzll(b->usable ^ off);
+}
+
+/* mark block off of order k as free and put it on its list */
+static void buddy_insert(struct memory_pool *p, size_t off, int k)
+{
+  struct pa_buddy *b = p->buddy;
+  struct buddy_links *l = buddy_links(p, off);
+
+  l->prev = BUDDY_NONE;
+  l->next = b->heads[k];
+  if (l->next != BUDDY_NONE) {
+    buddy_links(p, l->next)->prev = off;
+  }
+  b->heads[k] = off;
+  b->orders |= 1ULL << k;
+  bit_set(b, b->free_map[k], off >> k);
+}
+
+/* take free block off of order k off its list */
+static void buddy_remove(struct memory_pool *p, size_t off, int k)
+{
+  struct pa_buddy *b = p->buddy;
+  struct buddy_links *l = buddy_links(p, off);
+
+  if (l->prev != BUDDY_NONE) {
+    buddy_links(p, l->prev)->next = l->next;
+  } else {
+    b->heads[k] = l->next;
+  }
+  if (l->next != BUDDY_NONE) {
+    buddy_links(p, l->next)->prev = l->prev;
+  }
+
+  if (b->heads[k] == BUDDY_NONE) {
+    b->orders &= ~(1ULL << k);
+  }
+  bit_clear(b, b->free_map[k], off >> k);
+}
+
+/* allocate the bitmaps and cut the pool into free blocks */
+/* returns 0 if the pool is too small or memory could not be allocated */
+int pa_buddy_init(struct memory_pool *p)
+{
+  size_t usable = p->size & ~(size_t) (BUDDY_MIN - 1);
+  size_t words = 0, off;
+  int k;
+
+  if (((uintptr_t) p->start) % BUDDY_MIN != 0 || usable == 0) {
+    return 0;
+  }
+
+  //one bit per possible block of each order, for both bitmaps
+  for (k = BUDDY_MIN_ORDER; k < BUDDY_ORDERS && (usable >> k) > 0; k++) {
+    words += 2 * ((usable >> k) / 64 + 1);
+  }
+
+  struct pa_buddy *b = (struct pa_buddy*)calloc(1, sizeof(struct pa_buddy) + words * sizeof(uint64_t));
+  if (b == NULL) { //check mem allocation
+    return 0;
+  }
+
+  b->usable = usable;
+  words = 0;
+  for (k = 0; k < BUDDY_ORDERS; k++) {
+    b->heads[k] = BUDDY_NONE;
+    if (k >= BUDDY_MIN_ORDER && (usable >> k) > 0) {
+      b->free_map[k] = words;
+      b->split_map[k] = words + (usable >> k) / 64 + 1;
+      words += 2 * ((usable >> k) / 64 + 1);
+    }
+  }
+  p->buddy = b;
+
+  //largest blocks first, one for each bit of the size
+  off = 0;
+  for (k = BUDDY_ORDERS - 1; k >= BUDDY_MIN_ORDER; k--) {
+    if (usable & ((size_t) 1 << k)) {
+      buddy_insert(p, off, k);
+      off += (size_t) 1 << k;
+    }
+  }
+
+  return 1;
+}
+
+/* smallest order that holds `size` bytes */
+static int buddy_fit(size_t size)
+{
+  if (size <= BUDDY_MIN) {
+    return BUDDY_MIN_ORDER;
+  }
+  return 64 - __builtin_clzll(size - 1);  /* ceil(log2(size)) */
+}
+
+/* split allocated block off of order j down to order k, freeing the upper halves */
+static void buddy_split(struct memory_pool *p, size_t off, int j, int k)
+{
+  struct pa_buddy *b = p->buddy;
+
+  while (j > k) {
+    bit_set(b, b->split_map[j], off >> j);
+    j--;
+    buddy_insert(p, off + ((size_t) 1 << j), j);
+  }
+}
+
+/* allocate a block of the smallest order that holds `size` bytes */
+/* blocks are aligned to their size within the pool, so a block of at
+   least `align` bytes is aligned to `align` if the pool is */
+void *pa_buddy_alloc(struct memory_pool *p, size_t size, size_t align)
+{
+  struct pa_buddy *b = p->buddy;
+  int k = buddy_fit((size > align) ? size : align), j;
+
+  if (k >= BUDDY_ORDERS || ((uintptr_t) p->start & (align - 1)) != 0) {
+    return NULL;
+  }
+
+  /* smallest order at or above k that has a free block */
+  uint64_t avail = b->orders & (~0ULL << k);
+  if (avail == 0) {
+    return NULL;
+  }
+  j = __builtin_ctzll(avail);
+
+  size_t off = b->heads[j];
+  buddy_remove(p, off, j);
+
+  /* split it down, keeping the lower half and freeing the upper one */
+  buddy_split(p, off, j, k);
+  return p->start + off;
+}
+
+/* order of the allocated block at addr, -1 if there is none */
+/* found by following the split halves that contain it from the top */
+static int buddy_order(struct memory_pool *p, void *addr)
+{
+  struct pa_buddy *b = p->buddy;
+  size_t off = (char *) addr - p->start;
+
+  if ((char *) addr < p->start || off >= b->usable || off % BUDDY_MIN != 0) {
+    return -1; //not a block of this pool
+  }
+
+  int k = buddy_top(b, off);
+
+  while (k > BUDDY_MIN_ORDER && bit_test(b, b->split_map[k], off >> k)) {
+    k--;
+  }
+  if ((off & (((size_t) 1 << k) - 1)) != 0 || bit_test(b, b->free_map[k], off >> k)) {
+    return -1; //not the start of an allocated block, or already free
+  }
+  return k;
+}
+
+/* bytes in the block at addr, 0 if it is not allocated */
+size_t pa_buddy_usable(struct memory_pool *p, void *addr)
+{
+  int k = buddy_order(p, addr);
+
+  return (k >= 0) ? (size_t) 1 << k : 0;
+}
+
+/* free a block and merge it with its buddy for as long as the buddy is free */
+void pa_buddy_free(struct memory_pool *p, void *addr)
+{
+  struct pa_buddy *b = p->buddy;
+  size_t off = (char *) addr - p->start;
+  int k = buddy_order(p, addr);
+
+  if (k < 0) {
+    return;
+  }
+
+  int top = buddy_top(b, off);
+
+  /* merge with free buddies; the blocks the pool was cut into have none */
+  while (k < top) {
+    size_t buddy = off ^ ((size_t) 1 << k);
+
+    if (!bit_test(b, b->free_map[k], buddy >> k)) {
+      break;
+    }
+
+    buddy_remove(p, buddy, k);
+    off &= ~((size_t) 1 << k);
+    k++;
+    bit_clear(b, b->split_map[k], off >> k);
+  }
+
+  buddy_insert(p, off, k);
+}
+
+/* resize the allocated block at addr to the order that holds `size`
+   bytes without moving it */
+/* returns 0 if the block would have to move: it is the upper half at
+   some order on the way, or one of the upper buddies is not free */
+int pa_buddy_resize(struct memory_pool *p, void *addr, size_t size)
+{
+  struct pa_buddy *b = p->buddy;
+  size_t off = (char *) addr - p->start;
+  int k = buddy_order(p, addr);
+  int j = buddy_fit(size), m;
+
+  if (k < 0 || j >= BUDDY_ORDERS) {
+    return 0;
+  }
+  if (j <= k) {
+    buddy_split(p, off, k, j);
+    return 1;
+  }
+
+  /* every order from k up to j needs the block to be the lower half and
+     its upper buddy to be free as a whole */
+  if (j > buddy_top(b, off) || (off & (((size_t) 1 << j) - 1)) != 0) {
+    return 0;
+  }
+  for (m = k; m < j; m++) {
+    if (!bit_test(b, b->free_map[m], (off >> m) + 1)) {
+      return 0;
+    }
+  }
+
+  for (m = k; m < j; m++) {
+    buddy_remove(p, off + ((size_t) 1 << m), m);
+    bit_clear(b, b->split_map[m + 1], off >> (m + 1));
+  }
+  return 1;
+}
+
+/* add the bytes of every free block to *total and raise *largest to the
+   largest of them */
+void pa_buddy_free_space(struct memory_pool *p, size_t *total, size_t *largest)
+{
+  struct pa_buddy *b = p->buddy;
+  size_t off;
+  int k;
+
+  for (k = BUDDY_MIN_ORDER; k < BUDDY_ORDERS; k++) {
+    for (off = b->heads[k]; off != BUDDY_NONE; off = buddy_links(p, off)->next) {
+      *total += (size_t) 1 << k;
+    }
+    if (b->orders & (1ULL << k)) {
+      *largest = ((size_t) 1 << k > *largest) ? (size_t) 1 << k : *largest;
+    }
+  }
+}
+
+/* call fn for the part of every free block after its links */
+void pa_buddy_free_spans(struct memory_pool *p, void (*fn)(struct memory_pool *, size_t, size_t, void *), void *ctx)
+{
+  struct pa_buddy *b = p->buddy;
+  size_t off;
+  int k;
+
+  for (k = BUDDY_MIN_ORDER; k < BUDDY_ORDERS; k++) {
+    for (off = b->heads[k]; off != BUDDY_NONE; off = buddy_links(p, off)->next) {
+      fn(p, off + sizeof(struct buddy_links), ((size_t) 1 << k) - sizeof(struct buddy_links), ctx);
+    }
+  }
+}
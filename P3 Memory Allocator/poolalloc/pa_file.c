@@ -0,0 +1,244 @@
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "poolalloc.h"
+#include "poolalloc_int.h"
+
+/*
+   file-backed pools: a MPOOL_TAGS pool in a file mapped with MAP_SHARED
+
+   MPOOL_TAGS keeps all of its metadata inside the pool as offsets: the
+   boundary tags of every block, and the links between free blocks of a
+   bin. Only the heads of the bins (tag_bins) and the binmap live in the
+   memory_pool struct. A file pool keeps a copy of those in a header page
+   in front of the pool, so reopening the file is one mmap and a copy of
+   about 2 KiB, however large the pool is.
+
+     offset 0            struct pa_file_header, padded to FILE_HEADER
+     offset FILE_HEADER  the pool (p->start), MPOOL_TAGS layout
+
+   Blocks are referred to by their offset from p->start (mpool_off,
+   mpool_ptr), which stays the same wherever the file is mapped; 0 is
+   never a block and stands for NULL. mpool_set_root records the offset
+   of one block in the header, from which a program finds its data again
+   after reopening.
+
+   The header's copy of the bins is only written by mpool_sync and
+   mpool_destroy, and `clean` is only set by mpool_destroy. A file that
+   was not closed (the process died) has its bins rebuilt from the
+   boundary tags when it is opened, which walks every block once. No
+   operation is atomic on disk: a crash in the middle of mpool_alloc or
+   mpool_free can leave tags that do not describe a valid pool, and then
+   mpool_open fails.
+
+   Blocks cached in MPOOL_THREADS magazines and frees queued by
+   MPOOL_DEFERRED are given back before the file is closed; after a crash
+   they stay allocated.
+*/
+
+#define FILE_HEADER ((size_t) 4096)   /* also keeps the pool page-aligned for mpool_alloc_aligned */
+#define FILE_MAGIC "mpooltg1"         /* MPOOL_TAGS layout, version 1 */
+
+struct pa_file_header {
+  char magic[8];
+  uint64_t size;                      /* bytes of pool after the header */
+  uint64_t clean;                     /* the bins below match the tags */
+  uint64_t root;                      /* offset set with mpool_set_root, 0 if none */
+  size_t tag_bins[MPOOL_NBINS];
+  uint64_t binmap[MPOOL_BINMAP_WORDS];
+};
+
+struct pa_file {
+  int fd;
+  char *map;                          /* the whole file, header first */
+  size_t map_size;
+  struct pa_file_header *header;
+};
+
+/* copy the bins of p into the header */
+static void file_save(struct memory_pool *p)
+{
+  struct pa_file_header *h = p->file->header;
+
+  memcpy(h->tag_bins, p->tag_bins, sizeof(h->tag_bins));
+  memcpy(h->binmap, p->binmap, sizeof(h->binmap));
+}
+
+/* map the file at fd, creating the pool if it is empty */
+/* returns 0 if it cannot be mapped or holds something other than a pool */
+static int file_map(struct memory_pool *p, struct pa_file *f, size_t size)
+{
+  struct stat st;
+  int created = 0;
+
+  if (fstat(f->fd, &st) != 0) {
+    return 0;
+  }
+  if (st.st_size == 0) { //a new pool
+    if (size == 0 || FILE_HEADER + size < size || ftruncate(f->fd, FILE_HEADER + size) != 0) {
+      return 0;
+    }
+    st.st_size = FILE_HEADER + size;
+    created = 1;
+  }
+  if ((size_t) st.st_size <= FILE_HEADER) {
+    return 0;
+  }
+
+  f->map_size = st.st_size;
+  f->map = mmap(NULL, f->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, f->fd, 0);
+  if (f->map == MAP_FAILED) {
+    f->map = NULL;
+    return 0;
+  }
+  f->header = (struct pa_file_header *) f->map;
+  p->start = f->map + FILE_HEADER;
+  p->size = f->map_size - FILE_HEADER;
+
+  struct pa_file_header *h = f->header;
+
+  if (created) {
+    memcpy(h->magic, FILE_MAGIC, sizeof(h->magic));
+    h->size = p->size;
+    h->root = 0;
+    return pa_tags_init(p);
+  }
+
+  if (memcmp(h->magic, FILE_MAGIC, sizeof(h->magic)) != 0 || h->size != p->size) {
+    return 0;
+  }
+  if (!h->clean) { //not closed, the bins in the header may be stale
+    return pa_tags_rebuild(p);
+  }
+  memcpy(p->tag_bins, h->tag_bins, sizeof(p->tag_bins));
+  memcpy(p->binmap, h->binmap, sizeof(p->binmap));
+  return 1;
+}
+
+/* open the pool in the file at path, or create one of `size` bytes
+   (plus a header page) if the file does not exist or is empty */
+/* flags must be MPOOL_TAGS, optionally or'ed with MPOOL_THREADS,
+   MPOOL_STATS, MPOOL_CACHELINE and MPOOL_DEFERRED; the pool cannot grow.
+   size is ignored when the file already holds a pool. The pool is closed
+   with mpool_destroy, which keeps the file. */
+/* returns NULL if the file cannot be opened or mapped, does not hold a
+   pool, or the flags are not valid */
+struct memory_pool *mpool_open(const char *path, size_t size, int flags)
+{
+  if ((flags & MPOOL_MODE_MASK) != MPOOL_TAGS || (flags & (MPOOL_GROW | MPOOL_HUGEPAGE | MPOOL_HUGETLB))) {
+    return NULL;
+  }
+  /* the magazines of MPOOL_THREADS already put off frees, per thread */
+  if ((flags & MPOOL_DEFERRED) && (flags & MPOOL_THREADS)) {
+    return NULL;
+  }
+
+  struct memory_pool *mp = (struct memory_pool*)calloc(1, sizeof(struct memory_pool));
+  struct pa_file *f = (struct pa_file*)calloc(1, sizeof(struct pa_file));
+
+  if (mp == NULL || f == NULL) { //check mem allocation
+    free(mp);
+    free(f);
+    return NULL;
+  }
+  mp->flags = flags;
+
+  if ((f->fd = open(path, O_RDWR | O_CREAT, 0644)) < 0 || !file_map(mp, f, size)) {
+    if (f->map != NULL) {
+      munmap(f->map, f->map_size);
+    }
+    if (f->fd >= 0) {
+      close(f->fd);
+    }
+    free(f);
+    free(mp);
+    return NULL;
+  }
+
+  /* from here on mpool_destroy writes the header back */
+  mp->file = f;
+  f->header->clean = 0;
+  msync(f->map, FILE_HEADER, MS_SYNC);
+
+  if (!pa_pool_options(mp)) {
+    mpool_destroy(mp);
+    return NULL;
+  }
+  return mp;
+}
+
+/* write the bins of a file-backed pool to its header and the whole file
+   to disk */
+/* blocks in MPOOL_THREADS magazines and MPOOL_DEFERRED queues count as
+   allocated until mpool_destroy; returns 0 if p is not a file-backed pool
+   or the file could not be written */
+int mpool_sync(struct memory_pool *p)
+{
+  struct pa_file *f = p->file;
+
+  if (f == NULL) {
+    return 0;
+  }
+
+  if (p->threads != NULL) {
+    pa_threads_lock(p);
+  }
+  file_save(p);
+  if (p->threads != NULL) {
+    pa_threads_unlock(p);
+  }
+  return msync(f->map, f->map_size, MS_SYNC) == 0;
+}
+
+/* called by mpool_destroy: give back cached and queued blocks, write the
+   header, and unmap and close the file */
+void pa_file_close(struct memory_pool *p)
+{
+  struct pa_file *f = p->file;
+
+  pa_threads_drain(p);
+  mpool_flush(p);
+
+  file_save(p);
+  f->header->clean = 1;
+  msync(f->map, f->map_size, MS_SYNC);
+  munmap(f->map, f->map_size);
+  close(f->fd);
+
+  free(f);
+  p->file = NULL;
+  p->start = NULL; //not from malloc
+}
+
+/* the block at offset off of p, NULL for offset 0 */
+void *mpool_ptr(struct memory_pool *p, size_t off)
+{
+  return (off != 0) ? p->start + off : NULL;
+}
+
+/* offset of the block at ptr in p, 0 for NULL */
+size_t mpool_off(struct memory_pool *p, void *ptr)
+{
+  return (ptr != NULL) ? (size_t) ((char *) ptr - p->start) : 0;
+}
+
+/* offset recorded with mpool_set_root, 0 if there is none or p is not a
+   file-backed pool */
+size_t mpool_root(struct memory_pool *p)
+{
+  return (p->file != NULL) ? p->file->header->root : 0;
+}
+
+/* record off (from mpool_off) in the header of a file-backed pool, so
+   the block can be found again after the file is reopened */
+void mpool_set_root(struct memory_pool *p, size_t off)
+{
+  if (p->file != NULL) {
+    p->file->header->root = off;
+  }
+}
@@ -0,0 +1,125 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "poolalloc.h"
+#include "poolalloc_int.h"
+
+/*
+   fixed-block lists: a set number of equal blocks, taken from a
+   memory_pool once, that any number of threads allocate and free without
+   a lock
+
+   The free blocks form a Treiber stack. Its head is one 64-bit word that
+   holds the index of the first free block in the low 32 bits and a tag
+   in the high 32 bits; every successful push or pop adds one to the tag.
+   A pop that read the head, was preempted while the block it saw was
+   popped, used and pushed back, and then finds the same index again still
+   fails its compare-and-swap, because the tag has moved on (the ABA
+   problem). That takes 2^32 other operations to defeat, instead of the
+   one a plain pointer would, and needs no 128-bit compare-and-swap.
+
+   The link to the next free block is kept in a separate array of 32-bit
+   indexes rather than in the block itself: a pop that lost the race may
+   still read the link of a block another thread now owns, and that must
+   not race with what the owner writes into it. The same array marks
+   allocated blocks with FIXED_USED, so freeing a block twice (or from two
+   threads at once) is caught by a compare-and-swap and ignored.
+
+   Blocks are aligned as mpool_alloc would align block_size bytes. The
+   list does not grow: mpool_fixed_alloc returns NULL when all blocks are
+   taken.
+*/
+
+#define FIXED_NIL UINT32_MAX          /* end of the free list */
+#define FIXED_USED (UINT32_MAX - 1)   /* link of an allocated block */
+
+static uint64_t fixed_head(uint64_t head, uint32_t index)
+{
+  return (((head >> 32) + 1) << 32) | index;
+}
+
+/* create a list of nblocks blocks of block_size bytes, taken from pool */
+/* returns NULL if memory could not be allocated, or nblocks is 0 or too large */
+struct mpool_fixed *mpool_fixed_create(struct memory_pool *pool, size_t block_size, size_t nblocks)
+{
+  if (block_size == 0 || nblocks == 0 || nblocks >= FIXED_USED) {
+    return NULL;
+  }
+
+  struct mpool_fixed *f = (struct mpool_fixed*)calloc(1, sizeof(struct mpool_fixed));
+  if (f == NULL) { //check mem allocation
+    return NULL;
+  }
+
+  size_t align = pa_alloc_align(block_size);
+  size_t stride = (block_size + align - 1) & ~(align - 1);
+
+  /* blocks first (mpool_alloc aligns the region for them), then the links */
+  if ((f->blocks = mpool_alloc(pool, nblocks * stride + nblocks * sizeof(uint32_t))) == NULL) {
+    free(f);
+    return NULL;
+  }
+
+  f->pool = pool;
+  f->block_size = block_size;
+  f->stride = stride;
+  f->nblocks = (uint32_t) nblocks;
+  f->next = (uint32_t *) (f->blocks + nblocks * stride);
+
+  size_t i;
+  for (i = 0; i < nblocks; i++) {
+    f->next[i] = (i + 1 < nblocks) ? (uint32_t) i + 1 : FIXED_NIL;
+  }
+  f->head = 0;  //tag 0, block 0
+  return f;
+}
+
+/* give the blocks back to the pool; no thread may still be using the list */
+void mpool_fixed_destroy(struct mpool_fixed *f)
+{
+  mpool_free(f->pool, f->blocks);
+  free(f);
+}
+
+/* allocate a block, NULL if all are taken */
+void *mpool_fixed_alloc(struct mpool_fixed *f)
+{
+  uint64_t head = __atomic_load_n(&f->head, __ATOMIC_ACQUIRE);
+  uint32_t i;
+
+  do {
+    i = (uint32_t) head;
+    if (i == FIXED_NIL) {
+      return NULL;
+    }
+    //if block i was taken meanwhile this link is stale, but then the tag changed and the swap fails
+  } while (!__atomic_compare_exchange_n(&f->head, &head, fixed_head(head, __atomic_load_n(&f->next[i], __ATOMIC_RELAXED)),
+                                        1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+  __atomic_store_n(&f->next[i], FIXED_USED, __ATOMIC_RELAXED);
+  return f->blocks + (size_t) i * f->stride;
+}
+
+/* free a block of the list; anything else (including a block that is
+   already free) is ignored */
+void mpool_fixed_free(struct mpool_fixed *f, void *addr)
+{
+  size_t offset = (char *) addr - f->blocks;
+  uint32_t used = FIXED_USED, i;
+  uint64_t head;
+
+  if ((char *) addr < f->blocks || offset >= (size_t) f->nblocks * f->stride || offset % f->stride != 0) {
+    return;
+  }
+  i = (uint32_t) (offset / f->stride);
+
+  /* only one free of an allocated block gets past this */
+  if (!__atomic_compare_exchange_n(&f->next[i], &used, FIXED_NIL, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    return;
+  }
+
+  head = __atomic_load_n(&f->head, __ATOMIC_RELAXED);
+  do {
+    __atomic_store_n(&f->next[i], (uint32_t) head, __ATOMIC_RELAXED);
+  } while (!__atomic_compare_exchange_n(&f->head, &head, fixed_head(head, i), 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,194 @@
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "poolalloc.h"
+#include "poolalloc_int.h"
+
+/*
+   mmap-backed and growable pools
+
+   Pools created with MPOOL_GROW, MPOOL_HUGEPAGE or MPOOL_HUGETLB get
+   their memory from mmap instead of malloc.
+
+   A MPOOL_GROW pool that runs out of memory maps another chunk and
+   allocates from it. Every chunk is a memory_pool of its own, in the same
+   mode, with its own free structures, so a chunk never has to know about
+   the others. Chunks are kept in the `grown` list of the first one,
+   newest first, and are only unmapped by mpool_destroy.
+
+   Chunk sizes follow the growth policy set with mpool_set_growth: the
+   first grown chunk is grow_size bytes, each next one grow_pct percent
+   of the one before (100 for chunks of a fixed size), and all chunks
+   together stay below grow_limit bytes. A chunk is always made large
+   enough for the allocation that needed it.
+
+   MPOOL_HUGEPAGE rounds mappings to 2 MiB, aligns them to 2 MiB and asks
+   for transparent huge pages with madvise(MADV_HUGEPAGE). MPOOL_HUGETLB
+   first tries MAP_HUGETLB, which needs huge pages reserved by the
+   administrator, and falls back to MPOOL_HUGEPAGE behaviour.
+*/
+
+#define HUGE_SIZE ((size_t) 2 << 20)
+
+static size_t round_up(size_t n, size_t align)
+{
+  return (n + align - 1) & ~(align - 1);
+}
+
+/* map `size` bytes (rounded up) for p->start */
+/* returns 0 if no memory could be mapped */
+int pa_grow_map(struct memory_pool *p, size_t size)
+{
+  int huge = p->flags & (MPOOL_HUGEPAGE | MPOOL_HUGETLB);
+  size_t align = huge ? HUGE_SIZE : (size_t) sysconf(_SC_PAGESIZE);
+  char *start;
+
+  size = round_up(size ? size : 1, align);
+  if (size == 0) { //overflow
+    return 0;
+  }
+
+#ifdef MAP_HUGETLB
+  if (p->flags & MPOOL_HUGETLB) {
+    start = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (start != MAP_FAILED) {
+      p->start = start;
+      p->size = p->map_size = size;
+      return 1;
+    }
+  }
+#endif
+
+  //over-map by one huge page so that the pool can start on a huge page boundary
+  size_t extra = huge ? HUGE_SIZE : 0;
+
+  start = mmap(NULL, size + extra, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (start == MAP_FAILED) {
+    return 0;
+  }
+
+  if (extra > 0) {
+    char *aligned = (char *) round_up((uintptr_t) start, HUGE_SIZE);
+
+    if (aligned > start) {
+      munmap(start, aligned - start);
+    }
+    if (start + extra > aligned) {
+      munmap(aligned + size, start + extra - aligned);
+    }
+    start = aligned;
+#ifdef MADV_HUGEPAGE
+    madvise(start, size, MADV_HUGEPAGE); //only a hint, the pool works without it
+#endif
+  }
+
+  p->start = start;
+  p->size = p->map_size = size;
+  return 1;
+}
+
+void pa_grow_unmap(struct memory_pool *p)
+{
+  munmap(p->start, p->map_size);
+}
+
+/* set how a MPOOL_GROW pool grows */
+
+/* chunk_size is the size of the next chunk (0 keeps the current one),
+   each chunk after it is growth_pct percent of the one before (at least
+   100) and all chunks together, including the first, never take more
+   than limit bytes (0 for no limit) */
+
+/* returns 0 if p is not a MPOOL_GROW pool */
+int mpool_set_growth(struct memory_pool *p, size_t chunk_size, unsigned int growth_pct, size_t limit)
+{
+  if (!(p->flags & MPOOL_GROW)) {
+    return 0;
+  }
+
+  if (chunk_size > 0) {
+    p->grow_size = chunk_size;
+  }
+  p->grow_pct = (growth_pct < 100) ? 100 : growth_pct;
+  p->grow_limit = limit;
+  return 1;
+}
+
+/* map a new chunk that can hold an allocation of `size` bytes and put it first in p->grown */
+static struct memory_pool *grow_chunk(struct memory_pool *p, size_t size)
+{
+  /* a buddy chunk needs a power of two at least as large as the request,
+     the other modes a little room for their own tags */
+  size_t min = ((p->flags & MPOOL_MODE_MASK) == MPOOL_BUDDY) ? 2 * size : size + 4096;
+  size_t want = (p->grow_size > min) ? p->grow_size : min;
+
+  if (min < size) { //overflow
+    return NULL;
+  }
+  if (p->grow_limit > 0) {
+    if (p->grow_total >= p->grow_limit || p->grow_limit - p->grow_total < min) {
+      return NULL;
+    }
+    if (want > p->grow_limit - p->grow_total) {
+      want = p->grow_limit - p->grow_total;
+    }
+  }
+
+  struct memory_pool *c = (struct memory_pool*)calloc(1, sizeof(struct memory_pool));
+  if (c == NULL) { //check mem allocation
+    return NULL;
+  }
+
+  c->flags = p->flags & (MPOOL_MODE_MASK | MPOOL_HUGEPAGE | MPOOL_HUGETLB);
+  if (!pa_grow_map(c, want) || !pa_pool_init(c)) {
+    mpool_destroy(c);
+    return NULL;
+  }
+
+  //mapping rounds up, which may pass the limit by less than a page
+  p->grow_total += c->size;
+  if (p->grow_size <= ((size_t) -1) / p->grow_pct) {
+    p->grow_size = p->grow_size * p->grow_pct / 100;
+  }
+
+  /* other threads may walk p->grown without the MPOOL_THREADS lock (see
+     pa_grow_owner), so the chunk is complete before it is published */
+  c->grown = p->grown;
+  __atomic_store_n(&p->grown, c, __ATOMIC_RELEASE);
+  return c;
+}
+
+/* allocate from the grown chunks of p, mapping a new one if none has room */
+/* p itself has already been tried */
+void *pa_grow_alloc(struct memory_pool *p, size_t size, size_t align)
+{
+  struct memory_pool *c;
+  void *addr;
+
+  for (c = p->grown; c != NULL; c = c->grown) {
+    if ((addr = pa_pool_alloc(c, size, align)) != NULL) {
+      return addr;
+    }
+  }
+
+  //room for the block wherever the alignment puts it
+  if (size + align < size || (c = grow_chunk(p, size + align)) == NULL) {
+    return NULL;
+  }
+  return pa_pool_alloc(c, size, align);
+}
+
+/* the grown chunk of p that holds addr, NULL if there is none */
+struct memory_pool *pa_grow_owner(struct memory_pool *p, void *addr)
+{
+  struct memory_pool *c;
+
+  for (c = __atomic_load_n(&p->grown, __ATOMIC_ACQUIRE); c != NULL; c = __atomic_load_n(&c->grown, __ATOMIC_ACQUIRE)) {
+    if ((char *) addr >= c->start && (char *) addr < c->start + c->size) {
+      return c;
+    }
+  }
+  return NULL;
+}
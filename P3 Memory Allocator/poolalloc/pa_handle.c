@@ -0,0 +1,275 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "poolalloc.h"
+#include "poolalloc_int.h"
+
+/*
+   handles: blocks that may move, so that free space can be slid together
+
+   A pool whose free space is scattered over many small blocks fails
+   allocations it has room for. Blocks the program only reaches through a
+   handle (a 32-bit index into a table holding the block's offset) can be
+   moved, and then the holes between them can be closed up.
+
+   The heap is one block of the pool, taken when the handles are created.
+   Every block in it starts with a struct hblock header naming its handle
+   (0 while free), and blocks follow each other without gaps, so the heap
+   can be walked from offset 0 to top. mpool_halloc takes the space above
+   top; mpool_hfree only clears the header's handle, and lowers top when
+   the block was the last one.
+
+   Compaction is one pass over the heap that slides every block down to
+   `dest`, the end of the blocks already compacted. The pass keeps its
+   place in `scan` and `dest`, so it can stop after any block and go on
+   with the next call: mpool_hcompact stops at the first block after it
+   has done `budget` bytes of work (bytes moved plus a header for every
+   block looked at), so a call does no more than the budget plus one
+   block. Between calls, [dest, scan) is free, and mpool_halloc puts
+   blocks there before it goes above top. When the pass reaches top, top
+   drops to dest.
+
+   mpool_pin returns the address of a block and keeps it where it is until
+   the matching mpool_unpin; the address is only valid while the block is
+   pinned. The pass does not move a pinned block, but leaves a free block
+   in front of it and goes on behind it.
+
+   When there is no room for a block, mpool_halloc compacts up to the
+   budget given to mpool_handles_create before it gives up. Handles are
+   not thread-safe; a handle that was freed may be handed out again.
+*/
+
+#define HANDLE_ALIGN 16
+#define HANDLE_USED UINT32_MAX      /* link of an entry that is in use */
+
+struct hblock {
+  uint32_t handle;                  /* 0 while the block is free */
+  uint32_t unused;
+  size_t size;                      /* bytes in the block, header included */
+};
+
+#define HEADER ((sizeof(struct hblock) + HANDLE_ALIGN - 1) & ~((size_t) HANDLE_ALIGN - 1))
+
+struct pa_handle_entry {
+  size_t offset;                    /* of the block's header in the heap */
+  uint32_t pins;
+  uint32_t next;                    /* next unused entry, HANDLE_USED while in use */
+};
+
+static struct hblock *block_at(struct mpool_handles *h, size_t offset)
+{
+  return (struct hblock *) (h->heap + offset);
+}
+
+/* the entry of handle, NULL if it is not in use */
+static struct pa_handle_entry *entry_of(struct mpool_handles *h, uint32_t handle)
+{
+  return (handle != 0 && handle < h->nhandles && h->table[handle].next == HANDLE_USED) ? &h->table[handle] : NULL;
+}
+
+/* take an unused entry, doubling the table when there is none */
+/* returns 0 if memory could not be allocated */
+static uint32_t take_handle(struct mpool_handles *h)
+{
+  uint32_t i;
+
+  if (h->free_handle == 0) {
+    uint32_t n = h->nhandles ? 2 * h->nhandles : 64;
+    struct pa_handle_entry *t;
+
+    if (n <= h->nhandles || n == HANDLE_USED) {
+      return 0;
+    }
+    t = (struct pa_handle_entry*)realloc(h->table, n * sizeof(struct pa_handle_entry));
+    if (t == NULL) { //check mem allocation
+      return 0;
+    }
+    for (i = (h->nhandles ? h->nhandles : 1); i < n; i++) {
+      t[i].next = (i + 1 < n) ? i + 1 : 0;
+    }
+    h->free_handle = h->nhandles ? h->nhandles : 1;
+    h->table = t;
+    h->nhandles = n;
+  }
+
+  i = h->free_handle;
+  h->free_handle = h->table[i].next;
+  h->table[i].next = HANDLE_USED;
+  h->table[i].pins = 0;
+  return i;
+}
+
+/* one step of the compaction pass, at most budget bytes of work (0 for
+   the rest of the pass) */
+/* returns 1 if the pass is done */
+static int compact(struct mpool_handles *h, size_t budget)
+{
+  size_t work = 0;
+
+  while (h->scan < h->top) {
+    struct hblock *b = block_at(h, h->scan);
+    size_t size = b->size;
+
+    if (budget != 0 && work >= budget) {
+      return 0;
+    }
+    work += HEADER;
+
+    if (b->handle == 0) {
+      h->scan += size;
+    } else if (h->table[b->handle].pins > 0) { //stays, the hole in front of it becomes a free block
+      if (h->dest < h->scan) {
+        block_at(h, h->dest)->handle = 0;
+        block_at(h, h->dest)->size = h->scan - h->dest;
+      }
+      h->dest = h->scan = h->scan + size;
+    } else {
+      if (h->dest < h->scan) {
+        h->table[b->handle].offset = h->dest;
+        memmove(h->heap + h->dest, b, size);
+        work += size;
+      }
+      h->dest += size;
+      h->scan += size;
+    }
+  }
+
+  h->top = h->dest;
+  h->scan = h->dest = 0;
+  return 1;
+}
+
+/* create a heap of size bytes, taken from pool, for blocks reached
+   through handles; mpool_halloc does at most budget bytes of compaction
+   work per call (0 for no limit) */
+/* returns NULL if memory could not be allocated or size is too small */
+struct mpool_handles *mpool_handles_create(struct memory_pool *pool, size_t size, size_t budget)
+{
+  size = size & ~((size_t) HANDLE_ALIGN - 1);
+  if (size <= HEADER) {
+    return NULL;
+  }
+
+  struct mpool_handles *h = (struct mpool_handles*)calloc(1, sizeof(struct mpool_handles));
+  if (h == NULL) { //check mem allocation
+    return NULL;
+  }
+
+  if ((h->heap = mpool_alloc_aligned(pool, size, HANDLE_ALIGN)) == NULL) {
+    free(h);
+    return NULL;
+  }
+  h->pool = pool;
+  h->size = size;
+  h->budget = budget;
+  return h;
+}
+
+/* give the heap back to the pool; every handle becomes invalid */
+void mpool_handles_destroy(struct mpool_handles *h)
+{
+  mpool_free(h->pool, h->heap);
+  free(h->table);
+  free(h);
+}
+
+/* allocate a block of size bytes */
+/* returns its handle, 0 if there is no room even after compacting as
+   much as the budget allows */
+uint32_t mpool_halloc(struct mpool_handles *h, size_t size)
+{
+  size_t need = HEADER + ((size + HANDLE_ALIGN - 1) & ~((size_t) HANDLE_ALIGN - 1));
+  size_t offset;
+  uint32_t handle;
+
+  if (size == 0 || need < size || need > h->size - h->live) {
+    return 0;
+  }
+
+  /* the hole of an unfinished pass, then the top, then compact and try both again */
+  if (need > h->scan - h->dest && need > h->size - h->top) {
+    compact(h, h->budget);
+    if (need > h->scan - h->dest && need > h->size - h->top) {
+      return 0;
+    }
+  }
+  if ((handle = take_handle(h)) == 0) {
+    return 0;
+  }
+
+  if (need <= h->scan - h->dest) {
+    offset = h->dest;
+    h->dest += need;
+  } else {
+    offset = h->top;
+    h->top += need;
+  }
+  block_at(h, offset)->handle = handle;
+  block_at(h, offset)->size = need;
+  h->table[handle].offset = offset;
+  h->live += need;
+  return handle;
+}
+
+/* free the block of handle, pinned or not; a handle that is not in use is ignored */
+void mpool_hfree(struct mpool_handles *h, uint32_t handle)
+{
+  struct pa_handle_entry *e = entry_of(h, handle);
+
+  if (e == NULL) {
+    return;
+  }
+
+  struct hblock *b = block_at(h, e->offset);
+
+  b->handle = 0;
+  h->live -= b->size;
+  if (e->offset + b->size == h->top && e->offset >= h->dest) { //the last block, and not part of a pass
+    h->top = e->offset;
+    h->scan = (h->scan < h->top) ? h->scan : h->top;
+  }
+
+  e->next = h->free_handle;
+  h->free_handle = handle;
+}
+
+/* address of the block of handle, which stays there until mpool_unpin;
+   pins nest */
+/* returns NULL if handle is not in use */
+void *mpool_pin(struct mpool_handles *h, uint32_t handle)
+{
+  struct pa_handle_entry *e = entry_of(h, handle);
+
+  if (e == NULL) {
+    return NULL;
+  }
+  e->pins++;
+  return h->heap + e->offset + HEADER;
+}
+
+/* undo one mpool_pin; the block may move again once all are undone */
+void mpool_unpin(struct mpool_handles *h, uint32_t handle)
+{
+  struct pa_handle_entry *e = entry_of(h, handle);
+
+  if (e != NULL && e->pins > 0) {
+    e->pins--;
+  }
+}
+
+/* usable bytes of the block of handle, 0 if handle is not in use */
+size_t mpool_hsize(struct mpool_handles *h, uint32_t handle)
+{
+  struct pa_handle_entry *e = entry_of(h, handle);
+
+  return (e != NULL) ? block_at(h, e->offset)->size - HEADER : 0;
+}
+
+/* go on with the compaction pass for at most budget bytes of work (0 to
+   finish it) */
+/* returns 1 if the pass is done and the free space is in one piece above
+   top (apart from holes in front of pinned blocks), 0 if more is left */
+int mpool_hcompact(struct mpool_handles *h, size_t budget)
+{
+  return compact(h, budget);
+}
@@ -0,0 +1,136 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "pa_map.h"
+
+/*
+   address maps: open-addressing hash tables keyed by an address (or
+   anything else that fits a uintptr_t and is never 0)
+
+   Slab caches find the slab of an object by its granule, the heap
+   profiler finds the sample of a block, and the trace recorder in
+   bench/ finds the id of a block; all three keep their entries in one of
+   these. An entry is a struct of the user's own that starts with a
+   uintptr_t key, 0 in an empty slot; the map only knows its size.
+
+   Lookups probe linearly from the key's hash. The table doubles once it
+   is half full, and removal shifts the rest of the run back into the
+   hole instead of leaving a tombstone, so lookups never slow down with
+   churn. Entries move when the table grows or an entry is removed, so a
+   pointer returned by the map is only good until the next change.
+*/
+
+#define MAP_MIN_CAP 16
+
+static size_t map_hash(uintptr_t key, size_t cap)
+{
+  return ((key * 0x9e3779b97f4a7c15ULL) >> 32) & (cap - 1);
+}
+
+static uintptr_t *map_slot(struct pa_map *m, size_t i)
+{
+  return (uintptr_t *) ((char *) m->slots + i * m->entry_size);
+}
+
+/* an empty map of entries of entry_size bytes; nothing is allocated
+   until the first pa_map_add */
+void pa_map_init(struct pa_map *m, size_t entry_size)
+{
+  m->slots = NULL;
+  m->entry_size = entry_size;
+  m->cap = 0;
+  m->used = 0;
+}
+
+void pa_map_free(struct pa_map *m)
+{
+  free(m->slots);
+  pa_map_init(m, m->entry_size);
+}
+
+/* the entry of key, NULL if there is none */
+void *pa_map_find(struct pa_map *m, uintptr_t key)
+{
+  size_t i;
+
+  if (m->cap == 0) {
+    return NULL;
+  }
+  for (i = map_hash(key, m->cap); *map_slot(m, i) != 0; i = (i + 1) & (m->cap - 1)) {
+    if (*map_slot(m, i) == key) {
+      return map_slot(m, i);
+    }
+  }
+  return NULL;
+}
+
+static int map_grow(struct pa_map *m)
+{
+  size_t cap = m->cap ? 2 * m->cap : MAP_MIN_CAP, i, j;
+  struct pa_map old = *m;
+
+  m->slots = calloc(cap, m->entry_size);
+  if (m->slots == NULL) { //check mem allocation
+    m->slots = old.slots;
+    return 0;
+  }
+  m->cap = cap;
+
+  for (i = 0; i < old.cap; i++) {
+    uintptr_t key = *map_slot(&old, i);
+
+    if (key != 0) {
+      for (j = map_hash(key, cap); *map_slot(m, j) != 0; j = (j + 1) & (cap - 1));
+      memcpy(map_slot(m, j), map_slot(&old, i), m->entry_size);
+    }
+  }
+
+  free(old.slots);
+  return 1;
+}
+
+/* the entry of key, a new one (zeroed but for its key) if there is none */
+/* returns NULL if memory could not be allocated */
+void *pa_map_add(struct pa_map *m, uintptr_t key)
+{
+  uintptr_t *e = pa_map_find(m, key);
+  size_t i;
+
+  if (e != NULL) {
+    return e;
+  }
+  if (2 * (m->used + 1) > m->cap && !map_grow(m)) {
+    return NULL;
+  }
+
+  for (i = map_hash(key, m->cap); *map_slot(m, i) != 0; i = (i + 1) & (m->cap - 1));
+  e = map_slot(m, i);
+  memset(e, 0, m->entry_size);
+  *e = key;
+  m->used++;
+  return e;
+}
+
+/* take entry e (returned by pa_map_find or pa_map_add) out of the map */
+void pa_map_remove(struct pa_map *m, void *e)
+{
+  size_t i = ((char *) e - (char *) m->slots) / m->entry_size, j, k;
+
+  //backward-shift deletion keeps every probe sequence unbroken
+  m->used--;
+  for (j = (i + 1) & (m->cap - 1); *map_slot(m, j) != 0; j = (j + 1) & (m->cap - 1)) {
+    k = map_hash(*map_slot(m, j), m->cap);
+    if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+      memcpy(map_slot(m, i), map_slot(m, j), m->entry_size);
+      i = j;
+    }
+  }
+  *map_slot(m, i) = 0;
+}
+
+/* entry i of the table (0 <= i < m->cap), to walk every entry; its key
+   is 0 if the slot is empty */
+void *pa_map_slot(struct pa_map *m, size_t i)
+{
+  return map_slot(m, i);
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/* address maps: open-addressing hash tables keyed by address (pa_map.c) */
+/* used by slab caches, the heap profiler and bench's trace recorder;
+   entries are the caller's own structs and start with a uintptr_t key,
+   0 when the slot is empty */
+
+struct pa_map {
+  void *slots;                /* cap entries of entry_size bytes */
+  size_t entry_size;
+  size_t cap;                 /* a power of two, 0 before the first entry */
+  size_t used;                /* entries in the table */
+};
+
+void pa_map_init(struct pa_map *m, size_t entry_size);
+void pa_map_free(struct pa_map *m);
+void *pa_map_find(struct pa_map *m, uintptr_t key);
+void *pa_map_add(struct pa_map *m, uintptr_t key);
+void pa_map_remove(struct pa_map *m, void *e);
+void *pa_map_slot(struct pa_map *m, size_t i);
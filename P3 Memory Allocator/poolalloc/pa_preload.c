@@ -0,0 +1,266 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include "poolalloc.h"
+#include "poolalloc_int.h"
+
+/*
+   libpoolalloc.so: malloc and friends on a memory_pool, for LD_PRELOAD
+
+     LD_PRELOAD=./libpoolalloc.so program
+
+   The loader splits LD_PRELOAD at spaces and colons, and does not honour
+   quotes, so the library has to be given by a path without them. The
+   path of this tree has spaces; `make check-preload` copies the library
+   to a temporary directory and runs pa_test_preload against it there.
+
+   Every process gets one pool, created on the first call, in
+   MPOOL_TAGS | MPOOL_GROW | MPOOL_THREADS mode (MPOOL_BUDDY instead if
+   POOLALLOC_MODE=buddy) that starts at POOLALLOC_SIZE bytes (64 MiB by
+   default; it is mapped, so pages are only used once touched).
+
+   The pool keeps some of its own bookkeeping (the memory_pool structs
+   of grown chunks, per-thread magazines, dbll lists) in memory from
+   malloc. While a thread is inside the pool, and before the pool exists,
+   its calls go to the C library's own allocator (__libc_malloc and
+   friends) instead, and so do allocations the pool cannot serve
+   (alignments above MPOOL_MAX_ALIGN, or a pool that cannot grow any
+   more). free and realloc tell the two apart by whether the address
+   lies in one of the pool's chunks.
+
+   The pool lock (and the profiler's, when POOLALLOC_PROFILE is set) is
+   taken around fork, so the child does not inherit it held by a thread
+   that no longer exists.
+
+   POOLALLOC_PROFILE=<bytes> samples an allocation every that many bytes
+   on average (see pa_profile.c); SIGUSR2 then writes the folded stacks
+   of the memory in use to POOLALLOC_PROFILE_OUT (poolalloc.folded in the
+   current directory by default), or a pprof heap profile if the name
+   ends in .heap.
+*/
+
+#define PRELOAD_SIZE ((size_t) 64 << 20)
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t align, size_t size);
+extern void __libc_free(void *ptr);
+
+static struct memory_pool *pool;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static __thread int in_pool;  /* the calling thread is inside the pool (or creating it) */
+
+static void fork_prepare(void)
+{
+  pa_profile_lock(pool);
+  pa_threads_lock(pool);
+}
+
+static void fork_release(void)
+{
+  pa_threads_unlock(pool);
+  pa_profile_unlock(pool);
+}
+
+static void preload_init(void)
+{
+  const char *size = getenv("POOLALLOC_SIZE");
+  const char *mode = getenv("POOLALLOC_MODE");
+  int flags = MPOOL_GROW | MPOOL_THREADS;
+
+  flags |= (mode != NULL && strcmp(mode, "buddy") == 0) ? MPOOL_BUDDY : MPOOL_TAGS;
+
+  in_pool = 1;
+  struct memory_pool *p = mpool_create_flags((size != NULL && atol(size) > 0) ? (size_t) atol(size) : PRELOAD_SIZE, flags);
+  const char *profile = getenv("POOLALLOC_PROFILE");
+
+  if (p != NULL && profile != NULL && atol(profile) > 0 && mpool_set_profile(p, (size_t) atol(profile))) {
+    const char *out = getenv("POOLALLOC_PROFILE_OUT");
+    size_t len;
+
+    out = (out != NULL) ? out : "poolalloc.folded";
+    len = strlen(out);
+    mpool_profile_signal(p, SIGUSR2, out, (len > 5 && strcmp(out + len - 5, ".heap") == 0) ? MPOOL_PROFILE_PPROF : MPOOL_PROFILE_FOLDED);
+  }
+  if (p != NULL) {
+    __atomic_store_n(&pool, p, __ATOMIC_RELEASE);
+    pthread_atfork(fork_prepare, fork_release, fork_release);
+  }
+  in_pool = 0;
+}
+
+/* the pool, NULL if this call has to use the C library */
+static struct memory_pool *preload_pool(void)
+{
+  if (in_pool) {
+    return NULL;
+  }
+  pthread_once(&pool_once, preload_init);
+  return pool;
+}
+
+/* is addr a block of the pool? */
+static int preload_owns(void *addr)
+{
+  struct memory_pool *p = __atomic_load_n(&pool, __ATOMIC_ACQUIRE);
+
+  if (p == NULL || addr == NULL) {
+    return 0;
+  }
+  return ((char *) addr >= p->start && (char *) addr < p->start + p->size) || pa_grow_owner(p, addr) != NULL;
+}
+
+void *malloc(size_t size)
+{
+  struct memory_pool *p = preload_pool();
+  void *addr;
+
+  if (p == NULL) {
+    return __libc_malloc(size);
+  }
+
+  in_pool = 1;
+  addr = mpool_alloc(p, size ? size : 1);
+  in_pool = 0;
+
+  return (addr != NULL) ? addr : __libc_malloc(size);
+}
+
+void free(void *ptr)
+{
+  if (ptr == NULL) {
+    return;
+  }
+  if (in_pool || !preload_owns(ptr)) {
+    __libc_free(ptr);
+    return;
+  }
+
+  in_pool = 1;
+  mpool_free(pool, ptr);
+  in_pool = 0;
+}
+
+void *calloc(size_t n, size_t size)
+{
+  struct memory_pool *p = preload_pool();
+  size_t total = n * size;
+  void *addr;
+
+  if (size != 0 && total / size != n) { //overflow
+    errno = ENOMEM;
+    return NULL;
+  }
+  if (p == NULL) {
+    return __libc_calloc(n, size);
+  }
+
+  in_pool = 1;
+  addr = mpool_calloc(p, 1, total ? total : 1);
+  in_pool = 0;
+
+  return (addr != NULL) ? addr : __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+  void *addr;
+
+  if (ptr == NULL) {
+    return malloc(size);
+  }
+  if (in_pool || !preload_owns(ptr)) {
+    return __libc_realloc(ptr, size);
+  }
+  if (size == 0) {
+    free(ptr);
+    return NULL;
+  }
+
+  in_pool = 1;
+  addr = mpool_realloc(pool, ptr, size);
+  in_pool = 0;
+
+  if (addr == NULL && (addr = __libc_malloc(size)) != NULL) { //the pool is full, move the block out of it
+    size_t usable = pa_threads_usable(pool, ptr);
+
+    memcpy(addr, ptr, (usable < size) ? usable : size);
+    free(ptr);
+  }
+  return addr;
+}
+
+/* alignments up to MPOOL_MAX_ALIGN come from the pool, larger ones from the C library */
+static void *preload_memalign(size_t align, size_t size)
+{
+  struct memory_pool *p = preload_pool();
+  void *addr;
+
+  if (p == NULL || align > MPOOL_MAX_ALIGN || (align & (align - 1)) != 0) {
+    return __libc_memalign(align, size);
+  }
+
+  in_pool = 1;
+  addr = mpool_alloc_aligned(p, size ? size : 1, align);
+  in_pool = 0;
+
+  return (addr != NULL) ? addr : __libc_memalign(align, size);
+}
+
+int posix_memalign(void **memptr, size_t align, size_t size)
+{
+  void *addr;
+
+  if (align < sizeof(void *) || (align & (align - 1)) != 0) {
+    return EINVAL;
+  }
+  if ((addr = preload_memalign(align, size)) == NULL) {
+    return ENOMEM;
+  }
+  *memptr = addr;
+  return 0;
+}
+
+void *memalign(size_t align, size_t size)
+{
+  return preload_memalign(align, size);
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+  return preload_memalign(align, size);
+}
+
+void *valloc(size_t size)
+{
+  return preload_memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+void *pvalloc(size_t size)
+{
+  size_t page = sysconf(_SC_PAGESIZE);
+
+  return preload_memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+size_t malloc_usable_size(void *ptr)
+{
+  static size_t (*libc_usable)(void *);
+
+  if (preload_owns(ptr)) {
+    return pa_threads_usable(pool, ptr);
+  }
+  if (libc_usable == NULL) {
+    in_pool = 1; //dlsym may allocate
+    libc_usable = (size_t (*)(void *)) dlsym(RTLD_NEXT, "malloc_usable_size");
+    in_pool = 0;
+  }
+  return (ptr != NULL && libc_usable != NULL) ? libc_usable(ptr) : 0;
+}
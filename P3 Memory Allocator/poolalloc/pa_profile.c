@@ -0,0 +1,503 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <signal.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include "poolalloc.h"
+#include "poolalloc_int.h"
+
+/*
+   sampling heap profiler: which call sites hold the pool's memory
+
+   Tracing every allocation costs too much to leave on, so the profiler
+   samples. As in tcmalloc, it picks the byte to sample next at an
+   exponentially distributed distance (mean `rate`) from the last one,
+   and samples the allocation that covers it. An allocation of s bytes is
+   then sampled with probability 1 - exp(-s / rate), so counting every
+   sample as 1 / (1 - exp(-s / rate)) allocations (and that many times s
+   bytes) estimates the true totals without bias, for small and large
+   blocks alike. Between samples, mpool_alloc only subtracts the size
+   from a countdown.
+
+   A sample records the backtrace above mpool_alloc, mpool_alloc_aligned
+   or mpool_calloc (at most PROFILE_DEPTH frames). Samples with the same
+   backtrace add up in one call site. The sampled blocks themselves are
+   kept in an address map (pa_map.c), so that freeing one takes its
+   estimate off the site's in-use totals; a filter with one bit per
+   address hash lets mpool_free pass over blocks that were not sampled
+   without taking the profiler's lock. mpool_realloc counts a block that
+   moves as freed and allocated again; one resized in place keeps the
+   size it was sampled at. mpool_release_to and mpool_reset do not take
+   samples off.
+
+   mpool_profile_dump writes the sites with blocks in use as folded
+   stacks (one line per site, outermost frame first, then the bytes in
+   use; the input of flamegraph.pl) or all sites in the text heap profile
+   format of gperftools, which pprof reads. Frames are named with dladdr,
+   so only exported functions get names in folded stacks (link with
+   -rdynamic); pprof symbolizes addresses itself from the mappings at the
+   end of the profile.
+
+   A signal handler cannot safely write a file, so mpool_profile_signal
+   only has the handler set a flag, and the pool writes the profile on
+   its next allocation.
+*/
+
+#define PROFILE_DEPTH 32
+#define PROFILE_SKIP 3                /* frames of sample, pa_profile_alloc and mpool_alloc */
+#define PROFILE_FILTER_BITS 4096
+
+struct pa_site {
+  uint64_t hash;
+  int depth;
+  void *frames[PROFILE_DEPTH];        /* innermost first */
+  double alloc_count;                 /* estimated allocations, all time */
+  double alloc_bytes;
+  double inuse_count;                 /* estimated allocations not freed yet */
+  double inuse_bytes;
+};
+
+struct pa_sample {
+  uintptr_t addr;                     /* the key, 0 for an empty entry */
+  uint32_t site;
+  double count;                       /* what this sample stands for */
+  double bytes;
+};
+
+struct pa_profile {
+  int64_t left;                       /* bytes until the next sample */
+  size_t rate;
+  uint64_t rng;
+  pthread_mutex_t lock;               /* everything below */
+  struct pa_site *sites;
+  uint32_t nsites;
+  uint32_t sites_cap;
+  uint32_t *site_map;                 /* hash table of site index + 1, 0 for empty */
+  size_t site_map_cap;
+  struct pa_map samples;              /* address -> struct pa_sample */
+  size_t removed;                     /* samples removed since the filter was rebuilt */
+  uint64_t filter[PROFILE_FILTER_BITS / 64]; /* bit set for the hash of every sampled address */
+};
+
+/* the pool mpool_profile_signal dumps, and where to */
+static struct memory_pool *signal_pool;
+static char *signal_path;
+static int signal_format;
+static volatile sig_atomic_t signal_pending;
+
+static uint64_t addr_hash(void *addr)
+{
+  return ((uint64_t) (uintptr_t) addr * 0x9e3779b97f4a7c15ULL) >> 16;
+}
+
+static uint64_t frames_hash(void **frames, int depth)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  int i;
+
+  for (i = 0; i < depth; i++) {
+    h = (h ^ (uint64_t) (uintptr_t) frames[i]) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
+/* distance in bytes to the next sampled byte, exponential with mean rate */
+static int64_t next_sample(struct pa_profile *pf)
+{
+  pf->rng ^= pf->rng >> 12;
+  pf->rng ^= pf->rng << 25;
+  pf->rng ^= pf->rng >> 27;
+
+  double u = ((pf->rng * 0x2545f4914f6cdd1dULL) >> 11) * (1.0 / 9007199254740992.0); /* [0, 1) */
+
+  return (int64_t) (-log(1.0 - u) * pf->rate) + 1;
+}
+
+/* ---- call sites ---- */
+
+/* the site of a backtrace, added if it is new */
+/* returns UINT32_MAX if memory could not be allocated */
+static uint32_t site_of(struct pa_profile *pf, void **frames, int depth)
+{
+  uint64_t hash = frames_hash(frames, depth);
+  size_t i, mask;
+
+  if (2 * (pf->nsites + 1) > pf->site_map_cap) { //keep the map at most half full
+    size_t cap = pf->site_map_cap ? 2 * pf->site_map_cap : 64;
+    uint32_t *map = (uint32_t*)calloc(cap, sizeof(uint32_t));
+    uint32_t k;
+
+    if (map == NULL) { //check mem allocation
+      return UINT32_MAX;
+    }
+    for (k = 0; k < pf->nsites; k++) {
+      for (i = pf->sites[k].hash & (cap - 1); map[i] != 0; i = (i + 1) & (cap - 1));
+      map[i] = k + 1;
+    }
+    free(pf->site_map);
+    pf->site_map = map;
+    pf->site_map_cap = cap;
+  }
+
+  mask = pf->site_map_cap - 1;
+  for (i = hash & mask; pf->site_map[i] != 0; i = (i + 1) & mask) {
+    struct pa_site *s = &pf->sites[pf->site_map[i] - 1];
+
+    if (s->hash == hash && s->depth == depth && memcmp(s->frames, frames, depth * sizeof(void *)) == 0) {
+      return pf->site_map[i] - 1;
+    }
+  }
+
+  if (pf->nsites == pf->sites_cap) {
+    uint32_t cap = pf->sites_cap ? 2 * pf->sites_cap : 32;
+    struct pa_site *sites = (struct pa_site*)realloc(pf->sites, cap * sizeof(struct pa_site));
+
+    if (sites == NULL) { //check mem allocation
+      return UINT32_MAX;
+    }
+    pf->sites = sites;
+    pf->sites_cap = cap;
+  }
+
+  struct pa_site *s = &pf->sites[pf->nsites];
+
+  memset(s, 0, sizeof(*s));
+  s->hash = hash;
+  s->depth = depth;
+  memcpy(s->frames, frames, depth * sizeof(void *));
+  pf->site_map[i] = pf->nsites + 1;
+  return pf->nsites++;
+}
+
+/* ---- sampled blocks ---- */
+
+/* set the filter to the bits of the samples there are now; a word only
+   ever gains the bits of live samples, so a concurrent mpool_free still
+   finds every one of them */
+static void filter_rebuild(struct pa_profile *pf)
+{
+  uint64_t filter[PROFILE_FILTER_BITS / 64];
+  size_t i;
+
+  memset(filter, 0, sizeof(filter));
+  for (i = 0; i < pf->samples.cap; i++) {
+    struct pa_sample *e = pa_map_slot(&pf->samples, i);
+
+    if (e->addr != 0) {
+      uint64_t b = addr_hash((void *) e->addr) % PROFILE_FILTER_BITS;
+      filter[b / 64] |= 1ULL << (b % 64);
+    }
+  }
+  for (i = 0; i < PROFILE_FILTER_BITS / 64; i++) {
+    __atomic_store_n(&pf->filter[i], filter[i], __ATOMIC_RELAXED);
+  }
+  pf->removed = 0;
+}
+
+/* take the sample at e out of the table and off its site */
+static void sample_remove(struct pa_profile *pf, struct pa_sample *e)
+{
+  pf->sites[e->site].inuse_count -= e->count;
+  pf->sites[e->site].inuse_bytes -= e->bytes;
+  pa_map_remove(&pf->samples, e);
+  pf->removed++;
+
+  if (pf->removed > pf->samples.used) { //rebuild after as many removals as there are samples
+    filter_rebuild(pf);
+  }
+}
+
+/* returns 0 if memory could not be allocated */
+static int sample_add(struct pa_profile *pf, void *addr, uint32_t site, double count, double bytes)
+{
+  struct pa_sample *e;
+
+  if ((e = pa_map_find(&pf->samples, (uintptr_t) addr)) != NULL) { //a block freed without mpool_free, reused
+    sample_remove(pf, e);
+  }
+  if ((e = pa_map_add(&pf->samples, (uintptr_t) addr)) == NULL) {
+    return 0;
+  }
+  e->site = site;
+  e->count = count;
+  e->bytes = bytes;
+
+  uint64_t b = addr_hash(addr) % PROFILE_FILTER_BITS;
+  __atomic_fetch_or(&pf->filter[b / 64], 1ULL << (b % 64), __ATOMIC_RELAXED);
+  return 1;
+}
+
+/* ---- hooks ---- */
+
+/* record a sample for the block at addr, which took the countdown to
+   `left`; kept out of line so that the backtrace always starts
+   PROFILE_SKIP frames above the caller */
+__attribute__((noinline)) static void sample(struct memory_pool *p, void *addr, size_t size, int64_t left)
+{
+  struct pa_profile *pf = p->profile;
+  void *frames[PROFILE_DEPTH + PROFILE_SKIP];
+  int depth = backtrace(frames, PROFILE_DEPTH + PROFILE_SKIP) - PROFILE_SKIP;
+  double count = 1.0 / -expm1(-(double) size / pf->rate);
+  uint32_t site;
+
+  depth = (depth > 0) ? depth : 0;
+
+  pthread_mutex_lock(&pf->lock);
+  if ((site = site_of(pf, frames + PROFILE_SKIP, depth)) != UINT32_MAX) {
+    pf->sites[site].alloc_count += count;
+    pf->sites[site].alloc_bytes += count * size;
+    if (sample_add(pf, addr, site, count, count * size)) {
+      pf->sites[site].inuse_count += count;
+      pf->sites[site].inuse_bytes += count * size;
+    }
+  }
+  int64_t next = next_sample(pf);
+  pthread_mutex_unlock(&pf->lock);
+
+  /* start over at next, less what other threads took off meanwhile; the
+     rest of this block past the sampled byte does not count */
+  if (p->threads != NULL) {
+    __atomic_add_fetch(&pf->left, next - left, __ATOMIC_RELAXED);
+  } else {
+    pf->left = next;
+  }
+}
+
+/* write the profile mpool_profile_signal asked for */
+static void signal_dump(void)
+{
+  FILE *f;
+
+  if ((f = fopen(signal_path, "w")) != NULL) {
+    mpool_profile_dump(signal_pool, f, signal_format);
+    fclose(f);
+  }
+}
+
+/* called by mpool_alloc, mpool_alloc_aligned and mpool_calloc for the
+   block of size bytes at addr while the pool is profiled */
+void pa_profile_alloc(struct memory_pool *p, void *addr, size_t size)
+{
+  struct pa_profile *pf = p->profile;
+  int64_t left;
+
+  if (p->threads != NULL) {
+    left = __atomic_sub_fetch(&pf->left, (int64_t) size, __ATOMIC_RELAXED);
+  } else {
+    left = (pf->left -= (int64_t) size);
+  }
+
+  /* only the allocation that takes the countdown past 0 samples */
+  if (left <= 0 && left + (int64_t) size > 0) {
+    sample(p, addr, size, left);
+  }
+  if (signal_pending && p == signal_pool && __atomic_exchange_n(&signal_pending, 0, __ATOMIC_RELAXED)) {
+    signal_dump();
+  }
+}
+
+/* called by mpool_free and mpool_free_batch while the pool is profiled */
+void pa_profile_free(struct memory_pool *p, void *addr)
+{
+  struct pa_profile *pf = p->profile;
+  uint64_t b = addr_hash(addr) % PROFILE_FILTER_BITS;
+  struct pa_sample *e;
+
+  if (!(__atomic_load_n(&pf->filter[b / 64], __ATOMIC_RELAXED) & (1ULL << (b % 64)))) {
+    return;
+  }
+
+  pthread_mutex_lock(&pf->lock);
+  if ((e = pa_map_find(&pf->samples, (uintptr_t) addr)) != NULL) {
+    sample_remove(pf, e);
+  }
+  pthread_mutex_unlock(&pf->lock);
+}
+
+/* take the profiler's lock, for fork handlers that must not leave it
+   held by a thread the child does not have; take it before the pool
+   lock (mpool_profile_dump holds it while writing, which may allocate) */
+void pa_profile_lock(struct memory_pool *p)
+{
+  if (p->profile != NULL) {
+    pthread_mutex_lock(&p->profile->lock);
+  }
+}
+
+void pa_profile_unlock(struct memory_pool *p)
+{
+  if (p->profile != NULL) {
+    pthread_mutex_unlock(&p->profile->lock);
+  }
+}
+
+/* called by mpool_destroy and mpool_set_profile */
+void pa_profile_destroy(struct memory_pool *p)
+{
+  struct pa_profile *pf = p->profile;
+
+  if (signal_pool == p) {
+    signal_pool = NULL;
+  }
+  if (pf == NULL) {
+    return;
+  }
+  pthread_mutex_destroy(&pf->lock);
+  free(pf->sites);
+  free(pf->site_map);
+  pa_map_free(&pf->samples);
+  free(pf);
+  p->profile = NULL;
+}
+
+/* ---- public ---- */
+
+/* sample one allocation of p every `rate` bytes on average (rate 0
+   stops profiling and drops what was recorded); call it before other
+   threads use p */
+/* returns 0 if memory could not be allocated */
+int mpool_set_profile(struct memory_pool *p, size_t rate)
+{
+  pa_profile_destroy(p);
+  if (rate == 0) {
+    return 1;
+  }
+
+  struct pa_profile *pf = (struct pa_profile*)calloc(1, sizeof(struct pa_profile));
+  if (pf == NULL) { //check mem allocation
+    return 0;
+  }
+  pthread_mutex_init(&pf->lock, NULL);
+  pa_map_init(&pf->samples, sizeof(struct pa_sample));
+  pf->rate = rate;
+  pf->rng = 88172645463325252ULL ^ (uintptr_t) p;
+  pf->left = next_sample(pf);
+
+  /* the first backtrace loads the unwinder, which may allocate */
+  void *frame;
+  backtrace(&frame, 1);
+
+  p->profile = pf;
+  return 1;
+}
+
+/* name of a frame for folded stacks: the symbol, else the object and offset */
+static void frame_name(void *frame, char *buf, size_t n)
+{
+  Dl_info info;
+
+  memset(&info, 0, sizeof(info));
+  if (dladdr(frame, &info) && info.dli_sname != NULL) {
+    snprintf(buf, n, "%s", info.dli_sname);
+  } else if (info.dli_fname != NULL && info.dli_fbase != NULL) {
+    const char *base = strrchr(info.dli_fname, '/');
+    snprintf(buf, n, "%s+0x%lx", base ? base + 1 : info.dli_fname,
+             (unsigned long) ((char *) frame - (char *) info.dli_fbase));
+  } else {
+    snprintf(buf, n, "0x%lx", (unsigned long) (uintptr_t) frame);
+  }
+}
+
+/* write the profile of p to f, as MPOOL_PROFILE_FOLDED (bytes in use by
+   call site, for flame graphs) or MPOOL_PROFILE_PPROF (in use and all
+   time, for pprof) */
+/* returns 0 if p is not profiled or f could not be written */
+int mpool_profile_dump(struct memory_pool *p, FILE *f, int format)
+{
+  struct pa_profile *pf = p->profile;
+  double count = 0, bytes = 0, alloc_count = 0, alloc_bytes = 0;
+  char name[256];
+  uint32_t k;
+  int i;
+
+  if (pf == NULL) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&pf->lock);
+  if (format == MPOOL_PROFILE_FOLDED) {
+    for (k = 0; k < pf->nsites; k++) {
+      struct pa_site *s = &pf->sites[k];
+
+      if (s->inuse_bytes < 0.5) {
+        continue;
+      }
+      for (i = s->depth - 1; i >= 0; i--) {
+        frame_name(s->frames[i], name, sizeof(name));
+        fprintf(f, "%s%s", name, i ? ";" : "");
+      }
+      fprintf(f, "%s %.0f\n", s->depth ? "" : "[unknown]", s->inuse_bytes);
+    }
+  } else {
+    for (k = 0; k < pf->nsites; k++) {
+      count += pf->sites[k].inuse_count;
+      bytes += pf->sites[k].inuse_bytes;
+      alloc_count += pf->sites[k].alloc_count;
+      alloc_bytes += pf->sites[k].alloc_bytes;
+    }
+    fprintf(f, "heap profile: %6.0f: %8.0f [%6.0f: %8.0f] @ heapprofile\n", count, bytes, alloc_count, alloc_bytes);
+    for (k = 0; k < pf->nsites; k++) {
+      struct pa_site *s = &pf->sites[k];
+
+      fprintf(f, "%6.0f: %8.0f [%6.0f: %8.0f] @", s->inuse_count, s->inuse_bytes, s->alloc_count, s->alloc_bytes);
+      for (i = 0; i < s->depth; i++) {
+        fprintf(f, " %p", s->frames[i]);
+      }
+      fprintf(f, "\n");
+    }
+
+    /* pprof maps the addresses to binaries with these */
+    FILE *maps = fopen("/proc/self/maps", "r");
+    size_t n;
+
+    fprintf(f, "\nMAPPED_LIBRARIES:\n");
+    if (maps != NULL) {
+      while ((n = fread(name, 1, sizeof(name), maps)) > 0) {
+        fwrite(name, 1, n, f);
+      }
+      fclose(maps);
+    }
+  }
+  pthread_mutex_unlock(&pf->lock);
+
+  return !ferror(f);
+}
+
+static void signal_handler(int signo)
+{
+  (void) signo;
+  signal_pending = 1;
+}
+
+/* write the profile of p to path in `format` whenever the process gets
+   signal signo; the profile is written by the next allocation from p
+   after the signal. Only one pool per process can be dumped this way. */
+/* returns 0 if p is not profiled or the handler could not be installed */
+int mpool_profile_signal(struct memory_pool *p, int signo, const char *path, int format)
+{
+  struct sigaction sa;
+  char *copy;
+
+  if (p->profile == NULL || (copy = strdup(path)) == NULL) {
+    return 0;
+  }
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = signal_handler;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  if (sigaction(signo, &sa, NULL) != 0) {
+    free(copy);
+    return 0;
+  }
+
+  free(signal_path);
+  signal_path = copy;
+  signal_format = format;
+  signal_pool = p;
+  return 1;
+}
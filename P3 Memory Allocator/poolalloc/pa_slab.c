@@ -0,0 +1,316 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "poolalloc.h"
+#include "poolalloc_int.h"
+
+/*
+   slab caches: objects of one fixed size carved out of slabs that are
+   allocated from a memory_pool
+
+   Every slab starts with a struct pa_slab header, followed by its
+   occupancy bitmap and then its slots. A free slot holds the address of
+   the next free slot, so allocating pops the slab's free list and freeing
+   pushes onto it (slots need not be pointer-aligned, so the address is
+   copied with memcpy). Slots that were never used are handed out in order
+   instead, so a new slab does not have to be threaded first.
+
+   Slabs that have free slots are on the cache's `partial` list, full ones
+   on its `full` list. When a slab becomes empty it is given back to the
+   pool, except that one empty slab is kept so that a cache that keeps
+   allocating and freeing a single object does not allocate a slab each
+   time.
+
+   mpool_slab_free finds the slab of an object through an address map
+   (pa_map.c) keyed by address >> granule_shift. A granule is the largest
+   power of two that is no longer than a slab, so no slab fits inside a
+   granule with room to spare: the slabs that reach into a granule are at
+   most the one that holds its first byte and the one that holds its
+   last. A slab covers two or three granules and is recorded under each
+   of them.
+
+   Slab caches are not thread-safe; they use the pool through mpool_alloc
+   and mpool_free.
+*/
+
+#define SLAB_MIN_SIZE 4096
+#define SLAB_MIN_OBJECTS 8
+
+struct pa_slab {
+  struct mpool_slab_cache *cache;
+  struct pa_slab *next;     /* on the cache's partial or full list */
+  struct pa_slab *prev;
+  void *free;               /* first free slot, each free slot holds the next */
+  unsigned int used;        /* slots in use */
+  unsigned int fresh;       /* slots below this index have been used before */
+  char *slots;
+  uint64_t bitmap[];        /* bit i is set when slot i is in use */
+};
+
+struct slab_entry {
+  uintptr_t granule;        /* the key, 0 for an empty entry */
+  struct pa_slab *slab[2];
+};
+
+static void slab_list_push(struct pa_slab **list, struct pa_slab *s)
+{
+  s->prev = NULL;
+  s->next = *list;
+  if (s->next != NULL) {
+    s->next->prev = s;
+  }
+  *list = s;
+}
+
+static void slab_list_remove(struct pa_slab **list, struct pa_slab *s)
+{
+  if (s->prev != NULL) {
+    s->prev->next = s->next;
+  } else {
+    *list = s->next;
+  }
+  if (s->next != NULL) {
+    s->next->prev = s->prev;
+  }
+}
+
+/* ---- granule -> slabs map ---- */
+
+/* record that slab s covers granule */
+static int map_add(struct mpool_slab_cache *c, uintptr_t granule, struct pa_slab *s)
+{
+  struct slab_entry *e = pa_map_add(&c->map, granule);
+
+  if (e == NULL) {
+    return 0;
+  }
+  e->slab[e->slab[0] != NULL] = s;
+  return 1;
+}
+
+/* forget that slab s covers granule, removing the entry once no slab does */
+static void map_remove(struct mpool_slab_cache *c, uintptr_t granule, struct pa_slab *s)
+{
+  struct slab_entry *e = pa_map_find(&c->map, granule);
+
+  if (e == NULL) {
+    return;
+  }
+
+  if (e->slab[0] == s) {
+    e->slab[0] = e->slab[1];
+  } else if (e->slab[1] != s) {
+    return;
+  }
+  e->slab[1] = NULL;
+  if (e->slab[0] == NULL) {
+    pa_map_remove(&c->map, e);
+  }
+}
+
+/* ---- slabs ---- */
+
+static size_t slab_bitmap_words(struct mpool_slab_cache *c)
+{
+  return (c->per_slab + 63) / 64;
+}
+
+/* allocate a slab from the pool and register it */
+static struct pa_slab *slab_new(struct mpool_slab_cache *c)
+{
+  struct pa_slab *s = mpool_alloc(c->pool, c->slab_size);
+
+  if (s == NULL) {
+    return NULL;
+  }
+
+  uintptr_t first = (uintptr_t) s >> c->granule_shift;
+  uintptr_t last = ((uintptr_t) s + c->slab_size - 1) >> c->granule_shift;
+  uintptr_t g;
+
+  for (g = first; g <= last; g++) {
+    if (!map_add(c, g, s)) {
+      while (g-- > first) {
+        map_remove(c, g, s);
+      }
+      mpool_free(c->pool, s);
+      return NULL;
+    }
+  }
+
+  size_t header = sizeof(struct pa_slab) + slab_bitmap_words(c) * sizeof(uint64_t);
+
+  s->cache = c;
+  s->free = NULL;
+  s->used = s->fresh = 0;
+  s->slots = (char *) (((uintptr_t) s + header + c->align - 1) & ~((uintptr_t) c->align - 1));
+  memset(s->bitmap, 0, slab_bitmap_words(c) * sizeof(uint64_t));
+  return s;
+}
+
+/* give a slab back to the pool */
+static void slab_release(struct mpool_slab_cache *c, struct pa_slab *s)
+{
+  uintptr_t first = (uintptr_t) s >> c->granule_shift;
+  uintptr_t last = ((uintptr_t) s + c->slab_size - 1) >> c->granule_shift;
+  uintptr_t g;
+
+  for (g = first; g <= last; g++) {
+    map_remove(c, g, s);
+  }
+  mpool_free(c->pool, s);
+}
+
+/* the slab that holds obj, NULL if obj is not a slot of this cache */
+static struct pa_slab *slab_of(struct mpool_slab_cache *c, void *obj)
+{
+  struct slab_entry *e = pa_map_find(&c->map, (uintptr_t) obj >> c->granule_shift);
+  int i;
+
+  for (i = 0; e != NULL && i < 2 && e->slab[i] != NULL; i++) {
+    struct pa_slab *s = e->slab[i];
+
+    if ((char *) obj >= s->slots && (char *) obj < s->slots + c->per_slab * c->stride) {
+      return s;
+    }
+  }
+  return NULL;
+}
+
+/* create a cache of objects of obj_size bytes, aligned to align (a power
+   of two, or 0 for the alignment mpool_alloc gives obj_size), whose slabs
+   are allocated from pool */
+/* returns NULL if memory could not be allocated or align is not valid */
+struct mpool_slab_cache *mpool_slab_create(struct memory_pool *pool, size_t obj_size, size_t align)
+{
+  if (align == 0) {
+    align = obj_size > 8 ? 16 : obj_size > 4 ? 8 : obj_size > 2 ? 4 : obj_size ? obj_size : 1;
+  }
+  if ((align & (align - 1)) != 0 || obj_size == 0) {
+    return NULL;
+  }
+
+  struct mpool_slab_cache *c = (struct mpool_slab_cache*)calloc(1, sizeof(struct mpool_slab_cache));
+  if (c == NULL) { //check mem allocation
+    return NULL;
+  }
+
+  /* a free slot must hold a pointer */
+  size_t stride = (obj_size < sizeof(void *)) ? sizeof(void *) : obj_size;
+  stride = (stride + align - 1) & ~(align - 1);
+
+  /* at least SLAB_MIN_OBJECTS slots and SLAB_MIN_SIZE bytes per slab */
+  size_t per_slab = SLAB_MIN_OBJECTS;
+  size_t slab_size;
+
+  for (;;) {
+    slab_size = sizeof(struct pa_slab) + (per_slab + 63) / 64 * sizeof(uint64_t) + align - 1 + per_slab * stride;
+    if (slab_size >= SLAB_MIN_SIZE) {
+      break;
+    }
+    per_slab++;
+  }
+
+  c->pool = pool;
+  c->obj_size = obj_size;
+  c->align = align;
+  c->stride = stride;
+  c->per_slab = per_slab;
+  c->slab_size = slab_size;
+  pa_map_init(&c->map, sizeof(struct slab_entry));
+  for (c->granule_shift = 12; ((size_t) 2 << c->granule_shift) <= slab_size; c->granule_shift++);
+
+  return c;
+}
+
+/* free a slab cache and give all its slabs back to the pool, including
+   ones that still hold objects */
+void mpool_slab_destroy(struct mpool_slab_cache *c)
+{
+  struct pa_slab *s;
+
+  while ((s = c->partial) != NULL) {
+    c->partial = s->next;
+    mpool_free(c->pool, s);
+  }
+  while ((s = c->full) != NULL) {
+    c->full = s->next;
+    mpool_free(c->pool, s);
+  }
+  if (c->empty != NULL) {
+    mpool_free(c->pool, c->empty);
+  }
+
+  pa_map_free(&c->map);
+  free(c);
+}
+
+/* allocate one object, NULL if the pool has no room for another slab */
+void *mpool_slab_alloc(struct mpool_slab_cache *c)
+{
+  struct pa_slab *s = c->partial;
+  void *obj;
+
+  if (s == NULL) {
+    if ((s = c->empty) != NULL) {
+      c->empty = NULL;
+    } else if ((s = slab_new(c)) == NULL) {
+      return NULL;
+    }
+    slab_list_push(&c->partial, s);
+  }
+
+  if (s->free != NULL) {
+    obj = s->free;
+    memcpy(&s->free, obj, sizeof(void *));
+  } else {
+    obj = s->slots + s->fresh++ * c->stride;
+  }
+
+  size_t i = ((char *) obj - s->slots) / c->stride;
+  s->bitmap[i / 64] |= 1ULL << (i % 64);
+
+  if (++s->used == c->per_slab) {
+    slab_list_remove(&c->partial, s);
+    slab_list_push(&c->full, s);
+  }
+
+  return obj;
+}
+
+/* free an object of the cache; anything else (including an object that
+   is already free) is ignored */
+void mpool_slab_free(struct mpool_slab_cache *c, void *obj)
+{
+  struct pa_slab *s;
+  size_t i;
+
+  if (obj == NULL || (s = slab_of(c, obj)) == NULL) {
+    return;
+  }
+
+  i = ((char *) obj - s->slots) / c->stride;
+  if ((size_t) ((char *) obj - s->slots) % c->stride != 0 || !(s->bitmap[i / 64] & (1ULL << (i % 64)))) {
+    return;
+  }
+  s->bitmap[i / 64] &= ~(1ULL << (i % 64));
+
+  memcpy(obj, &s->free, sizeof(void *));
+  s->free = obj;
+
+  if (s->used-- == c->per_slab) {
+    slab_list_remove(&c->full, s);
+    slab_list_push(&c->partial, s);
+  }
+
+  if (s->used == 0) {
+    slab_list_remove(&c->partial, s);
+
+    //keep one empty slab, give any other back to the pool
+    if (c->empty == NULL) {
+      c->empty = s;
+    } else {
+      slab_release(c, s);
+    }
+  }
+}
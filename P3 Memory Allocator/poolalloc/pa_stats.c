@@ -0,0 +1,346 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "poolalloc.h"
+#include "poolalloc_int.h"
+
+/*
+   MPOOL_STATS: usage statistics and latency histograms
+
+   mpool_alloc, mpool_free and mpool_realloc check p->stats once and only
+   go through this file when it is set, so a pool created without
+   MPOOL_STATS pays for one pointer test.
+
+   Counters are updated with relaxed atomic operations so that
+   MPOOL_THREADS pools can keep them without taking the pool lock; a
+   snapshot taken while other threads allocate is therefore only
+   approximately consistent. Live bytes are usable bytes (what the pool
+   set aside for a block, not what was asked for), so every free has to
+   look up the size of its block first.
+
+   The free bytes and the largest free block are not tracked but found by
+   walking the free structures when mpool_stats is called.
+
+   Latencies are measured with CLOCK_MONOTONIC and counted in buckets
+   whose width grows with their value, like an HDR histogram: the size
+   classes of the free bins are reused, so a bucket is exact below
+   MPOOL_EXACT_BINS nanoseconds and within 25% above. The largest latency
+   is kept on the side, so the max reported is exact.
+*/
+
+struct pa_stats {
+  size_t live_bytes;
+  size_t live_count;
+  size_t peak_bytes;
+  size_t peak_count;
+  size_t allocs;
+  size_t frees;
+  size_t failed;
+  size_t requested_bytes;
+  size_t allocated_bytes;
+  uint64_t size_classes[MPOOL_NBINS];
+  uint64_t alloc_ns[MPOOL_NBINS];
+  uint64_t free_ns[MPOOL_NBINS];
+  uint64_t alloc_ns_max;
+  uint64_t free_ns_max;
+};
+
+static uint64_t clock_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void stat_add(size_t *counter, size_t n)
+{
+  __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+/* add n to a live counter and raise its peak if it passed it */
+static void stat_live_add(size_t *live, size_t *peak, size_t n)
+{
+  size_t now = __atomic_add_fetch(live, n, __ATOMIC_RELAXED);
+  size_t old = __atomic_load_n(peak, __ATOMIC_RELAXED);
+
+  while (now > old && !__atomic_compare_exchange_n(peak, &old, now, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static void stat_count(uint64_t *hist, uint64_t value)
+{
+  int i = pa_bin_index(value);
+
+  __atomic_fetch_add(&hist[i], 1, __ATOMIC_RELAXED);
+}
+
+/* count a latency in hist and raise *max if it is the largest yet */
+static void stat_latency(uint64_t *hist, uint64_t *max, uint64_t ns)
+{
+  uint64_t old = __atomic_load_n(max, __ATOMIC_RELAXED);
+
+  stat_count(hist, ns);
+  while (ns > old && !__atomic_compare_exchange_n(max, &old, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/* usable bytes of the allocated block at addr, 0 if there is none */
+static size_t stats_usable(struct memory_pool *p, void *addr)
+{
+  return (p->threads != NULL) ? pa_threads_usable(p, addr) : pa_pool_usable(p, addr);
+}
+
+int pa_stats_init(struct memory_pool *p)
+{
+  p->stats = (struct pa_stats*)calloc(1, sizeof(struct pa_stats));
+  return p->stats != NULL;
+}
+
+void *pa_stats_alloc(struct memory_pool *p, size_t size, size_t align)
+{
+  struct pa_stats *s = p->stats;
+  uint64_t t = clock_ns();
+  void *addr = pa_alloc(p, size, align);
+
+  stat_latency(s->alloc_ns, &s->alloc_ns_max, clock_ns() - t);
+
+  if (addr == NULL) {
+    stat_add(&s->failed, 1);
+    return NULL;
+  }
+
+  /* arenas do not record block sizes, their blocks are exactly as large as asked */
+  size_t usable = ((p->flags & MPOOL_MODE_MASK) == MPOOL_ARENA) ? size : stats_usable(p, addr);
+
+  stat_count(s->size_classes, size);
+  stat_add(&s->allocs, 1);
+  stat_add(&s->requested_bytes, size);
+  stat_add(&s->allocated_bytes, usable);
+  stat_live_add(&s->live_bytes, &s->peak_bytes, usable);
+  stat_live_add(&s->live_count, &s->peak_count, 1);
+  return addr;
+}
+
+void pa_stats_free(struct memory_pool *p, void *addr)
+{
+  struct pa_stats *s = p->stats;
+  size_t usable = stats_usable(p, addr);
+  uint64_t t = clock_ns();
+
+  pa_free(p, addr);
+  stat_latency(s->free_ns, &s->free_ns_max, clock_ns() - t);
+
+  /* usable is 0 for anything that is not an allocated block, and for
+     arena blocks, which are not freed */
+  if (usable > 0) {
+    stat_add(&s->frees, 1);
+    __atomic_fetch_sub(&s->live_bytes, usable, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&s->live_count, 1, __ATOMIC_RELAXED);
+  }
+}
+
+/* the sizes are looked up before the batch is freed, once per address
+   (the batch is sorted first to find repeated ones); its time is spread
+   evenly over its blocks */
+void pa_stats_free_batch(struct memory_pool *p, void **addrs, size_t n)
+{
+  struct pa_stats *s = p->stats;
+  size_t usable = 0, count = 0, size, i;
+  uint64_t t;
+
+  pa_addr_sort(addrs, n);
+  for (i = 0; i < n; i++) {
+    if (addrs[i] != NULL && (i == 0 || addrs[i] != addrs[i - 1]) && (size = stats_usable(p, addrs[i])) > 0) {
+      usable += size;
+      count++;
+    }
+  }
+
+  t = clock_ns();
+  pa_free_batch(p, addrs, n);
+  t = clock_ns() - t;
+  for (i = 0; i < n; i++) {
+    stat_latency(s->free_ns, &s->free_ns_max, t / n);
+  }
+
+  stat_add(&s->frees, count);
+  __atomic_fetch_sub(&s->live_bytes, usable, __ATOMIC_RELAXED);
+  __atomic_fetch_sub(&s->live_count, count, __ATOMIC_RELAXED);
+}
+
+/* a block that moves is counted by mpool_alloc and mpool_free, one that
+   is resized in place only changes the live bytes */
+void *pa_stats_realloc(struct memory_pool *p, void *addr, size_t size)
+{
+  struct pa_stats *s = p->stats;
+
+  if (addr == NULL || size == 0 || (p->flags & MPOOL_MODE_MASK) == MPOOL_ARENA) {
+    return pa_realloc(p, addr, size);
+  }
+
+  size_t before = stats_usable(p, addr);
+  void *moved = pa_realloc(p, addr, size);
+
+  if (moved == addr && before > 0) {
+    size_t after = stats_usable(p, addr);
+
+    if (after >= before) {
+      stat_live_add(&s->live_bytes, &s->peak_bytes, after - before);
+    } else {
+      __atomic_fetch_sub(&s->live_bytes, before - after, __ATOMIC_RELAXED);
+    }
+  }
+  return moved;
+}
+
+static size_t stat_load(size_t *counter)
+{
+  return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void hist_load(uint64_t *dst, uint64_t *src)
+{
+  int i;
+
+  for (i = 0; i < MPOOL_NBINS; i++) {
+    dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+  }
+}
+
+/* fill *out with the statistics of p */
+/* returns 0 if p was not created with MPOOL_STATS */
+int mpool_stats(struct memory_pool *p, struct mpool_stats *out)
+{
+  struct pa_stats *s = p->stats;
+
+  if (s == NULL) {
+    return 0;
+  }
+
+  memset(out, 0, sizeof(*out));
+  out->live_bytes = stat_load(&s->live_bytes);
+  out->live_count = stat_load(&s->live_count);
+  out->peak_bytes = stat_load(&s->peak_bytes);
+  out->peak_count = stat_load(&s->peak_count);
+  out->allocs = stat_load(&s->allocs);
+  out->frees = stat_load(&s->frees);
+  out->failed = stat_load(&s->failed);
+  out->requested_bytes = stat_load(&s->requested_bytes);
+  out->allocated_bytes = stat_load(&s->allocated_bytes);
+  hist_load(out->size_classes, s->size_classes);
+  hist_load(out->alloc_ns, s->alloc_ns);
+  hist_load(out->free_ns, s->free_ns);
+  out->alloc_ns_max = __atomic_load_n(&s->alloc_ns_max, __ATOMIC_RELAXED);
+  out->free_ns_max = __atomic_load_n(&s->free_ns_max, __ATOMIC_RELAXED);
+
+  if (p->threads != NULL) {
+    pa_threads_lock(p);
+  }
+  mpool_flush(p); //queued frees are free space
+  pa_pool_free_space(p, &out->free_bytes, &out->largest_free);
+  if (p->threads != NULL) {
+    pa_threads_unlock(p);
+  }
+
+  //arena blocks are only freed by moving arena_top
+  if ((p->flags & MPOOL_MODE_MASK) == MPOOL_ARENA) {
+    out->live_bytes = p->arena_top;
+  }
+
+  out->internal_waste = out->allocated_bytes ? 1.0 - (double) out->requested_bytes / out->allocated_bytes : 0.0;
+  out->external_frag = out->free_bytes ? 1.0 - (double) out->largest_free / out->free_bytes : 0.0;
+  return 1;
+}
+
+/* smallest value counted in histogram bucket i */
+size_t mpool_stats_bucket(int i)
+{
+  return pa_bin_lower(i);
+}
+
+/* the bucket (by its smallest value) below which pct percent of the
+   values in hist fall, 0 if hist is empty */
+size_t mpool_stats_percentile(const uint64_t *hist, double pct)
+{
+  uint64_t total = 0, seen = 0, rank;
+  int i;
+
+  for (i = 0; i < MPOOL_NBINS; i++) {
+    total += hist[i];
+  }
+  if (total == 0) {
+    return 0;
+  }
+
+  rank = (uint64_t) (pct / 100.0 * total);
+  if (rank >= total) {
+    rank = total - 1;
+  }
+  for (i = 0; i < MPOOL_NBINS; i++) {
+    seen += hist[i];
+    if (seen > rank) {
+      break;
+    }
+  }
+  return pa_bin_lower(i);
+}
+
+/* the non-empty buckets of hist as [[lowest value, count], ...] */
+static void json_buckets(FILE *f, const uint64_t *hist)
+{
+  const char *sep = "";
+  int i;
+
+  fprintf(f, "[");
+  for (i = 0; i < MPOOL_NBINS; i++) {
+    if (hist[i] > 0) {
+      fprintf(f, "%s[%zu, %llu]", sep, pa_bin_lower(i), (unsigned long long) hist[i]);
+      sep = ", ";
+    }
+  }
+  fprintf(f, "]");
+}
+
+static void json_latency(FILE *f, const char *name, const uint64_t *hist, uint64_t max)
+{
+  fprintf(f, "  \"%s\": {\"p50\": %zu, \"p90\": %zu, \"p99\": %zu, \"p999\": %zu, \"max\": %llu, \"buckets\": ",
+          name, mpool_stats_percentile(hist, 50), mpool_stats_percentile(hist, 90),
+          mpool_stats_percentile(hist, 99), mpool_stats_percentile(hist, 99.9),
+          (unsigned long long) max);
+  json_buckets(f, hist);
+  fprintf(f, "}");
+}
+
+/* write the statistics of p to f as one JSON object */
+/* returns 0 if p was not created with MPOOL_STATS */
+int mpool_stats_json(struct memory_pool *p, FILE *f)
+{
+  struct mpool_stats *s = (struct mpool_stats*)malloc(sizeof(struct mpool_stats));
+
+  if (s == NULL) { //check mem allocation
+    return 0;
+  }
+  if (!mpool_stats(p, s)) {
+    free(s);
+    return 0;
+  }
+
+  fprintf(f, "{\n");
+  fprintf(f, "  \"live_bytes\": %zu,\n  \"live_count\": %zu,\n", s->live_bytes, s->live_count);
+  fprintf(f, "  \"peak_bytes\": %zu,\n  \"peak_count\": %zu,\n", s->peak_bytes, s->peak_count);
+  fprintf(f, "  \"allocs\": %zu,\n  \"frees\": %zu,\n  \"failed\": %zu,\n", s->allocs, s->frees, s->failed);
+  fprintf(f, "  \"requested_bytes\": %zu,\n  \"allocated_bytes\": %zu,\n", s->requested_bytes, s->allocated_bytes);
+  fprintf(f, "  \"free_bytes\": %zu,\n  \"largest_free\": %zu,\n", s->free_bytes, s->largest_free);
+  fprintf(f, "  \"internal_waste\": %.4f,\n  \"external_frag\": %.4f,\n", s->internal_waste, s->external_frag);
+  fprintf(f, "  \"size_classes\": ");
+  json_buckets(f, s->size_classes);
+  fprintf(f, ",\n");
+  json_latency(f, "alloc_ns", s->alloc_ns, s->alloc_ns_max);
+  fprintf(f, ",\n");
+  json_latency(f, "free_ns", s->free_ns, s->free_ns_max);
+  fprintf(f, "\n}\n");
+
+  free(s);
+  return 1;
+}
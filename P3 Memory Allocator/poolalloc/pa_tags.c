@@ -0,0 +1,383 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "poolalloc.h"
+#include "poolalloc_int.h"
+
+/*
+   MPOOL_TAGS mode: every block carries a header word in front of its
+   payload and a footer word at its end, both inside the pool memory
+
+     header: block size | TAG_FREE if the block is free
+     footer: block size | TAG_FREE while the block is free,
+             requested size << TAG_SHIFT while it is allocated
+
+   Blocks are multiples of TAG_ALIGN bytes and start one word before a
+   TAG_ALIGN boundary, so every payload is 16-byte aligned. The first word
+   of the pool is a footer and the last word is a header of size 0, both
+   marked allocated, so coalescing never looks outside the pool.
+
+   A free block keeps the offsets of the next and previous free blocks of
+   its size class in its payload. Offset 0 (the leading footer) means none.
+
+   mpool_free finds a block's size from its header and its neighbours from
+   the next header and the previous footer, so freeing and coalescing are
+   O(1) with no list searches. mpool_realloc uses the next header the same
+   way to grow a block into a free block after it, and shrinks a block by
+   splitting off its tail.
+*/
+
+#define TAG_FREE 0x1
+#define TAG_FLAGS 0xf
+#define TAG_SHIFT 4
+#define TAG_ALIGN 16
+#define TAG_WORD sizeof(size_t)
+#define TAG_MIN_BLOCK 32   /* header + free links + footer */
+#define TAG_PROBES 4
+
+struct tag_links {
+  size_t next;  /* offset of the next free block in this bin, 0 if none */
+  size_t prev;  /* offset of the previous free block in this bin, 0 if none */
+};
+
+static size_t *tag_header(struct memory_pool *p, size_t off)
+{
+  return (size_t *) (p->start + off);
+}
+
+static size_t *tag_footer(struct memory_pool *p, size_t off, size_t size)
+{
+  return (size_t *) (p->start + off + size - TAG_WORD);
+}
+
+static struct tag_links *tag_links(struct memory_pool *p, size_t off)
+{
+  return (struct tag_links *) (p->start + off + TAG_WORD);
+}
+
+static size_t tag_size(struct memory_pool *p, size_t off)
+{
+  return *tag_header(p, off) & ~(size_t) TAG_FLAGS;
+}
+
+/* offset of the final (size 0) header; blocks live in [TAG_WORD, end) */
+static size_t tag_end(struct memory_pool *p)
+{
+  return (p->size & ~(size_t) (TAG_ALIGN - 1)) - TAG_WORD;
+}
+
+/* mark block off as free and put it into the bin for its size */
+static void tag_insert(struct memory_pool *p, size_t off, size_t size)
+{
+  int i = pa_bin_index(size);
+  struct tag_links *l = tag_links(p, off);
+
+  *tag_header(p, off) = size | TAG_FREE;
+  *tag_footer(p, off, size) = size | TAG_FREE;
+
+  l->prev = 0;
+  l->next = p->tag_bins[i];
+  if (l->next != 0) {
+    tag_links(p, l->next)->prev = off;
+  }
+  p->tag_bins[i] = off;
+  pa_binmap_set(p, i);
+}
+
+/* take free block off out of its bin */
+static void tag_remove(struct memory_pool *p, size_t off, size_t size)
+{
+  int i = pa_bin_index(size);
+  struct tag_links *l = tag_links(p, off);
+
+  if (l->prev != 0) {
+    tag_links(p, l->prev)->next = l->next;
+  } else {
+    p->tag_bins[i] = l->next;
+  }
+  if (l->next != 0) {
+    tag_links(p, l->next)->prev = l->prev;
+  }
+
+  if (p->tag_bins[i] == 0) {
+    pa_binmap_clear(p, i);
+  }
+}
+
+/* first block of bin i that is at least `size` bytes, looking at no more than `limit` blocks (0 for no limit) */
+static size_t tag_search(struct memory_pool *p, int i, size_t size, int limit)
+{
+  size_t off;
+
+  for (off = p->tag_bins[i]; off != 0; off = tag_links(p, off)->next) {
+    if (tag_size(p, off) >= size) {
+      return off;
+    }
+    if (limit > 0 && --limit == 0) {
+      break;
+    }
+  }
+
+  return 0;
+}
+
+/* lay out the pool as a single free block between the two sentinels */
+/* returns 0 if the pool is too small to hold any block */
+int pa_tags_init(struct memory_pool *p)
+{
+  if (((uintptr_t) p->start) % TAG_ALIGN != 0 || p->size < TAG_WORD + TAG_MIN_BLOCK + TAG_WORD) {
+    return 0;
+  }
+
+  size_t end = tag_end(p);
+
+  *tag_header(p, 0) = 0;    /* leading footer: allocated */
+  *tag_header(p, end) = 0;  /* final header: allocated, size 0 */
+  tag_insert(p, TAG_WORD, end - TAG_WORD);
+  return 1;
+}
+
+/* fill the bins from the boundary tags of a pool whose blocks are laid
+   out but whose bins were lost (a file-backed pool that was not closed) */
+/* returns 0 if the tags do not describe a valid pool */
+int pa_tags_rebuild(struct memory_pool *p)
+{
+  size_t end = tag_end(p), off, size;
+
+  memset(p->tag_bins, 0, sizeof(p->tag_bins));
+  memset(p->binmap, 0, sizeof(p->binmap));
+
+  for (off = TAG_WORD; off < end; off += size) {
+    size = tag_size(p, off);
+    if (size < TAG_MIN_BLOCK || size > end - off) {
+      return 0;
+    }
+    if (*tag_header(p, off) & TAG_FREE) {
+      tag_insert(p, off, size);
+    }
+  }
+  return off == end;
+}
+
+/* block size needed for a payload of `size` bytes, 0 on overflow */
+static size_t tag_need(size_t size)
+{
+  size_t need = (size + 2 * TAG_WORD + TAG_ALIGN - 1) & ~(size_t) (TAG_ALIGN - 1);
+
+  if (need < size) {
+    return 0;
+  }
+  return (need < TAG_MIN_BLOCK) ? TAG_MIN_BLOCK : need;
+}
+
+/* allocate `size` bytes; payloads are always 16-byte aligned, which
+   satisfies every alignment mpool_alloc promises */
+static void *tag_alloc(struct memory_pool *p, size_t size)
+{
+  size_t need = tag_need(size);
+  size_t off = 0;
+  int lo, hi, i;
+
+  if (need == 0) { //overflow
+    return NULL;
+  }
+
+  /* a close fit from the requested size class, then the head of the
+     smallest class in which every block fits, then a full search */
+  lo = pa_bin_index(need);
+  hi = pa_bin_fit(need);
+
+  if ((off = tag_search(p, lo, need, TAG_PROBES)) == 0) {
+    if ((i = pa_bin_next(p, hi)) >= 0) {
+      off = p->tag_bins[i];
+    } else if (lo < hi) {
+      off = tag_search(p, lo, need, 0);
+    }
+  }
+  if (off == 0) {
+    return NULL;
+  }
+
+  size_t bsize = tag_size(p, off);
+  tag_remove(p, off, bsize);
+
+  /* split off the tail if it can hold a block of its own */
+  if (bsize - need >= TAG_MIN_BLOCK) {
+    tag_insert(p, off + need, bsize - need);
+    bsize = need;
+  }
+
+  *tag_header(p, off) = bsize;
+  *tag_footer(p, off, bsize) = size << TAG_SHIFT;
+
+  return p->start + off + TAG_WORD;
+}
+
+/* allocate `size` bytes aligned to `align` (larger than TAG_ALIGN) */
+/* a block with room to spare is allocated; the part in front of the
+   aligned payload becomes a block of its own that is freed right away
+   (it is at least TAG_MIN_BLOCK bytes), and the tail is trimmed with
+   pa_tags_resize */
+static void *tag_alloc_aligned(struct memory_pool *p, size_t size, size_t align)
+{
+  size_t room = size + align + TAG_MIN_BLOCK;
+  char *addr;
+
+  if (room < size || (addr = tag_alloc(p, room)) == NULL) {
+    return NULL;
+  }
+
+  size_t off = addr - p->start - TAG_WORD;
+  size_t bsize = tag_size(p, off);
+  uintptr_t aligned = ((uintptr_t) addr + align - 1) & ~((uintptr_t) align - 1);
+
+  if (aligned != (uintptr_t) addr && aligned - (uintptr_t) addr < TAG_MIN_BLOCK) {
+    aligned += align;
+  }
+
+  size_t front = aligned - (uintptr_t) addr;
+  if (front > 0) {
+    *tag_header(p, off) = front;
+    *tag_footer(p, off, front) = 0;
+    *tag_header(p, off + front) = bsize - front;
+    pa_tags_free(p, addr);
+  }
+
+  pa_tags_resize(p, (char *) aligned, size);
+  return (char *) aligned;
+}
+
+/* allocate `size` bytes aligned to `align` */
+void *pa_tags_alloc(struct memory_pool *p, size_t size, size_t align)
+{
+  return (align <= TAG_ALIGN) ? tag_alloc(p, size) : tag_alloc_aligned(p, size, align);
+}
+
+/* offset of the allocated block whose payload is at addr, 0 if there is none */
+static size_t tag_block(struct memory_pool *p, void *addr)
+{
+  size_t off = (char *) addr - p->start - TAG_WORD;
+
+  if ((char *) addr < p->start + 2 * TAG_WORD || off >= tag_end(p) || off % TAG_ALIGN != TAG_WORD) {
+    return 0; //not a block of this pool
+  }
+  if (*tag_header(p, off) & TAG_FREE) {
+    return 0; //already free
+  }
+  return off;
+}
+
+/* payload bytes of the block at addr, 0 if it is not allocated */
+/* only reads the block's own header, which no other block changes */
+size_t pa_tags_usable(struct memory_pool *p, void *addr)
+{
+  size_t off = tag_block(p, addr);
+
+  return (off != 0) ? tag_size(p, off) - 2 * TAG_WORD : 0;
+}
+
+/* free a block and coalesce it with its free neighbours */
+void pa_tags_free(struct memory_pool *p, void *addr)
+{
+  size_t off = tag_block(p, addr);
+
+  if (off == 0) {
+    return;
+  }
+
+  size_t size = tag_size(p, off);
+
+  /* the block after it starts right at its end */
+  size_t next = off + size;
+  if (*tag_header(p, next) & TAG_FREE) {
+    size_t nsize = tag_size(p, next);
+
+    tag_remove(p, next, nsize);
+    size += nsize;
+  }
+
+  /* the block before it ends with the footer just in front of it */
+  size_t prev_footer = *(size_t *) (p->start + off - TAG_WORD);
+  if (prev_footer & TAG_FREE) {
+    size_t psize = prev_footer & ~(size_t) TAG_FLAGS;
+
+    tag_remove(p, off - psize, psize);
+    off -= psize;
+    size += psize;
+  }
+
+  tag_insert(p, off, size);
+}
+
+/* resize the allocated block at addr to hold `size` bytes without moving it */
+/* grows into the free block after it if that is large enough, and
+   shrinks by giving the tail back (coalesced with a free block after it);
+   returns 0 if the block would have to move */
+int pa_tags_resize(struct memory_pool *p, void *addr, size_t size)
+{
+  size_t off = tag_block(p, addr);
+  size_t need = tag_need(size);
+
+  if (off == 0 || need == 0) {
+    return 0;
+  }
+
+  size_t bsize = tag_size(p, off);
+  size_t next = off + bsize;
+
+  if (need > bsize) {
+    size_t nsize = tag_size(p, next);
+
+    if (!(*tag_header(p, next) & TAG_FREE) || bsize + nsize < need) {
+      return 0;
+    }
+    tag_remove(p, next, nsize);
+    bsize += nsize;
+  } else if (need < bsize && (*tag_header(p, next) & TAG_FREE)) { //the tail joins the free block after it
+    size_t nsize = tag_size(p, next);
+
+    tag_remove(p, next, nsize);
+    tag_insert(p, off + need, bsize - need + nsize);
+    bsize = need;
+  }
+
+  /* split off what is left if it can hold a block of its own */
+  if (bsize - need >= TAG_MIN_BLOCK) {
+    tag_insert(p, off + need, bsize - need);
+    bsize = need;
+  }
+
+  *tag_header(p, off) = bsize;
+  *tag_footer(p, off, bsize) = size << TAG_SHIFT;
+  return 1;
+}
+
+/* add the payload bytes of every free block to *total and raise
+   *largest to the largest of them */
+void pa_tags_free_space(struct memory_pool *p, size_t *total, size_t *largest)
+{
+  size_t off;
+  int i;
+
+  for (i = pa_bin_next(p, 0); i >= 0; i = pa_bin_next(p, i + 1)) {
+    for (off = p->tag_bins[i]; off != 0; off = tag_links(p, off)->next) {
+      size_t size = tag_size(p, off) - 2 * TAG_WORD;
+
+      *total += size;
+      *largest = (size > *largest) ? size : *largest;
+    }
+  }
+}
+
+/* call fn for the part of every free block that holds no tags or links */
+void pa_tags_free_spans(struct memory_pool *p, void (*fn)(struct memory_pool *, size_t, size_t, void *), void *ctx)
+{
+  size_t off;
+  int i;
+
+  for (i = pa_bin_next(p, 0); i >= 0; i = pa_bin_next(p, i + 1)) {
+    for (off = p->tag_bins[i]; off != 0; off = tag_links(p, off)->next) {
+      fn(p, off + TAG_WORD + sizeof(struct tag_links), tag_size(p, off) - 2 * TAG_WORD - sizeof(struct tag_links), ctx);
+    }
+  }
+}
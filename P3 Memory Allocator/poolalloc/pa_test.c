@@ -1,6 +1,13 @@
+#define _DEFAULT_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
 
 #include "dbll.h"
 #include "poolalloc.h"
@@ -91,6 +98,1488 @@ int test_create_destroy(size_t poolsize) {
   return ret;
 }
 
+/* check that the free_list is in address order, fully coalesced, and that every free block is in a bin */
+int check_free_list(const char *test, struct memory_pool *p) {
+  struct llnode *n;
+  struct alloc_info *prev = NULL;
+  int ret = 1;
+
+  for(n = p->free_list->first; ret && n != NULL; n = n->next) {
+	struct alloc_info *ai = n->user_data;
+
+	ret = th_check(ai->size > 0 && ai->offset + ai->size <= p->size, "%s: free block (%lu, %lu) is inside pool", test, ai->offset, ai->size) && ret;
+	ret = th_check(ai->bin_node != NULL && ai->bin_node->user_data == ai, "%s: free block (%lu, %lu) is in a size-class bin", test, ai->offset, ai->size) && ret;
+
+	if(prev != NULL)
+	  ret = th_check(prev->offset + prev->size < ai->offset, "%s: free block (%lu, %lu) is after and not adjacent to (%lu, %lu)",
+					 test, ai->offset, ai->size, prev->offset, prev->size) && ret;
+	prev = ai;
+  }
+
+  return ret;
+}
+
+/* random allocations and frees; flags selects the pool mode */
+int test_random_alloc_free(int flags) {
+  struct memory_pool *p;
+  int N = 200, OPS = 20000;
+  char *live[N];
+  size_t livesz[N];
+  int i, j, ret = 0;
+  int lists = (flags & MPOOL_MODE_MASK) == MPOOL_LISTS;
+
+  p = mpool_create_flags(32768, flags);
+
+  if(!(ret = th_check(p != NULL, "random: mpool_create returned non-null (%p)", p)))
+	return 0;
+
+  for(i = 0; i < N; i++)
+	live[i] = NULL;
+
+  srand(252);
+  for(i = 0; ret && i < OPS; i++) {
+	j = rand() % N;
+
+	if(live[j] != NULL) {
+	  /* every byte must still hold the pattern written at allocation time */
+	  size_t k;
+	  for(k = 0; k < livesz[j] && live[j][k] == (char) j; k++);
+	  ret = th_check(k == livesz[j], "random: block %p of size %lu was not overwritten", live[j], livesz[j]) && ret;
+
+	  mpool_free(p, live[j]);
+	  live[j] = NULL;
+	} else {
+	  livesz[j] = 1 + rand() % 300;
+	  live[j] = mpool_alloc(p, livesz[j]);
+
+	  if(live[j] != NULL) {
+		size_t align = livesz[j] > 8 ? 16 : livesz[j] > 4 ? 8 : livesz[j] > 2 ? 4 : livesz[j];
+
+		ret = th_check((live[j] - p->start) % align == 0, "random: block %p for size %lu is aligned to %lu", live[j], livesz[j], align) && ret;
+		ret = th_check(live[j] >= p->start && live[j] + livesz[j] <= p->start + p->size, "random: block %p is inside pool", live[j]) && ret;
+		memset(live[j], j, livesz[j]);
+	  }
+	}
+
+	if(lists && i % 1000 == 0)
+	  ret = check_free_list("random", p) && ret;
+  }
+
+  for(i = 0; i < N; i++)
+	mpool_free(p, live[i]);
+
+  if(lists) {
+	ret = check_free_list("random: after freeing everything", p) && ret;
+	ret = th_check(p->alloc_list->first == NULL, "random: alloc_list is empty after freeing everything") && ret;
+	ret = th_check(p->free_list->first != NULL && p->free_list->first == p->free_list->last &&
+				   ((struct alloc_info *) p->free_list->first->user_data)->size == p->size,
+				   "random: free_list is a single block of the pool size after freeing everything") && ret;
+  }
+
+  /* only possible if all blocks were coalesced again */
+  char *all = mpool_alloc(p, p->size - 64);
+  ret = th_check(all != NULL, "random: mpool_alloc (%p) of nearly the whole pool after freeing everything is non-null", all) && ret;
+  mpool_free(p, all);
+
+  mpool_destroy(p);
+
+  return ret;
+}
+
+/* buddy system: blocks are powers of two and merge with their buddies again */
+int test_buddy() {
+  struct memory_pool *p;
+  char *a, *b, *c, *d;
+  int ret = 0;
+
+  p = mpool_create_flags(4096, MPOOL_BUDDY);
+
+  if(!(ret = th_check(p != NULL, "buddy: mpool_create_flags returned non-null (%p)", p)))
+	return 0;
+
+  /* 100 bytes take a 128-byte block, so the first two are buddies */
+  a = mpool_alloc(p, 100);
+  b = mpool_alloc(p, 100);
+  ret = th_check(a != NULL && b != NULL, "buddy: two allocations of 100 bytes are non-null (%p, %p)", a, b) && ret;
+  ret = ret && th_check(((a - p->start) ^ (b - p->start)) == 128, "buddy: blocks at %ld and %ld are buddies of 128 bytes",
+						(long) (a - p->start), (long) (b - p->start));
+
+  c = mpool_alloc(p, 1);
+  ret = th_check(c != NULL && (c - p->start) % 16 == 0, "buddy: allocation of 1 byte (%p) is 16-byte aligned", c) && ret;
+
+  /* nothing can be merged back while c is allocated */
+  mpool_free(p, a);
+  mpool_free(p, b);
+  d = mpool_alloc(p, 4096);
+  ret = th_check(d == NULL, "buddy: whole pool is not available while a block is allocated (%p)", d) && ret;
+
+  /* freeing c merges every block back into one */
+  mpool_free(p, c);
+  d = mpool_alloc(p, 4096);
+  ret = th_check(d == p->start, "buddy: whole pool (%p) is available after freeing everything", d) && ret;
+  mpool_free(p, d);
+
+  mpool_destroy(p);
+
+  /* a pool that is not a power of two is cut into blocks of 4096 + 1024 + 16 */
+  p = mpool_create_flags(5136, MPOOL_BUDDY);
+  if(!(ret = th_check(p != NULL, "buddy: mpool_create_flags(5136) returned non-null (%p)", p) && ret))
+	return 0;
+
+  a = mpool_alloc(p, 4096);
+  b = mpool_alloc(p, 1024);
+  c = mpool_alloc(p, 16);
+  d = mpool_alloc(p, 16);
+  ret = th_check(a == p->start && b == p->start + 4096 && c == p->start + 5120, "buddy: pool is cut into the largest blocks that fit") && ret;
+  ret = th_check(d == NULL, "buddy: pool is full (%p)", d) && ret;
+
+  /* free of a pointer inside a block, and double free, are ignored */
+  mpool_free(p, a + 16);
+  mpool_free(p, b);
+  mpool_free(p, b);
+  d = mpool_alloc(p, 512);
+  ret = th_check(d == b, "buddy: freed block is split again (%p, %p)", d, b) && ret;
+
+  mpool_destroy(p);
+
+  return ret;
+}
+
+/* blocks of up to 8 bytes share bitmap regions in MPOOL_LISTS pools */
+int test_tiny() {
+  struct memory_pool *p;
+  struct llnode *n;
+  int N = 5000;
+  char *obj[N];
+  size_t sz[] = {1, 2, 4, 8};
+  size_t held = 0, blocks = 0;
+  int i, k, ok = 1;
+  int ret = 0;
+
+  fprintf(stderr, "=== test_tiny\n");
+
+  p = mpool_create(4096);
+  ret = th_check(p != NULL && p->tiny == NULL, "tiny: small pools do not use regions");
+  mpool_destroy(p);
+
+  p = mpool_create(1 << 20);
+
+  if(!(ret = th_check(p != NULL && p->tiny != NULL, "tiny: mpool_create returned non-null (%p) with regions", p) && ret))
+	return 0;
+
+  for(i = 0; i < N; i++) {
+	obj[i] = mpool_alloc(p, sz[i % 4]);
+	if(obj[i] == NULL)
+	  return th_check(0, "tiny: object %d is non-null", i);
+	ok = ok && obj[i] >= p->start && obj[i] + sz[i % 4] <= p->start + p->size && (uintptr_t) obj[i] % sz[i % 4] == 0;
+	memset(obj[i], (char) i, sz[i % 4]);
+  }
+  ret = th_check(ok, "tiny: objects are inside the pool and aligned") && ret;
+
+  for(i = 0; i < N; i++) {
+	for(k = 0; k < (int) sz[i % 4] && obj[i][k] == (char) i; k++);
+	ok = ok && k == (int) sz[i % 4];
+  }
+  ret = th_check(ok, "tiny: objects do not overlap") && ret;
+
+  /* the pool only sees the regions, and they are mostly payload */
+  for(n = p->alloc_list->first; n != NULL; n = n->next) {
+	held += ((struct alloc_info *) n->user_data)->size;
+	blocks++;
+  }
+  ret = th_check(blocks == 5, "tiny: %d objects take 5 regions (%lu)", N, blocks) && ret;
+  ret = th_check((held - 8192) * 0.98 <= (size_t) N * 8, "tiny: metadata is under 2%% (%lu bytes for %d slots)", held, N) && ret;
+
+  /* a tiny block resizes in its slot, or moves out of it with its contents */
+  ret = th_check(mpool_realloc(p, obj[0], 8) == obj[0], "tiny: realloc within the slot stays in place") && ret;
+  obj[0] = mpool_realloc(p, obj[0], 100);
+  ret = th_check(obj[0] != NULL && obj[0][0] == 0, "tiny: realloc out of the slot keeps the contents") && ret;
+
+  for(i = 0; i < N; i++) {
+	mpool_free(p, obj[i]);
+  }
+  mpool_free(p, obj[1]); //already free, ignored
+
+  /* empty regions went back to the pool */
+  ret = th_check(p->alloc_list->first == NULL, "tiny: no blocks are left allocated") && ret;
+  ret = check_free_list("tiny", p) && ret;
+  ret = th_check(p->free_list->first != NULL && p->free_list->first == p->free_list->last &&
+				 ((struct alloc_info *) p->free_list->first->user_data)->size == p->size, "tiny: the pool is one free block again") && ret;
+
+  mpool_destroy(p);
+
+  return ret;
+}
+
+/* threads sharing one MPOOL_THREADS pool */
+#define THREADS 8
+#define THREAD_SLOTS 64
+#define THREAD_OPS 20000
+
+struct thread_arg {
+  struct memory_pool *p;
+  int id;
+  int ok;
+};
+
+static void *thread_churn(void *arg) {
+  struct thread_arg *ta = arg;
+  char *live[THREAD_SLOTS];
+  size_t livesz[THREAD_SLOTS];
+  unsigned int seed = ta->id;
+  int i, j;
+  char mark;
+
+  for(i = 0; i < THREAD_SLOTS; i++)
+	live[i] = NULL;
+
+  ta->ok = 1;
+  for(i = 0; i < THREAD_OPS; i++) {
+	seed = seed * 1103515245 + 12345;
+	j = (seed >> 16) % THREAD_SLOTS;
+	mark = (char) (ta->id * THREAD_SLOTS + j);
+
+	if(live[j] != NULL) {
+	  size_t k;
+	  for(k = 0; k < livesz[j] && live[j][k] == mark; k++);
+	  ta->ok = ta->ok && k == livesz[j];
+
+	  mpool_free(ta->p, live[j]);
+	  live[j] = NULL;
+	} else {
+	  seed = seed * 1103515245 + 12345;
+	  livesz[j] = 1 + (seed >> 16) % ((seed & 0x100) ? 64 : 1000);
+	  live[j] = mpool_alloc(ta->p, livesz[j]);
+	  if(live[j] != NULL)
+		memset(live[j], mark, livesz[j]);
+	}
+  }
+
+  for(i = 0; i < THREAD_SLOTS; i++)
+	mpool_free(ta->p, live[i]);
+
+  return NULL;
+}
+
+int test_threads(int flags) {
+  struct memory_pool *p;
+  pthread_t tid[THREADS];
+  struct thread_arg ta[THREADS];
+  int i, ret = 0;
+
+  p = mpool_create_flags(THREADS * THREAD_SLOTS * 1024 * 2, flags | MPOOL_THREADS);
+
+  if(!(ret = th_check(p != NULL, "threads: mpool_create_flags returned non-null (%p)", p)))
+	return 0;
+
+  for(i = 0; i < THREADS; i++) {
+	ta[i].p = p;
+	ta[i].id = i;
+	pthread_create(&tid[i], NULL, thread_churn, &ta[i]);
+  }
+  for(i = 0; i < THREADS; i++) {
+	pthread_join(tid[i], NULL);
+	ret = th_check(ta[i].ok, "threads: blocks of thread %d were not overwritten", i) && ret;
+  }
+
+  /* exiting threads gave their cached blocks back, so everything coalesces again */
+  char *all = mpool_alloc(p, p->size / 2 + 1);
+  ret = th_check(all != NULL, "threads: mpool_alloc (%p) of more than half the pool after all threads exited is non-null", all) && ret;
+  mpool_free(p, all);
+
+  mpool_destroy(p);
+
+  return ret;
+}
+
+/* a MPOOL_GROW pool maps more chunks when it is full */
+int test_grow(int flags) {
+  struct memory_pool *p, *c;
+  int N = 1000;
+  char *live[N];
+  int i, chunks, ret = 0;
+  size_t total;
+
+  p = mpool_create_flags(4096, flags | MPOOL_GROW);
+
+  if(!(ret = th_check(p != NULL, "grow: mpool_create_flags returned non-null (%p)", p)))
+	return 0;
+
+  ret = th_check(p->map_size >= 4096 && p->size >= 4096, "grow: pool is mapped (%lu bytes)", p->map_size) && ret;
+
+  /* far more than the first chunk holds */
+  for(i = 0; i < N; i++) {
+	live[i] = mpool_alloc(p, 100);
+	ret = th_check(live[i] != NULL && ((uintptr_t) live[i]) % 16 == 0, "grow: allocation %d (%p) is non-null and aligned", i, live[i]) && ret;
+	if(live[i] != NULL)
+	  memset(live[i], (char) i, 100);
+  }
+
+  chunks = 0;
+  total = p->size;
+  for(c = p->grown; c != NULL; c = c->grown) {
+	chunks++;
+	total += c->size;
+  }
+  ret = th_check(chunks > 0 && chunks < 10, "grow: pool grew by a few chunks (%d)", chunks) && ret;
+  ret = th_check(total == p->grow_total, "grow: grow_total (%lu) is the size of all chunks (%lu)", p->grow_total, total) && ret;
+
+  /* larger than any chunk so far */
+  char *big = mpool_alloc(p, 4 * total);
+  ret = th_check(big != NULL, "grow: allocation of %lu bytes (%p) is non-null", 4 * total, big) && ret;
+
+  for(i = 0; i < N; i++) {
+	size_t k;
+	for(k = 0; k < 100 && live[i][k] == (char) i; k++);
+	ret = th_check(k == 100, "grow: block %d was not overwritten", i) && ret;
+	mpool_free(p, live[i]);
+  }
+  mpool_free(p, big);
+
+  /* the freed blocks are reused, so the pool does not grow again */
+  total = p->grow_total;
+  for(i = 0; i < N; i++)
+	live[i] = mpool_alloc(p, 100);
+  ret = th_check(p->grow_total == total, "grow: pool reuses freed blocks (%lu, %lu)", p->grow_total, total) && ret;
+  for(i = 0; i < N; i++)
+	mpool_free(p, live[i]);
+
+  mpool_destroy(p);
+
+  /* fixed-size chunks up to a limit */
+  p = mpool_create_flags(4096, flags | MPOOL_GROW);
+  if(!(ret = th_check(p != NULL, "grow: mpool_create_flags returned non-null (%p)", p) && ret))
+	return 0;
+
+  ret = th_check(mpool_set_growth(p, 16384, 100, 65536), "grow: mpool_set_growth succeeded") && ret;
+
+  for(i = 0; i < N && (live[i] = mpool_alloc(p, 100)) != NULL; i++);
+  ret = th_check(i < N, "grow: pool stops growing at its limit (%d allocations)", i) && ret;
+  ret = th_check(p->grow_total <= 65536, "grow: chunks (%lu bytes) stay within the limit", p->grow_total) && ret;
+  /* only the newest chunk may be cut short by the limit */
+  for(c = p->grown; c != NULL; c = c->grown)
+	ret = th_check(c->size == 16384 || (c == p->grown && c->size < 16384), "grow: chunk has the fixed size (%lu)", c->size) && ret;
+
+  while(i-- > 0)
+	mpool_free(p, live[i]);
+  mpool_destroy(p);
+
+  /* huge page backing only changes how the memory is mapped */
+  p = mpool_create_flags(100000, flags | MPOOL_HUGEPAGE);
+  if(!(ret = th_check(p != NULL, "grow: huge page pool is non-null (%p)", p) && ret))
+	return 0;
+  ret = th_check(((uintptr_t) p->start) % (2 << 20) == 0 && p->size % (2 << 20) == 0, "grow: huge page pool is aligned to 2 MiB (%p, %lu)", p->start, p->size) && ret;
+  ret = th_check(mpool_alloc(p, 100) != NULL, "grow: huge page pool allocates") && ret;
+  mpool_destroy(p);
+
+  p = mpool_create_flags(100000, flags | MPOOL_HUGETLB | MPOOL_GROW);
+  if(!(ret = th_check(p != NULL, "grow: MAP_HUGETLB pool (or its fallback) is non-null (%p)", p) && ret))
+	return 0;
+  ret = th_check(mpool_alloc(p, 100) != NULL, "grow: MAP_HUGETLB pool allocates") && ret;
+  mpool_destroy(p);
+
+  return ret;
+}
+
+/* fixed-size objects from slabs */
+int test_slab(int flags) {
+  struct memory_pool *p;
+  struct mpool_slab_cache *c, *c2;
+  int N = 2000;
+  char *obj[N];
+  int i, ret = 0;
+
+  p = mpool_create_flags(1 << 20, flags);
+
+  if(!(ret = th_check(p != NULL, "slab: mpool_create_flags returned non-null (%p)", p)))
+	return 0;
+
+  c = mpool_slab_create(p, 24, 0);
+  c2 = mpool_slab_create(p, 5, 64);
+  if(!(ret = th_check(c != NULL && c2 != NULL, "slab: mpool_slab_create returned non-null (%p, %p)", c, c2) && ret))
+	return 0;
+
+  ret = th_check(mpool_slab_create(p, 24, 3) == NULL, "slab: alignment that is not a power of two is rejected") && ret;
+
+  for(i = 0; i < N; i++) {
+	obj[i] = mpool_slab_alloc(i % 2 ? c2 : c);
+	ret = th_check(obj[i] != NULL, "slab: object %d (%p) is non-null", i, obj[i]) && ret;
+	if(obj[i] == NULL)
+	  return 0;
+	ret = th_check(((uintptr_t) obj[i]) % (i % 2 ? 64 : 16) == 0, "slab: object %d (%p) is aligned", i, obj[i]) && ret;
+	ret = th_check(obj[i] >= p->start && obj[i] < p->start + p->size, "slab: object %d (%p) is inside the pool", i, obj[i]) && ret;
+	memset(obj[i], (char) i, i % 2 ? 5 : 24);
+  }
+
+  for(i = 0; i < N; i++) {
+	size_t k, n = i % 2 ? 5 : 24;
+	for(k = 0; k < n && obj[i][k] == (char) i; k++);
+	ret = th_check(k == n, "slab: object %d was not overwritten", i) && ret;
+  }
+
+  /* freed slots are reused before new slabs are taken */
+  mpool_slab_free(c, obj[10]);
+  mpool_slab_free(c, obj[10]); //ignored
+  mpool_slab_free(c, obj[11]); //not an object of c, ignored
+  char *again = mpool_slab_alloc(c);
+  ret = th_check(again == obj[10], "slab: freed slot is reused (%p, %p)", again, obj[10]) && ret;
+
+  /* once every object is freed, the slabs (except one kept for reuse) are back in the pool */
+  for(i = 0; i < N; i++)
+	mpool_slab_free(i % 2 ? c2 : c, obj[i]);
+  ret = th_check(c->partial == NULL && c->full == NULL && c->empty != NULL, "slab: empty cache holds only its spare slab") && ret;
+  ret = th_check(c->map.used <= 3, "slab: only the spare slab is registered (%lu entries)", c->map.used) && ret;
+
+  mpool_slab_destroy(c);
+  mpool_slab_destroy(c2);
+
+  char *all = mpool_alloc(p, p->size / 2);
+  ret = th_check(all != NULL, "slab: pool has its memory back after the caches are destroyed (%p)", all) && ret;
+  mpool_free(p, all);
+
+  mpool_destroy(p);
+
+  return ret;
+}
+
+/* many slabs of a size just over a page, allocated and freed at random */
+int test_slab_churn(int flags) {
+  struct memory_pool *p;
+  struct mpool_slab_cache *c;
+  int N = 40000;
+  char **obj;
+  int i, k, n, ret = 0;
+
+  p = mpool_create_flags(1 << 20, flags);
+  obj = malloc(N * sizeof(char *));
+
+  if(!(ret = th_check(p != NULL && obj != NULL, "slab_churn: mpool_create_flags returned non-null (%p)", p)))
+	return 0;
+
+  c = mpool_slab_create(p, 16, 0);
+  if(!(ret = th_check(c != NULL && c->slab_size > 4096, "slab_churn: slabs are just over a page (%lu bytes)", c ? c->slab_size : 0) && ret))
+	return 0;
+
+  /* fill the pool, then free and refill random objects a few times */
+  for(n = 0; n < N && (obj[n] = mpool_slab_alloc(c)) != NULL; n++);
+  ret = th_check(n > 100, "slab_churn: %d objects allocated", n) && ret;
+
+  srand(36);
+  for(k = 0; k < 4; k++) {
+	for(i = 0; i < n; i++) {
+	  if(rand() % 2) {
+		mpool_slab_free(c, obj[i]);
+		obj[i] = NULL;
+	  }
+	}
+	for(i = 0; i < n; i++) {
+	  if(obj[i] == NULL)
+		obj[i] = mpool_slab_alloc(c);
+	}
+  }
+
+  /* every object is found again, so every slab but the spare goes back */
+  for(i = 0; i < n; i++)
+	mpool_slab_free(c, obj[i]);
+  ret = th_check(c->partial == NULL && c->full == NULL && c->empty != NULL, "slab_churn: empty cache holds only its spare slab") && ret;
+  ret = th_check(c->map.used <= 3, "slab_churn: only the spare slab is registered (%lu entries)", c->map.used) && ret;
+
+  mpool_slab_destroy(c);
+
+  char *all = mpool_alloc(p, p->size - p->size / 16);
+  ret = th_check(all != NULL, "slab_churn: pool coalesces back into one block (%p)", all) && ret;
+  mpool_free(p, all);
+
+  mpool_destroy(p);
+  free(obj);
+
+  return ret;
+}
+
+/* bump allocation with mark/release */
+int test_arena() {
+  struct memory_pool *p;
+  char *a, *b, *c, *d;
+  size_t mark;
+  int i, ret = 0;
+
+  ret = th_check(mpool_create_flags(1024, MPOOL_ARENA | MPOOL_GROW) == NULL, "arena: growable arenas are rejected");
+
+  p = mpool_create_flags(1024, MPOOL_ARENA);
+
+  if(!(ret = th_check(p != NULL, "arena: mpool_create_flags returned non-null (%p)", p) && ret))
+	return 0;
+
+  /* same alignment rules as every other mode, and nothing in between */
+  a = mpool_alloc(p, 1);
+  b = mpool_alloc(p, 4);
+  c = mpool_alloc(p, 3);
+  d = mpool_alloc(p, 17);
+  ret = th_check(a == p->start && b == p->start + 4 && c == p->start + 8 && d == p->start + 16,
+				 "arena: allocations are bumped and aligned (%p %p %p %p)", a, b, c, d) && ret;
+
+  mark = mpool_mark(p);
+  ret = th_check(mark == 33, "arena: mark is the top of the arena (%lu)", mark) && ret;
+
+  mpool_free(p, d); //does nothing
+  for(i = 0; mpool_alloc(p, 100) != NULL; i++);
+  ret = th_check(i == 8, "arena: arena fills up (%d allocations of 100 bytes)", i) && ret;
+
+  /* releasing to the mark hands out the same memory again */
+  mpool_release_to(p, mark);
+  a = mpool_alloc(p, 100);
+  ret = th_check(a == p->start + 48, "arena: memory after the mark is reused (%p)", a) && ret;
+
+  mpool_reset(p);
+  a = mpool_alloc(p, 1024);
+  ret = th_check(a == p->start, "arena: whole arena is available after mpool_reset (%p)", a) && ret;
+
+  mpool_destroy(p);
+
+  return ret;
+}
+
+/* does the block hold byte c in its first n bytes? */
+int holds(char *addr, int c, size_t n) {
+  size_t i;
+
+  for(i = 0; i < n; i++) {
+	if(addr[i] != (char) c)
+	  return 0;
+  }
+  return 1;
+}
+
+int test_realloc(int flags) {
+  struct memory_pool *p;
+  char *a, *b, *c;
+  char *slots[64];
+  size_t sizes[64];
+  int i, moves, ok;
+  int ret = 1;
+
+  fprintf(stderr, "=== test_realloc (flags %d)\n", flags);
+
+  p = mpool_create_flags(65536, flags);
+
+  if(!(ret = th_check(p != NULL, "realloc: mpool_create_flags returned non-null (%p)", p)))
+	return 0;
+
+  a = mpool_realloc(p, NULL, 100);
+  ret = th_check(a != NULL, "realloc: NULL block is allocated (%p)", a) && ret;
+  memset(a, 'a', 100);
+
+  /* the space after the block is free, so it grows in place */
+  b = mpool_realloc(p, a, 200);
+  ret = th_check(b == a, "realloc: block grows in place (%p, %p)", a, b) && ret;
+  memset(b + 100, 'a', 100);
+
+  /* with a block after it, it has to move */
+  c = mpool_alloc(p, 50);
+  b = mpool_realloc(p, a, 2000);
+  ret = th_check(b != NULL && b != a, "realloc: block moves when it cannot grow (%p, %p)", a, b) && ret;
+  ret = th_check(b != NULL && holds(b, 'a', 200), "realloc: contents are copied") && ret;
+
+  a = mpool_realloc(p, b, 10);
+  ret = th_check(a == b && holds(a, 'a', 10), "realloc: block shrinks in place (%p, %p)", a, b) && ret;
+
+  ret = th_check(mpool_realloc(p, a, 0) == NULL, "realloc: size 0 frees the block") && ret;
+  mpool_free(p, c);
+  mpool_destroy(p);
+
+  /* an append-only buffer in an otherwise empty pool never moves */
+  p = mpool_create_flags(65536, flags);
+  a = NULL;
+  moves = 0;
+  ok = 1;
+  for(i = 1; i <= 128; i++) {
+	b = mpool_realloc(p, a, 16 * i);
+	if(b == NULL) {
+	  ok = 0;
+	  break;
+	}
+	moves += (a != NULL && b != a);
+	ok = ok && holds(b, 'x', 16 * (i - 1));
+	memset(b + 16 * (i - 1), 'x', 16);
+	a = b;
+  }
+  ret = th_check(ok, "realloc: appending keeps the contents") && ret;
+  if(!(flags & MPOOL_THREADS)) //blocks cached in magazines stand in the way
+	ret = th_check(moves == 0, "realloc: appending grows in place (%d moves)", moves) && ret;
+  mpool_destroy(p);
+
+  /* random resizes keep the contents of every block */
+  p = mpool_create_flags(65536, flags);
+  memset(slots, 0, sizeof(slots));
+  memset(sizes, 0, sizeof(sizes));
+  srand(252);
+  ok = 1;
+  for(i = 0; i < 5000; i++) {
+	int s = rand() % 64;
+	size_t size = 1 + rand() % 300;
+
+	a = mpool_realloc(p, slots[s], size);
+	if(a == NULL)
+	  continue; //the old block is still there
+
+	ok = ok && holds(a, s, (sizes[s] < size) ? sizes[s] : size);
+	memset(a, s, size);
+	slots[s] = a;
+	sizes[s] = size;
+  }
+  ret = th_check(ok, "realloc: random resizes keep the contents") && ret;
+  mpool_destroy(p);
+
+  return ret;
+}
+
+int test_stats(int flags) {
+  struct memory_pool *p;
+  struct mpool_stats st;
+  char *blocks[10];
+  char json[4096], max[64];
+  uint64_t timed = 0;
+  size_t n;
+  FILE *f;
+  int i;
+  int ret = 1;
+  int arena = (flags & MPOOL_MODE_MASK) == MPOOL_ARENA;
+
+  fprintf(stderr, "=== test_stats (flags %d)\n", flags);
+
+  p = mpool_create_flags(4096, flags);
+  ret = th_check(p != NULL && !mpool_stats(p, &st), "stats: pools without MPOOL_STATS have none");
+  mpool_destroy(p);
+
+  p = mpool_create_flags(4096, flags | MPOOL_STATS);
+
+  if(!(ret = th_check(p != NULL, "stats: mpool_create_flags returned non-null (%p)", p) && ret))
+	return 0;
+
+  for(i = 0; i < 10; i++)
+	blocks[i] = mpool_alloc(p, 100);
+  ret = th_check(mpool_alloc(p, 10000) == NULL, "stats: oversized allocation fails") && ret;
+  for(i = 0; i < 5; i++)
+	mpool_free(p, blocks[i]);
+
+  ret = th_check(mpool_stats(p, &st), "stats: mpool_stats succeeded") && ret;
+  ret = th_check(st.allocs == 10 && st.failed == 1, "stats: allocations are counted (%lu, %lu failed)", st.allocs, st.failed) && ret;
+  ret = th_check(st.requested_bytes == 1000 && st.allocated_bytes >= 1000, "stats: requested and allocated bytes (%lu, %lu)",
+				 st.requested_bytes, st.allocated_bytes) && ret;
+  ret = th_check(st.internal_waste >= 0 && st.internal_waste < 1, "stats: internal waste is a fraction (%f)", st.internal_waste) && ret;
+  ret = th_check(st.peak_count == 10 && st.peak_bytes >= 1000, "stats: peak usage (%lu blocks, %lu bytes)", st.peak_count, st.peak_bytes) && ret;
+  if(!arena) {
+	ret = th_check(st.frees == 5 && st.live_count == 5, "stats: frees are counted (%lu, %lu live)", st.frees, st.live_count) && ret;
+	ret = th_check(st.live_bytes * 2 == st.peak_bytes, "stats: live bytes (%lu of %lu)", st.live_bytes, st.peak_bytes) && ret;
+  }
+  ret = th_check(st.free_bytes > 0 && st.largest_free <= st.free_bytes, "stats: free space (%lu, largest %lu)",
+				 st.free_bytes, st.largest_free) && ret;
+  ret = th_check(st.external_frag >= 0 && st.external_frag < 1, "stats: external fragmentation is a fraction (%f)", st.external_frag) && ret;
+  ret = th_check(mpool_stats_percentile(st.size_classes, 50) == 96, "stats: size class of 100 bytes (%lu)",
+				 mpool_stats_percentile(st.size_classes, 50)) && ret;
+
+  for(i = 0; i < MPOOL_NBINS; i++)
+	timed += st.alloc_ns[i];
+  ret = th_check(timed == 11, "stats: every allocation is timed (%lu)", (size_t) timed) && ret;
+
+  /* the slowest allocation is exact, so it falls inside the top bucket */
+  for(i = MPOOL_NBINS - 1; i > 0 && st.alloc_ns[i] == 0; i--);
+  ret = th_check(st.alloc_ns_max >= mpool_stats_bucket(i) && (i == MPOOL_NBINS - 1 || st.alloc_ns_max < mpool_stats_bucket(i + 1)),
+				 "stats: slowest allocation (%lu ns) is in the top bucket", (size_t) st.alloc_ns_max) && ret;
+
+  f = tmpfile();
+  ret = th_check(f != NULL && mpool_stats_json(p, f), "stats: mpool_stats_json succeeded") && ret;
+  if(f != NULL) {
+	rewind(f);
+	n = fread(json, 1, sizeof(json) - 1, f);
+	json[n] = '\0';
+	fclose(f);
+	ret = th_check(json[0] == '{' && strstr(json, "\"allocs\": 10,") != NULL && strstr(json, "\"alloc_ns\": {") != NULL,
+				   "stats: JSON holds the counters") && ret;
+	snprintf(max, sizeof(max), "\"max\": %lu,", (size_t) st.alloc_ns_max);
+	ret = th_check(strstr(json, max) != NULL, "stats: JSON holds the slowest allocation (%s)", max) && ret;
+  }
+
+  mpool_destroy(p);
+
+  return ret;
+}
+
+/* lock-free fixed blocks, hammered by more threads than there are cores */
+#define FIXED_HOLD 16
+#define FIXED_OPS 20000
+
+struct fixed_arg {
+  struct mpool_fixed *f;
+  uint64_t id;
+  int ok;
+  size_t got;
+};
+
+static void *thread_fixed(void *arg) {
+  struct fixed_arg *fa = arg;
+  uint64_t *held[FIXED_HOLD];
+  int i, j, n;
+
+  fa->ok = 1;
+  fa->got = 0;
+  for(i = 0; i < FIXED_OPS; i += n) {
+	/* take a few blocks and stamp them, so a block handed out twice is overwritten */
+	for(n = 0; n < FIXED_HOLD && (held[n] = mpool_fixed_alloc(fa->f)) != NULL; n++) {
+	  held[n][0] = fa->id;
+	  held[n][1] = (uint64_t) i + n;
+	}
+	for(j = 0; j < n; j++) {
+	  fa->ok = fa->ok && held[j][0] == fa->id && held[j][1] == (uint64_t) i + j;
+	  mpool_fixed_free(fa->f, held[j]);
+	}
+	fa->got += n;
+	n = n ? n : 1;
+  }
+
+  return NULL;
+}
+
+int test_fixed(int flags) {
+  struct memory_pool *p;
+  struct mpool_fixed *f;
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  int nthreads = (cores * 2 < 8) ? 8 : (cores * 2 > 64) ? 64 : (int) cores * 2;
+  pthread_t tid[64];
+  struct fixed_arg fa[64];
+  size_t nblocks = nthreads * FIXED_HOLD / 2; //fewer than the threads want, so the list runs empty
+  char *seen;
+  size_t i, k;
+  int ret = 0;
+
+  fprintf(stderr, "=== test_fixed (flags %d, %d threads)\n", flags, nthreads);
+
+  p = mpool_create_flags(1 << 16, flags);
+
+  if(!(ret = th_check(p != NULL, "fixed: mpool_create_flags returned non-null (%p)", p)))
+	return 0;
+
+  ret = th_check(mpool_fixed_create(p, 16, 0) == NULL, "fixed: a list without blocks is rejected") && ret;
+
+  f = mpool_fixed_create(p, 16, nblocks);
+  if(!(ret = th_check(f != NULL, "fixed: mpool_fixed_create returned non-null (%p)", f) && ret))
+	return 0;
+
+  for(i = 0; i < (size_t) nthreads; i++) {
+	fa[i].f = f;
+	fa[i].id = i + 1;
+	pthread_create(&tid[i], NULL, thread_fixed, &fa[i]);
+  }
+  for(i = 0; i < (size_t) nthreads; i++) {
+	pthread_join(tid[i], NULL);
+	ret = th_check(fa[i].ok, "fixed: no block of thread %lu was handed to another thread (%lu allocations)", i, fa[i].got) && ret;
+  }
+
+  /* every block is free again, exactly once */
+  seen = calloc(nblocks, 1);
+  for(k = 0; k < nblocks; k++) {
+	char *b = mpool_fixed_alloc(f);
+	if(!(ret = th_check(b != NULL, "fixed: block %lu of %lu is still there", k, nblocks) && ret))
+	  break;
+	i = (b - f->blocks) / f->stride;
+	ret = th_check(b >= p->start && b < p->start + p->size && ((uintptr_t) b) % 16 == 0 && !seen[i],
+				   "fixed: block %lu (%p) is inside the pool, aligned and not handed out twice", k, b) && ret;
+	seen[i] = 1;
+  }
+  ret = th_check(mpool_fixed_alloc(f) == NULL, "fixed: no more blocks than were created") && ret;
+  free(seen);
+
+  mpool_fixed_free(f, p->start + p->size); //not a block, ignored
+  mpool_fixed_free(f, f->blocks + 1); //inside a block, ignored
+  ret = th_check(mpool_fixed_alloc(f) == NULL, "fixed: foreign addresses are not taken as blocks") && ret;
+
+  mpool_fixed_free(f, f->blocks);
+  mpool_fixed_free(f, f->blocks); //already free, ignored
+  ret = th_check(mpool_fixed_alloc(f) == f->blocks, "fixed: a freed block is allocated again") && ret;
+  ret = th_check(mpool_fixed_alloc(f) == NULL, "fixed: a block freed twice is only on the list once") && ret;
+
+  mpool_fixed_destroy(f);
+
+  char *all = mpool_alloc(p, p->size / 2);
+  ret = th_check(all != NULL, "fixed: pool has its memory back after the list is destroyed (%p)", all) && ret;
+  mpool_free(p, all);
+
+  mpool_destroy(p);
+
+  return ret;
+}
+
+/* handles: fill a heap, free every other block, and have compaction make
+   room for a block larger than any hole */
+static int handles_intact(struct mpool_handles *h, uint32_t *handles, int n) {
+  int ok = 1, i;
+
+  for(i = 0; i < n; i++) {
+	unsigned char *b;
+	if(handles[i] == 0)
+	  continue;
+	b = mpool_pin(h, handles[i]);
+	ok = ok && b != NULL && b[0] == (unsigned char) i && b[99] == (unsigned char) i;
+	mpool_unpin(h, handles[i]);
+  }
+  return ok;
+}
+
+int test_handles(int flags) {
+  struct memory_pool *p;
+  struct mpool_handles *h;
+  uint32_t handles[256], big;
+  char *pinned;
+  int n, i, steps;
+  int ret = 0;
+
+  fprintf(stderr, "=== test_handles (flags %d)\n", flags);
+
+  p = mpool_create_flags(1 << 16, flags);
+
+  if(!(ret = th_check(p != NULL, "handles: mpool_create_flags returned non-null (%p)", p)))
+	return 0;
+
+  ret = th_check(mpool_handles_create(p, 8, 0) == NULL, "handles: a heap too small for one block is rejected") && ret;
+
+  h = mpool_handles_create(p, 16384, 0);
+  if(!(ret = th_check(h != NULL, "handles: mpool_handles_create returned non-null (%p)", h) && ret))
+	return 0;
+
+  for(n = 0; n < 256 && (handles[n] = mpool_halloc(h, 100)) != 0; n++) {
+	memset(mpool_pin(h, handles[n]), n, 100);
+	mpool_unpin(h, handles[n]);
+  }
+  ret = th_check(n > 64 && n < 256, "handles: the heap fills up (%d blocks)", n) && ret;
+  ret = th_check(mpool_hsize(h, handles[0]) >= 100, "handles: usable size (%lu)", mpool_hsize(h, handles[0])) && ret;
+
+  pinned = mpool_pin(h, handles[n / 2 + 1]);
+  for(i = 0; i < n; i += 2) {
+	mpool_hfree(h, handles[i]);
+	handles[i] = 0;
+  }
+  mpool_hfree(h, 0); //never a handle, ignored
+  mpool_hfree(h, 100000); //not in use, ignored
+
+  big = mpool_halloc(h, 2000);
+  ret = th_check(big != 0, "handles: compaction made room for a block larger than any hole") && ret;
+  ret = th_check(handles_intact(h, handles, n), "handles: the blocks that moved kept their contents") && ret;
+  ret = th_check(mpool_pin(h, handles[n / 2 + 1]) == pinned, "handles: a pinned block did not move") && ret;
+  mpool_unpin(h, handles[n / 2 + 1]);
+  mpool_unpin(h, handles[n / 2 + 1]);
+  mpool_hfree(h, big);
+
+  /* a pass in small steps, with a new block put in the hole it leaves */
+  for(i = 0; i < n; i++) {
+	if(i % 4 == 1) {
+	  mpool_hfree(h, handles[i]);
+	  handles[i] = 0;
+	}
+  }
+  ret = th_check(mpool_hcompact(h, 256) == 0, "handles: a step of 256 bytes does not finish the pass") && ret;
+  big = mpool_halloc(h, 100);
+  ret = th_check(big != 0, "handles: a block is allocated while the pass is unfinished") && ret;
+  memset(mpool_pin(h, big), 0xff, 100);
+  mpool_unpin(h, big);
+  for(steps = 1; steps < 1000 && !mpool_hcompact(h, 256); steps++);
+  ret = th_check(steps > 1 && steps < 1000, "handles: the pass finished in %d steps", steps) && ret;
+  ret = th_check(h->top == h->live, "handles: the heap has no holes left (%lu in use, %lu live)", h->top, h->live) && ret;
+  ret = th_check(handles_intact(h, handles, n), "handles: blocks kept their contents over the steps") && ret;
+  ret = th_check(((unsigned char *) mpool_pin(h, big))[99] == 0xff, "handles: so did the block allocated during the pass") && ret;
+  mpool_unpin(h, big);
+
+  mpool_handles_destroy(h);
+
+  char *all = mpool_alloc(p, p->size / 2);
+  ret = th_check(all != NULL, "handles: pool has its memory back after the heap is destroyed (%p)", all) && ret;
+  mpool_free(p, all);
+
+  mpool_destroy(p);
+
+  return ret;
+}
+
+/* typed pools: a struct, a type smaller than the free-list link and an
+   over-aligned one */
+typedef struct tnode {
+  struct tnode *next;
+  int key;
+  char name[20];
+} tnode_t;
+
+typedef char tbyte_t;
+
+typedef struct {
+  double v[3];
+} __attribute__((aligned(64))) tvec_t;
+
+MPOOL_DEFINE_TYPED(tnode_t)
+MPOOL_DEFINE_TYPED(tbyte_t)
+MPOOL_DEFINE_TYPED(tvec_t)
+
+int test_typed(int flags) {
+  struct memory_pool *p;
+  struct mpool_tnode_t nodes;
+  struct mpool_tbyte_t bytes;
+  struct mpool_tvec_t vecs;
+  tnode_t *list = NULL, *n, *first;
+  tbyte_t *b[100];
+  tvec_t *v[100];
+  int i, ok;
+  int ret = 0;
+
+  fprintf(stderr, "=== test_typed (flags %d)\n", flags);
+
+  p = mpool_create_flags(1 << 18, flags);
+
+  if(!(ret = th_check(p != NULL, "typed: mpool_create_flags returned non-null (%p)", p)))
+	return 0;
+
+  ret = th_check(MPOOL_TYPED_STRIDE(tnode_t) == sizeof(tnode_t) && MPOOL_TYPED_STRIDE(tbyte_t) == sizeof(void *)
+				 && MPOOL_TYPED_STRIDE(tvec_t) == 64, "typed: strides are constants of the type") && ret;
+
+  mpool_tnode_t_init(&nodes, p);
+  mpool_tbyte_t_init(&bytes, p);
+  mpool_tvec_t_init(&vecs, p);
+
+  /* a list of 1000 nodes, spread over several chunks */
+  for(i = 0; i < 1000; i++) {
+	if((n = mpool_tnode_t_alloc(&nodes)) == NULL)
+	  break;
+	n->key = i;
+	n->next = list;
+	list = n;
+  }
+  ret = th_check(i == 1000, "typed: 1000 nodes allocated (%d)", i) && ret;
+  for(ok = 1, n = list; n != NULL; n = n->next, i--)
+	ok = ok && n->key == i - 1 && (char *) n >= p->start && (char *) n < p->start + p->size
+	  && ((uintptr_t) n) % __alignof__(tnode_t) == 0;
+  ret = th_check(ok && i == 0, "typed: nodes are distinct, aligned and inside the pool") && ret;
+
+  for(i = 0; i < 100; i++) {
+	b[i] = mpool_tbyte_t_alloc(&bytes);
+	v[i] = mpool_tvec_t_alloc(&vecs);
+	if(b[i] == NULL || v[i] == NULL)
+	  break;
+	*b[i] = (char) i;
+	v[i]->v[2] = i;
+  }
+  ret = th_check(i == 100, "typed: bytes and vectors allocated") && ret;
+  for(ok = 1, i = 0; i < 100; i++)
+	ok = ok && *b[i] == (char) i && v[i]->v[2] == i && ((uintptr_t) v[i]) % 64 == 0;
+  ret = th_check(ok, "typed: small and over-aligned objects do not overlap, vectors are aligned to 64") && ret;
+
+  /* freed objects come back first, most recent first */
+  first = list;
+  while(list != NULL) {
+	n = list->next;
+	mpool_tnode_t_free(&nodes, list);
+	list = n;
+  }
+  mpool_tnode_t_free(&nodes, NULL); //ignored
+  ret = th_check(mpool_tnode_t_alloc(&nodes) != NULL && nodes.t.free != NULL, "typed: freed nodes are reused") && ret;
+  n = mpool_tnode_t_alloc(&nodes);
+  ret = th_check(n != NULL && n != first, "typed: the free list hands out each node once") && ret;
+
+  mpool_tnode_t_destroy(&nodes);
+  mpool_tbyte_t_destroy(&bytes);
+  mpool_tvec_t_destroy(&vecs);
+
+  char *all = mpool_alloc(p, p->size / 2);
+  ret = th_check(all != NULL, "typed: pool has its memory back after the typed pools are destroyed (%p)", all) && ret;
+  mpool_free(p, all);
+
+  mpool_destroy(p);
+
+  return ret;
+}
+
+/* the profile of p in `format`, read back into buf */
+static size_t profile_text(struct memory_pool *p, int format, char *buf, size_t n) {
+  FILE *f = tmpfile();
+  size_t len = 0;
+
+  if(f == NULL)
+	return 0;
+  if(mpool_profile_dump(p, f, format)) {
+	rewind(f);
+	len = fread(buf, 1, n - 1, f);
+  }
+  buf[len] = '\0';
+  fclose(f);
+  return len;
+}
+
+/* the bytes in use on each line of a folded profile, in order; returns the number of lines */
+static int profile_folded(const char *text, double *bytes, int max) {
+  int n = 0;
+  const char *line, *end, *sp;
+
+  for(line = text; *line != '\0' && n < max; line = end + 1) {
+	if((end = strchr(line, '\n')) == NULL)
+	  break;
+	for(sp = end; sp > line && sp[-1] != ' '; sp--);
+	bytes[n++] = atof(sp);
+  }
+  return n;
+}
+
+/* the sampling heap profiler: every allocation sampled, then a rate */
+int test_profile(int flags) {
+  struct memory_pool *p;
+  char *a[10], *b[5], *buf = malloc(1 << 20);
+  char path[] = "/tmp/pa_test_profile_XXXXXX";
+  double bytes[8], inuse = 0;
+  int i, n, fd;
+  int ret = 0;
+
+  fprintf(stderr, "=== test_profile (flags %d)\n", flags);
+
+  p = mpool_create_flags(1 << 16, flags);
+
+  if(!(ret = th_check(p != NULL, "profile: mpool_create_flags returned non-null (%p)", p)))
+	return 0;
+
+  ret = th_check(!mpool_profile_dump(p, stdout, MPOOL_PROFILE_FOLDED), "profile: a pool that is not profiled has no profile") && ret;
+  ret = th_check(mpool_set_profile(p, 1), "profile: mpool_set_profile succeeded") && ret;
+
+  /* with a rate of one byte every block is sampled, and counts as itself */
+  for(i = 0; i < 10; i++)
+	a[i] = mpool_alloc(p, 200);
+  for(i = 0; i < 5; i++)
+	b[i] = mpool_alloc(p, 1000);
+
+  profile_text(p, MPOOL_PROFILE_FOLDED, buf, 1 << 20);
+  n = profile_folded(buf, bytes, 8);
+  ret = th_check(n == 2 && ((bytes[0] == 2000 && bytes[1] == 5000) || (bytes[0] == 5000 && bytes[1] == 2000)),
+				 "profile: two call sites holding 2000 and 5000 bytes (%d sites)", n) && ret;
+  ret = th_check(strchr(buf, ';') != NULL, "profile: folded stacks have more than one frame") && ret;
+
+  for(i = 0; i < 10; i++)
+	mpool_free(p, a[i]);
+  mpool_free_batch(p, (void **) b, 2);
+  profile_text(p, MPOOL_PROFILE_FOLDED, buf, 1 << 20);
+  n = profile_folded(buf, bytes, 8);
+  ret = th_check(n == 1 && bytes[0] == 3000, "profile: freed blocks are no longer in use (%d sites)", n) && ret;
+
+  profile_text(p, MPOOL_PROFILE_PPROF, buf, 1 << 20);
+  ret = th_check(strncmp(buf, "heap profile:", 13) == 0 && strstr(buf, "@ heapprofile") != NULL
+				 && strstr(buf, "\nMAPPED_LIBRARIES:\n") != NULL, "profile: pprof heap profile header and mappings") && ret;
+  n = sscanf(buf, "heap profile: %*f: %lf", &inuse);
+  ret = th_check(n == 1 && inuse == 3000, "profile: pprof profile holds the bytes in use (%.0f)", inuse) && ret;
+
+  /* dump on a signal, written by the next allocation */
+  if((fd = mkstemp(path)) >= 0) {
+	close(fd);
+	ret = th_check(mpool_profile_signal(p, SIGUSR1, path, MPOOL_PROFILE_FOLDED), "profile: signal handler installed") && ret;
+	raise(SIGUSR1);
+	a[0] = mpool_alloc(p, 100);
+	FILE *f = fopen(path, "r");
+	n = (f != NULL) ? fread(buf, 1, 4096, f) : 0;
+	if(f != NULL)
+	  fclose(f);
+	ret = th_check(n > 0, "profile: the signal wrote the profile (%d bytes)", n) && ret;
+	mpool_free(p, a[0]);
+	unlink(path);
+  }
+
+  ret = th_check(mpool_set_profile(p, 0) && !mpool_profile_dump(p, stdout, MPOOL_PROFILE_FOLDED), "profile: profiling stops") && ret;
+  mpool_destroy(p);
+
+  /* sampled every 4 KiB on average, the estimate is close to the truth */
+  p = mpool_create_flags(1 << 22, flags);
+  if(!(ret = th_check(p != NULL, "profile: mpool_create_flags returned non-null (%p)", p) && ret))
+	return 0;
+  mpool_set_profile(p, 4096);
+  for(i = 0; i < 20000; i++)
+	mpool_alloc(p, 100);
+  profile_text(p, MPOOL_PROFILE_PPROF, buf, 1 << 20);
+  inuse = 0;
+  sscanf(buf, "heap profile: %*f: %lf", &inuse);
+  ret = th_check(inuse > 1500000 && inuse < 2500000, "profile: 2000000 bytes in use estimated as %.0f", inuse) && ret;
+  mpool_destroy(p);
+
+  free(buf);
+  return ret;
+}
+
+/* mpool_alloc_aligned for every alignment up to a page */
+int test_aligned(int flags) {
+  struct memory_pool *p;
+  char *blocks[40];
+  size_t sizes[40];
+  size_t align, n = 0, i, j;
+  int ok = 1, arena = (flags & MPOOL_MODE_MASK) == MPOOL_ARENA;
+  int ret = 0;
+
+  fprintf(stderr, "=== test_aligned (flags %d)\n", flags);
+
+  p = mpool_create_flags(1 << 18, flags);
+
+  if(!(ret = th_check(p != NULL, "aligned: mpool_create_flags returned non-null (%p)", p)))
+	return 0;
+
+  ret = th_check(mpool_alloc_aligned(p, 10, 0) == NULL && mpool_alloc_aligned(p, 10, 48) == NULL &&
+				 mpool_alloc_aligned(p, 10, 2 * MPOOL_MAX_ALIGN) == NULL, "aligned: alignments that are not powers of two up to a page are rejected") && ret;
+
+  for(align = 1; align <= MPOOL_MAX_ALIGN; align *= 2) {
+	for(i = 0; i < 3; i++) {
+	  size_t size = (i == 0) ? 1 : (i == 1) ? align + 3 : 100;
+	  char *b = mpool_alloc_aligned(p, size, align);
+
+	  ok = ok && b != NULL && b >= p->start && b + size <= p->start + p->size && ((uintptr_t) b) % align == 0;
+	  if(b != NULL) {
+		memset(b, (char) n, size);
+		sizes[n] = size;
+		blocks[n++] = b;
+	  }
+	  if(n == 40) break;
+	}
+	if(n == 40) break;
+  }
+  ret = th_check(ok, "aligned: every block is inside the pool and aligned") && ret;
+
+  for(i = 0; i < n; i++) {
+	for(j = 0; j < sizes[i] && blocks[i][j] == (char) i; j++);
+	ok = ok && j == sizes[i];
+  }
+  ret = th_check(ok, "aligned: blocks do not overlap") && ret;
+
+  if(!arena) {
+	for(i = 0; i < n; i++)
+	  mpool_free(p, blocks[i]);
+
+	/* the padding in front of aligned blocks was given back as well */
+	char *all = mpool_alloc(p, p->size / 2);
+	ret = th_check(all != NULL, "aligned: pool has its memory back after freeing (%p)", all) && ret;
+	mpool_free(p, all);
+  }
+
+  mpool_destroy(p);
+
+  return ret;
+}
+
+/* MPOOL_CACHELINE pads and aligns every block to a cache line */
+int test_cacheline(int flags) {
+  struct memory_pool *p;
+  char *blocks[20];
+  int i, j, ok = 1;
+  int ret = 0;
+
+  fprintf(stderr, "=== test_cacheline (flags %d)\n", flags);
+
+  p = mpool_create_flags(1 << 16, flags | MPOOL_CACHELINE);
+
+  if(!(ret = th_check(p != NULL, "cacheline: mpool_create_flags returned non-null (%p)", p)))
+	return 0;
+
+  for(i = 0; i < 20; i++) {
+	blocks[i] = mpool_alloc(p, 1 + i * 7);
+	ok = ok && blocks[i] != NULL && ((uintptr_t) blocks[i]) % MPOOL_CACHELINE_SIZE == 0;
+  }
+  ret = th_check(ok, "cacheline: every block starts a cache line") && ret;
+
+  /* the cache lines of block i are first[i] to last[i] */
+  for(i = 0; i < 20; i++) {
+	for(j = 0; j < i; j++) {
+	  uintptr_t first_i = (uintptr_t) blocks[i] / MPOOL_CACHELINE_SIZE, last_i = ((uintptr_t) blocks[i] + i * 7) / MPOOL_CACHELINE_SIZE;
+	  uintptr_t first_j = (uintptr_t) blocks[j] / MPOOL_CACHELINE_SIZE, last_j = ((uintptr_t) blocks[j] + j * 7) / MPOOL_CACHELINE_SIZE;
+	  ok = ok && (last_i < first_j || last_j < first_i);
+	}
+  }
+  ret = th_check(ok, "cacheline: no two blocks share a cache line") && ret;
+
+  blocks[0] = mpool_realloc(p, blocks[0], 100);
+  ret = th_check(blocks[0] != NULL && ((uintptr_t) blocks[0]) % MPOOL_CACHELINE_SIZE == 0, "cacheline: realloc keeps the alignment") && ret;
+
+  for(i = 0; i < 20; i++)
+	mpool_free(p, blocks[i]);
+  mpool_destroy(p);
+
+  return ret;
+}
+
+/* mpool_free_batch frees blocks in any order, skipping NULL and repeated addresses */
+int test_free_batch(int flags) {
+  struct memory_pool *p;
+  int N = 300;
+  char *blocks[N + 2];
+  size_t sizes[N];
+  int i, j, ok = 1;
+  int ret = 0;
+  int lists = (flags & MPOOL_MODE_MASK) == MPOOL_LISTS;
+
+  fprintf(stderr, "=== test_free_batch (flags %d)\n", flags);
+
+  p = mpool_create_flags(1 << 18, flags);
+
+  if(!(ret = th_check(p != NULL, "free_batch: mpool_create_flags returned non-null (%p)", p)))
+	return 0;
+
+  srand(252);
+  for(i = 0; i < N; i++) {
+	sizes[i] = 1 + rand() % 200;
+	if((blocks[i] = mpool_alloc(p, sizes[i])) == NULL)
+	  return th_check(0, "free_batch: mpool_alloc of %lu bytes returned non-null", sizes[i]);
+	memset(blocks[i], (int) sizes[i], sizes[i]);
+  }
+
+  /* free a random half, plus a NULL and one of them twice */
+  for(i = N - 1; i > 0; i--) {
+	j = rand() % (i + 1);
+	char *b = blocks[i]; blocks[i] = blocks[j]; blocks[j] = b;
+	size_t s = sizes[i]; sizes[i] = sizes[j]; sizes[j] = s;
+  }
+  blocks[N] = NULL;
+  blocks[N + 1] = blocks[0];
+  char *half[N / 2 + 2];
+  memcpy(half, blocks, (N / 2) * sizeof(char *));
+  half[N / 2] = blocks[N];
+  half[N / 2 + 1] = blocks[N + 1];
+  mpool_free_batch(p, (void **) half, N / 2 + 2);
+
+  for(i = N / 2; i < N; i++) {
+	size_t k;
+	for(k = 0; k < sizes[i] && blocks[i][k] == (char) sizes[i]; k++);
+	ok = ok && k == sizes[i];
+  }
+  ret = th_check(ok, "free_batch: the blocks not in the batch are untouched") && ret;
+  if(lists && !(flags & MPOOL_THREADS))
+	ret = check_free_list("free_batch: after half", p) && ret;
+
+  mpool_free_batch(p, (void **) (blocks + N / 2), N - N / 2);
+
+  if(flags & MPOOL_STATS) {
+	struct mpool_stats st;
+
+	mpool_stats(p, &st);
+	ret = th_check(st.live_count == 0 && st.live_bytes == 0 && st.frees == (size_t) N,
+				   "free_batch: every block is counted as freed once (%lu live, %lu frees)", st.live_count, st.frees) && ret;
+  }
+
+  /* magazines keep some blocks of a MPOOL_THREADS pool */
+  if(!(flags & MPOOL_THREADS)) {
+	if(lists) {
+	  ret = check_free_list("free_batch: after all", p) && ret;
+	  ret = th_check(p->alloc_list->first == NULL, "free_batch: alloc_list is empty after freeing everything") && ret;
+	}
+
+	char *all = mpool_alloc(p, p->size - 64);
+	ret = th_check(all != NULL, "free_batch: mpool_alloc (%p) of nearly the whole pool after freeing everything is non-null", all) && ret;
+	mpool_free(p, all);
+  }
+
+  mpool_destroy(p);
+
+  return ret;
+}
+
+/* MPOOL_DEFERRED queues frees until MPOOL_DEFER_MAX are queued, an allocation fails or mpool_flush */
+int test_deferred(int flags) {
+  struct memory_pool *p;
+  char *blocks[MPOOL_DEFER_MAX + 44];
+  int i, n;
+  int ret = 0;
+  int lists = (flags & MPOOL_MODE_MASK) == MPOOL_LISTS;
+
+  fprintf(stderr, "=== test_deferred (flags %d)\n", flags);
+
+  ret = th_check(mpool_create_flags(1 << 16, flags | MPOOL_DEFERRED | MPOOL_THREADS) == NULL,
+				 "deferred: MPOOL_DEFERRED cannot be combined with MPOOL_THREADS");
+
+  p = mpool_create_flags(1 << 16, flags | MPOOL_DEFERRED);
+
+  if(!(ret = th_check(p != NULL, "deferred: mpool_create_flags returned non-null (%p)", p) && ret))
+	return 0;
+
+  /* use half the pool, then free it all: nothing is given back yet */
+  for(n = 0; n < 32 && (blocks[n] = mpool_alloc(p, 1000)) != NULL; n++);
+  for(i = 0; i < n; i++)
+	mpool_free(p, blocks[i]);
+  ret = th_check(p->ndeferred == (size_t) n, "deferred: %d frees are queued (%lu)", n, p->ndeferred) && ret;
+
+  /* until an allocation does not fit; a MPOOL_GROW pool must not grow for it */
+  char *all = mpool_alloc(p, p->size - 64);
+  ret = th_check(all != NULL && p->ndeferred == 0, "deferred: a failed allocation frees the queue and is retried (%p)", all) && ret;
+  ret = th_check(p->grown == NULL, "deferred: the pool did not grow") && ret;
+  mpool_free(p, all);
+
+  /* the queue is freed when it is full */
+  for(i = 0; i < MPOOL_DEFER_MAX + 44; i++)
+	blocks[i] = mpool_alloc(p, 24);
+  for(i = 0; i < MPOOL_DEFER_MAX + 44; i++)
+	mpool_free(p, blocks[i]);
+  ret = th_check(p->ndeferred == 44, "deferred: a full queue is freed (%lu left)", p->ndeferred) && ret;
+
+  mpool_flush(p);
+  ret = th_check(p->ndeferred == 0, "deferred: mpool_flush empties the queue") && ret;
+  if(lists) {
+	ret = check_free_list("deferred", p) && ret;
+	ret = th_check(p->alloc_list->first == NULL, "deferred: alloc_list is empty after mpool_flush") && ret;
+  }
+
+  mpool_destroy(p);
+
+  return ret;
+}
+
+/* a file-backed pool keeps its blocks and free space across mpool_destroy and mpool_open, and across a crash */
+int test_file(int flags) {
+  struct memory_pool *p;
+  char path[] = "/tmp/pa_test_pool_XXXXXX";
+  size_t *table;
+  int i, fd, status;
+  int ret = 0;
+
+  fprintf(stderr, "=== test_file (flags %d)\n", flags);
+
+  if((fd = mkstemp(path)) < 0)
+	return th_check(0, "file: mkstemp created a file");
+  close(fd);
+
+  ret = th_check(mpool_open(path, 1 << 20, MPOOL_LISTS) == NULL, "file: only MPOOL_TAGS pools can be file-backed");
+
+  p = mpool_open(path, 1 << 20, flags);
+  if(!(ret = th_check(p != NULL, "file: mpool_open created a pool (%p)", p) && ret))
+	return 0;
+
+  /* a table of 10 strings, found through the root */
+  table = mpool_alloc(p, 10 * sizeof(size_t));
+  for(i = 0; i < 10; i++) {
+	char *s = mpool_alloc(p, 32);
+	snprintf(s, 32, "block %d", i);
+	table[i] = mpool_off(p, s);
+  }
+  mpool_free(p, mpool_ptr(p, table[3]));
+  table[3] = 0;
+  mpool_set_root(p, mpool_off(p, table));
+  ret = th_check(mpool_ptr(p, 0) == NULL && mpool_off(p, NULL) == 0, "file: offset 0 is NULL") && ret;
+  mpool_destroy(p);
+
+  p = mpool_open(path, 0, flags);
+  if(!(ret = th_check(p != NULL, "file: mpool_open reopened the pool (%p)", p) && ret))
+	return 0;
+
+  table = mpool_ptr(p, mpool_root(p));
+  for(i = 0; i < 10; i++) {
+	char want[32];
+	snprintf(want, 32, "block %d", i);
+	ret = th_check(i == 3 ? table[i] == 0 : strcmp(mpool_ptr(p, table[i]), want) == 0, "file: block %d survived", i) && ret;
+  }
+
+  mpool_destroy(p);
+
+  /* a process that dies without closing the pool: the bins are rebuilt from the tags */
+  if(fork() == 0) {
+	p = mpool_open(path, 0, flags);
+	table = mpool_ptr(p, mpool_root(p));
+	char *s = mpool_alloc(p, 32);
+	strcpy(s, "after the crash");
+	mpool_free(p, mpool_ptr(p, table[5]));
+	table[5] = 0;
+	table[3] = mpool_off(p, s);
+	_exit(0);
+  }
+  wait(&status);
+
+  p = mpool_open(path, 0, flags);
+  if(!(ret = th_check(p != NULL, "file: mpool_open reopened the pool after a crash (%p)", p) && ret))
+	return 0;
+
+  table = mpool_ptr(p, mpool_root(p));
+  ret = th_check(table[3] != 0 && strcmp(mpool_ptr(p, table[3]), "after the crash") == 0 && table[5] == 0,
+				 "file: the changes made before the crash are there") && ret;
+  ret = th_check(strcmp(mpool_ptr(p, table[0]), "block 0") == 0, "file: block 0 survived the crash") && ret;
+  for(i = 0; i < 10; i++)
+	mpool_free(p, mpool_ptr(p, table[i]));
+  mpool_free(p, table);
+  mpool_set_root(p, 0);
+
+  /* blocks the crashed process had in its magazines are lost */
+  if(!(flags & MPOOL_THREADS)) {
+	char *all = mpool_alloc(p, p->size - 64);
+	ret = th_check(all != NULL, "file: mpool_alloc (%p) of nearly the whole pool after freeing everything is non-null", all) && ret;
+	mpool_free(p, all);
+  }
+  mpool_destroy(p);
+
+  unlink(path);
+  return ret;
+}
+
+/* is the page at addr mapped in memory? */
+int resident(void *addr) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  unsigned char vec = 0;
+
+  mincore((void *) ((uintptr_t) addr & ~(page - 1)), page, &vec);
+  return vec & 1;
+}
+
+/* mpool_trim gives free pages back, and mpool_calloc still returns zeros */
+int test_trim(int flags) {
+  struct memory_pool *p;
+  char *blocks[200];
+  size_t page = sysconf(_SC_PAGESIZE), released, k;
+  int i, ok = 1;
+  int ret = 0;
+
+  fprintf(stderr, "=== test_trim (flags %d)\n", flags);
+
+  p = mpool_create_flags(1 << 20, flags);
+
+  if(!(ret = th_check(p != NULL, "trim: mpool_create_flags returned non-null (%p)", p)))
+	return 0;
+
+  for(i = 0; i < 200; i++) {
+	if((blocks[i] = mpool_alloc(p, 4000)) == NULL)
+	  return th_check(0, "trim: mpool_alloc of 4000 bytes returned non-null");
+	memset(blocks[i], 0xab, 4000);
+  }
+  char *middle = blocks[100] + page;
+  for(i = 0; i < 200; i++)
+	mpool_free(p, blocks[i]);
+
+  released = mpool_trim(p, 0);
+  ret = th_check(released >= 600 * 1024 && released == p->released_bytes, "trim: mpool_trim released most of the pool (%lu)", released) && ret;
+  ret = th_check(!resident(middle), "trim: a released page is not resident") && ret;
+  ret = th_check(mpool_trim(p, 0) == 0, "trim: a second mpool_trim has nothing left to release") && ret;
+
+  /* calloc'd blocks are zero, whether their pages were released or not */
+  for(i = 0; i < 2; i++) {
+	char *z = mpool_calloc(p, 1000, 100);
+
+	if(z == NULL)
+	  return th_check(0, "trim: mpool_calloc returned non-null");
+	for(k = 0; k < 100000 && z[k] == 0; k++);
+	ok = ok && k == 100000;
+	memset(z, 0xcd, 100000);
+	mpool_free(p, z);
+  }
+  ret = th_check(ok, "trim: mpool_calloc returns zeros") && ret;
+  ret = th_check(mpool_calloc(p, (size_t) -1, 16) == NULL, "trim: mpool_calloc fails on overflow") && ret;
+
+  /* hysteresis: trim at 256 KiB resident free memory, down to 64 KiB */
+  ret = th_check(!mpool_set_trim(p, 1024, 4096), "trim: mpool_set_trim rejects low above high") && ret;
+  ret = th_check(mpool_set_trim(p, 256 * 1024, 64 * 1024), "trim: mpool_set_trim") && ret;
+  for(i = 0; i < 200; i++) {
+	blocks[i] = mpool_alloc(p, 4000);
+	memset(blocks[i], 0xab, 4000);
+  }
+  released = p->released_bytes;
+  for(i = 0; i < 192; i++) //the pool checks after every 64 frees
+	mpool_free(p, blocks[i]);
+  ret = th_check(p->released_bytes > released, "trim: freeing blocks released pages by itself") && ret;
+  ret = th_check(mpool_trim(p, 64 * 1024) == 0, "trim: no more than 64 KiB of free memory is left resident") && ret;
+  for(; i < 200; i++)
+	mpool_free(p, blocks[i]);
+
+  mpool_destroy(p);
+
+  return ret;
+}
+
 int main(int argc, char *argv[]) {
   int poolsize = 1024;
 
@@ -105,6 +1594,189 @@ int main(int argc, char *argv[]) {
   if(!test_alloc_free(poolsize))
 	exit(1);
 
+  if(!test_random_alloc_free(MPOOL_LISTS))
+	exit(1);
+
+  if(!test_random_alloc_free(MPOOL_TAGS))
+	exit(1);
+
+  if(!test_random_alloc_free(MPOOL_BUDDY))
+	exit(1);
+
+  if(!test_buddy())
+	exit(1);
+
+  if(!test_tiny())
+	exit(1);
+
+  if(!test_threads(MPOOL_LISTS))
+	exit(1);
+
+  if(!test_threads(MPOOL_TAGS))
+	exit(1);
+
+  if(!test_threads(MPOOL_BUDDY))
+	exit(1);
+
+  if(!test_grow(MPOOL_LISTS))
+	exit(1);
+
+  if(!test_grow(MPOOL_TAGS))
+	exit(1);
+
+  if(!test_grow(MPOOL_BUDDY))
+	exit(1);
+
+  if(!test_slab(MPOOL_LISTS))
+	exit(1);
+
+  if(!test_slab(MPOOL_TAGS))
+	exit(1);
+
+  if(!test_slab(MPOOL_BUDDY))
+	exit(1);
+
+  if(!test_slab(MPOOL_ARENA))
+	exit(1);
+
+  if(!test_slab_churn(MPOOL_LISTS))
+	exit(1);
+
+  if(!test_slab_churn(MPOOL_TAGS))
+	exit(1);
+
+  if(!test_slab_churn(MPOOL_BUDDY))
+	exit(1);
+
+  if(!test_arena())
+	exit(1);
+
+  if(!test_realloc(MPOOL_LISTS))
+	exit(1);
+
+  if(!test_realloc(MPOOL_TAGS))
+	exit(1);
+
+  if(!test_realloc(MPOOL_BUDDY))
+	exit(1);
+
+  if(!test_realloc(MPOOL_ARENA))
+	exit(1);
+
+  if(!test_realloc(MPOOL_TAGS | MPOOL_THREADS))
+	exit(1);
+
+  if(!test_stats(MPOOL_LISTS))
+	exit(1);
+
+  if(!test_stats(MPOOL_TAGS))
+	exit(1);
+
+  if(!test_stats(MPOOL_BUDDY))
+	exit(1);
+
+  if(!test_stats(MPOOL_ARENA))
+	exit(1);
+
+  if(!test_stats(MPOOL_TAGS | MPOOL_THREADS))
+	exit(1);
+
+  if(!test_fixed(MPOOL_TAGS))
+	exit(1);
+
+  if(!test_aligned(MPOOL_LISTS))
+	exit(1);
+
+  if(!test_aligned(MPOOL_TAGS))
+	exit(1);
+
+  if(!test_aligned(MPOOL_BUDDY))
+	exit(1);
+
+  if(!test_aligned(MPOOL_ARENA))
+	exit(1);
+
+  if(!test_aligned(MPOOL_TAGS | MPOOL_THREADS))
+	exit(1);
+
+  if(!test_aligned(MPOOL_BUDDY | MPOOL_GROW))
+	exit(1);
+
+  if(!test_cacheline(MPOOL_LISTS))
+	exit(1);
+
+  if(!test_cacheline(MPOOL_TAGS | MPOOL_THREADS))
+	exit(1);
+
+  if(!test_cacheline(MPOOL_BUDDY | MPOOL_THREADS))
+	exit(1);
+
+  if(!test_fixed(MPOOL_BUDDY | MPOOL_THREADS))
+	exit(1);
+
+  if(!test_free_batch(MPOOL_LISTS))
+	exit(1);
+
+  if(!test_free_batch(MPOOL_TAGS))
+	exit(1);
+
+  if(!test_free_batch(MPOOL_BUDDY | MPOOL_GROW))
+	exit(1);
+
+  if(!test_free_batch(MPOOL_LISTS | MPOOL_STATS))
+	exit(1);
+
+  if(!test_free_batch(MPOOL_TAGS | MPOOL_THREADS))
+	exit(1);
+
+  if(!test_deferred(MPOOL_LISTS))
+	exit(1);
+
+  if(!test_deferred(MPOOL_TAGS))
+	exit(1);
+
+  if(!test_deferred(MPOOL_BUDDY | MPOOL_GROW))
+	exit(1);
+
+  if(!test_file(MPOOL_TAGS))
+	exit(1);
+
+  if(!test_file(MPOOL_TAGS | MPOOL_THREADS))
+	exit(1);
+
+  if(!test_trim(MPOOL_LISTS))
+	exit(1);
+
+  if(!test_trim(MPOOL_TAGS))
+	exit(1);
+
+  if(!test_trim(MPOOL_BUDDY))
+	exit(1);
+
+  if(!test_trim(MPOOL_TAGS | MPOOL_THREADS))
+	exit(1);
+
+  if(!test_trim(MPOOL_LISTS | MPOOL_GROW))
+	exit(1);
+
+  if(!test_handles(MPOOL_LISTS))
+	exit(1);
+
+  if(!test_handles(MPOOL_TAGS | MPOOL_THREADS))
+	exit(1);
+
+  if(!test_typed(MPOOL_LISTS))
+	exit(1);
+
+  if(!test_typed(MPOOL_BUDDY))
+	exit(1);
+
+  if(!test_profile(MPOOL_LISTS))
+	exit(1);
+
+  if(!test_profile(MPOOL_TAGS | MPOOL_THREADS))
+	exit(1);
+
   printf("ALL DONE\n");
   return 0;
 }
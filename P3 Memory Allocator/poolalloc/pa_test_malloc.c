@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "dbll.h"
+#include "poolalloc.h"
+#include "test_helper.h"
+
+/* checks that the pool does not call malloc for its own bookkeeping once
+   it has room for enough blocks */
+
+/* malloc, calloc and realloc are replaced for this program and count
+   every call before handing it to the C library */
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static size_t malloc_calls = 0;
+
+void *malloc(size_t size) {
+  malloc_calls++;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+  malloc_calls++;
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  malloc_calls++;
+  return __libc_realloc(ptr, size);
+}
+
+#define NSLOTS 256
+#define NOPS 20000
+
+/* allocate and free blocks at random, return the number of malloc calls made */
+size_t churn(struct memory_pool *p, char **slots) {
+  size_t before = malloc_calls;
+  int i;
+
+  for(i = 0; i < NOPS; i++) {
+	int s = rand() % NSLOTS;
+
+	if(slots[s] != NULL) {
+	  mpool_free(p, slots[s]);
+	  slots[s] = NULL;
+	} else {
+	  slots[s] = mpool_alloc(p, 1 + rand() % 200);
+	}
+  }
+
+  return malloc_calls - before;
+}
+
+int test_no_malloc(int flags) {
+  struct memory_pool *p;
+  char *slots[NSLOTS];
+  size_t calls, held;
+  int i;
+  int ret = 1;
+
+  fprintf(stderr, "=== test_no_malloc (flags %d)\n", flags);
+
+  p = mpool_create_flags(NSLOTS * 256, flags);
+  if(!(ret = th_check(p != NULL, "mpool_create_flags returned non-null (%p)", p)))
+	return 0;
+
+  memset(slots, 0, sizeof(slots));
+  srand(252);
+
+  /* every slot holds at most one block and leaves at most two free blocks
+	 around it; a deferred pool also holds up to MPOOL_DEFER_MAX freed ones */
+  held = NSLOTS + ((flags & MPOOL_DEFERRED) ? MPOOL_DEFER_MAX : 0);
+  ret = th_check(mpool_reserve(p, 2 * held + 1), "mpool_reserve succeeded") && ret;
+
+  calls = churn(p, slots);
+  ret = th_check(calls == 0, "no malloc calls while allocating and freeing after mpool_reserve (%lu)", calls) && ret;
+
+  mpool_destroy(p);
+
+  /* without reserving, the pool may grow its bookkeeping while it warms
+	 up, but not once it has seen its largest number of blocks */
+  p = mpool_create_flags(NSLOTS * 256, flags);
+  if(!(ret = th_check(p != NULL, "mpool_create_flags returned non-null (%p)", p) && ret))
+	return 0;
+
+  /* the side table must start too small for the churn, or the steady
+	 state below proves nothing */
+  ret = th_check(p->nrecords < NSLOTS, "side table starts small (%lu records)", p->nrecords) && ret;
+
+  memset(slots, 0, sizeof(slots));
+  calls = malloc_calls;
+
+  for(i = 0; i < NSLOTS; i++) {
+	slots[i] = mpool_alloc(p, 1 + i % 200);
+  }
+  for(i = 0; i < NSLOTS; i += 2) {
+	mpool_free(p, slots[i]);
+	slots[i] = NULL;
+  }
+  churn(p, slots);
+  calls = malloc_calls - calls;
+  if((flags & MPOOL_MODE_MASK) == MPOOL_LISTS)
+	ret = th_check(calls > 0 && p->nrecords >= NSLOTS, "side table grew while warming up (%lu calls, %lu records)", calls, p->nrecords) && ret;
+
+  calls = churn(p, slots);
+  ret = th_check(calls == 0, "no malloc calls in steady state (%lu)", calls) && ret;
+
+  /* freeing many blocks at once sorts and merges them in place */
+  for(i = 0; i < NSLOTS; i++) {
+	if(slots[i] == NULL)
+	  slots[i] = mpool_alloc(p, 1 + i % 200);
+  }
+  calls = malloc_calls;
+  mpool_free_batch(p, (void **) slots, NSLOTS);
+  calls = malloc_calls - calls;
+  ret = th_check(calls == 0, "no malloc calls in mpool_free_batch (%lu)", calls) && ret;
+
+  mpool_destroy(p);
+
+  fprintf(stderr, "=== DONE\n\n");
+  return ret;
+}
+
+int main(int argc, char *argv[]) {
+  if(!test_no_malloc(MPOOL_LISTS))
+	exit(1);
+
+  if(!test_no_malloc(MPOOL_TAGS))
+	exit(1);
+
+  /* a deferred pool frees its blocks a batch at a time */
+  if(!test_no_malloc(MPOOL_LISTS | MPOOL_DEFERRED))
+	exit(1);
+
+  if(!test_no_malloc(MPOOL_TAGS | MPOOL_DEFERRED))
+	exit(1);
+
+  printf("ALL DONE\n");
+  return 0;
+}
@@ -0,0 +1,138 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <sys/wait.h>
+
+#include "test_helper.h"
+
+/* checks libpoolalloc.so from the outside: run with LD_PRELOAD set to it
+   (make check-preload does that) */
+
+#define NBLOCKS 1000
+
+static volatile int stop;
+
+/* keeps the pool busy while the main thread forks */
+void *churn(void *arg) {
+  (void) arg;
+
+  while(!stop) {
+	void *a = malloc(64);
+	free(a);
+  }
+  return NULL;
+}
+
+int test_preloaded() {
+  Dl_info info;
+  int ret = 1;
+
+  fprintf(stderr, "=== test_preloaded\n");
+
+  ret = th_check(dladdr((void *) malloc, &info) != 0 && info.dli_fname != NULL && strstr(info.dli_fname, "libpoolalloc") != NULL,
+				 "malloc comes from libpoolalloc.so (%s)", info.dli_fname ? info.dli_fname : "?");
+
+  fprintf(stderr, "=== DONE\n\n");
+  return ret;
+}
+
+int test_calls() {
+  char *blocks[NBLOCKS];
+  volatile size_t huge = SIZE_MAX / 8 + 1;
+  void *aligned;
+  int i, k, ok;
+  int ret = 1;
+
+  fprintf(stderr, "=== test_calls\n");
+
+  for(i = 0; i < NBLOCKS; i++) {
+	blocks[i] = malloc(1 + i % 300);
+	if(blocks[i] != NULL)
+	  memset(blocks[i], (char) i, 1 + i % 300);
+  }
+  for(i = 0, ok = 1; i < NBLOCKS; i++)
+	ok = ok && blocks[i] != NULL && blocks[i][i % 300] == (char) i && malloc_usable_size(blocks[i]) >= (size_t) (1 + i % 300);
+  ret = th_check(ok, "malloc: %d blocks hold their bytes", NBLOCKS) && ret;
+
+  /* grow every other block a lot and shrink the rest */
+  for(i = 0; i < NBLOCKS; i++)
+	blocks[i] = realloc(blocks[i], (i % 2) ? 4000 : 1);
+  for(i = 0, ok = 1; i < NBLOCKS; i++)
+	ok = ok && blocks[i] != NULL && blocks[i][0] == (char) i;
+  ret = th_check(ok, "realloc: blocks keep their first bytes") && ret;
+  for(i = 0; i < NBLOCKS; i++)
+	free(blocks[i]);
+
+  for(i = 0, ok = 1; i < 100; i++) {
+	char *z = calloc(i + 1, 37);
+	for(k = 0; z != NULL && k < (i + 1) * 37 && z[k] == 0; k++);
+	ok = ok && z != NULL && k == (i + 1) * 37;
+	if(z != NULL)
+	  memset(z, 0xff, (i + 1) * 37);
+	free(z);
+  }
+  ret = th_check(ok, "calloc: blocks are zeroed, even reused ones") && ret;
+  ret = th_check(calloc(huge, 16) == NULL, "calloc: an overflowing size fails") && ret;
+
+  for(i = 3; i <= 13; i++) {
+	aligned = NULL;
+	ok = posix_memalign(&aligned, (size_t) 1 << i, 100) == 0 && aligned != NULL && (uintptr_t) aligned % ((size_t) 1 << i) == 0;
+	ret = th_check(ok, "posix_memalign: %lu-byte alignment (%p)", (size_t) 1 << i, aligned) && ret;
+	free(aligned);
+  }
+  ret = th_check(posix_memalign(&aligned, 24, 100) != 0, "posix_memalign: alignment that is not a power of two is rejected") && ret;
+
+  fprintf(stderr, "=== DONE\n\n");
+  return ret;
+}
+
+int test_fork() {
+  pthread_t thread;
+  int i, status, ok;
+  int ret = 1;
+
+  fprintf(stderr, "=== test_fork\n");
+
+  stop = 0;
+  ret = th_check(pthread_create(&thread, NULL, churn, NULL) == 0, "fork: churning thread started");
+
+  /* the child must not find the pool lock held by a thread it does not have */
+  for(i = 0, ok = 1; i < 20; i++) {
+	pid_t pid = fork();
+
+	if(pid == 0) {
+	  char *a = malloc(100), *b = calloc(10, 10);
+	  free(a);
+	  free(b);
+	  _exit(a != NULL && b != NULL ? 0 : 1);
+	}
+	ok = ok && pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  }
+  ret = th_check(ok, "fork: children allocate and exit") && ret;
+
+  stop = 1;
+  pthread_join(thread, NULL);
+
+  fprintf(stderr, "=== DONE\n\n");
+  return ret;
+}
+
+int main(int argc, char *argv[]) {
+  if(!test_preloaded())
+	exit(1);
+
+  if(!test_calls())
+	exit(1);
+
+  if(!test_fork())
+	exit(1);
+
+  printf("ALL DONE\n");
+  return 0;
+}
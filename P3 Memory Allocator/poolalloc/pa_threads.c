@@ -0,0 +1,316 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "poolalloc.h"
+#include "poolalloc_int.h"
+
+/*
+   MPOOL_THREADS: a pool shared between threads
+
+   The pool itself is protected by one mutex. In front of it every thread
+   keeps a magazine of free blocks for each small size class, so most
+   allocations and frees only touch the calling thread's magazines and
+   take no lock at all.
+
+   An empty magazine is refilled with MAG_BATCH blocks under one lock, and
+   a full one gives its MAG_BATCH oldest blocks back under one lock. When
+   a thread exits, its magazines are flushed back to the pool.
+
+   A freed block goes to the magazine of the largest class its usable size
+   can serve, whichever thread allocated it. Classes are multiples of
+   MAG_QUANTUM, except in MPOOL_BUDDY pools where they are the powers of
+   two the pool hands out anyway, so that blocks come back to the class
+   they were taken from.
+
+   Finding the usable size does not need the lock in MPOOL_TAGS and
+   MPOOL_BUDDY pools; MPOOL_LISTS pools must search alloc_list for it, so
+   their frees always lock.
+*/
+
+#define MAG_QUANTUM 16                    /* size classes are multiples of this */
+#define MAG_CLASSES 32
+#define MAG_MAX_SIZE (MAG_QUANTUM * MAG_CLASSES)
+#define MAG_SIZE 64                       /* blocks a magazine can hold */
+#define MAG_BATCH 32                      /* blocks moved per refill or flush */
+
+struct pa_magazine {
+  int n;
+  void *slots[MAG_SIZE];
+};
+
+/* the magazines of one thread for one pool */
+struct pa_tcache {
+  struct memory_pool *pool;
+  struct pa_tcache *next;   /* all caches of the pool, so that mpool_destroy can free them */
+  struct pa_tcache *prev;
+  struct pa_magazine mags[MAG_CLASSES];
+};
+
+struct pa_threads {
+  pthread_mutex_t lock;
+  pthread_key_t key;          /* the calling thread's pa_tcache */
+  struct pa_tcache *caches;
+};
+
+/* size of the blocks in class c */
+static size_t mag_class_size(struct memory_pool *p, int c)
+{
+  if ((p->flags & MPOOL_MODE_MASK) == MPOOL_BUDDY) {
+    return (size_t) MAG_QUANTUM << c;
+  }
+  return (size_t) (c + 1) * MAG_QUANTUM;
+}
+
+/* smallest class for an allocation of `size` bytes (at most MAG_MAX_SIZE) */
+static int mag_class(struct memory_pool *p, size_t size)
+{
+  if ((p->flags & MPOOL_MODE_MASK) == MPOOL_BUDDY) {
+    return (size <= MAG_QUANTUM) ? 0 : 64 - __builtin_clzll((size - 1) / MAG_QUANTUM);
+  }
+  return (size - 1) / MAG_QUANTUM;
+}
+
+/* largest class a block with `usable` bytes can serve, -1 if it is not cached */
+static int mag_class_of(struct memory_pool *p, size_t usable)
+{
+  if (usable < MAG_QUANTUM || usable > MAG_MAX_SIZE + MAG_QUANTUM - 1) {
+    return -1;
+  }
+  if ((p->flags & MPOOL_MODE_MASK) == MPOOL_BUDDY) {
+    return 63 - __builtin_clzll(usable / MAG_QUANTUM);
+  }
+  return usable / MAG_QUANTUM - 1;
+}
+
+/* give the first n blocks of magazine m back to the pool; the lock must be held */
+static void mag_flush(struct memory_pool *p, struct pa_magazine *m, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++) {
+    pa_pool_free(p, m->slots[i]);
+  }
+  memmove(m->slots, m->slots + n, (m->n - n) * sizeof(void *));
+  m->n -= n;
+}
+
+/* called when a thread exits: return its blocks to the pool */
+static void tcache_exit(void *arg)
+{
+  struct pa_tcache *tc = arg;
+  struct memory_pool *p = tc->pool;
+  struct pa_threads *t = p->threads;
+  int c;
+
+  pthread_mutex_lock(&t->lock);
+  for (c = 0; c < MAG_CLASSES; c++) {
+    mag_flush(p, &tc->mags[c], tc->mags[c].n);
+  }
+  if (tc->prev != NULL) {
+    tc->prev->next = tc->next;
+  } else {
+    t->caches = tc->next;
+  }
+  if (tc->next != NULL) {
+    tc->next->prev = tc->prev;
+  }
+  pthread_mutex_unlock(&t->lock);
+
+  free(tc);
+}
+
+/* the calling thread's magazines, created on first use; NULL if out of memory */
+static struct pa_tcache *tcache_get(struct memory_pool *p)
+{
+  struct pa_threads *t = p->threads;
+  struct pa_tcache *tc = pthread_getspecific(t->key);
+
+  if (tc != NULL) {
+    return tc;
+  }
+
+  tc = (struct pa_tcache*)calloc(1, sizeof(struct pa_tcache));
+  if (tc == NULL) { //check mem allocation
+    return NULL;
+  }
+  tc->pool = p;
+
+  if (pthread_setspecific(t->key, tc) != 0) {
+    free(tc);
+    return NULL;
+  }
+
+  pthread_mutex_lock(&t->lock);
+  tc->next = t->caches;
+  if (tc->next != NULL) {
+    tc->next->prev = tc;
+  }
+  t->caches = tc;
+  pthread_mutex_unlock(&t->lock);
+
+  return tc;
+}
+
+/* set up the lock and the per-thread magazines of a MPOOL_THREADS pool */
+int pa_threads_init(struct memory_pool *p)
+{
+  struct pa_threads *t = (struct pa_threads*)calloc(1, sizeof(struct pa_threads));
+
+  if (t == NULL) { //check mem allocation
+    return 0;
+  }
+  if (pthread_key_create(&t->key, tcache_exit) != 0) {
+    free(t);
+    return 0;
+  }
+  pthread_mutex_init(&t->lock, NULL);
+
+  p->threads = t;
+  return 1;
+}
+
+/* give the blocks in every thread's magazines back to the pool (for a
+   pool that outlives the process); no thread may use the pool any more */
+void pa_threads_drain(struct memory_pool *p)
+{
+  struct pa_tcache *tc;
+  int c;
+
+  if (p->threads == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&p->threads->lock);
+  for (tc = p->threads->caches; tc != NULL; tc = tc->next) {
+    for (c = 0; c < MAG_CLASSES; c++) {
+      mag_flush(p, &tc->mags[c], tc->mags[c].n);
+    }
+  }
+  pthread_mutex_unlock(&p->threads->lock);
+}
+
+/* free the magazines of every thread; no thread may use the pool any more */
+void pa_threads_destroy(struct memory_pool *p)
+{
+  struct pa_threads *t = p->threads;
+
+  if (t == NULL) {
+    return;
+  }
+
+  //after this, exiting threads no longer call tcache_exit
+  pthread_key_delete(t->key);
+
+  while (t->caches != NULL) {
+    struct pa_tcache *next = t->caches->next;
+    free(t->caches);
+    t->caches = next;
+  }
+
+  pthread_mutex_destroy(&t->lock);
+  free(t);
+  p->threads = NULL;
+}
+
+/* alignment of every block a magazine holds */
+static size_t mag_align(struct memory_pool *p)
+{
+  return (p->flags & MPOOL_CACHELINE) ? MPOOL_CACHELINE_SIZE : MAG_QUANTUM;
+}
+
+/* blocks aligned to more than the magazines guarantee bypass them */
+void *pa_threads_alloc(struct memory_pool *p, size_t size, size_t align)
+{
+  struct pa_threads *t = p->threads;
+  struct pa_tcache *tc;
+  void *addr;
+
+  if (size > MAG_MAX_SIZE || align > mag_align(p) || (tc = tcache_get(p)) == NULL) {
+    pthread_mutex_lock(&t->lock);
+    addr = pa_pool_alloc(p, size, align);
+    pthread_mutex_unlock(&t->lock);
+    return addr;
+  }
+
+  int c = mag_class(p, size);
+  struct pa_magazine *m = &tc->mags[c];
+
+  if (m->n == 0) { //refill
+    pthread_mutex_lock(&t->lock);
+    while (m->n < MAG_BATCH && (addr = pa_pool_alloc(p, mag_class_size(p, c), mag_align(p))) != NULL) {
+      m->slots[m->n++] = addr;
+    }
+    pthread_mutex_unlock(&t->lock);
+
+    if (m->n == 0) {
+      return NULL;
+    }
+  }
+
+  return m->slots[--m->n];
+}
+
+/* pa_pool_usable, locking only where the mode needs it */
+size_t pa_threads_usable(struct memory_pool *p, void *addr)
+{
+  struct pa_threads *t = p->threads;
+  size_t usable;
+
+  if ((p->flags & MPOOL_MODE_MASK) != MPOOL_LISTS) {
+    return pa_pool_usable(p, addr);
+  }
+
+  pthread_mutex_lock(&t->lock);
+  usable = pa_pool_usable(p, addr);
+  pthread_mutex_unlock(&t->lock);
+  return usable;
+}
+
+void pa_threads_free(struct memory_pool *p, void *addr)
+{
+  struct pa_threads *t = p->threads;
+  struct pa_tcache *tc = tcache_get(p);
+  int c = mag_class_of(p, pa_threads_usable(p, addr));
+
+  if (tc == NULL || c < 0) {
+    pthread_mutex_lock(&t->lock);
+    pa_pool_free(p, addr);
+    pthread_mutex_unlock(&t->lock);
+    return;
+  }
+
+  struct pa_magazine *m = &tc->mags[c];
+
+  if (m->n == MAG_SIZE) { //flush the oldest blocks
+    pthread_mutex_lock(&t->lock);
+    mag_flush(p, m, MAG_BATCH);
+    pthread_mutex_unlock(&t->lock);
+  }
+
+  m->slots[m->n++] = addr;
+}
+
+/* mpool_realloc's in-place resize, under the lock */
+/* only blocks in the pool's free structures are merged with, never the
+   ones cached in magazines, which the pool sees as allocated */
+int pa_threads_resize(struct memory_pool *p, void *addr, size_t size, size_t *copy)
+{
+  struct pa_threads *t = p->threads;
+  int done;
+
+  pthread_mutex_lock(&t->lock);
+  done = pa_pool_resize(p, addr, size, copy);
+  pthread_mutex_unlock(&t->lock);
+  return done;
+}
+
+void pa_threads_lock(struct memory_pool *p)
+{
+  pthread_mutex_lock(&p->threads->lock);
+}
+
+void pa_threads_unlock(struct memory_pool *p)
+{
+  pthread_mutex_unlock(&p->threads->lock);
+}
@@ -0,0 +1,194 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "poolalloc.h"
+#include "poolalloc_int.h"
+
+/*
+   tiny blocks of MPOOL_LISTS pools: regions with occupancy bitmaps
+
+   A block of at most PA_TINY_SLOT bytes tracked by its own alloc_info
+   costs a record, two list nodes and a linear search on free. Instead,
+   such blocks take one PA_TINY_SLOT-byte slot of a region: a block of
+   PA_TINY_REGION bytes, aligned to PA_TINY_REGION and allocated from the
+   pool like any other, that starts with a struct tiny_region header
+   holding one bit per slot.
+   The slots the header itself covers are marked in use for good, so the
+   only metadata is the header, 152 bytes of every 8 KiB (under 2%).
+
+   Allocation scans the bitmap of the first region on the `partial` list
+   from its hint with __builtin_ctzll, one 64-slot word at a time.
+   Freeing clears one bit: the region of an address is found by rounding
+   it down to PA_TINY_REGION, and a bitmap with one bit per
+   PA_TINY_REGION of the pool tells whether that is a region at all. An empty region is
+   given back to the pool right away, so a pool without tiny blocks is
+   laid out exactly as if there were no regions.
+
+   Only pools of at least TINY_MIN_POOL bytes use regions; smaller ones
+   would give up too large a share of their space to a single region.
+*/
+
+#define TINY_SLOTS (PA_TINY_REGION / PA_TINY_SLOT)
+#define TINY_WORDS (TINY_SLOTS / 64)
+#define TINY_MIN_POOL (16 * PA_TINY_REGION)
+
+struct tiny_region {
+  struct tiny_region *next;   /* on the partial list */
+  struct tiny_region *prev;
+  uint32_t used;              /* slots in use, not counting the header's */
+  uint32_t hint;              /* bitmap words below this one are full */
+  uint64_t bitmap[TINY_WORDS]; /* bit i is set when slot i is in use or holds the header */
+};
+
+#define TINY_HEADER_SLOTS ((sizeof(struct tiny_region) + PA_TINY_SLOT - 1) / PA_TINY_SLOT)
+
+struct pa_tiny {
+  struct tiny_region *partial; /* regions with free slots */
+  uintptr_t base;             /* p->start >> PA_TINY_SHIFT */
+  size_t nregions;            /* bits in map */
+  uint64_t map[];             /* bit i is set when (base + i) << PA_TINY_SHIFT is a region */
+};
+
+static void region_push(struct pa_tiny *t, struct tiny_region *r)
+{
+  r->prev = NULL;
+  r->next = t->partial;
+  if (r->next != NULL) {
+    r->next->prev = r;
+  }
+  t->partial = r;
+}
+
+static void region_remove(struct pa_tiny *t, struct tiny_region *r)
+{
+  if (r->prev != NULL) {
+    r->prev->next = r->next;
+  } else {
+    t->partial = r->next;
+  }
+  if (r->next != NULL) {
+    r->next->prev = r->prev;
+  }
+}
+
+/* the region that holds addr, NULL if addr is not in one */
+static struct tiny_region *region_of(struct pa_tiny *t, void *addr)
+{
+  size_t i = ((uintptr_t) addr >> PA_TINY_SHIFT) - t->base;
+
+  if ((uintptr_t) addr >> PA_TINY_SHIFT < t->base || i >= t->nregions || !(t->map[i / 64] & (1ULL << (i % 64)))) {
+    return NULL;
+  }
+  return (struct tiny_region *) ((uintptr_t) addr & ~((uintptr_t) PA_TINY_REGION - 1));
+}
+
+/* set up p->tiny if p is large enough to use regions */
+/* returns 0 if memory could not be allocated */
+int pa_tiny_init(struct memory_pool *p)
+{
+  if (p->size < TINY_MIN_POOL) {
+    return 1;
+  }
+
+  uintptr_t first = (uintptr_t) p->start >> PA_TINY_SHIFT;
+  uintptr_t last = ((uintptr_t) p->start + p->size - 1) >> PA_TINY_SHIFT;
+  size_t n = last - first + 1;
+
+  p->tiny = (struct pa_tiny*)calloc(1, sizeof(struct pa_tiny) + (n + 63) / 64 * sizeof(uint64_t));
+  if (p->tiny == NULL) { //check mem allocation
+    return 0;
+  }
+  p->tiny->base = first;
+  p->tiny->nregions = n;
+  return 1;
+}
+
+/* make the block at addr (PA_TINY_REGION bytes, aligned to PA_TINY_REGION) a region */
+void pa_tiny_add(struct memory_pool *p, void *addr)
+{
+  struct pa_tiny *t = p->tiny;
+  struct tiny_region *r = addr;
+  size_t i = ((uintptr_t) addr >> PA_TINY_SHIFT) - t->base, k;
+
+  memset(r, 0, sizeof(*r));
+  for (k = 0; k < TINY_HEADER_SLOTS; k++) {
+    r->bitmap[k / 64] |= 1ULL << (k % 64);
+  }
+  t->map[i / 64] |= 1ULL << (i % 64);
+  region_push(t, r);
+}
+
+/* take a slot from the first region that has one, NULL if none has */
+void *pa_tiny_alloc(struct memory_pool *p)
+{
+  struct tiny_region *r = p->tiny->partial;
+  uint32_t w;
+
+  if (r == NULL) {
+    return NULL;
+  }
+
+  for (w = r->hint; r->bitmap[w] == ~0ULL; w++);
+  int bit = __builtin_ctzll(~r->bitmap[w]);
+
+  r->bitmap[w] |= 1ULL << bit;
+  r->hint = w;
+  if (++r->used == TINY_SLOTS - TINY_HEADER_SLOTS) {
+    region_remove(p->tiny, r);
+  }
+  return (char *) r + (w * 64 + bit) * PA_TINY_SLOT;
+}
+
+/* the region of the allocated slot at addr, setting *i to the slot's
+   index; NULL if addr is not an allocated slot */
+static struct tiny_region *slot_of(struct memory_pool *p, void *addr, size_t *i)
+{
+  struct tiny_region *r;
+
+  if (p->tiny == NULL || (r = region_of(p->tiny, addr)) == NULL || ((uintptr_t) addr & (PA_TINY_SLOT - 1)) != 0) {
+    return NULL;
+  }
+  *i = ((char *) addr - (char *) r) / PA_TINY_SLOT;
+  return (*i >= TINY_HEADER_SLOTS && (r->bitmap[*i / 64] & (1ULL << (*i % 64)))) ? r : NULL;
+}
+
+/* is addr in a region of p (allocated or not)? */
+int pa_tiny_owns(struct memory_pool *p, void *addr)
+{
+  return p->tiny != NULL && region_of(p->tiny, addr) != NULL;
+}
+
+/* usable bytes of the slot at addr, 0 if it is not an allocated slot */
+size_t pa_tiny_usable(struct memory_pool *p, void *addr)
+{
+  size_t i;
+
+  return (slot_of(p, addr, &i) != NULL) ? PA_TINY_SLOT : 0;
+}
+
+/* free the slot at addr; anything else is ignored */
+/* returns the region if it is now empty and has to go back to the pool, else NULL */
+void *pa_tiny_free(struct memory_pool *p, void *addr)
+{
+  struct pa_tiny *t = p->tiny;
+  struct tiny_region *r;
+  size_t i;
+
+  if ((r = slot_of(p, addr, &i)) == NULL) {
+    return NULL;
+  }
+
+  r->bitmap[i / 64] &= ~(1ULL << (i % 64));
+  r->hint = (i / 64 < r->hint) ? i / 64 : r->hint;
+  if (r->used-- == TINY_SLOTS - TINY_HEADER_SLOTS) {
+    region_push(t, r);
+  }
+  if (r->used > 0) {
+    return NULL;
+  }
+
+  region_remove(t, r);
+  i = ((uintptr_t) r >> PA_TINY_SHIFT) - t->base;
+  t->map[i / 64] &= ~(1ULL << (i % 64));
+  return r;
+}
@@ -0,0 +1,269 @@
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "poolalloc.h"
+#include "poolalloc_int.h"
+
+/*
+   returning free memory to the system
+
+   mpool_trim gives the pages that lie entirely inside free memory back
+   with madvise(MADV_DONTNEED): the pool keeps the address range, and a
+   page is only mapped again (filled with zeros) when it is next written.
+   Free memory is what pa_pool_free_spans reports: whole free blocks of
+   MPOOL_LISTS pools and the unused top of arenas, which keep no
+   bookkeeping in the pool, and free blocks less their tags or links in
+   MPOOL_TAGS and MPOOL_BUDDY pools.
+
+   Every chunk gets a bitmap with one bit per page on its first trim. The
+   bit is set while the page is released, so no page is given back twice
+   and the pool knows how much of its free memory is still resident. An
+   allocation (mpool_alloc, mpool_alloc_aligned, mpool_calloc, a realloc
+   that grows in place, a new tiny region) clears the bits of the pages it
+   touches. Nothing else writes to the free memory of MPOOL_LISTS and
+   MPOOL_ARENA pools, so there a page whose bit is still set is known to
+   be zero, and mpool_calloc does not clear it again. MPOOL_TAGS and
+   MPOOL_BUDDY pools write tags and links into free memory when they split
+   blocks, so mpool_calloc always clears their blocks.
+
+   MADV_FREE would be cheaper, but a page given back with it keeps its
+   contents until the kernel actually needs the memory, so it could never
+   be known to be zero.
+
+   mpool_set_trim makes a pool trim itself: every TRIM_CHECK frees it adds
+   up its resident free memory, and once that is over `high` bytes it
+   releases pages until no more than `low` bytes are left. The gap between
+   the two keeps a pool whose use goes up and down around one size from
+   releasing and faulting in the same pages over and over. Each check
+   walks all free blocks, so it costs about as much as mpool_stats.
+
+   File-backed pools (a released page would be read back from the file)
+   and MPOOL_HUGETLB pools are never trimmed.
+*/
+
+#define TRIM_CHECK 64
+
+struct trim_walk {
+  size_t page;
+  size_t resident;            /* free bytes in pages that are not released */
+  size_t excess;              /* bytes release_span still has to release */
+  size_t released;            /* bytes released so far */
+};
+
+static int can_trim(struct memory_pool *p)
+{
+  return p->file == NULL && !(p->flags & MPOOL_HUGETLB);
+}
+
+/* start of the first whole page of chunk c */
+static char *first_page(struct memory_pool *c, size_t page)
+{
+  return (char *) (((uintptr_t) c->start + page - 1) & ~((uintptr_t) page - 1));
+}
+
+/* number of whole pages in chunk c */
+static size_t chunk_pages(struct memory_pool *c, size_t page)
+{
+  char *base = first_page(c, page);
+
+  return (c->start + c->size > base) ? (size_t) (c->start + c->size - base) / page : 0;
+}
+
+static int page_released(struct memory_pool *c, size_t i)
+{
+  return (__atomic_load_n(&c->released[i / 64], __ATOMIC_RELAXED) >> (i % 64)) & 1;
+}
+
+/* the whole pages [*first, *last) of the free span at off; 0 if there are none */
+static int span_pages(struct memory_pool *c, size_t off, size_t size, size_t page, size_t *first, size_t *last)
+{
+  char *base = first_page(c, page), *start = c->start + off, *end = start + size;
+
+  if (end <= base) {
+    return 0;
+  }
+  *first = (start <= base) ? 0 : (size_t) (start - base + page - 1) / page;
+  *last = (size_t) (end - base) / page;
+  return *first < *last;
+}
+
+static void count_span(struct memory_pool *c, size_t off, size_t size, void *ctx)
+{
+  struct trim_walk *w = ctx;
+  size_t first, last, i;
+
+  if (span_pages(c, off, size, w->page, &first, &last)) {
+    for (i = first; i < last; i++) {
+      w->resident += page_released(c, i) ? 0 : w->page;
+    }
+  }
+}
+
+/* release the resident pages of a free span, a run of them per madvise */
+static void release_span(struct memory_pool *c, size_t off, size_t size, void *ctx)
+{
+  struct trim_walk *w = ctx;
+  char *base = first_page(c, w->page);
+  size_t first, last, i, j, k;
+
+  if (w->excess == 0 || !span_pages(c, off, size, w->page, &first, &last)) {
+    return;
+  }
+
+  for (i = first; i < last && w->excess > 0; i = j) {
+    if (page_released(c, i)) {
+      j = i + 1;
+      continue;
+    }
+
+    size_t want = (w->excess + w->page - 1) / w->page;
+    for (j = i + 1; j < last && j - i < want && !page_released(c, j); j++);
+
+    if (madvise(base + i * w->page, (j - i) * w->page, MADV_DONTNEED) != 0) {
+      w->excess = 0; //leave the rest resident
+      return;
+    }
+    for (k = i; k < j; k++) {
+      __atomic_fetch_or(&c->released[k / 64], 1ULL << (k % 64), __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&c->released_bytes, (j - i) * w->page, __ATOMIC_RELAXED);
+    w->released += (j - i) * w->page;
+    w->excess = (w->excess > (j - i) * w->page) ? w->excess - (j - i) * w->page : 0;
+  }
+}
+
+/* release pages until at most `keep` bytes of free memory are resident,
+   if more than `above` are; the lock must be held */
+/* returns the bytes released */
+static size_t trim(struct memory_pool *p, size_t keep, size_t above)
+{
+  struct trim_walk w = { (size_t) sysconf(_SC_PAGESIZE), 0, 0, 0 };
+  struct memory_pool *c;
+
+  if (!can_trim(p)) {
+    return 0;
+  }
+
+  /* chunks whose bitmap cannot be allocated are left alone; pa_trim_claim
+     looks at none of them while the first chunk has no bitmap */
+  for (c = p; c != NULL; c = c->grown) {
+    if (c->released == NULL) {
+      c->released = (uint64_t*)calloc((chunk_pages(c, w.page) + 63) / 64 + 1, sizeof(uint64_t));
+    }
+    if (c->released == NULL && c == p) {
+      return 0;
+    }
+    if (c->released != NULL) {
+      pa_pool_free_spans(c, count_span, &w);
+    }
+  }
+
+  if (w.resident <= keep || w.resident <= above) {
+    return 0;
+  }
+
+  w.excess = w.resident - keep;
+  for (c = p; c != NULL && w.excess > 0; c = c->grown) {
+    if (c->released != NULL) {
+      pa_pool_free_spans(c, release_span, &w);
+    }
+  }
+  return w.released;
+}
+
+/* give free pages of p (and all its chunks) back to the system, keeping
+   up to `keep` bytes of free memory resident */
+/* returns the bytes released */
+size_t mpool_trim(struct memory_pool *p, size_t keep)
+{
+  size_t released;
+
+  if (p->threads != NULL) {
+    pa_threads_lock(p);
+  }
+  mpool_flush(p); //frees queued by MPOOL_DEFERRED are free memory too
+  released = trim(p, keep, 0);
+  if (p->threads != NULL) {
+    pa_threads_unlock(p);
+  }
+  return released;
+}
+
+/* trim p whenever more than `high` bytes of its free memory are
+   resident, down to `low` bytes; high 0 turns this off */
+/* returns 0 if p cannot be trimmed or low is above high */
+int mpool_set_trim(struct memory_pool *p, size_t high, size_t low)
+{
+  if (!can_trim(p) || low > high) {
+    return 0;
+  }
+  p->trim_low = low;
+  p->trim_high = high;
+  return 1;
+}
+
+/* called by mpool_free when mpool_set_trim is on */
+void pa_trim_check(struct memory_pool *p)
+{
+  if (__atomic_add_fetch(&p->trim_frees, 1, __ATOMIC_RELAXED) % TRIM_CHECK != 0) {
+    return;
+  }
+
+  if (p->threads != NULL) {
+    pa_threads_lock(p);
+  }
+  trim(p, p->trim_low, p->trim_high);
+  if (p->threads != NULL) {
+    pa_threads_unlock(p);
+  }
+}
+
+/* the block [addr, addr + size) was just allocated: its pages are no
+   longer released; with zero set, also set the block to zero except for
+   pages that are known to be zero already */
+void pa_trim_claim(struct memory_pool *p, void *addr, size_t size, int zero)
+{
+  struct memory_pool *c = p;
+  char *start = addr, *end = start + size, *zeroed = start;
+
+  if (c->released != NULL && (start < c->start || start >= c->start + c->size)) {
+    c = (p->flags & MPOOL_GROW) ? pa_grow_owner(p, addr) : NULL;
+  }
+
+  if (c != NULL && c->released != NULL) {
+    size_t page = (size_t) sysconf(_SC_PAGESIZE), n = chunk_pages(c, page), first, last, i;
+    char *base = first_page(c, page);
+    int known = (c->flags & MPOOL_MODE_MASK) == MPOOL_LISTS || (c->flags & MPOOL_MODE_MASK) == MPOOL_ARENA;
+
+    first = (start <= base) ? 0 : (size_t) (start - base) / page;
+    last = (end <= base) ? 0 : (size_t) (end - base + page - 1) / page;
+    last = (last < n) ? last : n;
+
+    for (i = first; i < last; i++) {
+      uint64_t bit = 1ULL << (i % 64);
+
+      if (!(__atomic_fetch_and(&c->released[i / 64], ~bit, __ATOMIC_RELAXED) & bit)) {
+        continue;
+      }
+      __atomic_fetch_sub(&c->released_bytes, page, __ATOMIC_RELAXED);
+
+      /* a released page of a block nobody wrote to is still zero */
+      if (zero && known) {
+        char *pg = base + i * page, *pg_end = pg + page;
+
+        pg = (pg > start) ? pg : start;
+        if (pg > zeroed) {
+          memset(zeroed, 0, pg - zeroed);
+        }
+        zeroed = (pg_end < end) ? pg_end : end;
+      }
+    }
+  }
+
+  if (zero && end > zeroed) {
+    memset(zeroed, 0, end - zeroed);
+  }
+}
@@ -0,0 +1,71 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "poolalloc.h"
+#include "poolalloc_int.h"
+
+/*
+   typed pools: the out-of-line half of MPOOL_DEFINE_TYPED
+
+   mpool_alloc has to work out the alignment of every request and search
+   the pool for a block. A call site that allocates one type knows its
+   size and alignment at compile time, so MPOOL_DEFINE_TYPED generates
+   inline functions that pop and push a free list threaded through the
+   free objects, with the stride and alignment of the type as constants.
+
+   Only when the list is empty does mpool_T_alloc call mpool_typed_refill,
+   which hands out the next never-used object of the newest chunk, and
+   takes a new chunk of TYPED_CHUNK bytes (at least TYPED_MIN_OBJECTS
+   objects) from the pool once that one is used up. A chunk starts with
+   the link to the chunk taken before it, so mpool_typed_destroy can give
+   them all back; objects are never given back one at a time.
+*/
+
+#define TYPED_CHUNK 4096
+#define TYPED_MIN_OBJECTS 8
+
+/* set up t to take its chunks from pool */
+void mpool_typed_init(struct mpool_typed *t, struct memory_pool *pool)
+{
+  memset(t, 0, sizeof(*t));
+  t->pool = pool;
+}
+
+/* give every chunk back to the pool; all objects of t become invalid */
+void mpool_typed_destroy(struct mpool_typed *t)
+{
+  void *c, *next;
+
+  for (c = t->chunks; c != NULL; c = next) {
+    next = *(void **) c;
+    mpool_free(t->pool, c);
+  }
+  mpool_typed_init(t, t->pool);
+}
+
+/* called by mpool_T_alloc when the free list is empty: an object of
+   stride bytes aligned to align, from the newest chunk or a new one */
+/* returns NULL if the pool has no room for a chunk */
+void *mpool_typed_refill(struct mpool_typed *t, size_t stride, size_t align)
+{
+  void *obj;
+
+  if (t->bump == NULL || (size_t) (t->end - t->bump) < stride) {
+    size_t header = (sizeof(void *) + align - 1) & ~(align - 1);
+    size_t n = (TYPED_CHUNK - header) / stride;
+    char *c;
+
+    n = (n < TYPED_MIN_OBJECTS) ? TYPED_MIN_OBJECTS : n;
+    if ((c = mpool_alloc_aligned(t->pool, header + n * stride, align)) == NULL) {
+      return NULL;
+    }
+    *(void **) c = t->chunks;
+    t->chunks = c;
+    t->bump = c + header;
+    t->end = t->bump + n * stride;
+  }
+
+  obj = t->bump;
+  t->bump += stride;
+  return obj;
+}
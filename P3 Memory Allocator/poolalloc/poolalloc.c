@@ -1,59 +1,354 @@
+#define _POSIX_C_SOURCE 200112L
 #include "dbll.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include "poolalloc.h"
+#include "poolalloc_int.h"
 
 /*
    a pool-based allocator that uses doubly-linked lists to track
    allocated and free blocks
+
+   MPOOL_TAGS pools track blocks with boundary tags instead (pa_tags.c),
+   MPOOL_BUDDY pools use a binary buddy system (pa_buddy.c) and
+   MPOOL_ARENA pools only bump a pointer (pa_arena.c)
  */
 
+/* how many blocks of the exact size class are tried before falling back
+   to a size class where every block fits */
+#define BIN_PROBES 4
+
+/* smallest number of records the side table grows by */
+#define TABLE_MIN 64
+
+/* add a chunk of n records to the side table */
+static int table_grow(struct memory_pool *p, size_t n)
+{
+  struct pa_chunk *c = (struct pa_chunk*)malloc(sizeof(struct pa_chunk) + n * sizeof(struct pa_block));
+  size_t i;
+
+  if (c == NULL) {
+    return 0;
+  }
+
+  c->n = n;
+  c->next = p->chunks;
+  p->chunks = c;
+
+  for (i = 0; i < n; i++) {
+    c->blocks[i].node.user_data = (i + 1 < n) ? &c->blocks[i + 1] : p->spare;
+  }
+  p->spare = &c->blocks[0];
+  p->nrecords += n;
+  return 1;
+}
+
+/* take an unused record from the side table */
+/* the table doubles when it runs out, so this only calls malloc O(log n) times */
+static struct alloc_info *info_new(struct memory_pool *p)
+{
+  if (p->spare == NULL && !table_grow(p, p->nrecords > TABLE_MIN ? p->nrecords : TABLE_MIN)) {
+    return NULL;
+  }
+
+  struct pa_block *b = p->spare;
+  p->spare = b->node.user_data;
+
+  memset(&b->ai, 0, sizeof(b->ai));
+  dbll_node_init(&b->node, &b->ai);
+  dbll_node_init(&b->bin_node, &b->ai);
+  return &b->ai;
+}
+
+/* return a record to the side table */
+static void info_release(struct memory_pool *p, struct alloc_info *ai)
+{
+  struct pa_block *b = (struct pa_block *) ai;
+
+  b->node.user_data = p->spare;
+  p->spare = b;
+}
+
+/* make sure that at least nblocks blocks (allocated or free) can be
+   tracked without growing the side table */
+/* only meaningful for MPOOL_LISTS pools; returns 0 if memory could not be allocated */
+int mpool_reserve(struct memory_pool *p, size_t nblocks)
+{
+  if ((p->flags & MPOOL_MODE_MASK) != MPOOL_LISTS || nblocks <= p->nrecords) {
+    return 1;
+  }
+  return table_grow(p, nblocks - p->nrecords);
+}
+
+/* put a free block into the bin for its size */
+static void bin_insert(struct memory_pool *p, struct alloc_info *ai)
+{
+  int i = pa_bin_index(ai->size);
+
+  ai->bin_node = dbll_link_before(&p->bins[i], NULL, &((struct pa_block *) ai)->bin_node);
+  pa_binmap_set(p, i);
+}
+
+/* take a free block out of its bin */
+static void bin_remove(struct memory_pool *p, struct alloc_info *ai)
+{
+  int i = pa_bin_index(ai->size);
+
+  dbll_remove(&p->bins[i], ai->bin_node);
+  ai->bin_node = NULL;
+
+  if (p->bins[i].first == NULL) {
+    pa_binmap_clear(p, i);
+  }
+}
+
+/* offset at which an allocation aligned to `align` can start in block ai */
+static size_t fit_offset(struct memory_pool *p, struct alloc_info *ai, size_t align)
+{
+  uintptr_t addr = (uintptr_t) (p->start + ai->offset);
+  uintptr_t aligned = (addr + align - 1) & ~((uintptr_t) align - 1);
+
+  return ai->offset + (aligned - addr);
+}
+
+/* does an allocation of `size` bytes aligned to `align` fit into block ai? */
+static int block_fits(struct memory_pool *p, struct alloc_info *ai, size_t size, size_t align)
+{
+  size_t off = fit_offset(p, ai, align);
+
+  return off - ai->offset <= ai->size && size <= ai->size - (off - ai->offset);
+}
+
+/* first block of bin i that fits, looking at no more than `limit` blocks (0 for no limit) */
+static struct alloc_info *bin_search(struct memory_pool *p, int i, size_t size, size_t align, int limit)
+{
+  struct llnode *node;
+
+  for (node = p->bins[i].first; node != NULL; node = node->next) {
+    if (block_fits(p, node->user_data, size, align)) {
+      return node->user_data;
+    }
+    if (limit > 0 && --limit == 0) {
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+/* find a free block for `size` bytes aligned to `align` */
+static struct alloc_info *find_free_block(struct memory_pool *p, size_t size, size_t align)
+{
+  size_t need = size + align - 1;  /* any block this large fits, whatever its offset */
+  int lo = pa_bin_index(size);
+  int hi, i;
+  struct alloc_info *ai;
+
+  if (need < size) { //overflow
+    return NULL;
+  }
+
+  /* 1. a few blocks of the requested size class (a close fit) */
+  if ((ai = bin_search(p, lo, size, align, BIN_PROBES)) != NULL) {
+    return ai;
+  }
+
+  /* 2. the head of the smallest non-empty class in which every block fits */
+  hi = pa_bin_fit(need);
+  if ((i = pa_bin_next(p, hi)) >= 0) {
+    return p->bins[i].first->user_data;
+  }
+
+  /* 3. nearly full: search the remaining classes that may hold a fit */
+  for (i = pa_bin_next(p, lo); i >= 0 && i < hi; i = pa_bin_next(p, i + 1)) {
+    if ((ai = bin_search(p, i, size, align, 0)) != NULL) {
+      return ai;
+    }
+  }
+
+  return NULL;
+}
+
+static void *list_alloc(struct memory_pool *p, size_t size, size_t align);
+static void *tiny_alloc(struct memory_pool *p);
+static void list_free(struct memory_pool *p, void *addr);
+static void list_free_batch(struct memory_pool *p, void **addrs, size_t n);
+static int list_resize(struct memory_pool *p, void *addr, size_t size);
+static struct llnode *list_find(struct memory_pool *p, void *addr);
+
 /* create and initialize a memory pool of the required size */
 /* use malloc() or calloc() to obtain this initial pool of memory from the system */
-/* observe: 
+/* observe:
     1. alloc_list points to an empty doubly-linked list (dbll).
     2. free_list points to a dbll containing a single llnode.
     3. The user_data of this llnode points to an alloc_info object that contains offset 0 and size equal to the pool size (X).
        Essentially this indicates that a free block of at most size X is available for allocation. */
 struct memory_pool *mpool_create(size_t size)
 {
-  struct memory_pool *mp = (struct memory_pool*)malloc(sizeof(struct memory_pool));
+  return mpool_create_flags(size, MPOOL_LISTS);
+}
+
+/* set up the alloc_list and free_list of a MPOOL_LISTS pool */
+static int list_init(struct memory_pool *mp)
+{
+  /* create a doubly-linked list to track allocations */
+  mp->alloc_list = dbll_create();
+  /* create a doubly-linked list to track free blocks */
+  mp->free_list = dbll_create();
+
+  /* create a free block of memory for the entire pool and place it on the free_list */
+  /* its alloc_info comes from the side table, which starts with TABLE_MIN
+     records and doubles as the pool needs more (mpool_reserve sets aside
+     more up front); a record is about 100 bytes, so sizing the table by
+     pool bytes would spend a large part of the pool on it before the
+     first allocation */
+  if (mp->alloc_list == NULL || mp->free_list == NULL || !table_grow(mp, TABLE_MIN) || !pa_tiny_init(mp)) {
+    return 0;
+  }
+
+  struct alloc_info *ai = info_new(mp); //user_data to be stored in ll_free node
+
+  ai->offset = 0;
+  ai->size = mp->size;
+  ai->node = dbll_link_after(mp->free_list, NULL, &((struct pa_block *) ai)->node); //add to list
+
+  bin_insert(mp, ai);
+  return 1;
+}
+
+/* set up the free structures of p->start for the pool's mode */
+/* returns 0 if memory could not be allocated or the pool is too small */
+int pa_pool_init(struct memory_pool *p)
+{
+  switch (p->flags & MPOOL_MODE_MASK) {
+  case MPOOL_TAGS: return pa_tags_init(p);
+  case MPOOL_BUDDY: return pa_buddy_init(p);
+  case MPOOL_ARENA: return pa_arena_init(p);
+  default: return list_init(p);
+  }
+}
+
+/* create a memory pool of the required size in the mode given by flags */
+/* (one of MPOOL_LISTS, MPOOL_TAGS, MPOOL_BUDDY or MPOOL_ARENA, optionally or'ed with
+   MPOOL_THREADS, MPOOL_GROW, MPOOL_HUGEPAGE, MPOOL_HUGETLB, MPOOL_STATS,
+   MPOOL_CACHELINE and MPOOL_DEFERRED) */
+/* returns NULL if memory could not be allocated or the flags are not valid */
+struct memory_pool *mpool_create_flags(size_t size, int flags)
+{
+  int mode = flags & MPOOL_MODE_MASK;
+
+  if (mode != MPOOL_LISTS && mode != MPOOL_TAGS && mode != MPOOL_BUDDY && mode != MPOOL_ARENA) {
+    return NULL;
+  }
+  /* an arena is only ever released as a whole, one chunk at a time */
+  if (mode == MPOOL_ARENA && (flags & (MPOOL_THREADS | MPOOL_GROW))) {
+    return NULL;
+  }
+  /* the magazines of MPOOL_THREADS already put off frees, per thread */
+  if ((flags & MPOOL_DEFERRED) && (flags & MPOOL_THREADS)) {
+    return NULL;
+  }
+
+  struct memory_pool *mp = (struct memory_pool*)calloc(1, sizeof(struct memory_pool));
 
   if (mp != NULL) {
-    /* set start to memory obtained from malloc */
-    mp->start = mp;
-    /* set size to size */
-    mp->size = size;
-
-    /* create a doubly-linked list to track allocations */
-    mp->alloc_list = dbll_create();
-    /* create a doubly-linked list to track free blocks */
-    mp->free_list = dbll_create();
-
-    /* create a free block of memory for the entire pool and place it on the free_list */
-    struct alloc_info *ai = (struct alloc_info*)malloc(sizeof(struct alloc_info)); //user_data to be stored in ll_free node
-    ai->offset = 0;
-    ai->size = size;
-    dbll_append(mp->free_list, ai); //create node, add to list
+    int ok;
+
+    mp->flags = flags;
+    if (flags & (MPOOL_GROW | MPOOL_HUGEPAGE | MPOOL_HUGETLB)) {
+      /* map the memory, rounded up to whole pages */
+      ok = pa_grow_map(mp, size);
+    } else if (mode == MPOOL_BUDDY) {
+      /* buddy blocks are aligned to their size within the pool, so the
+         pool is page-aligned for mpool_alloc_aligned */
+      ok = posix_memalign((void **) &mp->start, MPOOL_MAX_ALIGN, size) == 0;
+      mp->size = size;
+    } else {
+      /* set start to memory obtained from malloc */
+      mp->start = (char*)malloc(size);
+      /* set size to size */
+      mp->size = size;
+      ok = mp->start != NULL;
+    }
+
+    ok = ok && pa_pool_init(mp) && pa_pool_options(mp);
+    if (!ok) {
+      mpool_destroy(mp);
+      return NULL;
+    }
 
     /* return memory pool object */
-    //printf("memory pool mem allo worked");
     return mp;
   }
-  //printf("memory pool mem allo didn't work");
   return NULL;
 }
 
+/* set up the options of a pool whose memory is ready */
+/* returns 0 if memory could not be allocated */
+int pa_pool_options(struct memory_pool *mp)
+{
+  int ok = 1;
+
+  if (mp->flags & MPOOL_GROW) {
+    /* by default every chunk is twice as large as the one before */
+    mp->grow_size = 2 * mp->size;
+    mp->grow_pct = 200;
+    mp->grow_total = mp->size;
+  }
+  if (ok && (mp->flags & MPOOL_THREADS)) {
+    ok = pa_threads_init(mp);
+  }
+  if (ok && (mp->flags & MPOOL_STATS)) {
+    ok = pa_stats_init(mp);
+  }
+  if (ok && (mp->flags & MPOOL_DEFERRED)) {
+    ok = (mp->deferred = (void **)malloc(MPOOL_DEFER_MAX * sizeof(void *))) != NULL;
+  }
+  return ok;
+}
+
 /* ``destroy'' the memory pool by freeing it and all associated data structures */
 /* this includes the alloc_list and the free_list as well */
 void mpool_destroy(struct memory_pool *p)
 {
-  /* make sure the allocated list is empty (i.e. everything has been freed) */
-  /* free the alloc_list dbll */
+  /* a file-backed pool writes its bins back and unmaps the file */
+  if (p->file != NULL) {
+    pa_file_close(p);
+  }
+  /* free the alloc_list dbll and the free_list dbll (their nodes and
+     the alloc_info records belong to the side table) */
   dbll_free(p->alloc_list);
-  /* free the free_list dbll  */
   dbll_free(p->free_list);
+  /* free the per-thread magazines, the statistics and the queue of
+     deferred frees (the blocks in it go with the pool) */
+  pa_threads_destroy(p);
+  free(p->stats);
+  free(p->deferred);
+  free(p->released);
+  pa_profile_destroy(p);
+  /* free the buddy system bitmaps and the tiny region map */
+  free(p->buddy);
+  free(p->tiny);
+  /* free the side table */
+  while (p->chunks != NULL) {
+    struct pa_chunk *next = p->chunks->next;
+    free(p->chunks);
+    p->chunks = next;
+  }
+  /* destroy the chunks a MPOOL_GROW pool grew by */
+  while (p->grown != NULL) {
+    struct memory_pool *next = p->grown->grown;
+    p->grown->grown = NULL;
+    mpool_destroy(p->grown);
+    p->grown = next;
+  }
   /* free the memory pool structure */
+  if (p->map_size > 0) {
+    pa_grow_unmap(p);
+  } else {
+    free(p->start);
+  }
   free(p);
 }
 
@@ -65,52 +360,213 @@ void mpool_destroy(struct memory_pool *p)
    size=2), 4 (for size=3,4), 8 (for size=5,6,7,8). For all other
    sizes, align to 16.
 */
+
+/* free blocks are found through the size-class bins: small requests pop
+   the head of a bin, and only a nearly full pool searches inside bins */
 void *mpool_alloc(struct memory_pool *p, size_t size)
 {
-  /* check if there is enough memory for allocation of `size` (taking
-	 alignment into account) by checking the list of free blocks */
-  if (p->size < size) {
+  void *addr = (p->stats != NULL) ? pa_stats_alloc(p, size, 0) : pa_alloc(p, size, 0);
+
+  /* pages mpool_trim gave back are in use again */
+  if (addr != NULL && p->released != NULL) {
+    pa_trim_claim(p, addr, size, 0);
+  }
+  if (addr != NULL && p->profile != NULL) {
+    pa_profile_alloc(p, addr, size);
+  }
+  return addr;
+}
+
+/* allocate `size` bytes aligned to `align`, a power of two up to
+   MPOOL_MAX_ALIGN (or more, if mpool_alloc would align `size` bytes to
+   more) */
+/* the block is freed with mpool_free; mpool_realloc only keeps the
+   alignment mpool_alloc would give the new size */
+/* returns NULL if there is not enough memory or align is not valid */
+void *mpool_alloc_aligned(struct memory_pool *p, size_t size, size_t align)
+{
+  if (align == 0 || (align & (align - 1)) != 0 || align > MPOOL_MAX_ALIGN) {
     return NULL;
   }
+  align = (align < pa_alloc_align(size)) ? pa_alloc_align(size) : align;
 
-  /* search the free list for a suitable block */
-  /* there are many strategies you can use: first fit (the first block that fits),
-	 best fit (the smallest block that fits), etc. */
-  struct llnode *node = p->free_list->first; //node to search free_list ll
-  struct alloc_info *ai = node->user_data; //ai object to access size in each node
-  int free = 0;
+  void *addr = (p->stats != NULL) ? pa_stats_alloc(p, size, align) : pa_alloc(p, size, align);
 
-  while (node != NULL) {
-    if (ai->size >= size) {
-      free = 1;
-      break;
+  if (addr != NULL && p->released != NULL) {
+    pa_trim_claim(p, addr, size, 0);
+  }
+  if (addr != NULL && p->profile != NULL) {
+    pa_profile_alloc(p, addr, size);
+  }
+  return addr;
+}
+
+/* allocate n * size bytes, aligned as mpool_alloc aligns them, set to zero */
+/* pages that mpool_trim gave back and that nothing has used since are
+   already zero in MPOOL_LISTS and MPOOL_ARENA pools, and are not cleared
+   again; returns NULL if there is not enough memory or n * size overflows */
+void *mpool_calloc(struct memory_pool *p, size_t n, size_t size)
+{
+  size_t total = n * size;
+
+  if (size != 0 && total / size != n) { //overflow
+    return NULL;
+  }
+
+  void *addr = (p->stats != NULL) ? pa_stats_alloc(p, total, 0) : pa_alloc(p, total, 0);
+
+  if (addr != NULL) {
+    pa_trim_claim(p, addr, total, 1);
+  }
+  if (addr != NULL && p->profile != NULL) {
+    pa_profile_alloc(p, addr, total);
+  }
+  return addr;
+}
+
+/* mpool_alloc and mpool_alloc_aligned without statistics */
+/* align 0 is the alignment mpool_alloc gives `size` bytes */
+void *pa_alloc(struct memory_pool *p, size_t size, size_t align)
+{
+  if (size == 0 || (p->size < size && !(p->flags & MPOOL_GROW))) {
+    return NULL;
+  }
+  if (align == 0) {
+    align = pa_alloc_align(size);
+  }
+
+  /* whole cache lines, starting at a cache line */
+  if (p->flags & MPOOL_CACHELINE) {
+    size_t padded = (size + MPOOL_CACHELINE_SIZE - 1) & ~(size_t) (MPOOL_CACHELINE_SIZE - 1);
+
+    if (padded < size) { //overflow
+      return NULL;
     }
-    node = node->next;
-    //ai = node->user_data;
+    size = padded;
+    align = (align < MPOOL_CACHELINE_SIZE) ? MPOOL_CACHELINE_SIZE : align;
+  }
+
+  if (p->threads != NULL) {
+    return pa_threads_alloc(p, size, align);
+  }
+  return pa_pool_alloc(p, size, align);
+}
+
+/* allocate from the pool's mode, without going through any thread cache */
+/* a MPOOL_GROW pool that is full goes on to its other chunks */
+void *pa_pool_alloc(struct memory_pool *p, size_t size, size_t align)
+{
+  void *addr;
+
+  switch (p->flags & MPOOL_MODE_MASK) {
+  case MPOOL_TAGS: addr = pa_tags_alloc(p, size, align); break;
+  case MPOOL_BUDDY: addr = pa_buddy_alloc(p, size, align); break;
+  case MPOOL_ARENA: addr = pa_arena_alloc(p, size, align); break;
+  default:
+    addr = (size <= PA_TINY_SLOT && align <= PA_TINY_SLOT && p->tiny != NULL) ? tiny_alloc(p) : NULL;
+    addr = (addr != NULL) ? addr : list_alloc(p, size, align);
+    break;
   }
 
+  /* the frees MPOOL_DEFERRED has queued may make room */
+  if (addr == NULL && p->ndeferred > 0) {
+    mpool_flush(p);
+    return pa_pool_alloc(p, size, align);
+  }
+  if (addr == NULL && (p->flags & MPOOL_GROW)) {
+    addr = pa_grow_alloc(p, size, align);
+  }
+  return addr;
+}
+
+/* the chunk of p that holds addr: p itself unless it is a MPOOL_GROW
+   pool and addr is in one of the chunks it grew by */
+static struct memory_pool *pool_owner(struct memory_pool *p, void *addr)
+{
+  struct memory_pool *c;
+
+  if ((p->flags & MPOOL_GROW) && ((char *) addr < p->start || (char *) addr >= p->start + p->size) &&
+      (c = pa_grow_owner(p, addr)) != NULL) {
+    return c;
+  }
+  return p;
+}
+
+/* allocate a tiny block of a MPOOL_LISTS pool, taking a new region from
+   the pool when every region is full */
+static void *tiny_alloc(struct memory_pool *p)
+{
+  void *addr = pa_tiny_alloc(p);
+
+  if (addr == NULL && (addr = list_alloc(p, PA_TINY_REGION, PA_TINY_REGION)) != NULL) {
+    if (p->released != NULL) { //the header is written before anyone claims a slot
+      pa_trim_claim(p, addr, PA_TINY_REGION, 0);
+    }
+    pa_tiny_add(p, addr);
+    addr = pa_tiny_alloc(p);
+  }
+  return addr;
+}
+
+/* allocate from a MPOOL_LISTS pool */
+static void *list_alloc(struct memory_pool *p, size_t size, size_t align)
+{
+  /* search the bins for a suitable block */
+  struct alloc_info *ai = find_free_block(p, size, align);
+
   /* if no suitable block can be found, return NULL */
-  if (free == 0) {
+  if (ai == NULL) {
     return NULL;
   }
 
-  /* if found, create an alloc_info node, store start of new region
-	 into offset, set size to allocation size (take alignment into
-	 account!), set free to null */
-  struct alloc_info *alloc_ai = (struct alloc_info*)malloc(sizeof(struct alloc_info));
-  //node = p->free_list->last;
+  /* create an alloc_info record for the allocation */
+  struct alloc_info *alloc_ai = info_new(p);
+  struct alloc_info *tail_ai = NULL;
 
-  
+  size_t off = fit_offset(p, ai, align);
+  size_t front = off - ai->offset;                /* alignment padding left free before the allocation */
+  size_t tail = ai->size - front - size;          /* free space after the allocation */
+
+  if (front > 0 && tail > 0) { //free space on both sides needs another record
+    tail_ai = info_new(p);
+  }
+  if (alloc_ai == NULL || (front > 0 && tail > 0 && tail_ai == NULL)) {
+    if (alloc_ai != NULL) {
+      info_release(p, alloc_ai);
+    }
+    return NULL;
+  }
+
+  alloc_ai->offset = off;
   alloc_ai->size = alloc_ai->request_size = size;
-  alloc_ai->offset = ai->size;
-  ai->size -= size;
-  ai->offset = size;
 
   /* add the new alloc_info node to the memory pool's allocated list */
-  dbll_append(p->alloc_list, alloc_ai);
+  alloc_ai->node = dbll_link_after(p->alloc_list, NULL, &((struct pa_block *) alloc_ai)->node);
+
+  /* split the free block around the allocation */
+  bin_remove(p, ai);
+
+  if (tail_ai != NULL) { //ai keeps the front, a new block holds the tail
+    tail_ai->offset = off + size;
+    tail_ai->size = tail;
+    tail_ai->node = dbll_link_after(p->free_list, ai->node, &((struct pa_block *) tail_ai)->node);
+    bin_insert(p, tail_ai);
+    ai->size = front;
+  } else if (front > 0 || tail > 0) { //ai shrinks to whichever side is left
+    ai->offset = (front > 0) ? ai->offset : off + size;
+    ai->size = (front > 0) ? front : tail;
+  } else { //exact fit, the free block disappears
+    dbll_remove(p->free_list, ai->node);
+    info_release(p, ai);
+    ai = NULL;
+  }
+
+  if (ai != NULL) {
+    bin_insert(p, ai);
+  }
 
   /* return pointer to allocated region*/
-  return p->start + ai->offset;
+  return p->start + off;
 }
 
 /* Free a chunk of memory out of the pool */
@@ -120,7 +576,520 @@ void *mpool_alloc(struct memory_pool *p, size_t size)
    block. Note this requires that you keep the list of free blocks in order */
 void mpool_free(struct memory_pool *p, void *addr)
 {
-  /* search the alloc_list for the block */
+  if (addr == NULL) {
+    return;
+  }
+
+  if (p->profile != NULL) {
+    pa_profile_free(p, addr);
+  }
+  if (p->stats != NULL) {
+    pa_stats_free(p, addr);
+    return;
+  }
+  pa_free(p, addr);
+}
+
+/* mpool_free without statistics */
+/* a MPOOL_DEFERRED pool only queues addr, and frees the whole queue
+   with mpool_free_batch once it holds MPOOL_DEFER_MAX blocks */
+void pa_free(struct memory_pool *p, void *addr)
+{
+  if (p->threads != NULL) {
+    pa_threads_free(p, addr);
+  } else if (p->deferred != NULL) {
+    p->deferred[p->ndeferred++] = addr;
+    if (p->ndeferred == MPOOL_DEFER_MAX) {
+      mpool_flush(p);
+    }
+  } else {
+    pa_pool_free(p, addr);
+  }
+
+  if (p->trim_high > 0) {
+    pa_trim_check(p);
+  }
+}
+
+/* free n blocks at once */
+
+/* A MPOOL_LISTS pool sorts addrs by address in place, finds all their
+   records in one walk of alloc_list and merges them into free_list in one
+   more, so that blocks next to each other coalesce without searching the
+   list again for each. The other modes already free and coalesce in O(1)
+   (or O(log n)), and free the blocks one by one. NULL entries and
+   addresses that are not allocated blocks are ignored. The blocks are
+   freed right away, even in a MPOOL_DEFERRED pool, and a MPOOL_THREADS
+   pool takes its lock once for the whole batch instead of caching the
+   blocks in a magazine. */
+void mpool_free_batch(struct memory_pool *p, void **addrs, size_t n)
+{
+  size_t i;
+
+  for (i = 0; p->profile != NULL && i < n; i++) {
+    if (addrs[i] != NULL) {
+      pa_profile_free(p, addrs[i]);
+    }
+  }
+  if (p->stats != NULL) {
+    pa_stats_free_batch(p, addrs, n);
+    return;
+  }
+  pa_free_batch(p, addrs, n);
+}
+
+/* mpool_free_batch without statistics */
+void pa_free_batch(struct memory_pool *p, void **addrs, size_t n)
+{
+  if (p->threads != NULL) {
+    pa_threads_lock(p);
+    pa_pool_free_batch(p, addrs, n);
+    pa_threads_unlock(p);
+    return;
+  }
+  pa_pool_free_batch(p, addrs, n);
+}
+
+/* free the blocks a MPOOL_DEFERRED pool has queued; does nothing for other pools */
+void mpool_flush(struct memory_pool *p)
+{
+  size_t n = p->ndeferred;
+
+  p->ndeferred = 0;
+  if (n > 0) {
+    pa_pool_free_batch(p, p->deferred, n);
+  }
+}
+
+/* does chunk c hold addr? */
+static int chunk_holds(struct memory_pool *c, void *addr)
+{
+  return (char *) addr >= c->start && (char *) addr < c->start + c->size;
+}
+
+/* mpool_free_batch to the pool's mode, without going through any thread cache */
+void pa_pool_free_batch(struct memory_pool *p, void **addrs, size_t n)
+{
+  size_t i = 0, j;
+
+  if ((p->flags & MPOOL_MODE_MASK) != MPOOL_LISTS) {
+    for (i = 0; i < n; i++) {
+      if (addrs[i] != NULL) {
+        pa_pool_free(p, addrs[i]);
+      }
+    }
+    return;
+  }
+
+  pa_addr_sort(addrs, n);
+  while (i < n && addrs[i] == NULL) {
+    i++;
+  }
+
+  /* chunks do not overlap, so the blocks of each chunk are one run */
+  for (; i < n; i = j) {
+    struct memory_pool *c = pool_owner(p, addrs[i]);
+
+    for (j = i + 1; j < n && chunk_holds(c, addrs[j]); j++);
+    list_free_batch(c, addrs + i, j - i);
+  }
+}
+
+/* free to the pool's mode, without going through any thread cache */
+void pa_pool_free(struct memory_pool *p, void *addr)
+{
+  p = pool_owner(p, addr);
+
+  switch (p->flags & MPOOL_MODE_MASK) {
+  case MPOOL_TAGS: pa_tags_free(p, addr); break;
+  case MPOOL_BUDDY: pa_buddy_free(p, addr); break;
+  case MPOOL_ARENA: break; //released with mpool_release_to or mpool_reset
+  default: list_free(p, addr); break;
+  }
+}
+
+/* number of bytes that can be used at addr, 0 if it is not an allocated block */
+size_t pa_pool_usable(struct memory_pool *p, void *addr)
+{
+  p = pool_owner(p, addr);
+
+  switch (p->flags & MPOOL_MODE_MASK) {
+  case MPOOL_TAGS: return pa_tags_usable(p, addr);
+  case MPOOL_BUDDY: return pa_buddy_usable(p, addr);
+  case MPOOL_ARENA: return 0; //block sizes are not recorded
+  default: {
+    if (pa_tiny_owns(p, addr)) {
+      return pa_tiny_usable(p, addr);
+    }
+    struct llnode *node = list_find(p, addr);
+    return (node != NULL) ? ((struct alloc_info *) node->user_data)->size : 0;
+  }
+  }
+}
+
+/* add the free bytes of p and all its chunks to *total and raise
+   *largest to the largest free block among them */
+/* with MPOOL_THREADS the lock must be held */
+void pa_pool_free_space(struct memory_pool *p, size_t *total, size_t *largest)
+{
+  struct memory_pool *c;
+
+  for (c = p; c != NULL; c = c->grown) {
+    switch (c->flags & MPOOL_MODE_MASK) {
+    case MPOOL_TAGS: pa_tags_free_space(c, total, largest); break;
+    case MPOOL_BUDDY: pa_buddy_free_space(c, total, largest); break;
+    case MPOOL_ARENA: {
+      *total += c->size - c->arena_top;
+      *largest = (c->size - c->arena_top > *largest) ? c->size - c->arena_top : *largest;
+      break;
+    }
+    default: {
+      struct llnode *node;
+
+      for (node = c->free_list->first; node != NULL; node = node->next) {
+        size_t size = ((struct alloc_info *) node->user_data)->size;
+
+        *total += size;
+        *largest = (size > *largest) ? size : *largest;
+      }
+      break;
+    }
+    }
+  }
+}
+
+/* call fn(p, off, size, ctx) for every byte range of chunk p (not its
+   other chunks) that is free and holds none of the pool's own data */
+/* with MPOOL_THREADS the lock must be held */
+void pa_pool_free_spans(struct memory_pool *p, void (*fn)(struct memory_pool *, size_t, size_t, void *), void *ctx)
+{
+  struct llnode *node;
+
+  switch (p->flags & MPOOL_MODE_MASK) {
+  case MPOOL_TAGS: pa_tags_free_spans(p, fn, ctx); break;
+  case MPOOL_BUDDY: pa_buddy_free_spans(p, fn, ctx); break;
+  case MPOOL_ARENA: fn(p, p->arena_top, p->size - p->arena_top, ctx); break;
+  default:
+    for (node = p->free_list->first; node != NULL; node = node->next) {
+      struct alloc_info *ai = node->user_data;
+
+      fn(p, ai->offset, ai->size, ctx);
+    }
+    break;
+  }
+}
+
+/* resize a block to `size` bytes, moving it only if it cannot grow in place */
+
+/* addr NULL is the same as mpool_alloc and size 0 the same as mpool_free
+   (returning NULL). A block grows into the free block right after it if
+   that is large enough and shrinks by giving its tail back; otherwise a
+   new block is allocated, the contents copied and the old block freed. */
+
+/* returns the (possibly moved) block, or NULL if no block of `size` bytes
+   could be allocated (the old block is then left as it was) or addr is
+   not a block of the pool */
+void *mpool_realloc(struct memory_pool *p, void *addr, size_t size)
+{
+  if (p->stats != NULL) {
+    return pa_stats_realloc(p, addr, size);
+  }
+  return pa_realloc(p, addr, size);
+}
+
+/* mpool_realloc without statistics for the resize itself (a block that
+   moves is allocated and freed through mpool_alloc and mpool_free) */
+void *pa_realloc(struct memory_pool *p, void *addr, size_t size)
+{
+  size_t copy;
+  int done;
+
+  if (addr == NULL) {
+    return mpool_alloc(p, size);
+  }
+  if (size == 0) {
+    mpool_free(p, addr);
+    return NULL;
+  }
+  if ((p->flags & MPOOL_CACHELINE) && size <= (size_t) -MPOOL_CACHELINE_SIZE) {
+    size = (size + MPOOL_CACHELINE_SIZE - 1) & ~(size_t) (MPOOL_CACHELINE_SIZE - 1);
+  }
+
+  /* a block that stays put must already be aligned for its new size;
+     resizing to 0 only finds out how much to copy */
+  size_t want = ((uintptr_t) addr & (pa_alloc_align(size) - 1)) == 0 ? size : 0;
+
+  if (p->threads != NULL) {
+    done = pa_threads_resize(p, addr, want, &copy);
+  } else {
+    done = pa_pool_resize(p, addr, want, &copy);
+  }
+
+  if (done) {
+    if (p->released != NULL) {
+      pa_trim_claim(p, addr, size, 0);
+    }
+    return addr;
+  }
+  if (copy == 0) { //not a block of this pool
+    return NULL;
+  }
+
+  void *moved = mpool_alloc(p, size);
+  if (moved != NULL) {
+    memcpy(moved, addr, (copy < size) ? copy : size);
+    mpool_free(p, addr);
+  }
+  return moved;
+}
+
+/* resize the block at addr in place, in the pool's own mode */
+/* returns 0 if it has to move (always for size 0), setting *copy to the
+   bytes to copy to the new block (0 if addr is not an allocated block) */
+int pa_pool_resize(struct memory_pool *p, void *addr, size_t size, size_t *copy)
+{
+  int done;
+
+  p = pool_owner(p, addr);
+
+  switch (p->flags & MPOOL_MODE_MASK) {
+  case MPOOL_TAGS: done = size > 0 && pa_tags_resize(p, addr, size); break;
+  case MPOOL_BUDDY: done = size > 0 && pa_buddy_resize(p, addr, size); break;
+  case MPOOL_ARENA: return pa_arena_resize(p, addr, size, copy);
+  default: done = size > 0 && list_resize(p, addr, size); break;
+  }
+
+  if (!done) {
+    *copy = pa_pool_usable(p, addr);
+  }
+  return done;
+}
+
+/* search the alloc_list of a MPOOL_LISTS pool for the block at addr */
+static struct llnode *list_find(struct memory_pool *p, void *addr)
+{
+  size_t off = (char *) addr - p->start;
+  struct llnode *node;
+
+  for (node = p->alloc_list->first; node != NULL; node = node->next) {
+    if (((struct alloc_info *) node->user_data)->offset == off) {
+      break;
+    }
+  }
+  return node;
+}
+
+/* put block ai, just taken off alloc_list, on the free_list before `next`
+   (the first free block after it, NULL at the end) and coalesce it with
+   the free blocks on either side */
+/* returns the free block that now holds it */
+static struct alloc_info *free_insert(struct memory_pool *p, struct alloc_info *ai, struct llnode *next)
+{
+  struct llnode *prev = (next != NULL) ? next->prev : p->free_list->last;
+
+  ai->node = NULL;
+
+  /* coalesce with the free block before it */
+  if (prev != NULL) {
+    struct alloc_info *prev_ai = prev->user_data;
+
+    if (prev_ai->offset + prev_ai->size == ai->offset) {
+      bin_remove(p, prev_ai);
+      prev_ai->size += ai->size;
+      info_release(p, ai);
+      ai = prev_ai;
+    }
+  }
+
   /* move it to the free_list */
-  /* coalesce the free_list */
+  if (ai->node == NULL) {
+    struct llnode *link = &((struct pa_block *) ai)->node;
+
+    ai->node = (next != NULL) ? dbll_link_before(p->free_list, next, link) : dbll_link_after(p->free_list, NULL, link);
+  }
+
+  /* coalesce with the free block after it */
+  if (next != NULL) {
+    struct alloc_info *next_ai = next->user_data;
+
+    if (ai->offset + ai->size == next_ai->offset) {
+      bin_remove(p, next_ai);
+      ai->size += next_ai->size;
+      dbll_remove(p->free_list, next);
+      info_release(p, next_ai);
+    }
+  }
+
+  bin_insert(p, ai);
+  return ai;
+}
+
+/* free a block of a MPOOL_LISTS pool */
+/* the block is found by searching alloc_list and its neighbours by searching free_list */
+static void list_free(struct memory_pool *p, void *addr)
+{
+  size_t off = (char *) addr - p->start;
+
+  /* a tiny block only clears its bit, and its region goes back once empty */
+  if (pa_tiny_owns(p, addr)) {
+    if ((addr = pa_tiny_free(p, addr)) != NULL) {
+      list_free(p, addr);
+    }
+    return;
+  }
+
+  /* search the alloc_list for the block */
+  struct llnode *node = list_find(p, addr);
+  if (node == NULL) { //not allocated from this pool
+    return;
+  }
+
+  struct alloc_info *ai = node->user_data;
+  dbll_remove(p->alloc_list, node);
+
+  /* find its place in the (address-ordered) free_list */
+  struct llnode *next;
+  for (next = p->free_list->first; next != NULL; next = next->next) {
+    if (((struct alloc_info *) next->user_data)->offset > off) {
+      break;
+    }
+  }
+
+  free_insert(p, ai, next);
+}
+
+/* order records by offset, for dbll_sort */
+static int offset_cmp(void *a, void *b, void *ctx)
+{
+  size_t x = ((struct alloc_info *) a)->offset, y = ((struct alloc_info *) b)->offset;
+
+  (void) ctx;
+  return (x > y) - (x < y);
+}
+
+/* free the blocks at addrs (sorted, without NULLs) of a MPOOL_LISTS pool */
+/* one walk of alloc_list finds all of their records, looking each block
+   up in addrs by binary search, and moves them to a list of their own
+   (through the node every record carries, so nothing is allocated). That
+   list is sorted by offset, and one walk of free_list puts them back in
+   address order, so every block coalesces with the one freed before it
+   without searching free_list again */
+static void list_free_batch(struct memory_pool *p, void **addrs, size_t n)
+{
+  struct dbll freed = { NULL, NULL };
+  struct llnode *node, *next;
+  size_t k, left = n;
+
+  /* tiny blocks only clear their bits */
+  for (k = 0; k < n; k++) {
+    if (pa_tiny_owns(p, addrs[k])) {
+      void *region = pa_tiny_free(p, addrs[k]);
+
+      if (region != NULL) {
+        list_free(p, region);
+      }
+      left--;
+    }
+  }
+
+  /* take the records of the others off alloc_list */
+  for (node = p->alloc_list->first; node != NULL && left > 0; node = next) {
+    struct alloc_info *ai = node->user_data;
+    void *key = p->start + ai->offset;
+
+    next = node->next;
+    if (bsearch(&key, addrs, n, sizeof(void *), pa_addr_cmp) != NULL) {
+      dbll_remove(p->alloc_list, node);
+      dbll_link_after(&freed, NULL, &((struct pa_block *) ai)->node);
+      left--;
+    }
+  }
+  dbll_sort(&freed, NULL, offset_cmp);
+
+  /* and merge them into free_list, from a cursor that only moves forward */
+  next = p->free_list->first;
+  while ((node = freed.first) != NULL) {
+    struct alloc_info *ai = node->user_data;
+
+    dbll_remove(&freed, node);
+    while (next != NULL && ((struct alloc_info *) next->user_data)->offset < ai->offset) {
+      next = next->next;
+    }
+    next = free_insert(p, ai, next)->node;
+  }
+}
+
+/* resize a block of a MPOOL_LISTS pool without moving it */
+/* it grows into the free block right after it and shrinks by giving its
+   tail to that free block, or to a new one; returns 0 if it cannot grow */
+static int list_resize(struct memory_pool *p, void *addr, size_t size)
+{
+  size_t off = (char *) addr - p->start;
+
+  /* a tiny block stays in its slot as long as it fits */
+  if (pa_tiny_owns(p, addr)) {
+    return size <= pa_tiny_usable(p, addr);
+  }
+
+  struct llnode *node = list_find(p, addr);
+
+  if (node == NULL) {
+    return 0;
+  }
+
+  struct alloc_info *ai = node->user_data;
+  size_t end = off + ai->size;
+
+  /* the free block that starts at the end of this one, if any */
+  struct llnode *next;
+  for (next = p->free_list->first; next != NULL; next = next->next) {
+    if (((struct alloc_info *) next->user_data)->offset >= end) {
+      break;
+    }
+  }
+  struct alloc_info *next_ai = (next != NULL && ((struct alloc_info *) next->user_data)->offset == end) ? next->user_data : NULL;
+
+  if (size > ai->size) {
+    size_t grow = size - ai->size;
+
+    if (next_ai == NULL || next_ai->size < grow) {
+      return 0;
+    }
+
+    bin_remove(p, next_ai);
+    if (next_ai->size == grow) { //the free block disappears
+      dbll_remove(p->free_list, next);
+      info_release(p, next_ai);
+    } else {
+      next_ai->offset += grow;
+      next_ai->size -= grow;
+      bin_insert(p, next_ai);
+    }
+  } else if (size < ai->size) {
+    size_t shrink = ai->size - size;
+
+    if (next_ai != NULL) {
+      bin_remove(p, next_ai);
+      next_ai->offset -= shrink;
+      next_ai->size += shrink;
+      bin_insert(p, next_ai);
+    } else {
+      struct alloc_info *tail_ai = info_new(p);
+
+      if (tail_ai == NULL) { //keep the block as it is
+        ai->request_size = size;
+        return 1;
+      }
+
+      struct llnode *link = &((struct pa_block *) tail_ai)->node;
+
+      tail_ai->offset = off + size;
+      tail_ai->size = shrink;
+      tail_ai->node = (next != NULL) ? dbll_link_before(p->free_list, next, link) : dbll_link_after(p->free_list, NULL, link);
+      bin_insert(p, tail_ai);
+    }
+  }
+
+  ai->size = ai->request_size = size;
+  return 1;
 }
@@ -1,20 +1,273 @@
 #pragma once
+#include <stdint.h>
+#include <stdio.h>
 #include "dbll.h"
+#include "pa_map.h"
 
 struct alloc_info {
   size_t offset;     /* offset from beginning of pool */
   size_t size;       /* size of allocation */
   size_t request_size; /* size actually requested */
+  struct llnode *node;     /* node holding this alloc_info in alloc_list or free_list */
+  struct llnode *bin_node; /* node in the size-class bin while free, NULL otherwise */
 };
 
+/* free blocks are also kept in segregated lists ("bins") by size class */
+/* sizes below MPOOL_EXACT_BINS get one bin each, larger sizes are split
+   into powers of two with MPOOL_SUB_BINS bins per power of two */
+#define MPOOL_EXACT_BINS 32
+#define MPOOL_SUB_BITS 2
+#define MPOOL_SUB_BINS (1 << MPOOL_SUB_BITS)
+#define MPOOL_EXACT_LOG2 5 /* log2(MPOOL_EXACT_BINS) */
+#define MPOOL_NBINS (MPOOL_EXACT_BINS + (64 - MPOOL_EXACT_LOG2) * MPOOL_SUB_BINS)
+#define MPOOL_BINMAP_WORDS ((MPOOL_NBINS + 63) / 64)
+
+/* pool modes, selected with mpool_create_flags */
+#define MPOOL_LISTS 0x0      /* blocks are tracked in alloc_list and free_list (the default) */
+#define MPOOL_TAGS 0x1       /* blocks carry inline boundary tags; alloc_list and free_list are not used */
+#define MPOOL_BUDDY 0x2      /* power-of-two blocks in a binary buddy system; alloc_list and free_list are not used */
+#define MPOOL_ARENA 0x3      /* bump allocation, freed only with mpool_release_to or mpool_reset */
+#define MPOOL_MODE_MASK 0xf
+
+/* options, or'ed with the mode */
+#define MPOOL_THREADS 0x10   /* the pool may be shared between threads; each thread caches free blocks */
+#define MPOOL_GROW 0x20      /* the pool maps more chunks when it is full (see mpool_set_growth) */
+#define MPOOL_HUGEPAGE 0x40  /* map the pool aligned to 2 MiB and ask for transparent huge pages */
+#define MPOOL_HUGETLB 0x80   /* map the pool with MAP_HUGETLB if possible, else as MPOOL_HUGEPAGE */
+#define MPOOL_STATS 0x100    /* keep usage statistics and latency histograms (see mpool_stats) */
+#define MPOOL_CACHELINE 0x200 /* pad and align every block to MPOOL_CACHELINE_SIZE, so no two blocks share a cache line */
+#define MPOOL_DEFERRED 0x400 /* mpool_free queues blocks and frees MPOOL_DEFER_MAX at a time (see mpool_flush) */
+
+#define MPOOL_CACHELINE_SIZE 64
+#define MPOOL_MAX_ALIGN 4096 /* largest alignment mpool_alloc_aligned accepts (one page) */
+#define MPOOL_DEFER_MAX 256  /* frees a MPOOL_DEFERRED pool queues before it coalesces them */
+
+/* formats of mpool_profile_dump */
+#define MPOOL_PROFILE_FOLDED 0 /* folded stacks of the bytes in use, for flame graphs */
+#define MPOOL_PROFILE_PPROF 1  /* gperftools text heap profile, for pprof */
+
+struct pa_block;
+struct pa_chunk;
+struct pa_buddy;
+struct pa_tiny;
+struct pa_threads;
+struct pa_stats;
+struct pa_file;
+struct pa_profile;
+
 struct memory_pool {
   char *start;                /* start of pool */
   size_t size;                /* size of pool */
   struct dbll *alloc_list;    /* track allocations */
-  struct dbll *free_list;     /* list of freed regions */
+  struct dbll *free_list;     /* list of freed regions, in address order */
+  struct dbll bins[MPOOL_NBINS];        /* free regions by size class */
+  uint64_t binmap[MPOOL_BINMAP_WORDS];  /* bit i is set when bins[i] (or tag_bins[i]) is not empty */
+  int flags;                  /* mode and options given to mpool_create_flags */
+  struct pa_block *spare;     /* MPOOL_LISTS: unused bookkeeping records */
+  struct pa_chunk *chunks;    /* MPOOL_LISTS: side table that holds every bookkeeping record */
+  size_t nrecords;            /* MPOOL_LISTS: number of records in the side table */
+  size_t tag_bins[MPOOL_NBINS];         /* MPOOL_TAGS: offset of the first free block of each bin, 0 if empty */
+  struct pa_buddy *buddy;     /* MPOOL_BUDDY: free lists and bitmaps of each order */
+  struct pa_tiny *tiny;       /* MPOOL_LISTS: bitmap regions for blocks of at most 8 bytes, NULL in small pools */
+  struct pa_threads *threads; /* MPOOL_THREADS: lock and per-thread magazines, NULL otherwise */
+  size_t arena_top;           /* MPOOL_ARENA: offset of the first unallocated byte */
+  size_t arena_last;          /* MPOOL_ARENA: offset of the last allocation, (size_t) -1 if unknown */
+  size_t map_size;            /* bytes mapped with mmap at start, 0 if start came from malloc */
+  struct memory_pool *grown;  /* MPOOL_GROW: chunks mapped when the pool was full, newest first */
+  size_t grow_size;           /* MPOOL_GROW: size of the next chunk */
+  unsigned int grow_pct;      /* MPOOL_GROW: each chunk is this percentage of the one before */
+  size_t grow_limit;          /* MPOOL_GROW: most bytes all chunks together may take, 0 for no limit */
+  size_t grow_total;          /* MPOOL_GROW: bytes in all chunks, including the first */
+  struct pa_stats *stats;     /* MPOOL_STATS: counters and histograms, NULL otherwise */
+  void **deferred;            /* MPOOL_DEFERRED: blocks freed but not yet given back, NULL otherwise */
+  size_t ndeferred;           /* MPOOL_DEFERRED: blocks in deferred */
+  struct pa_file *file;       /* mpool_open: the mapped file, NULL otherwise */
+  uint64_t *released;         /* mpool_trim: bit i is set while the i-th whole page is given back, NULL before the first trim */
+  size_t released_bytes;      /* mpool_trim: bytes in pages given back */
+  size_t trim_high;           /* mpool_set_trim: resident free bytes that start a trim, 0 for none */
+  size_t trim_low;            /* mpool_set_trim: resident free bytes a trim leaves */
+  unsigned int trim_frees;    /* mpool_set_trim: frees counted towards the next check */
+  struct pa_profile *profile;  /* mpool_set_profile: sampled blocks by call site, NULL otherwise */
+};
+
+/* a snapshot of the statistics of a MPOOL_STATS pool (pa_stats.c) */
+/* sizes are in bytes; histogram bucket i counts values from
+   mpool_stats_bucket(i) up to mpool_stats_bucket(i + 1) - 1, using the
+   same classes as the free bins (exact below MPOOL_EXACT_BINS, then
+   MPOOL_SUB_BINS per power of two) */
+struct mpool_stats {
+  size_t live_bytes;          /* usable bytes of the blocks allocated now (arena_top for arenas) */
+  size_t live_count;          /* blocks allocated now */
+  size_t peak_bytes;          /* largest live_bytes seen */
+  size_t peak_count;          /* largest live_count seen */
+  size_t allocs;              /* successful allocations, including moves by mpool_realloc */
+  size_t frees;
+  size_t failed;              /* allocations that returned NULL */
+  size_t requested_bytes;     /* bytes asked for by all allocations */
+  size_t allocated_bytes;     /* usable bytes handed out by all allocations */
+  size_t free_bytes;          /* bytes in free blocks now */
+  size_t largest_free;        /* largest free block now */
+  double internal_waste;      /* 1 - requested_bytes / allocated_bytes */
+  double external_frag;       /* 1 - largest_free / free_bytes */
+  uint64_t size_classes[MPOOL_NBINS];   /* allocations by requested size */
+  uint64_t alloc_ns[MPOOL_NBINS];       /* mpool_alloc latency in nanoseconds */
+  uint64_t free_ns[MPOOL_NBINS];        /* mpool_free latency in nanoseconds */
+  uint64_t alloc_ns_max;                /* slowest mpool_alloc, exact */
+  uint64_t free_ns_max;                 /* slowest mpool_free, exact */
+};
+
+struct pa_slab;
+
+/* a cache of fixed-size objects allocated in slabs from a memory_pool (pa_slab.c) */
+struct mpool_slab_cache {
+  struct memory_pool *pool;   /* where slabs come from */
+  size_t obj_size;            /* size of an object */
+  size_t align;               /* alignment of every object */
+  size_t stride;              /* distance between two slots */
+  size_t per_slab;            /* slots in a slab */
+  size_t slab_size;           /* bytes allocated from the pool for a slab */
+  int granule_shift;          /* log2 of the granules slabs are looked up by */
+  struct pa_slab *partial;    /* slabs with free and used slots */
+  struct pa_slab *full;       /* slabs without free slots */
+  struct pa_slab *empty;      /* one empty slab kept for reuse, or NULL */
+  struct pa_map map;          /* granule -> slabs */
+};
+
+/* equal blocks that threads allocate and free without a lock (pa_fixed.c) */
+struct mpool_fixed {
+  struct memory_pool *pool;   /* where the blocks come from */
+  size_t block_size;          /* size of a block */
+  size_t stride;              /* distance between two blocks */
+  uint32_t nblocks;
+  char *blocks;               /* the first block */
+  uint32_t *next;             /* per block: the next free block, FIXED_USED while allocated */
+  uint64_t head;              /* tag << 32 | index of the first free block */
 };
 
+struct pa_handle_entry;
+
+/* movable blocks reached through handles, in a heap that is taken from a
+   memory_pool once and compacted in place (pa_handle.c) */
+struct mpool_handles {
+  struct memory_pool *pool;   /* where the heap comes from */
+  char *heap;
+  size_t size;                /* bytes in heap */
+  size_t top;                 /* offset of the first byte above every block */
+  size_t live;                /* bytes in allocated blocks, headers included */
+  size_t scan;                /* compaction: offset of the next block to look at */
+  size_t dest;                /* compaction: where the next block that can move goes */
+  size_t budget;              /* bytes mpool_halloc may compact before it gives up, 0 for no limit */
+  struct pa_handle_entry *table; /* per handle: offset of its block and pin count */
+  uint32_t nhandles;          /* entries in table, the first is never used */
+  uint32_t free_handle;       /* first unused entry, 0 if there is none */
+};
+
+/* objects of one type, with their size and alignment known at compile
+   time (pa_typed.c); see MPOOL_DEFINE_TYPED */
+struct mpool_typed {
+  struct memory_pool *pool;   /* where chunks come from */
+  void *free;                 /* first free object, each free object holds the next */
+  char *bump;                 /* next object of the newest chunk that was never used */
+  char *end;                  /* end of the newest chunk */
+  void *chunks;               /* chunks taken from the pool, each starts with a link to the next */
+};
+
+/* alignment and distance between objects of type T: every object must
+   be able to hold the free-list link */
+#define MPOOL_TYPED_ALIGN(T) (__alignof__(T) > __alignof__(void *) ? __alignof__(T) : __alignof__(void *))
+#define MPOOL_TYPED_STRIDE(T) \
+  (((sizeof(T) > sizeof(void *) ? sizeof(T) : sizeof(void *)) + MPOOL_TYPED_ALIGN(T) - 1) & ~(MPOOL_TYPED_ALIGN(T) - 1))
+
+/* MPOOL_DEFINE_TYPED(T) defines struct mpool_T and the static inline
+   functions
+
+     void mpool_T_init(struct mpool_T *tp, struct memory_pool *pool);
+     void mpool_T_destroy(struct mpool_T *tp);
+     T *mpool_T_alloc(struct mpool_T *tp);
+     void mpool_T_free(struct mpool_T *tp, T *obj);
+
+   for a type name T (a single identifier, so use a typedef for structs).
+   Allocating and freeing push and pop a free list at the call site with
+   the size and alignment of T as constants; only an empty list calls
+   mpool_typed_refill. Freed objects stay on the list, and go back to the
+   pool when the typed pool is destroyed. Not thread-safe. */
+#define MPOOL_DEFINE_TYPED(T) \
+  struct mpool_##T { struct mpool_typed t; }; \
+  static inline void mpool_##T##_init(struct mpool_##T *tp, struct memory_pool *pool) \
+  { \
+    mpool_typed_init(&tp->t, pool); \
+  } \
+  static inline void mpool_##T##_destroy(struct mpool_##T *tp) \
+  { \
+    mpool_typed_destroy(&tp->t); \
+  } \
+  static inline T *mpool_##T##_alloc(struct mpool_##T *tp) \
+  { \
+    void *obj = tp->t.free; \
+    if (__builtin_expect(obj != NULL, 1)) { \
+      tp->t.free = *(void **) obj; \
+      return (T *) obj; \
+    } \
+    return (T *) mpool_typed_refill(&tp->t, MPOOL_TYPED_STRIDE(T), MPOOL_TYPED_ALIGN(T)); \
+  } \
+  static inline void mpool_##T##_free(struct mpool_##T *tp, T *obj) \
+  { \
+    if (obj != NULL) { \
+      *(void **) obj = tp->t.free; \
+      tp->t.free = obj; \
+    } \
+  }
+
 struct memory_pool *mpool_create(size_t size);
+struct memory_pool *mpool_create_flags(size_t size, int flags);
 void mpool_destroy(struct memory_pool *p);
+struct memory_pool *mpool_open(const char *path, size_t size, int flags);
+int mpool_sync(struct memory_pool *p);
+void *mpool_ptr(struct memory_pool *p, size_t off);
+size_t mpool_off(struct memory_pool *p, void *ptr);
+size_t mpool_root(struct memory_pool *p);
+void mpool_set_root(struct memory_pool *p, size_t off);
+int mpool_reserve(struct memory_pool *p, size_t nblocks);
+int mpool_set_growth(struct memory_pool *p, size_t chunk_size, unsigned int growth_pct, size_t limit);
 void *mpool_alloc(struct memory_pool *p, size_t size);
+void *mpool_alloc_aligned(struct memory_pool *p, size_t size, size_t align);
+void *mpool_calloc(struct memory_pool *p, size_t n, size_t size);
 void mpool_free(struct memory_pool *p, void *addr);
+void mpool_free_batch(struct memory_pool *p, void **addrs, size_t n);
+void mpool_flush(struct memory_pool *p);
+size_t mpool_trim(struct memory_pool *p, size_t keep);
+int mpool_set_trim(struct memory_pool *p, size_t high, size_t low);
+void *mpool_realloc(struct memory_pool *p, void *addr, size_t size);
+size_t mpool_mark(struct memory_pool *p);
+void mpool_release_to(struct memory_pool *p, size_t mark);
+void mpool_reset(struct memory_pool *p);
+int mpool_stats(struct memory_pool *p, struct mpool_stats *s);
+size_t mpool_stats_bucket(int i);
+size_t mpool_stats_percentile(const uint64_t *hist, double pct);
+int mpool_stats_json(struct memory_pool *p, FILE *f);
+int mpool_set_profile(struct memory_pool *p, size_t rate);
+int mpool_profile_dump(struct memory_pool *p, FILE *f, int format);
+int mpool_profile_signal(struct memory_pool *p, int signo, const char *path, int format);
+
+struct mpool_slab_cache *mpool_slab_create(struct memory_pool *pool, size_t obj_size, size_t align);
+void mpool_slab_destroy(struct mpool_slab_cache *c);
+void *mpool_slab_alloc(struct mpool_slab_cache *c);
+void mpool_slab_free(struct mpool_slab_cache *c, void *obj);
+
+struct mpool_fixed *mpool_fixed_create(struct memory_pool *pool, size_t block_size, size_t nblocks);
+void mpool_fixed_destroy(struct mpool_fixed *f);
+void *mpool_fixed_alloc(struct mpool_fixed *f);
+void mpool_fixed_free(struct mpool_fixed *f, void *addr);
+
+void mpool_typed_init(struct mpool_typed *t, struct memory_pool *pool);
+void mpool_typed_destroy(struct mpool_typed *t);
+void *mpool_typed_refill(struct mpool_typed *t, size_t stride, size_t align);
+
+struct mpool_handles *mpool_handles_create(struct memory_pool *pool, size_t size, size_t budget);
+void mpool_handles_destroy(struct mpool_handles *h);
+uint32_t mpool_halloc(struct mpool_handles *h, size_t size);
+void mpool_hfree(struct mpool_handles *h, uint32_t handle);
+void *mpool_pin(struct mpool_handles *h, uint32_t handle);
+void mpool_unpin(struct mpool_handles *h, uint32_t handle);
+size_t mpool_hsize(struct mpool_handles *h, uint32_t handle);
+int mpool_hcompact(struct mpool_handles *h, size_t budget);
@@ -0,0 +1,224 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "poolalloc.h"
+
+/* internals shared by the pool allocator modes */
+
+/* bookkeeping for one block of a MPOOL_LISTS pool */
+/* records live in a side table owned by the pool, so allocating and
+   freeing never go to malloc for metadata */
+struct pa_block {
+  struct alloc_info ai;     /* must be first: an alloc_info is its pa_block */
+  struct llnode node;       /* node in alloc_list or free_list (node.user_data links unused records) */
+  struct llnode bin_node;   /* node in a size-class bin */
+};
+
+/* one allocation of side-table records */
+struct pa_chunk {
+  struct pa_chunk *next;
+  size_t n;
+  struct pa_block blocks[];
+};
+
+/* alignment required for an allocation of `size` bytes (see mpool_alloc) */
+static inline size_t pa_alloc_align(size_t size)
+{
+  if (size <= 2) return size;
+  if (size <= 4) return 4;
+  if (size <= 8) return 8;
+  return 16;
+}
+
+/* bsearch order of two void * by address */
+static inline int pa_addr_cmp(const void *a, const void *b)
+{
+  uintptr_t x = (uintptr_t) *(void * const *) a, y = (uintptr_t) *(void * const *) b;
+
+  return (x > y) - (x < y);
+}
+
+/* sort n addresses in place (a heapsort: glibc's qsort may malloc a
+   buffer, and batches are freed on paths that must not touch the heap) */
+static inline void pa_addr_sort(void **addrs, size_t n)
+{
+  size_t i, child, root;
+  void *top;
+
+  for (i = n / 2; n > 1; ) {
+    if (i > 0) { //build the heap
+      top = addrs[--i];
+      root = i;
+    } else { //move the largest behind the heap
+      top = addrs[--n];
+      addrs[n] = addrs[0];
+      root = 0;
+    }
+    for (; (child = 2 * root + 1) < n; root = child) {
+      if (child + 1 < n && (uintptr_t) addrs[child + 1] > (uintptr_t) addrs[child]) {
+        child++;
+      }
+      if ((uintptr_t) addrs[child] <= (uintptr_t) top) {
+        break;
+      }
+      addrs[root] = addrs[child];
+    }
+    addrs[root] = top;
+  }
+}
+
+/* size class of a block of `size` bytes */
+static inline int pa_bin_index(size_t size)
+{
+  if (size < MPOOL_EXACT_BINS) {
+    return size;
+  }
+
+  int fl = 63 - __builtin_clzll(size);  /* floor(log2(size)) */
+  int sl = (size >> (fl - MPOOL_SUB_BITS)) & (MPOOL_SUB_BINS - 1);
+
+  return MPOOL_EXACT_BINS + (fl - MPOOL_EXACT_LOG2) * MPOOL_SUB_BINS + sl;
+}
+
+/* smallest size that falls into bin i */
+static inline size_t pa_bin_lower(int i)
+{
+  if (i < MPOOL_EXACT_BINS) {
+    return i;
+  }
+
+  int fl = MPOOL_EXACT_LOG2 + (i - MPOOL_EXACT_BINS) / MPOOL_SUB_BINS;
+  int sl = (i - MPOOL_EXACT_BINS) % MPOOL_SUB_BINS;
+
+  return ((size_t) 1 << fl) + ((size_t) sl << (fl - MPOOL_SUB_BITS));
+}
+
+/* smallest bin in which every block is at least `size` bytes */
+static inline int pa_bin_fit(size_t size)
+{
+  int i = pa_bin_index(size);
+
+  return (pa_bin_lower(i) < size) ? i + 1 : i;
+}
+
+/* first non-empty bin at index i or above, -1 if there is none */
+static inline int pa_bin_next(struct memory_pool *p, int i)
+{
+  int w = i / 64;
+  uint64_t bits;
+
+  if (i >= MPOOL_NBINS) {
+    return -1;
+  }
+
+  bits = p->binmap[w] & (~0ULL << (i % 64));
+  while (bits == 0) {
+    if (++w == MPOOL_BINMAP_WORDS) {
+      return -1;
+    }
+    bits = p->binmap[w];
+  }
+
+  return w * 64 + __builtin_ctzll(bits);
+}
+
+static inline void pa_binmap_set(struct memory_pool *p, int i)
+{
+  p->binmap[i / 64] |= 1ULL << (i % 64);
+}
+
+static inline void pa_binmap_clear(struct memory_pool *p, int i)
+{
+  p->binmap[i / 64] &= ~(1ULL << (i % 64));
+}
+
+/* the pool's own mode, bypassing MPOOL_THREADS caches (poolalloc.c) */
+int pa_pool_init(struct memory_pool *p);
+int pa_pool_options(struct memory_pool *p);
+void *pa_pool_alloc(struct memory_pool *p, size_t size, size_t align);
+void pa_pool_free(struct memory_pool *p, void *addr);
+void pa_pool_free_batch(struct memory_pool *p, void **addrs, size_t n);
+size_t pa_pool_usable(struct memory_pool *p, void *addr);
+int pa_pool_resize(struct memory_pool *p, void *addr, size_t size, size_t *copy);
+void pa_pool_free_space(struct memory_pool *p, size_t *total, size_t *largest);
+void pa_pool_free_spans(struct memory_pool *p, void (*fn)(struct memory_pool *, size_t, size_t, void *), void *ctx);
+
+/* the public entry points without statistics (poolalloc.c) */
+void *pa_alloc(struct memory_pool *p, size_t size, size_t align);
+void pa_free(struct memory_pool *p, void *addr);
+void pa_free_batch(struct memory_pool *p, void **addrs, size_t n);
+void *pa_realloc(struct memory_pool *p, void *addr, size_t size);
+
+/* MPOOL_TAGS mode (pa_tags.c) */
+int pa_tags_init(struct memory_pool *p);
+int pa_tags_rebuild(struct memory_pool *p);
+void *pa_tags_alloc(struct memory_pool *p, size_t size, size_t align);
+void pa_tags_free(struct memory_pool *p, void *addr);
+size_t pa_tags_usable(struct memory_pool *p, void *addr);
+int pa_tags_resize(struct memory_pool *p, void *addr, size_t size);
+void pa_tags_free_space(struct memory_pool *p, size_t *total, size_t *largest);
+void pa_tags_free_spans(struct memory_pool *p, void (*fn)(struct memory_pool *, size_t, size_t, void *), void *ctx);
+
+/* MPOOL_BUDDY mode (pa_buddy.c) */
+int pa_buddy_init(struct memory_pool *p);
+void *pa_buddy_alloc(struct memory_pool *p, size_t size, size_t align);
+void pa_buddy_free(struct memory_pool *p, void *addr);
+size_t pa_buddy_usable(struct memory_pool *p, void *addr);
+int pa_buddy_resize(struct memory_pool *p, void *addr, size_t size);
+void pa_buddy_free_space(struct memory_pool *p, size_t *total, size_t *largest);
+void pa_buddy_free_spans(struct memory_pool *p, void (*fn)(struct memory_pool *, size_t, size_t, void *), void *ctx);
+
+/* MPOOL_ARENA mode (pa_arena.c) */
+int pa_arena_init(struct memory_pool *p);
+void *pa_arena_alloc(struct memory_pool *p, size_t size, size_t align);
+int pa_arena_resize(struct memory_pool *p, void *addr, size_t size, size_t *copy);
+
+/* tiny blocks of MPOOL_LISTS pools (pa_tiny.c) */
+#define PA_TINY_SLOT 8              /* blocks of at most this many bytes take one slot */
+#define PA_TINY_SHIFT 13
+#define PA_TINY_REGION ((size_t) 1 << PA_TINY_SHIFT)  /* size and alignment of a region */
+
+int pa_tiny_init(struct memory_pool *p);
+void pa_tiny_add(struct memory_pool *p, void *addr);
+void *pa_tiny_alloc(struct memory_pool *p);
+void *pa_tiny_free(struct memory_pool *p, void *addr);
+int pa_tiny_owns(struct memory_pool *p, void *addr);
+size_t pa_tiny_usable(struct memory_pool *p, void *addr);
+
+/* MPOOL_THREADS option (pa_threads.c) */
+int pa_threads_init(struct memory_pool *p);
+void pa_threads_destroy(struct memory_pool *p);
+void pa_threads_drain(struct memory_pool *p);
+void *pa_threads_alloc(struct memory_pool *p, size_t size, size_t align);
+void pa_threads_free(struct memory_pool *p, void *addr);
+int pa_threads_resize(struct memory_pool *p, void *addr, size_t size, size_t *copy);
+size_t pa_threads_usable(struct memory_pool *p, void *addr);
+void pa_threads_lock(struct memory_pool *p);
+void pa_threads_unlock(struct memory_pool *p);
+
+/* returning free pages to the system (pa_trim.c) */
+void pa_trim_claim(struct memory_pool *p, void *addr, size_t size, int zero);
+void pa_trim_check(struct memory_pool *p);
+
+/* sampling heap profiler (pa_profile.c) */
+void pa_profile_alloc(struct memory_pool *p, void *addr, size_t size);
+void pa_profile_free(struct memory_pool *p, void *addr);
+void pa_profile_destroy(struct memory_pool *p);
+void pa_profile_lock(struct memory_pool *p);
+void pa_profile_unlock(struct memory_pool *p);
+
+/* file-backed pools (pa_file.c) */
+void pa_file_close(struct memory_pool *p);
+
+/* mmap-backed and MPOOL_GROW pools (pa_grow.c) */
+int pa_grow_map(struct memory_pool *p, size_t size);
+void pa_grow_unmap(struct memory_pool *p);
+void *pa_grow_alloc(struct memory_pool *p, size_t size, size_t align);
+struct memory_pool *pa_grow_owner(struct memory_pool *p, void *addr);
+
+/* MPOOL_STATS option (pa_stats.c) */
+int pa_stats_init(struct memory_pool *p);
+void *pa_stats_alloc(struct memory_pool *p, size_t size, size_t align);
+void pa_stats_free(struct memory_pool *p, void *addr);
+void pa_stats_free_batch(struct memory_pool *p, void **addrs, size_t n);
+void *pa_stats_realloc(struct memory_pool *p, void *addr, size_t size);